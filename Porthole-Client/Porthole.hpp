@@ -0,0 +1,1208 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/*
+ * Header only C++17 client for the porthole driver.
+ *
+ * A Device talks to the driver through a Backend. WindowsBackend is the real
+ * device, FakeBackend is an in-process stand in that follows the same IOCTL
+ * contract so integrations can be built and exercised without a VM.
+ *
+ * Mappings are move-only handles that unlock themselves when destroyed, and
+ * the batch and asynchronous calls take caller owned storage so the hot path
+ * does not allocate. Mappings must not outlive the Device they came from.
+ */
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <SetupAPI.h>
+#include <winioctl.h>
+#pragma comment(lib, "setupapi.lib")
+#else
+#include <cstdint>
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t  LONG;
+typedef void *   PVOID;
+typedef void *   HANDLE;
+
+#define DEFINE_GUID(name, ...)
+#define FILE_DEVICE_UNKNOWN 0x00000022
+#define METHOD_BUFFERED     0
+#define FILE_ANY_ACCESS     0
+#define CTL_CODE(type, func, method, access) \
+	(((type) << 16) | ((access) << 14) | ((func) << 2) | (method))
+
+#define ERROR_INVALID_FUNCTION     1
+#define ERROR_NOT_ENOUGH_MEMORY    8
+#define ERROR_INVALID_PARAMETER    87
+#define ERROR_INSUFFICIENT_BUFFER  122
+#define ERROR_OPERATION_ABORTED    995
+#define ERROR_IO_PENDING           997
+#define ERROR_DEVICE_NOT_CONNECTED 1167
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../Porthole/Public.h"
+
+namespace porthole
+{
+
+/* NTSTATUS values reported per entry by the batch IOCTLs */
+constexpr LONG kStatusSuccess                = 0;
+constexpr LONG kStatusInvalidParameter       = (LONG)0xC000000D;
+constexpr LONG kStatusInsufficientResources  = (LONG)0xC000009A;
+constexpr LONG kStatusDeviceNotConnected     = (LONG)0xC000009D;
+constexpr LONG kStatusInvalidAddress         = (LONG)0xC0000141;
+
+/* batches are split into chunks of this size so results fit on the stack */
+constexpr size_t kBatchChunk = 256;
+
+/* the IOCTL_PORTHOLE_SEND_MSG64 form of a message */
+inline PortholeMsg64 widen(const PortholeMsg & msg)
+{
+	PortholeMsg64 wide;
+	wide.type = msg.type;
+	wide.addr = msg.addr;
+	wide.size = msg.size;
+	return wide;
+}
+
+class Error : public std::runtime_error
+{
+public:
+	Error(const char * what, uint32_t code) :
+		std::runtime_error(std::string(what) + " failed: " + std::to_string(code)),
+		m_code(code) {}
+
+	/* the win32 error code of the failed call */
+	uint32_t code() const { return m_code; }
+
+private:
+	uint32_t m_code;
+};
+
+/* storage for an asynchronous IOCTL, it must not move until complete */
+struct AsyncOp
+{
+#ifdef _WIN32
+	OVERLAPPED ov = {};
+
+	AsyncOp() { ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL); }
+	~AsyncOp() { if (ov.hEvent) CloseHandle(ov.hEvent); }
+#else
+	AsyncOp() = default;
+#endif
+	AsyncOp(const AsyncOp &) = delete;
+	AsyncOp & operator=(const AsyncOp &) = delete;
+
+	/* set by backends that complete the request before returning */
+	uint32_t error    = 0;
+	size_t   returned = 0;
+
+	/* set by backends that finish a pended request in wait */
+	std::function<uint32_t(size_t *)> finish;
+};
+
+class Backend
+{
+public:
+	virtual ~Backend() = default;
+
+	/* issue one of the IOCTLs from Public.h, returns 0 or a win32 error code.
+	 * given an op the call may return ERROR_IO_PENDING, the result is then
+	 * collected with wait */
+	virtual uint32_t ioctl(uint32_t code, const void * in, size_t inSize,
+		void * out, size_t outSize, size_t * returned, AsyncOp * op = nullptr) = 0;
+	virtual uint32_t wait(AsyncOp & op, size_t * returned) = 0;
+
+	/* handler is called with true on connect and false on disconnect */
+	virtual uint32_t watch(std::function<void(bool)> handler) = 0;
+};
+
+#ifdef _WIN32
+class WindowsBackend : public Backend
+{
+public:
+	/* open the first porthole device present */
+	static std::unique_ptr<WindowsBackend> open()
+	{
+		HDEVINFO                 deviceInfoSet = SetupDiGetClassDevs(&GUID_DEVINTERFACE_PORTHOLE, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+		SP_DEVICE_INTERFACE_DATA devInfData    = {};
+		DWORD                    reqSize       = 0;
+
+		if (deviceInfoSet == INVALID_HANDLE_VALUE)
+			throw Error("SetupDiGetClassDevs", GetLastError());
+
+		devInfData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+		if (!SetupDiEnumDeviceInterfaces(deviceInfoSet, NULL, &GUID_DEVINTERFACE_PORTHOLE, 0, &devInfData))
+		{
+			const DWORD error = GetLastError();
+			SetupDiDestroyDeviceInfoList(deviceInfoSet);
+			throw Error("SetupDiEnumDeviceInterfaces", error);
+		}
+
+		SetupDiGetDeviceInterfaceDetail(deviceInfoSet, &devInfData, NULL, 0, &reqSize, NULL);
+		std::vector<uint8_t> detail(reqSize);
+		PSP_DEVICE_INTERFACE_DETAIL_DATA infData = (PSP_DEVICE_INTERFACE_DETAIL_DATA)detail.data();
+		infData->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA);
+
+		HANDLE handle = INVALID_HANDLE_VALUE;
+		if (SetupDiGetDeviceInterfaceDetail(deviceInfoSet, &devInfData, infData, reqSize, NULL, NULL))
+			handle = CreateFile(infData->DevicePath, 0, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
+
+		const DWORD error = GetLastError();
+		SetupDiDestroyDeviceInfoList(deviceInfoSet);
+		if (handle == INVALID_HANDLE_VALUE)
+			throw Error("CreateFile", error);
+
+		return std::unique_ptr<WindowsBackend>(new WindowsBackend(handle));
+	}
+
+	~WindowsBackend() override
+	{
+		for (HANDLE & wait : m_waits)
+			if (wait)
+				UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+
+		for (HANDLE & event : m_events)
+			if (event)
+				CloseHandle(event);
+
+		CloseHandle(m_handle);
+	}
+
+	/* the device handle, it is opened for overlapped IO */
+	HANDLE handle() const { return m_handle; }
+
+	uint32_t ioctl(uint32_t code, const void * in, size_t inSize,
+		void * out, size_t outSize, size_t * returned, AsyncOp * op = nullptr) override
+	{
+		/* the handle is overlapped so synchronous calls still need an op */
+		AsyncOp local;
+		AsyncOp * use = op ? op : &local;
+
+		DWORD bytes = 0;
+		ResetEvent(use->ov.hEvent);
+		if (DeviceIoControl(m_handle, code, (LPVOID)in, (DWORD)inSize, out, (DWORD)outSize, &bytes, &use->ov))
+		{
+			use->error    = 0;
+			use->returned = bytes;
+			if (returned)
+				*returned = bytes;
+			return 0;
+		}
+
+		const DWORD error = GetLastError();
+		if (error != ERROR_IO_PENDING)
+			return error;
+
+		if (op)
+			return ERROR_IO_PENDING;
+
+		return wait(local, returned);
+	}
+
+	uint32_t wait(AsyncOp & op, size_t * returned) override
+	{
+		DWORD bytes = 0;
+		const uint32_t error = GetOverlappedResult(m_handle, &op.ov, &bytes, TRUE) ? 0 : GetLastError();
+		op.error    = error;
+		op.returned = bytes;
+		if (returned)
+			*returned = bytes;
+		return error;
+	}
+
+	uint32_t watch(std::function<void(bool)> handler) override
+	{
+		if (m_events[0])
+			return ERROR_INVALID_FUNCTION;
+
+		m_handler = std::move(handler);
+
+		/* auto reset so each wait fires once per notification */
+		PortholeEvents events;
+		events.connect    = m_events[0] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		events.disconnect = m_events[1] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (!events.connect || !events.disconnect)
+			return GetLastError();
+
+		uint32_t error = ioctl(IOCTL_PORTHOLE_REGISTER_EVENTS, &events, sizeof(events), NULL, 0, NULL);
+		if (error)
+			return error;
+
+		if (!RegisterWaitForSingleObject(&m_waits[0], m_events[0], on_connect   , this, INFINITE, WT_EXECUTEDEFAULT) ||
+			!RegisterWaitForSingleObject(&m_waits[1], m_events[1], on_disconnect, this, INFINITE, WT_EXECUTEDEFAULT))
+			return GetLastError();
+
+		return 0;
+	}
+
+private:
+	explicit WindowsBackend(HANDLE handle) : m_handle(handle) {}
+
+	static VOID CALLBACK on_connect(PVOID context, BOOLEAN)
+	{
+		((WindowsBackend *)context)->m_handler(true);
+	}
+
+	static VOID CALLBACK on_disconnect(PVOID context, BOOLEAN)
+	{
+		((WindowsBackend *)context)->m_handler(false);
+	}
+
+	HANDLE                    m_handle;
+	HANDLE                    m_events[2] = {};
+	HANDLE                    m_waits [2] = {};
+	std::function<void(bool)> m_handler;
+};
+#endif
+
+/*
+ * An in-process device following the driver's IOCTL contract. Handles are
+ * generation tagged like the driver's so stale IDs are rejected, and the
+ * mapping table is allocated up front so the map and unmap paths don't
+ * allocate. Requests complete before ioctl returns, except for notification
+ * waits which block until notify is called, or pend when given an op.
+ */
+class FakeBackend : public Backend
+{
+public:
+	explicit FakeBackend(size_t maxMappings = 65536) :
+		m_entries(std::min<size_t>(maxMappings, kIndexMask + 1))
+	{
+		for (size_t i = 0; i < m_entries.size(); ++i)
+			m_entries[i].nextFree = i + 1 < m_entries.size() ? (uint32_t)(i + 2) : 0;
+		m_freeHead = m_entries.empty() ? 0 : 1;
+	}
+
+	~FakeBackend() override
+	{
+		for (Entry & entry : m_entries)
+			std::free(entry.alloc);
+	}
+
+	/* simulate the host connecting or disconnecting, a disconnect drops
+	 * every mapping as the driver does */
+	void connect()
+	{
+		std::function<void(bool)> handler;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_connected = true;
+			handler     = m_handler;
+		}
+		if (handler)
+			handler(true);
+	}
+
+	void disconnect()
+	{
+		std::function<void(bool)> handler;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_connected = false;
+			for (size_t i = 0; i < m_entries.size(); ++i)
+				if (m_entries[i].live)
+					free_entry((uint32_t)i);
+			handler = m_handler;
+		}
+		m_notified.notify_all();
+		if (handler)
+			handler(false);
+	}
+
+	/* the number of live mappings */
+	size_t mapped() const
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_live;
+	}
+
+	/* the number of doorbells rung */
+	uint64_t doorbells() const
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_stats.device[PORTHOLE_STAT_DOORBELLS];
+	}
+
+	/* simulate the client notifying a mapping, false if nobody subscribed */
+	bool notify(PortholeMapID id, uint32_t value)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			Entry * entry = find(id);
+			if (!entry || !entry->subscribed)
+				return false;
+
+			entry->notifyValue |= value;
+			++entry->notifyCount;
+			count(PORTHOLE_STAT_NOTIFICATIONS, 1);
+		}
+		m_notified.notify_all();
+		return true;
+	}
+
+	/* look up a live mapping, false if the handle is not live */
+	bool lookup(PortholeMapID id, PortholeMsg64 * msg) const
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		const Entry * entry = find(id);
+		if (!entry)
+			return false;
+		if (msg)
+			*msg = entry->msg;
+		return true;
+	}
+
+	uint32_t ioctl(uint32_t code, const void * in, size_t inSize,
+		void * out, size_t outSize, size_t * returned, AsyncOp * op = nullptr) override
+	{
+		if (code == IOCTL_PORTHOLE_NOTIFY_WAIT)
+			return notify_wait(in, inSize, out, outSize, returned, op);
+
+		size_t   bytes = 0;
+		uint32_t error = dispatch(code, in, inSize, out, outSize, &bytes);
+		if (op)
+		{
+			op->error    = error;
+			op->returned = bytes;
+		}
+		if (returned)
+			*returned = bytes;
+		return error;
+	}
+
+	uint32_t wait(AsyncOp & op, size_t * returned) override
+	{
+		if (op.finish)
+		{
+			auto finish = std::move(op.finish);
+			op.finish   = nullptr;
+			op.error    = finish(&op.returned);
+		}
+
+		if (returned)
+			*returned = op.returned;
+		return op.error;
+	}
+
+	uint32_t watch(std::function<void(bool)> handler) override
+	{
+		bool connected;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_handler = handler;
+			connected = m_connected;
+		}
+
+		/* like the driver, report an existing connection straight away */
+		if (connected && handler)
+			handler(true);
+		return 0;
+	}
+
+private:
+	static constexpr uint32_t kIndexBits = 20;
+	static constexpr uint32_t kIndexMask = (1u << kIndexBits) - 1;
+	static constexpr uint32_t kGenMask   = (1u << 11) - 1;
+
+	struct Entry
+	{
+		PortholeMsg64 msg      = {};
+		void *      alloc      = nullptr;
+		uint32_t    generation = 1;
+		uint32_t    nextFree   = 0;
+		bool        live       = false;
+
+		bool        subscribed  = false;
+		uint32_t    notifyValue = 0;
+		uint32_t    notifyCount = 0;
+	};
+
+	Entry * find(PortholeMapID id)
+	{
+		return const_cast<Entry *>(static_cast<const FakeBackend *>(this)->find(id));
+	}
+
+	const Entry * find(PortholeMapID id) const
+	{
+		if (id < 0)
+			return nullptr;
+
+		const uint32_t index = (uint32_t)id & kIndexMask;
+		if (index >= m_entries.size())
+			return nullptr;
+
+		const Entry & entry = m_entries[index];
+		if (!entry.live || entry.generation != (((uint32_t)id >> kIndexBits) & kGenMask))
+			return nullptr;
+		return &entry;
+	}
+
+	/* there is only ever the one handle so both sets move together */
+	void count(uint32_t counter, uint64_t value)
+	{
+		m_stats.device[counter] += value;
+		m_stats.handle[counter] += value;
+	}
+
+	LONG map(const PortholeMsg64 & msg, PortholeMapID * id, void * alloc = nullptr)
+	{
+		if (!m_connected)
+			return kStatusDeviceNotConnected;
+
+		if (!msg.addr || !msg.size)
+			return kStatusInvalidParameter;
+
+		if (!m_freeHead)
+			return kStatusInsufficientResources;
+
+		const uint32_t index = m_freeHead - 1;
+		Entry & entry = m_entries[index];
+		m_freeHead = entry.nextFree;
+		++m_live;
+
+		entry.msg   = msg;
+		entry.alloc = alloc;
+		entry.live  = true;
+
+		/* memory here is virtual, call every mapping a single segment */
+		count(PORTHOLE_STAT_MAPS_CREATED, 1);
+		count(PORTHOLE_STAT_BYTES_MAPPED, msg.size);
+		count(PORTHOLE_STAT_SEGMENTS    , 1);
+		*id = (PortholeMapID)((entry.generation << kIndexBits) | index);
+		return kStatusSuccess;
+	}
+
+	void free_entry(uint32_t index)
+	{
+		Entry & entry = m_entries[index];
+		count(PORTHOLE_STAT_MAPS_FREED    , 1);
+		count(PORTHOLE_STAT_BYTES_UNMAPPED, entry.msg.size);
+		std::free(entry.alloc);
+		entry.alloc       = nullptr;
+		entry.live        = false;
+		entry.subscribed  = false;
+		entry.notifyValue = 0;
+		entry.notifyCount = 0;
+		entry.generation = (entry.generation % kGenMask) + 1;
+		entry.nextFree   = m_freeHead;
+		m_freeHead       = index + 1;
+		--m_live;
+	}
+
+	LONG extend(const PortholeExtendMsg & msg)
+	{
+		Entry * entry = find(msg.id);
+		if (!entry)
+			return kStatusInvalidAddress;
+
+		if (!m_connected)
+			return kStatusDeviceNotConnected;
+
+		if (!msg.addr || !msg.size || msg.size > UINT64_MAX - entry->msg.size)
+			return kStatusInvalidParameter;
+
+		entry->msg.size += msg.size;
+		count(PORTHOLE_STAT_BYTES_MAPPED, msg.size);
+		count(PORTHOLE_STAT_SEGMENTS    , 1);
+		return kStatusSuccess;
+	}
+
+	LONG unmap(PortholeMapID id)
+	{
+		if (!find(id))
+			return kStatusInvalidAddress;
+
+		if (!m_connected)
+			return kStatusDeviceNotConnected;
+
+		free_entry((uint32_t)id & kIndexMask);
+		m_notified.notify_all();
+		return kStatusSuccess;
+	}
+
+	/* block until the mapping has been notified, or dropped */
+	uint32_t take_notify(PortholeMapID id, PortholeNotifyResult * result, size_t * returned)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		Entry * entry = find(id);
+		if (!entry || !entry->subscribed)
+			return ERROR_INVALID_PARAMETER;
+
+		const uint32_t generation = entry->generation;
+		m_notified.wait(lock, [&]()
+		{
+			return !entry->live || entry->generation != generation || entry->notifyCount;
+		});
+
+		if (!entry->live || entry->generation != generation)
+			return ERROR_OPERATION_ABORTED;
+
+		result->value      = entry->notifyValue;
+		result->count      = entry->notifyCount;
+		entry->notifyValue = 0;
+		entry->notifyCount = 0;
+		if (returned)
+			*returned = sizeof(PortholeNotifyResult);
+		return 0;
+	}
+
+	uint32_t notify_wait(const void * in, size_t inSize, void * out, size_t outSize, size_t * returned, AsyncOp * op)
+	{
+		if (inSize != sizeof(PortholeMapID) || outSize != sizeof(PortholeNotifyResult))
+			return ERROR_INSUFFICIENT_BUFFER;
+
+		const PortholeMapID          id     = *(const PortholeMapID *)in;
+		PortholeNotifyResult * const result = (PortholeNotifyResult *)out;
+		if (!op)
+			return take_notify(id, result, returned);
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			const Entry * entry = find(id);
+			if (!entry || !entry->subscribed)
+				return ERROR_INVALID_PARAMETER;
+
+			/* like the driver, only pend when nothing has arrived yet */
+			if (!entry->notifyCount)
+			{
+				op->finish = [this, id, result](size_t * bytes) { return take_notify(id, result, bytes); };
+				return ERROR_IO_PENDING;
+			}
+		}
+
+		op->error = take_notify(id, result, &op->returned);
+		if (returned)
+			*returned = op->returned;
+		return op->error;
+	}
+
+	static uint32_t to_error(LONG status)
+	{
+		switch (status)
+		{
+			case kStatusSuccess              : return 0;
+			case kStatusInvalidParameter     : return ERROR_INVALID_PARAMETER;
+			case kStatusInsufficientResources: return ERROR_NOT_ENOUGH_MEMORY;
+			case kStatusDeviceNotConnected   : return ERROR_DEVICE_NOT_CONNECTED;
+			default                          : return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	uint32_t dispatch(uint32_t code, const void * in, size_t inSize,
+		void * out, size_t outSize, size_t * returned)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		switch (code)
+		{
+			case IOCTL_PORTHOLE_SEND_MSG:
+			{
+				if (inSize != sizeof(PortholeMsg) || outSize != sizeof(PortholeMapID))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const LONG status = map(widen(*(const PortholeMsg *)in), (PortholeMapID *)out);
+				if (status == kStatusSuccess)
+					*returned = sizeof(PortholeMapID);
+				return to_error(status);
+			}
+
+			case IOCTL_PORTHOLE_SEND_MSG64:
+			{
+				if (inSize != sizeof(PortholeMsg64) || outSize != sizeof(PortholeMapID))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const LONG status = map(*(const PortholeMsg64 *)in, (PortholeMapID *)out);
+				if (status == kStatusSuccess)
+					*returned = sizeof(PortholeMapID);
+				return to_error(status);
+			}
+
+			case IOCTL_PORTHOLE_UNLOCK_BUFFER:
+				if (inSize != sizeof(PortholeMapID))
+					return ERROR_INSUFFICIENT_BUFFER;
+				return to_error(unmap(*(const PortholeMapID *)in));
+
+			case IOCTL_PORTHOLE_EXTEND:
+				if (inSize != sizeof(PortholeExtendMsg))
+					return ERROR_INSUFFICIENT_BUFFER;
+				return to_error(extend(*(const PortholeExtendMsg *)in));
+
+			/* nothing is copied to a host here, only the request is checked */
+			case IOCTL_PORTHOLE_DIRTY:
+			{
+				const PortholeDirtyMsg * msg = (const PortholeDirtyMsg *)in;
+				if (inSize < sizeof(PortholeDirtyMsg) || !msg->count || msg->count > PORTHOLE_MAX_DIRTY ||
+					inSize != sizeof(PortholeDirtyMsg) + msg->count * sizeof(PortholeDirtyRange))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				if (!find(msg->id))
+					return to_error(kStatusInvalidAddress);
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_SEND_MSG_BATCH:
+			{
+				const size_t count = inSize / sizeof(PortholeMsg);
+				if (count == 0 || count > PORTHOLE_MAX_BATCH || inSize != count * sizeof(PortholeMsg) ||
+					outSize != count * sizeof(PortholeBatchResult))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const PortholeMsg   * msgs    = (const PortholeMsg *)in;
+				PortholeBatchResult * results = (PortholeBatchResult *)out;
+				for (size_t i = 0; i < count; ++i)
+				{
+					results[i].status = map(widen(msgs[i]), &results[i].id);
+					if (results[i].status != kStatusSuccess)
+						results[i].id = -1;
+				}
+				*returned = outSize;
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_UNLOCK_BATCH:
+			{
+				const size_t count = inSize / sizeof(PortholeMapID);
+				if (count == 0 || count > PORTHOLE_MAX_BATCH || inSize != count * sizeof(PortholeMapID) ||
+					outSize != count * sizeof(LONG))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const PortholeMapID * ids     = (const PortholeMapID *)in;
+				LONG                * results = (LONG *)out;
+				for (size_t i = 0; i < count; ++i)
+					results[i] = unmap(ids[i]);
+				*returned = outSize;
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_ALLOC_BUFFER:
+			{
+				if (inSize != sizeof(PortholeAllocMsg) || outSize != sizeof(PortholeAllocResult))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const PortholeAllocMsg * msg    = (const PortholeAllocMsg *)in;
+				PortholeAllocResult    * result = (PortholeAllocResult *)out;
+				if (!msg->size)
+					return ERROR_INVALID_PARAMETER;
+
+				void * alloc = std::calloc(1, msg->size);
+				if (!alloc)
+					return ERROR_NOT_ENOUGH_MEMORY;
+
+				PortholeMsg64 mapMsg;
+				mapMsg.type = msg->type;
+				mapMsg.addr = alloc;
+				mapMsg.size = msg->size;
+
+				const LONG status = map(mapMsg, &result->id, alloc);
+				if (status != kStatusSuccess)
+				{
+					std::free(alloc);
+					return to_error(status);
+				}
+
+				result->addr = alloc;
+				*returned    = sizeof(PortholeAllocResult);
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_DOORBELL:
+			{
+				if (inSize != sizeof(PortholeDoorbell))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const PortholeDoorbell * bell = (const PortholeDoorbell *)in;
+				if (!m_connected)
+					return ERROR_DEVICE_NOT_CONNECTED;
+				if (!find(bell->id) || bell->value > 0xFF)
+					return ERROR_INVALID_PARAMETER;
+
+				count(PORTHOLE_STAT_DOORBELLS, 1);
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_NOTIFY_REGISTER:
+			{
+				if (inSize != sizeof(PortholeNotifyRegister))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				/* there is nothing to signal the event with here, waits go
+				 * through IOCTL_PORTHOLE_NOTIFY_WAIT */
+				if (!m_connected)
+					return ERROR_DEVICE_NOT_CONNECTED;
+
+				Entry * entry = find(((const PortholeNotifyRegister *)in)->id);
+				if (!entry)
+					return ERROR_INVALID_PARAMETER;
+
+				entry->subscribed = true;
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_CONFIGURE:
+				if (inSize != sizeof(PortholeConfig))
+					return ERROR_INSUFFICIENT_BUFFER;
+				if (((const PortholeConfig *)in)->flags & ~(PORTHOLE_CONFIG_REG_CACHE | PORTHOLE_CONFIG_DEFERRED_UNMAP |
+					PORTHOLE_CONFIG_STREAM | PORTHOLE_CONFIG_PARALLEL_LOCK))
+					return ERROR_INVALID_PARAMETER;
+				if (((const PortholeConfig *)in)->lockThreads > PORTHOLE_MAX_LOCK_THREADS)
+					return ERROR_INVALID_PARAMETER;
+				return 0;
+
+			/* unlocks are never deferred here so there is nothing to wait for */
+			case IOCTL_PORTHOLE_FLUSH:
+				return 0;
+
+			case IOCTL_PORTHOLE_GET_CACHE_STATS:
+				if (outSize != sizeof(PortholeCacheStats))
+					return ERROR_INSUFFICIENT_BUFFER;
+				std::memset(out, 0, outSize);
+				*returned = outSize;
+				return 0;
+
+			case IOCTL_PORTHOLE_QUERY_STATS:
+				if (outSize != sizeof(PortholeStats))
+					return ERROR_INSUFFICIENT_BUFFER;
+				m_stats.version = PORTHOLE_STATS_VERSION;
+				m_stats.count   = PORTHOLE_STAT_MAX;
+				std::memcpy(out, &m_stats, sizeof(m_stats));
+				*returned = outSize;
+				return 0;
+
+			case IOCTL_PORTHOLE_GET_WAIT_HISTOGRAM:
+				if (outSize != sizeof(PortholeWaitHistogram))
+					return ERROR_INSUFFICIENT_BUFFER;
+				std::memset(out, 0, outSize);
+				*returned = outSize;
+				return 0;
+
+			default:
+				return ERROR_INVALID_FUNCTION;
+		}
+	}
+
+	mutable std::mutex        m_lock;
+	std::condition_variable   m_notified;
+	std::vector<Entry>        m_entries;
+	uint32_t                  m_freeHead  = 0; // index + 1, 0 if full
+	size_t                    m_live      = 0;
+	PortholeStats             m_stats     = {};
+	bool                      m_connected = true;
+	std::function<void(bool)> m_handler;
+};
+
+/* an owned mapping, unlocked when it goes out of scope */
+class Mapping
+{
+public:
+	Mapping() = default;
+	Mapping(Backend * backend, PortholeMapID id) : m_backend(backend), m_id(id) {}
+
+	Mapping(Mapping && other) noexcept : m_backend(other.m_backend), m_id(other.m_id)
+	{
+		other.m_backend = nullptr;
+	}
+
+	Mapping & operator=(Mapping && other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			m_backend       = other.m_backend;
+			m_id            = other.m_id;
+			other.m_backend = nullptr;
+		}
+		return *this;
+	}
+
+	Mapping(const Mapping &) = delete;
+	Mapping & operator=(const Mapping &) = delete;
+
+	~Mapping() { reset(); }
+
+	explicit operator bool() const { return m_backend != nullptr; }
+	PortholeMapID id() const { return m_id; }
+
+	/* unlock the mapping now, returns the win32 error of the unlock */
+	uint32_t reset()
+	{
+		if (!m_backend)
+			return 0;
+
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_UNLOCK_BUFFER, &m_id, sizeof(m_id), nullptr, 0, nullptr);
+		m_backend = nullptr;
+		return error;
+	}
+
+	/* give up ownership without unlocking */
+	PortholeMapID release()
+	{
+		m_backend = nullptr;
+		return m_id;
+	}
+
+private:
+	Backend *     m_backend = nullptr;
+	PortholeMapID m_id      = -1;
+};
+
+/* a driver allocated buffer, valid until the mapping is unlocked */
+struct SharedBuffer
+{
+	Mapping mapping;
+	void *  addr = nullptr;
+	UINT32  size = 0;
+};
+
+/* caller owned storage for an asynchronous send */
+class AsyncSend
+{
+public:
+	AsyncSend() = default;
+	AsyncSend(const AsyncSend &) = delete;
+	AsyncSend & operator=(const AsyncSend &) = delete;
+
+	/* wait for the send to complete and take the mapping */
+	Mapping wait()
+	{
+		if (!m_backend)
+			throw Error("AsyncSend::wait", ERROR_INVALID_FUNCTION);
+
+		Backend * backend = m_backend;
+		m_backend = nullptr;
+
+		size_t returned;
+		const uint32_t error = m_pending ? backend->wait(m_op, &returned) : m_op.error;
+		if (error)
+			throw Error("IOCTL_PORTHOLE_SEND_MSG", error);
+
+		return Mapping(backend, m_id);
+	}
+
+private:
+	friend class Device;
+
+	AsyncOp       m_op;
+	PortholeMsg   m_msg     = {};
+	PortholeMapID m_id      = -1;
+	Backend *     m_backend = nullptr;
+	bool          m_pending = false;
+};
+
+class Device
+{
+public:
+	explicit Device(std::unique_ptr<Backend> backend) : m_backend(std::move(backend)) {}
+
+#ifdef _WIN32
+	static Device open() { return Device(WindowsBackend::open()); }
+#endif
+
+	Backend & backend() { return *m_backend; }
+
+	/* buffers of 4GB and over go through IOCTL_PORTHOLE_SEND_MSG64 */
+	Mapping send(UINT32 type, void * addr, uint64_t size)
+	{
+		if (size > UINT32_MAX)
+		{
+			PortholeMsg64 msg;
+			msg.type = type;
+			msg.addr = addr;
+			msg.size = size;
+
+			PortholeMapID id;
+			const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_SEND_MSG64, &msg, sizeof(msg), &id, sizeof(id), nullptr);
+			if (error)
+				throw Error("IOCTL_PORTHOLE_SEND_MSG64", error);
+
+			return Mapping(m_backend.get(), id);
+		}
+
+		PortholeMsg msg;
+		msg.type = type;
+		msg.addr = addr;
+		msg.size = (UINT32)size;
+
+		PortholeMapID id;
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_SEND_MSG, &msg, sizeof(msg), &id, sizeof(id), nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_SEND_MSG", error);
+
+		return Mapping(m_backend.get(), id);
+	}
+
+	/* start a send, the result is collected with op.wait() */
+	void sendAsync(AsyncSend & op, UINT32 type, void * addr, UINT32 size)
+	{
+		op.m_msg.type = type;
+		op.m_msg.addr = addr;
+		op.m_msg.size = size;
+
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_SEND_MSG, &op.m_msg, sizeof(op.m_msg),
+			&op.m_id, sizeof(op.m_id), nullptr, &op.m_op);
+		if (error && error != ERROR_IO_PENDING)
+			throw Error("IOCTL_PORTHOLE_SEND_MSG", error);
+
+		op.m_backend = m_backend.get();
+		op.m_pending = error == ERROR_IO_PENDING;
+	}
+
+	/* map count buffers, mappings[i] is left empty for any entry that failed
+	 * and status[i], if supplied, receives each entry's NTSTATUS. returns the
+	 * number of buffers mapped */
+	size_t sendBatch(const PortholeMsg * msgs, size_t count, Mapping * mappings, LONG * status = nullptr)
+	{
+		PortholeBatchResult results[kBatchChunk];
+		size_t mapped = 0;
+
+		for (size_t base = 0; base < count; base += kBatchChunk)
+		{
+			const size_t n = std::min(count - base, kBatchChunk);
+			const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_SEND_MSG_BATCH,
+				msgs + base, n * sizeof(PortholeMsg), results, n * sizeof(PortholeBatchResult), nullptr);
+			if (error)
+				throw Error("IOCTL_PORTHOLE_SEND_MSG_BATCH", error);
+
+			for (size_t i = 0; i < n; ++i)
+			{
+				if (status)
+					status[base + i] = results[i].status;
+
+				if (results[i].status != kStatusSuccess)
+				{
+					mappings[base + i] = Mapping();
+					continue;
+				}
+
+				mappings[base + i] = Mapping(m_backend.get(), results[i].id);
+				++mapped;
+			}
+		}
+
+		return mapped;
+	}
+
+	/* unlock count mappings in as few calls as possible, mappings that fail
+	 * to unlock are left owned. returns the number unlocked */
+	size_t unlockBatch(Mapping * mappings, size_t count)
+	{
+		PortholeMapID ids    [kBatchChunk];
+		LONG          results[kBatchChunk];
+		Mapping *     owners [kBatchChunk];
+		size_t        unlocked = 0;
+
+		for (size_t base = 0; base < count; )
+		{
+			size_t n = 0;
+			for (; base < count && n < kBatchChunk; ++base)
+				if (mappings[base])
+				{
+					owners[n] = &mappings[base];
+					ids   [n] = mappings[base].id();
+					++n;
+				}
+
+			if (n == 0)
+				break;
+
+			const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_UNLOCK_BATCH,
+				ids, n * sizeof(PortholeMapID), results, n * sizeof(LONG), nullptr);
+			if (error)
+				throw Error("IOCTL_PORTHOLE_UNLOCK_BATCH", error);
+
+			for (size_t i = 0; i < n; ++i)
+				if (results[i] == kStatusSuccess)
+				{
+					owners[i]->release();
+					++unlocked;
+				}
+		}
+
+		return unlocked;
+	}
+
+	/* allocate a buffer in the driver and map it */
+	SharedBuffer alloc(UINT32 type, UINT32 size)
+	{
+		PortholeAllocMsg    msg;
+		PortholeAllocResult result;
+		msg.type = type;
+		msg.size = size;
+
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_ALLOC_BUFFER, &msg, sizeof(msg), &result, sizeof(result), nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_ALLOC_BUFFER", error);
+
+		SharedBuffer buffer;
+		buffer.mapping = Mapping(m_backend.get(), result.id);
+		buffer.addr    = result.addr;
+		buffer.size    = size;
+		return buffer;
+	}
+
+	/* append size bytes at addr to the end of the mapping, only the new pages
+	 * are locked and sent to the device and the mapping keeps it's ID */
+	void extend(const Mapping & mapping, void * addr, UINT64 size)
+	{
+		PortholeExtendMsg msg;
+		msg.id   = mapping.id();
+		msg.addr = addr;
+		msg.size = size;
+
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_EXTEND, &msg, sizeof(msg), nullptr, 0, nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_EXTEND", error);
+	}
+
+	/* tell the host which byte ranges of the mapping have been written so it
+	 * only copies those, the driver aligns and merges them */
+	void dirty(const Mapping & mapping, const PortholeDirtyRange * ranges, size_t count)
+	{
+		std::vector<uint8_t> buffer;
+		for (size_t done = 0; done < count; )
+		{
+			const size_t chunk = std::min<size_t>(count - done, PORTHOLE_MAX_DIRTY);
+			buffer.resize(sizeof(PortholeDirtyMsg) + chunk * sizeof(PortholeDirtyRange));
+
+			PortholeDirtyMsg msg;
+			msg.id    = mapping.id();
+			msg.count = (UINT32)chunk;
+			std::memcpy(buffer.data(), &msg, sizeof(msg));
+			std::memcpy(buffer.data() + sizeof(msg), ranges + done, chunk * sizeof(PortholeDirtyRange));
+
+			const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_DIRTY, buffer.data(), buffer.size(), nullptr, 0, nullptr);
+			if (error)
+				throw Error("IOCTL_PORTHOLE_DIRTY", error);
+			done += chunk;
+		}
+	}
+
+	/* notify the client of activity on a mapping without remapping it */
+	void doorbell(const Mapping & mapping, UINT32 value = 0)
+	{
+		PortholeDoorbell bell;
+		bell.id    = mapping.id();
+		bell.value = value;
+
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_DOORBELL, &bell, sizeof(bell), nullptr, 0, nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_DOORBELL", error);
+	}
+
+	/* subscribe to notifications the client raises on a mapping, event is
+	 * also signalled on each one when given */
+	void subscribe(const Mapping & mapping, HANDLE event = (HANDLE)-1)
+	{
+		PortholeNotifyRegister reg;
+		reg.id    = mapping.id();
+		reg.event = event;
+
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_NOTIFY_REGISTER, &reg, sizeof(reg), nullptr, 0, nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_NOTIFY_REGISTER", error);
+	}
+
+	/* block until the client notifies a subscribed mapping, returns the
+	 * notifications received since the last wait */
+	PortholeNotifyResult waitNotify(const Mapping & mapping)
+	{
+		const PortholeMapID  id = mapping.id();
+		PortholeNotifyResult result;
+
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_NOTIFY_WAIT, &id, sizeof(id), &result, sizeof(result), nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_NOTIFY_WAIT", error);
+		return result;
+	}
+
+	/* lockThreads is only used with PORTHOLE_CONFIG_PARALLEL_LOCK, 0 for one
+	 * per processor */
+	void configure(UINT32 flags, UINT64 cacheBudget = 0, UINT32 lockThreads = 0)
+	{
+		PortholeConfig config;
+		config.flags       = flags;
+		config.cacheBudget = cacheBudget;
+		config.lockThreads = lockThreads;
+
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_CONFIGURE, &config, sizeof(config), nullptr, 0, nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_CONFIGURE", error);
+	}
+
+	PortholeCacheStats cacheStats()
+	{
+		PortholeCacheStats stats;
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_GET_CACHE_STATS, nullptr, 0, &stats, sizeof(stats), nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_GET_CACHE_STATS", error);
+		return stats;
+	}
+
+	/* wait for the unlocks deferred by PORTHOLE_CONFIG_DEFERRED_UNMAP to be
+	 * done, throws with the first of them to fail since the last flush */
+	void flush()
+	{
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_FLUSH, nullptr, 0, nullptr, 0, nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_FLUSH", error);
+	}
+
+	/* the device wide and per handle counters, see PORTHOLE_STAT_* */
+	PortholeStats stats()
+	{
+		PortholeStats stats;
+		const uint32_t error = m_backend->ioctl(IOCTL_PORTHOLE_QUERY_STATS, nullptr, 0, &stats, sizeof(stats), nullptr);
+		if (error)
+			throw Error("IOCTL_PORTHOLE_QUERY_STATS", error);
+		return stats;
+	}
+
+	/* handler is called with true on connect and false on disconnect, it
+	 * may be called from another thread */
+	void onConnection(std::function<void(bool)> handler)
+	{
+		const uint32_t error = m_backend->watch(std::move(handler));
+		if (error)
+			throw Error("IOCTL_PORTHOLE_REGISTER_EVENTS", error);
+	}
+
+private:
+	std::unique_ptr<Backend> m_backend;
+};
+
+}
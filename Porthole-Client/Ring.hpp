@@ -0,0 +1,309 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/*
+ * A lock-free ring carried inside a single long lived mapping.
+ *
+ * The buffer starts with a RingHeader followed by a power of two sized data
+ * area holding variable length records. Producers and the consumer each keep
+ * a private position and only publish it to the shared header every so often,
+ * so a message costs a memcpy and the shared cache lines are touched once
+ * per batch rather than once per message.
+ *
+ * SpscProducer is for a single producer thread. MpscProducer lets any number
+ * of threads produce, space is claimed with a CAS and records are published
+ * in claim order. The consumer side is the same for both.
+ *
+ * This header only uses the standard library so the host side and tests can
+ * share it.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+namespace porthole
+{
+
+constexpr uint32_t kRingMagic     = 0x474E4952; // "RING"
+constexpr uint32_t kRingVersion   = 0x0100;
+constexpr size_t   kRingCacheLine = 64;
+
+constexpr uint32_t kRingFlagMPSC  = 1u << 0;
+
+struct RingHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t reserved;
+	uint64_t capacity; // bytes in the data area, a power of two
+
+	/* each position lives on it's own cache line so the producer and
+	 * consumer don't contend on the same line */
+	alignas(kRingCacheLine) std::atomic<uint64_t> head;    // published by producers
+	alignas(kRingCacheLine) std::atomic<uint64_t> tail;    // published by the consumer
+	alignas(kRingCacheLine) std::atomic<uint64_t> reserve; // claimed by MPSC producers
+	alignas(kRingCacheLine) uint8_t               data[1];
+};
+
+constexpr size_t kRingHeaderSize = offsetof(RingHeader, data);
+
+/* every record starts with this, payloads are padded to 8 bytes */
+struct RingRecord
+{
+	uint32_t size;
+	uint32_t flags;
+};
+
+constexpr uint32_t kRecordPad = 1u << 0; // skip to the start of the data area
+
+inline uint64_t ring_record_size(uint32_t size)
+{
+	return sizeof(RingRecord) + ((size + 7ull) & ~7ull);
+}
+
+/* format a buffer as a ring, returns nullptr if it's too small */
+inline RingHeader * ring_init(void * mem, size_t size, uint32_t flags = 0)
+{
+	if (size < kRingHeaderSize + 64)
+		return nullptr;
+
+	uint64_t capacity = 64;
+	while (capacity * 2 <= size - kRingHeaderSize)
+		capacity *= 2;
+
+	RingHeader * ring = (RingHeader *)mem;
+	ring->magic    = kRingMagic;
+	ring->version  = kRingVersion;
+	ring->flags    = flags;
+	ring->reserved = 0;
+	ring->capacity = capacity;
+	ring->head.store   (0, std::memory_order_relaxed);
+	ring->tail.store   (0, std::memory_order_relaxed);
+	ring->reserve.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	return ring;
+}
+
+/* attach to a ring formatted by the other side */
+inline RingHeader * ring_attach(void * mem, size_t size)
+{
+	RingHeader * ring = (RingHeader *)mem;
+	if (size < kRingHeaderSize || ring->magic != kRingMagic || ring->version != kRingVersion ||
+		ring->capacity > size - kRingHeaderSize)
+		return nullptr;
+	return ring;
+}
+
+class SpscProducer
+{
+public:
+	/* publish the head after every `batch` messages, publish() flushes early */
+	explicit SpscProducer(RingHeader * ring, uint32_t batch = 32) :
+		m_ring(ring),
+		m_mask(ring->capacity - 1),
+		m_head(ring->head.load(std::memory_order_relaxed)),
+		m_published(m_head),
+		m_tail(ring->tail.load(std::memory_order_acquire)),
+		m_batch(batch ? batch : 1) {}
+
+	/* copy a message into the ring, false if there is no room */
+	bool write(const void * data, uint32_t size)
+	{
+		const uint64_t capacity = m_mask + 1;
+		const uint64_t need     = ring_record_size(size);
+		const uint64_t offset   = m_head & m_mask;
+		const uint64_t pad      = offset + need > capacity ? capacity - offset : 0;
+
+		if (need > capacity)
+			return false;
+
+		if (m_head + pad + need - m_tail > capacity)
+		{
+			m_tail = m_ring->tail.load(std::memory_order_acquire);
+			if (m_head + pad + need - m_tail > capacity)
+			{
+				/* make sure the consumer can see what is there to drain */
+				publish();
+				return false;
+			}
+		}
+
+		if (pad)
+		{
+			RingRecord * record = (RingRecord *)(m_ring->data + offset);
+			record->size  = 0;
+			record->flags = kRecordPad;
+			m_head += pad;
+		}
+
+		RingRecord * record = (RingRecord *)(m_ring->data + (m_head & m_mask));
+		record->size  = size;
+		record->flags = 0;
+		std::memcpy(record + 1, data, size);
+		m_head += need;
+
+		if (++m_pending >= m_batch)
+			publish();
+		return true;
+	}
+
+	/* publish everything written so far, returns true if the ring was empty
+	 * beforehand so the caller knows the consumer may need a notification */
+	bool publish()
+	{
+		if (m_head == m_published)
+			return false;
+
+		const bool wasEmpty = m_ring->tail.load(std::memory_order_acquire) == m_published;
+		m_ring->head.store(m_head, std::memory_order_release);
+		m_published = m_head;
+		m_pending   = 0;
+		return wasEmpty;
+	}
+
+private:
+	RingHeader * m_ring;
+	uint64_t     m_mask;
+	uint64_t     m_head;      // next write position
+	uint64_t     m_published; // last head made visible
+	uint64_t     m_tail;      // cached consumer position
+	uint32_t     m_batch;
+	uint32_t     m_pending = 0;
+};
+
+class MpscProducer
+{
+public:
+	explicit MpscProducer(RingHeader * ring) :
+		m_ring(ring),
+		m_mask(ring->capacity - 1) {}
+
+	/* copy a message into the ring, false if there is no room. may be
+	 * called from any number of threads */
+	bool write(const void * data, uint32_t size)
+	{
+		const uint64_t capacity = m_mask + 1;
+		const uint64_t need     = ring_record_size(size);
+		if (need > capacity)
+			return false;
+
+		uint64_t pos = m_ring->reserve.load(std::memory_order_relaxed);
+		uint64_t pad;
+		for (;;)
+		{
+			const uint64_t offset = pos & m_mask;
+			pad = offset + need > capacity ? capacity - offset : 0;
+
+			if (pos + pad + need - m_ring->tail.load(std::memory_order_acquire) > capacity)
+				return false;
+
+			if (m_ring->reserve.compare_exchange_weak(pos, pos + pad + need,
+				std::memory_order_relaxed, std::memory_order_relaxed))
+				break;
+		}
+
+		uint64_t at = pos;
+		if (pad)
+		{
+			RingRecord * record = (RingRecord *)(m_ring->data + (at & m_mask));
+			record->size  = 0;
+			record->flags = kRecordPad;
+			at += pad;
+		}
+
+		RingRecord * record = (RingRecord *)(m_ring->data + (at & m_mask));
+		record->size  = size;
+		record->flags = 0;
+		std::memcpy(record + 1, data, size);
+
+		/* publish in claim order, earlier producers are only ever a copy away */
+		for (unsigned spins = 0; m_ring->head.load(std::memory_order_acquire) != pos; ++spins)
+			if (spins >= 64)
+				std::this_thread::yield();
+		m_ring->head.store(at + need, std::memory_order_release);
+		return true;
+	}
+
+private:
+	RingHeader * m_ring;
+	uint64_t     m_mask;
+};
+
+class RingConsumer
+{
+public:
+	explicit RingConsumer(RingHeader * ring) :
+		m_ring(ring),
+		m_mask(ring->capacity - 1),
+		m_tail(ring->tail.load(std::memory_order_relaxed)),
+		m_head(ring->head.load(std::memory_order_acquire)) {}
+
+	/* hand up to max messages to fn(const void * data, uint32_t size) and
+	 * publish the new tail once at the end, returns the number consumed */
+	template<typename F>
+	size_t poll(F && fn, size_t max = SIZE_MAX)
+	{
+		const uint64_t capacity = m_mask + 1;
+		size_t count = 0;
+
+		if (m_tail == m_head)
+			m_head = m_ring->head.load(std::memory_order_acquire);
+
+		while (m_tail != m_head && count < max)
+		{
+			const uint64_t     offset = m_tail & m_mask;
+			const RingRecord * record = (const RingRecord *)(m_ring->data + offset);
+			if (record->flags & kRecordPad)
+			{
+				m_tail += capacity - offset;
+				continue;
+			}
+
+			fn((const void *)(record + 1), record->size);
+			m_tail += ring_record_size(record->size);
+			++count;
+		}
+
+		if (count)
+			m_ring->tail.store(m_tail, std::memory_order_release);
+		return count;
+	}
+
+	bool empty()
+	{
+		return m_tail == m_ring->head.load(std::memory_order_acquire);
+	}
+
+private:
+	RingHeader * m_ring;
+	uint64_t     m_mask;
+	uint64_t     m_tail;
+	uint64_t     m_head; // cached producer position
+};
+
+}
@@ -0,0 +1,185 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+/*
+ * segtable_build's PFN walk over a 1GB buffer in three physical layouts,
+ * fully contiguous, 2MB pages scattered about memory, and fragmented into
+ * runs of one to eight pages. Each layout times Coalesce.c against the per
+ * page loop it replaced, fed a 1GB MDL's PFN array at a time. Build the
+ * library as described in Sim.h, then:
+ *
+ *   cc -O2 -Wno-multichar -Wno-unknown-pragmas -IPorthole-Sim \
+ *       Porthole-Sim/CoalesceBench.c libporthole-sim.a -lstdc++ -lpthread -o coalescebench
+ *
+ * `coalescebench [passes]` prints one line of csv per layout and method:
+ *   layout,method,pages,runs,ns_per_page,speedup
+ * where speedup is the per page loop's time over the method's.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "driver.h"
+#include "Sim.h"
+
+#define COALESCE_BENCH_PASSES 20
+#define COALESCE_BENCH_PAGES  (MDL_CHUNK_SIZE >> PAGE_SHIFT)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t next_random(uint32_t * state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+typedef struct _TOTALS
+{
+	uint64_t runs;
+	uint64_t bytes;
+}
+TOTALS;
+
+static int count_run(void * opaque, CO_U64 addr, CO_U64 size)
+{
+	UNREFERENCED_PARAMETER(addr);
+
+	TOTALS * totals = (TOTALS *)opaque;
+	++totals->runs;
+	totals->bytes += size;
+	return 0;
+}
+
+/* the loop segtable_build had before Coalesce.c, a page at a time */
+static void per_page(TOTALS * totals, const CO_PFN * pfns, CO_SIZE count)
+{
+	uint64_t lastPA = 0, size = 0;
+	for (CO_SIZE i = 0; i < count; ++i)
+	{
+		const uint64_t curPA = (uint64_t)pfns[i] << PAGE_SHIFT;
+		if (size && lastPA + size == curPA)
+		{
+			size += PAGE_SIZE;
+			continue;
+		}
+
+		if (size)
+			count_run(totals, lastPA, size);
+		lastPA = curPA;
+		size   = PAGE_SIZE;
+	}
+	count_run(totals, lastPA, size);
+}
+
+static void coalesce(TOTALS * totals, const CO_PFN * pfns, CO_SIZE count)
+{
+	COALESCE co;
+	coalesce_init(&co, count_run, totals);
+	coalesce_pfns(&co, pfns, count, 0, (CO_U64)count << PAGE_SHIFT);
+	coalesce_flush(&co);
+}
+
+/* runs of 1 << shift pages, or 1 to 8 pages when shift is 0, with a gap
+ * between each so none of them join up */
+static void fill(CO_PFN * pfns, CO_SIZE count, int shift)
+{
+	uint32_t seed = 0x3C6EF372;
+	CO_PFN   pfn  = 0x100000;
+	for (CO_SIZE i = 0; i < count; )
+	{
+		CO_SIZE run = shift ? (CO_SIZE)1 << shift : 1 + next_random(&seed) % 8;
+		for (; run && i < count; --run)
+			pfns[i++] = pfn++;
+		pfn += (CO_PFN)1 << (shift ? shift : 1);
+	}
+}
+
+typedef void (*walk)(TOTALS * totals, const CO_PFN * pfns, CO_SIZE count);
+
+static uint64_t time_walk(walk fn, const CO_PFN * pfns, int passes, TOTALS * totals)
+{
+	const uint64_t start = now_ns();
+	for (int i = 0; i < passes; ++i)
+	{
+		totals->runs  = 0;
+		totals->bytes = 0;
+		fn(totals, pfns, COALESCE_BENCH_PAGES);
+	}
+	return now_ns() - start;
+}
+
+int main(int argc, char * argv[])
+{
+	const int passes = argc > 1 ? atoi(argv[1]) : COALESCE_BENCH_PASSES;
+
+	static const struct
+	{
+		const char * name;
+		int          shift;
+	}
+	layouts[] =
+	{
+		{ "contiguous", 30 - PAGE_SHIFT },
+		{ "2mb"       , 21 - PAGE_SHIFT },
+		{ "fragmented", 0               },
+	};
+
+	CO_PFN * pfns = malloc(COALESCE_BENCH_PAGES * sizeof(CO_PFN));
+	if (!pfns || passes < 1)
+		return -1;
+
+	printf("layout,method,pages,runs,ns_per_page,speedup\n");
+	for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i)
+	{
+		fill(pfns, COALESCE_BENCH_PAGES, layouts[i].shift);
+
+		TOTALS old, cur;
+		const uint64_t oldNs = time_walk(per_page, pfns, passes, &old);
+		const uint64_t curNs = time_walk(coalesce, pfns, passes, &cur);
+
+		if (old.runs != cur.runs || old.bytes != cur.bytes || cur.bytes != MDL_CHUNK_SIZE)
+		{
+			fprintf(stderr, "%s: the runs differ\n", layouts[i].name);
+			free(pfns);
+			return -1;
+		}
+
+		const double pages = (double)COALESCE_BENCH_PAGES * passes;
+		printf("%s,per_page,%llu,%llu,%.3f,1.00\n", layouts[i].name,
+			(unsigned long long)COALESCE_BENCH_PAGES, (unsigned long long)old.runs, oldNs / pages);
+		printf("%s,coalesce,%llu,%llu,%.3f,%.2f\n", layouts[i].name,
+			(unsigned long long)COALESCE_BENCH_PAGES, (unsigned long long)cur.runs, curNs / pages,
+			(double)oldNs / curNs);
+	}
+
+	free(pfns);
+	return 0;
+}
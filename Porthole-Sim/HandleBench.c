@@ -0,0 +1,162 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * The driver's handle table with 10, 1k and 100k live mappings. Each size
+ * times claiming and returning a random live handle as an unmap does,
+ * freeing and reallocating a random entry as an unmap and map pair does,
+ * and for reference finding an ID by scanning an array as the fixed
+ * mdlList did. Build the library as described in Sim.h, then:
+ *
+ *   cc -O2 -Wno-multichar -Wno-unknown-pragmas -IPorthole-Sim \
+ *       Porthole-Sim/HandleBench.c libporthole-sim.a -lstdc++ -lpthread -o handlebench
+ *
+ * `handlebench` prints one line of csv per size and operation:
+ *   entries,op,ops,ns_per_op
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "driver.h"
+#include "Sim.h"
+
+#define HANDLE_BENCH_OPS  (4 * 1000 * 1000)
+
+/* the scan is O(n), keep it's total work about the same at every size */
+#define HANDLE_BENCH_SCAN (100 * 1000 * 1000)
+
+static const ULONG sizes[] = { 10, 1000, 100000 };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t next_random(uint32_t * state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void report(ULONG entries, const char * op, uint64_t ops, uint64_t start)
+{
+	printf("%lu,%s,%llu,%.1f\n", (unsigned long)entries, op, (unsigned long long)ops,
+		(double)(now_ns() - start) / ops);
+}
+
+/* the old lookup, an ID compared against every slot in turn */
+typedef struct _SCAN_ENTRY
+{
+	int  id;
+	PMDL mdl;
+}
+SCAN_ENTRY;
+
+static int run(ULONG entries)
+{
+	HANDLE_TABLE    table;
+	PortholeMapID * handles = malloc(entries * sizeof(PortholeMapID));
+	PMDLInfo      * infos   = malloc(entries * sizeof(PMDLInfo));
+	SCAN_ENTRY    * scan    = malloc(entries * sizeof(SCAN_ENTRY));
+	if (!handles || !infos || !scan)
+		return -1;
+
+	handle_table_init(&table);
+	for (ULONG i = 0; i < entries; ++i)
+	{
+		if (!NT_SUCCESS(handle_alloc(&table, &infos[i], &handles[i])))
+			return -1;
+		infos[i]->size = PAGE_SIZE;
+		handle_release(&table, infos[i], FALSE);
+
+		scan[i].id  = (int)i + 1;
+		scan[i].mdl = NULL;
+	}
+
+	uint32_t seed  = 0x9E3779B9;
+	uint64_t found = 0;
+
+	uint64_t start = now_ns();
+	for (ULONG i = 0; i < HANDLE_BENCH_OPS; ++i)
+	{
+		const ULONG    n    = next_random(&seed) % entries;
+		const PMDLInfo info = handle_claim(&table, handles[n]);
+		found += info != NULL;
+		handle_release(&table, info, FALSE);
+	}
+	report(entries, "claim", HANDLE_BENCH_OPS, start);
+
+	start = now_ns();
+	for (ULONG i = 0; i < HANDLE_BENCH_OPS; ++i)
+	{
+		const ULONG n = next_random(&seed) % entries;
+		handle_claim(&table, handles[n]);
+		handle_release(&table, infos[n], TRUE);
+		handle_alloc(&table, &infos[n], &handles[n]);
+		infos[n]->size = PAGE_SIZE;
+		handle_release(&table, infos[n], FALSE);
+	}
+	report(entries, "free_alloc", HANDLE_BENCH_OPS, start);
+
+	const uint64_t scans = max(HANDLE_BENCH_SCAN / entries, 1000);
+	start = now_ns();
+	for (uint64_t i = 0; i < scans; ++i)
+	{
+		const int id = (int)(next_random(&seed) % entries) + 1;
+		for (ULONG j = 0; j < entries; ++j)
+			if (scan[j].id == id)
+			{
+				found += scan[j].mdl == NULL;
+				break;
+			}
+	}
+	report(entries, "scan", scans, start);
+
+	/* keep the lookups from being optimised away */
+	if (found < HANDLE_BENCH_OPS)
+		fprintf(stderr, "lost handles\n");
+
+	handle_table_free(&table);
+	free(scan);
+	free(infos);
+	free(handles);
+	return 0;
+}
+
+int main(void)
+{
+	printf("entries,op,ops,ns_per_op\n");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		if (run(sizes[i]) != 0)
+		{
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
+
+	return 0;
+}
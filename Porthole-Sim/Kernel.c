@@ -0,0 +1,583 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "driver.h"
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE type, SIZE_T size, ULONG tag)
+{
+	UNREFERENCED_PARAMETER(tag);
+
+	const SIZE_T align = size >= PAGE_SIZE ? PAGE_SIZE :
+		type == NonPagedPoolCacheAligned ? 64 : 0;
+	if (!align)
+		return malloc(size);
+
+	return aligned_alloc(align, (size + align - 1) & ~(align - 1));
+}
+
+void ExFreePoolWithTag(PVOID addr, ULONG tag)
+{
+	UNREFERENCED_PARAMETER(tag);
+
+	/* so the model reading freed memory sees garbage, as the host would.
+	 * the barrier stops the compiler dropping the store ahead of free */
+	if (addr)
+	{
+		memset(addr, 0xDD, malloc_usable_size(addr));
+		__asm__ __volatile__("" : : "r"(addr) : "memory");
+	}
+	free(addr);
+}
+
+PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID addr)
+{
+	PHYSICAL_ADDRESS pa;
+	pa.QuadPart = (int64_t)(ULONG_PTR)addr;
+	return pa;
+}
+
+void ExInitializeFastMutex(PFAST_MUTEX mutex)
+{
+	pthread_mutex_init(&mutex->lock, NULL);
+}
+
+void ExAcquireFastMutex(PFAST_MUTEX mutex)
+{
+	pthread_mutex_lock(&mutex->lock);
+}
+
+void ExReleaseFastMutex(PFAST_MUTEX mutex)
+{
+	pthread_mutex_unlock(&mutex->lock);
+}
+
+void KeInitializeSpinLock(PKSPIN_LOCK lock)
+{
+	*lock = 0;
+}
+
+void KeAcquireSpinLock(PKSPIN_LOCK lock, PKIRQL oldIrql)
+{
+	*oldIrql = 0;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+			YieldProcessor();
+}
+
+void KeReleaseSpinLock(PKSPIN_LOCK lock, KIRQL oldIrql)
+{
+	UNREFERENCED_PARAMETER(oldIrql);
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+void KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK lock)
+{
+	KIRQL oldIrql;
+	KeAcquireSpinLock(lock, &oldIrql);
+}
+
+void KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK lock)
+{
+	KeReleaseSpinLock(lock, 0);
+}
+
+void ObDereferenceObject(PVOID object)
+{
+	UNREFERENCED_PARAMETER(object);
+}
+
+void KeInitializeEvent(PKEVENT event, EVENT_TYPE type, BOOLEAN state)
+{
+	UNREFERENCED_PARAMETER(type);
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&event->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_init(&event->lock, NULL);
+	event->signaled = state;
+}
+
+void KeSetEvent(PKEVENT event, KPRIORITY increment, BOOLEAN wait)
+{
+	UNREFERENCED_PARAMETER(increment);
+	UNREFERENCED_PARAMETER(wait);
+
+	pthread_mutex_lock(&event->lock);
+	event->signaled = 1;
+	pthread_cond_broadcast(&event->cond);
+	pthread_mutex_unlock(&event->lock);
+}
+
+void KeClearEvent(PKEVENT event)
+{
+	pthread_mutex_lock(&event->lock);
+	event->signaled = 0;
+	pthread_mutex_unlock(&event->lock);
+}
+
+static struct timespec deadline(PLARGE_INTEGER timeout)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	const int64_t ns = -timeout->QuadPart * 100;
+	ts.tv_sec  += ns / 1000000000;
+	ts.tv_nsec += ns % 1000000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+		++ts.tv_sec;
+		ts.tv_nsec -= 1000000000;
+	}
+	return ts;
+}
+
+NTSTATUS KeWaitForSingleObject(PKEVENT event, KWAIT_REASON reason, KPROCESSOR_MODE mode, BOOLEAN alertable, PLARGE_INTEGER timeout)
+{
+	UNREFERENCED_PARAMETER(reason);
+	UNREFERENCED_PARAMETER(mode);
+	UNREFERENCED_PARAMETER(alertable);
+
+	NTSTATUS status = STATUS_SUCCESS;
+	const struct timespec until = timeout ? deadline(timeout) : (struct timespec){ 0, 0 };
+
+	pthread_mutex_lock(&event->lock);
+	while (!event->signaled)
+	{
+		if (!timeout)
+			pthread_cond_wait(&event->cond, &event->lock);
+		else if (pthread_cond_timedwait(&event->cond, &event->lock, &until) == ETIMEDOUT)
+		{
+			status = STATUS_TIMEOUT;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&event->lock);
+	return status;
+}
+
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE mode, BOOLEAN alertable, PLARGE_INTEGER interval)
+{
+	UNREFERENCED_PARAMETER(mode);
+	UNREFERENCED_PARAMETER(alertable);
+
+	const struct timespec until = deadline(interval);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {}
+	return STATUS_SUCCESS;
+}
+
+/* a 10MHz counter, the usual frequency on Windows */
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER frequency)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (frequency)
+		frequency->QuadPart = 10000000;
+
+	LARGE_INTEGER counter;
+	counter.QuadPart = (int64_t)ts.tv_sec * 10000000 + ts.tv_nsec / 100;
+	return counter;
+}
+
+ULONG KeGetCurrentProcessorIndex(void)
+{
+	const int cpu = sched_getcpu();
+	return cpu < 0 ? 0 : (ULONG)cpu;
+}
+
+ULONG KeQueryMaximumProcessorCountEx(unsigned short group)
+{
+	UNREFERENCED_PARAMETER(group);
+
+	const long count = sysconf(_SC_NPROCESSORS_CONF);
+	return count < 1 ? 1 : (ULONG)count;
+}
+
+CCHAR RtlFindMostSignificantBit(ULONGLONG set)
+{
+	return set ? (CCHAR)(63 - __builtin_clzll(set)) : -1;
+}
+
+/* every thread starts in the one process, work item threads leave it */
+static struct _KPROCESS
+{
+	int unused;
+}
+process;
+
+static __thread PEPROCESS currentProcess = &process;
+static __thread BOOLEAN   workThread;
+
+PEPROCESS PsGetCurrentProcess(void)
+{
+	return currentProcess;
+}
+
+void KeStackAttachProcess(PEPROCESS target, PKAPC_STATE state)
+{
+	state->process = currentProcess;
+	currentProcess = target;
+}
+
+void KeUnstackDetachProcess(PKAPC_STATE state)
+{
+	currentProcess = state->process;
+}
+
+#define TRY_DEPTH 8
+
+static __thread jmp_buf tryFrames[TRY_DEPTH];
+static __thread int     tryDepth;
+
+jmp_buf * sim_try_enter(void)
+{
+	if (tryDepth == TRY_DEPTH)
+		abort();
+	return &tryFrames[tryDepth++];
+}
+
+jmp_buf * sim_try_leave(jmp_buf * frame)
+{
+	if (frame)
+		--tryDepth;
+	return NULL;
+}
+
+void ExRaiseStatus(NTSTATUS status)
+{
+	/* an exception nothing handles is a bugcheck */
+	if (!tryDepth)
+		abort();
+	longjmp(tryFrames[tryDepth - 1], status);
+}
+
+static ULONG    contigPages;
+static uint64_t pinNs;
+static PVOID    faultAddr;
+static uint64_t lockedPages;
+static uint64_t attachedPages;
+
+void kernel_configure(ULONG contig, uint64_t ns, PVOID fault)
+{
+	contigPages = contig;
+	pinNs       = ns;
+	faultAddr   = fault;
+}
+
+void kernel_locked(uint64_t * locked, uint64_t * attached)
+{
+	*locked   = __atomic_load_n(&lockedPages  , __ATOMIC_RELAXED);
+	*attached = __atomic_load_n(&attachedPages, __ATOMIC_RELAXED);
+}
+
+PMDL IoAllocateMdl(PVOID addr, ULONG length, BOOLEAN secondary, BOOLEAN chargeQuota, PIRP irp)
+{
+	UNREFERENCED_PARAMETER(secondary);
+	UNREFERENCED_PARAMETER(chargeQuota);
+	UNREFERENCED_PARAMETER(irp);
+
+	PMDL mdl = calloc(1, sizeof(MDL));
+	if (!mdl)
+		return NULL;
+
+	mdl->StartVa    = PAGE_ALIGN(addr);
+	mdl->ByteOffset = BYTE_OFFSET(addr);
+	mdl->ByteCount  = length;
+	if (!(mdl->Pfns = malloc(ADDRESS_AND_SIZE_TO_SPAN_PAGES(addr, length) * sizeof(PFN_NUMBER))))
+	{
+		free(mdl);
+		return NULL;
+	}
+	return mdl;
+}
+
+void IoFreeMdl(PMDL mdl)
+{
+	free(mdl->Pfns);
+	free(mdl);
+}
+
+void MmProbeAndLockPages(PMDL mdl, KPROCESSOR_MODE mode, LOCK_OPERATION operation)
+{
+	UNREFERENCED_PARAMETER(operation);
+
+	/* a user address means nothing outside of it's process */
+	if (mode == UserMode && !currentProcess)
+		ExRaiseStatus(STATUS_ACCESS_VIOLATION);
+
+	const PUCHAR start = (PUCHAR)mdl->StartVa;
+	const ULONG  pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(mdl), mdl->ByteCount);
+	if (faultAddr && (PUCHAR)faultAddr >= start && (PUCHAR)faultAddr < start + (SIZE_T)pages * PAGE_SIZE)
+		ExRaiseStatus(STATUS_ACCESS_VIOLATION);
+
+	const PFN_NUMBER first = (ULONG_PTR)start >> PAGE_SHIFT;
+	for (ULONG i = 0; i < pages; ++i)
+		mdl->Pfns[i] = first + i + (contigPages ? (first + i) / contigPages : 0);
+
+	if (pinNs)
+	{
+		const uint64_t ns = pinNs * pages;
+		const struct timespec ts = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+		nanosleep(&ts, NULL);
+	}
+
+	mdl->MdlFlags |= MDL_PAGES_LOCKED;
+	__atomic_add_fetch(&lockedPages, pages, __ATOMIC_RELAXED);
+	if (workThread)
+		__atomic_add_fetch(&attachedPages, pages, __ATOMIC_RELAXED);
+}
+
+void MmUnlockPages(PMDL mdl)
+{
+	const ULONG pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(mdl), mdl->ByteCount);
+	__atomic_sub_fetch(&lockedPages, pages, __ATOMIC_RELAXED);
+	mdl->MdlFlags &= ~MDL_PAGES_LOCKED;
+}
+
+/* every object starts with this so it's context can be found without
+ * knowing what the object is */
+typedef struct _WDF_OBJECT_HEADER
+{
+	PVOID context;
+}
+WDF_OBJECT_HEADER;
+
+struct WDFWORKITEM__
+{
+	WDF_OBJECT_HEADER header;
+	PFN_WDF_WORKITEM function;
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+	BOOLEAN          queued;
+	BOOLEAN          running;
+	BOOLEAN          deleted;
+	max_align_t      context[];
+};
+
+static void * work_thread(void * opaque)
+{
+	WDFWORKITEM item = (WDFWORKITEM)opaque;
+	currentProcess = NULL;
+	workThread     = TRUE;
+
+	pthread_mutex_lock(&item->lock);
+	for (;;)
+	{
+		while (!item->queued && !item->deleted)
+			pthread_cond_wait(&item->cond, &item->lock);
+		if (!item->queued)
+			break;
+
+		item->queued  = FALSE;
+		item->running = TRUE;
+		pthread_mutex_unlock(&item->lock);
+		item->function(item);
+		pthread_mutex_lock(&item->lock);
+		item->running = FALSE;
+		pthread_cond_broadcast(&item->cond);
+	}
+	pthread_mutex_unlock(&item->lock);
+	return NULL;
+}
+
+NTSTATUS WdfWorkItemCreate(PWDF_WORKITEM_CONFIG config, PWDF_OBJECT_ATTRIBUTES attributes, WDFWORKITEM * workItem)
+{
+	WDFWORKITEM item = calloc(1, sizeof(struct WDFWORKITEM__) + (attributes ? attributes->ContextSize : 0));
+	if (!item)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	item->header.context = item->context;
+	item->function       = config->EvtWorkItemFunc;
+	pthread_mutex_init(&item->lock, NULL);
+	pthread_cond_init (&item->cond, NULL);
+	if (pthread_create(&item->thread, NULL, work_thread, item) != 0)
+	{
+		pthread_cond_destroy (&item->cond);
+		pthread_mutex_destroy(&item->lock);
+		free(item);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	*workItem = item;
+	return STATUS_SUCCESS;
+}
+
+void WdfWorkItemEnqueue(WDFWORKITEM workItem)
+{
+	pthread_mutex_lock(&workItem->lock);
+	workItem->queued = TRUE;
+	pthread_cond_broadcast(&workItem->cond);
+	pthread_mutex_unlock(&workItem->lock);
+}
+
+void WdfWorkItemFlush(WDFWORKITEM workItem)
+{
+	pthread_mutex_lock(&workItem->lock);
+	while (workItem->queued || workItem->running)
+		pthread_cond_wait(&workItem->cond, &workItem->lock);
+	pthread_mutex_unlock(&workItem->lock);
+}
+
+/* only work items are created here */
+void WdfObjectDelete(WDFOBJECT object)
+{
+	WDFWORKITEM item = (WDFWORKITEM)object;
+	pthread_mutex_lock(&item->lock);
+	item->deleted = TRUE;
+	pthread_cond_broadcast(&item->cond);
+	pthread_mutex_unlock(&item->lock);
+
+	pthread_join(item->thread, NULL);
+	pthread_cond_destroy (&item->cond);
+	pthread_mutex_destroy(&item->lock);
+	free(item);
+}
+
+PVOID WdfObjectGetTypedContextWorker(WDFOBJECT object)
+{
+	return ((WDF_OBJECT_HEADER *)object)->context;
+}
+
+struct WDFFILEOBJECT__
+{
+	WDF_OBJECT_HEADER   header;
+	FILE_OBJECT_CONTEXT context;
+};
+
+WDFFILEOBJECT kernel_file_create(void)
+{
+	WDFFILEOBJECT file = calloc(1, sizeof(struct WDFFILEOBJECT__));
+	if (file)
+		file->header.context = &file->context;
+	return file;
+}
+
+void kernel_file_free(WDFFILEOBJECT file)
+{
+	free(file);
+}
+
+struct WDFREQUEST__
+{
+	WDF_OBJECT_HEADER      header;
+	WDFFILEOBJECT          file;
+	pthread_mutex_t        lock;      // cancel and cancelled
+	PFN_WDF_REQUEST_CANCEL cancel;    // while cancelable
+	BOOLEAN                cancelled;
+	KEVENT                 done;
+	NTSTATUS               status;
+	ULONG_PTR              information;
+	REQUEST_CONTEXT        context;
+};
+
+WDFREQUEST kernel_request_create(WDFFILEOBJECT file)
+{
+	WDFREQUEST request = calloc(1, sizeof(struct WDFREQUEST__));
+	if (!request)
+		return NULL;
+
+	request->header.context = &request->context;
+	request->file           = file;
+	pthread_mutex_init(&request->lock, NULL);
+	KeInitializeEvent(&request->done, NotificationEvent, FALSE);
+	return request;
+}
+
+NTSTATUS kernel_request_wait(WDFREQUEST request, PLARGE_INTEGER timeout)
+{
+	if (KeWaitForSingleObject(&request->done, Executive, KernelMode, FALSE, timeout) == STATUS_TIMEOUT)
+		return STATUS_TIMEOUT;
+	return request->status;
+}
+
+void kernel_request_cancel(WDFREQUEST request)
+{
+	pthread_mutex_lock(&request->lock);
+	const PFN_WDF_REQUEST_CANCEL cancel = request->cancel;
+	request->cancel    = NULL;
+	request->cancelled = TRUE;
+	pthread_mutex_unlock(&request->lock);
+
+	if (cancel)
+		cancel(request);
+}
+
+void kernel_request_free(WDFREQUEST request)
+{
+	pthread_mutex_destroy(&request->lock);
+	pthread_cond_destroy (&request->done.cond);
+	pthread_mutex_destroy(&request->done.lock);
+	free(request);
+}
+
+NTSTATUS WdfRequestMarkCancelableEx(WDFREQUEST request, PFN_WDF_REQUEST_CANCEL cancel)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	pthread_mutex_lock(&request->lock);
+	if (request->cancelled)
+		status = STATUS_CANCELLED;
+	else
+		request->cancel = cancel;
+	pthread_mutex_unlock(&request->lock);
+	return status;
+}
+
+/* fails once the cancel routine has been taken to run */
+NTSTATUS WdfRequestUnmarkCancelable(WDFREQUEST request)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	pthread_mutex_lock(&request->lock);
+	if (!request->cancel)
+		status = STATUS_CANCELLED;
+	request->cancel = NULL;
+	pthread_mutex_unlock(&request->lock);
+	return status;
+}
+
+void WdfRequestCompleteWithInformation(WDFREQUEST request, NTSTATUS status, ULONG_PTR information)
+{
+	request->status      = status;
+	request->information = information;
+	KeSetEvent(&request->done, IO_NO_INCREMENT, FALSE);
+}
+
+void WdfRequestComplete(WDFREQUEST request, NTSTATUS status)
+{
+	WdfRequestCompleteWithInformation(request, status, 0);
+}
+
+WDFFILEOBJECT WdfRequestGetFileObject(WDFREQUEST request)
+{
+	return request->file;
+}
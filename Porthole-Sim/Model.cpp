@@ -0,0 +1,459 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "Model.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+#define CMD_BITS (PH_REG_CR_START | PH_REG_CR_ADD_SEGMENT | PH_REG_CR_ADD_TABLE | PH_REG_CR_FINISH | PH_REG_CR_UNMAP | PH_REG_CR_EXTEND | PH_REG_CR_DIRTY)
+#define ERR_BITS (PH_REG_CR_TIMEOUT | PH_REG_CR_BADADDR | PH_REG_CR_NORES | PH_REG_CR_DEVERR)
+
+/* polls of an idle register file before the service thread starts to sleep */
+#define IDLE_SPIN  (100000)
+#define IDLE_SLEEP std::chrono::microseconds(20)
+
+/* waits shorter than this are spun so small latencies stay accurate */
+#define SPIN_LIMIT std::chrono::microseconds(50)
+
+struct Mapping
+{
+	uint32_t                     type;
+	std::vector<PortholeSegment> segments;
+};
+
+struct _MODEL
+{
+	PPortholeDeviceRegisters regs;
+	SIM_CONFIG               config;
+	model_interrupt          irq;
+	void                   * opaque;
+
+	std::thread              thread;
+	std::atomic<bool>        stop{ false };
+	std::atomic<int>         connect{ -1 }; // -1 or the requested state
+	std::atomic<bool>        resume{ false };
+
+	/* only the service thread touches these, the lock is for model_mapped */
+	std::mutex                             lock;
+	std::unordered_map<uint32_t, Mapping>  mappings;
+	std::vector<PortholeSegment>           pending;
+	bool                                   started   = false;
+	uint32_t                               extending = 0; // the mapping being appended to, if any
+	size_t                                 existing  = 0; // segments it already has
+	bool                                   connected = true;
+	uint32_t                               nextId    = 1;
+	uint32_t                               hung      = 0; // command bits that will never complete
+	uint64_t                               commands  = 0;
+	uint64_t                               dirty     = 0; // bytes the host would have copied, atomic
+	uint64_t                               tables    = 0; // bytes of segments read from tables, atomic
+
+	/* notifications the client raised that the driver hasn't read yet */
+	std::mutex                             noticeLock;
+	std::deque<ULONG>                      notices;
+	std::atomic<size_t>                    noticeCount{ 0 };
+};
+
+static uint32_t command_index(ULONG bit)
+{
+	switch (bit)
+	{
+		case PH_REG_CR_START      :
+		case PH_REG_CR_EXTEND     : return SIM_CMD_START;
+		case PH_REG_CR_ADD_SEGMENT: return SIM_CMD_ADD_SEGMENT;
+		case PH_REG_CR_ADD_TABLE  :
+		case PH_REG_CR_DIRTY      : return SIM_CMD_ADD_TABLE;
+		case PH_REG_CR_FINISH     : return SIM_CMD_FINISH;
+		default                   : return SIM_CMD_UNMAP;
+	}
+}
+
+static void delay(uint64_t ns)
+{
+	if (!ns)
+		return;
+
+	const auto until = Clock::now() + std::chrono::nanoseconds(ns);
+	if (std::chrono::nanoseconds(ns) > SPIN_LIMIT)
+		std::this_thread::sleep_until(until);
+	while (Clock::now() < until) {}
+}
+
+/* the driver only writes the registers while the device is idle, but the
+ * model also changes `cr` on it's own for connection changes */
+static void update_cr(MODEL * model, ULONG clear, ULONG set)
+{
+	ULONG cr = __atomic_load_n(&model->regs->cr, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&model->regs->cr, &cr, (cr & ~clear) | set,
+		false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {}
+}
+
+static void interrupt(MODEL * model, ULONG isr)
+{
+	if (!(__atomic_load_n(&model->regs->cr, __ATOMIC_ACQUIRE) & PH_REG_CR_IRQ))
+		return;
+
+	__atomic_fetch_or(&model->regs->isr, isr, __ATOMIC_ACQ_REL);
+	model->irq(model->opaque);
+}
+
+static void apply_connection(MODEL * model, bool connected)
+{
+	if (model->connected == connected)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(model->lock);
+		model->connected = connected;
+		if (!connected)
+			model->mappings.clear();
+	}
+
+	if (!connected)
+	{
+		std::lock_guard<std::mutex> lock(model->noticeLock);
+		model->notices.clear();
+		model->noticeCount = 0;
+	}
+
+	/* a connection change resets the device, abandoning any hung command */
+	model->started   = false;
+	model->extending = 0;
+	model->pending.clear();
+	update_cr(model, model->hung | (connected ? PH_REG_CR_NOCONN : 0), connected ? 0 : PH_REG_CR_NOCONN);
+	model->hung = 0;
+
+	interrupt(model, connected ? PH_REG_ISR_CONNECT : PH_REG_ISR_DISCONNECT);
+}
+
+static bool too_many_segments(MODEL * model)
+{
+	return model->config.maxSegments && model->existing + model->pending.size() > model->config.maxSegments;
+}
+
+/* read a segment table out of guest memory, following the link entries */
+static ULONG read_table(MODEL * model, uint64_t addr, uint32_t count)
+{
+	const PortholeSegment * page = (const PortholeSegment *)(uintptr_t)addr;
+	for (uint32_t i = 0, n = 0; n < count; )
+	{
+		const PortholeSegment & entry = page[i];
+		if (i == PH_SEGTABLE_ENTRIES - 1 && entry.size == 0)
+		{
+			page = (const PortholeSegment *)(uintptr_t)entry.addr;
+			i    = 0;
+			continue;
+		}
+
+		model->pending.push_back(entry);
+		__atomic_fetch_add(&model->tables, entry.size, __ATOMIC_RELAXED);
+		if (too_many_segments(model))
+			return PH_REG_CR_NORES;
+		++i;
+		++n;
+	}
+
+	delay(model->config.segmentNs * count);
+	return 0;
+}
+
+/* check a dirty range table the way the host would before copying from it */
+static ULONG read_dirty(MODEL * model, uint32_t id, uint64_t addr, uint32_t count)
+{
+	uint64_t length = 0;
+	{
+		std::lock_guard<std::mutex> lock(model->lock);
+		auto it = model->mappings.find(id);
+		if (it == model->mappings.end())
+			return PH_REG_CR_BADADDR;
+		for (const PortholeSegment & segment : it->second.segments)
+			length += segment.size;
+	}
+
+	/* sorted, page aligned, not touching and inside the mapping */
+	const uint64_t          limit = (length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+	const PortholeSegment * page  = (const PortholeSegment *)(uintptr_t)addr;
+	uint64_t                end   = 0;
+	for (uint32_t i = 0, n = 0; n < count; )
+	{
+		const PortholeSegment & entry = page[i];
+		if (i == PH_SEGTABLE_ENTRIES - 1 && entry.size == 0)
+		{
+			page = (const PortholeSegment *)(uintptr_t)entry.addr;
+			i    = 0;
+			continue;
+		}
+
+		if (!entry.size || (entry.addr | entry.size) & (PAGE_SIZE - 1) ||
+			(n && entry.addr <= end) || entry.size > limit || entry.addr > limit - entry.size)
+			return PH_REG_CR_DEVERR;
+
+		end = entry.addr + entry.size;
+		__atomic_fetch_add(&model->dirty, entry.size, __ATOMIC_RELAXED);
+		++i;
+		++n;
+	}
+
+	delay(model->config.segmentNs * count);
+	return 0;
+}
+
+static ULONG run_command(MODEL * model, ULONG bit)
+{
+	PPortholeDeviceRegisters regs = model->regs;
+
+	if (model->config.timeoutEvery && model->commands % model->config.timeoutEvery == 0)
+		return PH_REG_CR_TIMEOUT;
+
+	/* a disconnected device completes commands, the driver sees NOCONN */
+	if (!model->connected)
+		return 0;
+
+	switch (bit)
+	{
+		case PH_REG_CR_START:
+			model->pending.clear();
+			model->started   = true;
+			model->extending = 0;
+			model->existing  = 0;
+			if (model->config.maxMappings && model->mappings.size() >= model->config.maxMappings)
+				return PH_REG_CR_NORES;
+			return 0;
+
+		case PH_REG_CR_EXTEND:
+		{
+			if (!(model->config.caps & PH_REG_CAPS_EXTEND))
+				return PH_REG_CR_DEVERR;
+
+			model->pending.clear();
+			model->started   = false;
+			model->extending = 0;
+
+			const uint32_t id = (uint32_t)regs->addr.QuadPart;
+			std::lock_guard<std::mutex> lock(model->lock);
+			auto it = model->mappings.find(id);
+			if (it == model->mappings.end())
+				return PH_REG_CR_BADADDR;
+
+			model->started   = true;
+			model->extending = id;
+			model->existing  = it->second.segments.size();
+			return 0;
+		}
+
+		case PH_REG_CR_DIRTY:
+			if (!(model->config.caps & PH_REG_CAPS_DIRTY) || model->started)
+				return PH_REG_CR_DEVERR;
+			return read_dirty(model, regs->type, (uint64_t)regs->addr.QuadPart, regs->size);
+
+		case PH_REG_CR_ADD_SEGMENT:
+			if (!model->started)
+				return PH_REG_CR_DEVERR;
+			model->pending.push_back({ (uint64_t)regs->addr.QuadPart, regs->size });
+			return too_many_segments(model) ? PH_REG_CR_NORES : 0;
+
+		case PH_REG_CR_ADD_TABLE:
+			if (!model->started || !(model->config.caps & PH_REG_CAPS_SEGTABLE))
+				return PH_REG_CR_DEVERR;
+			return read_table(model, (uint64_t)regs->addr.QuadPart, regs->size);
+
+		case PH_REG_CR_FINISH:
+		{
+			if (!model->started || model->pending.empty())
+				return PH_REG_CR_DEVERR;
+
+			uint32_t id = model->extending;
+			{
+				std::lock_guard<std::mutex> lock(model->lock);
+				if (id)
+				{
+					/* a disconnect since PH_REG_CR_EXTEND would have cleared `started` */
+					std::vector<PortholeSegment> & segments = model->mappings.at(id).segments;
+					segments.insert(segments.end(), model->pending.begin(), model->pending.end());
+				}
+				else
+				{
+					/* IDs are positive, see PortholeMapID, and fit a doorbell
+					 * when the device has them */
+					const uint32_t last = model->config.caps & (PH_REG_CAPS_DOORBELL | PH_REG_CAPS_NOTIFY) ?
+						PH_DOORBELL_ID_MASK : 0x7FFFFFFF;
+					id = model->nextId;
+					model->nextId = model->nextId % last + 1;
+					model->mappings[id] = Mapping{ regs->type, std::move(model->pending) };
+				}
+			}
+			model->pending.clear();
+			model->started      = false;
+			model->extending    = 0;
+			regs->addr.QuadPart = id;
+			return 0;
+		}
+
+		default:
+		{
+			std::lock_guard<std::mutex> lock(model->lock);
+			return model->mappings.erase((uint32_t)regs->addr.QuadPart) ? 0 : PH_REG_CR_BADADDR;
+		}
+	}
+}
+
+static void complete(MODEL * model, ULONG bit)
+{
+	const ULONG error = run_command(model, bit);
+	update_cr(model, bit | ERR_BITS, error);
+
+	if (model->config.caps & PH_REG_CAPS_CMD_IRQ)
+		interrupt(model, PH_REG_ISR_COMPLETE);
+}
+
+static void service(MODEL * model)
+{
+	uint64_t idle = 0;
+	while (!model->stop.load(std::memory_order_relaxed))
+	{
+		const int connect = model->connect.exchange(-1);
+		if (connect >= 0)
+			apply_connection(model, connect != 0);
+
+		/* late, but with the registers as the driver left them */
+		if (model->resume.exchange(false))
+		{
+			for (ULONG hung = model->hung; hung; hung &= hung - 1)
+				complete(model, hung & (~hung + 1));
+			model->hung = 0;
+		}
+
+		/* raised again for as long as any are left unread */
+		if (model->noticeCount.load(std::memory_order_acquire))
+			interrupt(model, PH_REG_ISR_NOTIFY);
+
+		const ULONG cr      = __atomic_load_n(&model->regs->cr, __ATOMIC_ACQUIRE);
+		const ULONG pending = cr & CMD_BITS & ~model->hung;
+		if (!pending)
+		{
+			if (++idle < IDLE_SPIN)
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(IDLE_SLEEP);
+			continue;
+		}
+		idle = 0;
+
+		/* the driver only ever has one command outstanding */
+		const ULONG bit = pending & (~pending + 1);
+		++model->commands;
+
+		if (model->config.hangEvery && model->commands % model->config.hangEvery == 0)
+		{
+			model->hung |= bit;
+			continue;
+		}
+
+		delay(model->config.latencyNs[command_index(bit)]);
+		complete(model, bit);
+	}
+}
+
+MODEL * model_create(PPortholeDeviceRegisters regs, const SIM_CONFIG * config, model_interrupt irq, void * opaque)
+{
+	MODEL * model  = new MODEL;
+	model->regs   = regs;
+	model->config = *config;
+	model->irq    = irq;
+	model->opaque = opaque;
+
+	regs->caps = config->caps;
+	model->thread = std::thread(service, model);
+	return model;
+}
+
+void model_destroy(MODEL * model)
+{
+	model->stop = true;
+	model->thread.join();
+	delete model;
+}
+
+void model_connect(MODEL * model, int connected)
+{
+	model->connect = connected ? 1 : 0;
+}
+
+void model_resume(MODEL * model)
+{
+	model->resume = true;
+}
+
+void model_notify(MODEL * model, uint32_t id, uint32_t value)
+{
+	std::lock_guard<std::mutex> lock(model->noticeLock);
+	model->notices.push_back(PH_DOORBELL(id, value & PH_DOORBELL_VALUE_MASK));
+	model->noticeCount = model->notices.size();
+}
+
+uint32_t model_notify_read(MODEL * model)
+{
+	std::lock_guard<std::mutex> lock(model->noticeLock);
+	if (model->notices.empty())
+		return PH_NOTIFY_EMPTY;
+
+	const ULONG word = model->notices.front();
+	model->notices.pop_front();
+	model->noticeCount = model->notices.size();
+	return word;
+}
+
+uint32_t model_mapped(MODEL * model)
+{
+	std::lock_guard<std::mutex> lock(model->lock);
+	return (uint32_t)model->mappings.size();
+}
+
+uint32_t model_segments(MODEL * model, uint32_t id, uint64_t * bytes)
+{
+	std::lock_guard<std::mutex> lock(model->lock);
+	auto it = model->mappings.find(id);
+	if (it == model->mappings.end())
+		return 0;
+
+	*bytes = 0;
+	for (const PortholeSegment & segment : it->second.segments)
+		*bytes += segment.size;
+	return (uint32_t)it->second.segments.size();
+}
+
+uint64_t model_dirty(MODEL * model)
+{
+	return __atomic_load_n(&model->dirty, __ATOMIC_RELAXED);
+}
+
+uint64_t model_table_bytes(MODEL * model)
+{
+	return __atomic_load_n(&model->tables, __ATOMIC_RELAXED);
+}
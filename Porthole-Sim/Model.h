@@ -0,0 +1,62 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * The device side of the simulator. A service thread watches the command
+ * bits of the register file as QEMU would trap writes to them, performs the
+ * command after it's configured latency and clears the bit, setting the
+ * error bits and raising interrupts as the device does.
+ */
+
+#include "../Porthole/Registers.h"
+#include "Sim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _MODEL MODEL;
+
+/* raised from the service thread with the causes just latched in `isr` */
+typedef void (*model_interrupt)(void * opaque);
+
+MODEL *  model_create (PPortholeDeviceRegisters regs, const SIM_CONFIG * config, model_interrupt irq, void * opaque);
+void     model_destroy(MODEL * model);
+
+/* applied by the service thread between commands */
+void     model_connect(MODEL * model, int connected);
+void     model_resume (MODEL * model);
+
+/* queue a notification from the client, PH_REG_ISR_NOTIFY is raised until
+ * it has been read. `notify` is plain memory here so a read of it that
+ * pops the next notification is made through model_notify_read */
+void     model_notify (MODEL * model, uint32_t id, uint32_t value);
+uint32_t model_notify_read(MODEL * model);
+
+uint32_t model_mapped (MODEL * model);
+uint32_t model_segments(MODEL * model, uint32_t id, uint64_t * bytes);
+uint64_t model_dirty  (MODEL * model);
+uint64_t model_table_bytes(MODEL * model);
+
+#ifdef __cplusplus
+}
+#endif
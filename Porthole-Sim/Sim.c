@@ -0,0 +1,427 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "Model.h"
+
+/*
+ * The driver side of the simulator, this plays the part of Map.c, Queue.c's
+ * notification IOCTLs and the interrupt path around the unmodified command
+ * layer, page locking, streamed sends and Notify.c, all through a single
+ * handle.
+ * Kernel.c makes the buffer's PFNs up from it's virtual address, broken
+ * into runs of SIM_CONFIG.contigPages to model fragmentation, and charges
+ * SIM_CONFIG.pinNs a page to lock them. The pages are unlocked again as
+ * soon as the segment table is built, nothing here reads them.
+ */
+
+C_ASSERT(SIM_CMD_MAX == PORTHOLE_CMD_MAX);
+
+struct _SIM_DEVICE
+{
+	DEVICE_CONTEXT          context;
+	PortholeDeviceRegisters regs;
+	MODEL                 * model;
+	WDFFILEOBJECT           file;
+
+	pthread_mutex_t         watchLock;
+	sim_connection          handler;
+	void                  * opaque;
+};
+
+/* as Device.c's, reading `notify` through the model */
+static void handle_notify(SIM_DEVICE * sim)
+{
+	for (ULONG i = 0; i < PH_NOTIFY_DRAIN_MAX; ++i)
+	{
+		const ULONG word = model_notify_read(sim->model);
+		if (word == PH_NOTIFY_EMPTY)
+			break;
+		notify_signal(&sim->context, word & PH_DOORBELL_ID_MASK, word >> PH_DOORBELL_ID_BITS);
+	}
+}
+
+/* handle_isr and the DPCs in one, the model raises this from it's thread */
+static void sim_interrupt(void * opaque)
+{
+	SIM_DEVICE * sim = (SIM_DEVICE *)opaque;
+	const ULONG  isr = __atomic_exchange_n(&sim->regs.isr, 0, __ATOMIC_ACQ_REL);
+	if (!isr)
+		return;
+
+	stats_add(&sim->context, PORTHOLE_STAT_INTERRUPTS, 1);
+	stats_add(&sim->context, PORTHOLE_STAT_DPCS      , 1);
+
+	if (isr & PH_REG_ISR_COMPLETE)
+		KeSetEvent(&sim->context.cmdEvent, IO_NO_INCREMENT, FALSE);
+
+	if (isr & PH_REG_ISR_NOTIFY)
+		handle_notify(sim);
+
+	if (isr & (PH_REG_ISR_CONNECT | PH_REG_ISR_DISCONNECT))
+	{
+		const int connected = !(sim->regs.cr & PH_REG_CR_NOCONN);
+		stats_add(&sim->context, PORTHOLE_STAT_EVENT_SIGNALS, 1);
+
+		pthread_mutex_lock(&sim->watchLock);
+		if (sim->handler)
+			sim->handler(sim->opaque, connected);
+		pthread_mutex_unlock(&sim->watchLock);
+	}
+}
+
+/* the driver's are deleted along with the device */
+static void free_workers(SIM_DEVICE * sim)
+{
+	for (ULONG i = 0; i < PH_LOCK_WORKERS; ++i)
+		if (sim->context.lockWorkers[i])
+			WdfObjectDelete(sim->context.lockWorkers[i]);
+}
+
+SIM_DEVICE * sim_create(const SIM_CONFIG * config)
+{
+	SIM_DEVICE * sim = calloc(1, sizeof(SIM_DEVICE));
+	if (!sim)
+		return NULL;
+
+	kernel_configure(config->contigPages, config->pinNs, config->faultAddr);
+
+	sim->context.regs = &sim->regs;
+	ExInitializeFastMutex(&sim->context.cmdLock);
+	KeInitializeEvent(&sim->context.cmdEvent, NotificationEvent, FALSE);
+	notify_init(&sim->context.notify);
+	pthread_mutex_init(&sim->watchLock, NULL);
+
+	sim->file = kernel_file_create();
+	if (!sim->file)
+	{
+		free(sim);
+		return NULL;
+	}
+	FileGetContext(sim->file)->deviceContext = &sim->context;
+
+	if (!NT_SUCCESS(stats_init(&sim->context)))
+	{
+		kernel_file_free(sim->file);
+		free(sim);
+		return NULL;
+	}
+
+	if (!NT_SUCCESS(lock_init(&sim->context)))
+	{
+		free_workers(sim);
+		stats_free(&sim->context);
+		kernel_file_free(sim->file);
+		free(sim);
+		return NULL;
+	}
+
+	sim->model        = model_create(&sim->regs, config, sim_interrupt, sim);
+	sim->context.caps = sim->regs.caps;
+	sim->regs.cr     |= PH_REG_CR_IRQ;
+	return sim;
+}
+
+void sim_destroy(SIM_DEVICE * sim)
+{
+	model_destroy(sim->model);
+	notify_remove(&sim->context, FileGetContext(sim->file), NOTIFY_ALL);
+	cmd_cleanup(&sim->context);
+	free_workers(sim);
+	stats_free(&sim->context);
+	kernel_file_free(sim->file);
+	free(sim);
+}
+
+/* as Map.c's quarantine, there are no pages behind a table to hold */
+typedef struct _SIM_HELD
+{
+	CMD_HELD      held;
+	SEGMENT_TABLE table;
+}
+SIM_HELD;
+
+static void release_held(PCMD_HELD held)
+{
+	SIM_HELD * sim = CONTAINING_RECORD(held, SIM_HELD, held);
+	segtable_free(&sim->table);
+	free(sim);
+}
+
+/* keep a table a hung command may still be reading, the caller's is left
+ * empty. must be called between cmd_begin and cmd_end */
+static void quarantine(SIM_DEVICE * sim, NTSTATUS status, PSEGMENT_TABLE table)
+{
+	if (!cmd_hung(&sim->context, status))
+		return;
+
+	SIM_HELD * held = calloc(1, sizeof(SIM_HELD));
+	if (held)
+	{
+		held->table = *table;
+		cmd_quarantine(&sim->context, &held->held, release_held);
+	}
+	segtable_init(table);
+}
+
+/* the segment table of the buffer as map_prepare would build it, from up to
+ * threads threads under PORTHOLE_CONFIG_PARALLEL_LOCK */
+static NTSTATUS build_table(SIM_DEVICE * sim, void * addr, uint64_t size, uint32_t threads, PSEGMENT_TABLE table)
+{
+	segtable_init(table);
+	if (!size)
+		return STATUS_INVALID_PARAMETER;
+
+	PMDL     mdl;
+	NTSTATUS status = threads > 1 ?
+		lock_buffer_parallel(&sim->context, addr, size, threads, &mdl) :
+		lock_buffer_chain(addr, size, &mdl);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = segtable_build(table, mdl, size);
+	free_mdl(mdl);
+	return status;
+}
+
+static int32_t map_table(SIM_DEVICE * sim, uint32_t type, uint64_t size, NTSTATUS status, PSEGMENT_TABLE table, int32_t * id)
+{
+	if (NT_SUCCESS(status))
+	{
+		cmd_begin(&sim->context);
+		status = cmd_map(&sim->context, table, type, id);
+		quarantine(sim, status, table);
+		cmd_end(&sim->context);
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		stats_add(&sim->context, PORTHOLE_STAT_MAPS_CREATED, 1);
+		stats_add(&sim->context, PORTHOLE_STAT_BYTES_MAPPED, size);
+		stats_add(&sim->context, PORTHOLE_STAT_SEGMENTS    , table->count);
+	}
+
+	segtable_free(table);
+	return status;
+}
+
+int32_t sim_map(SIM_DEVICE * sim, uint32_t type, void * addr, uint64_t size, int32_t * id)
+{
+	SEGMENT_TABLE table;
+	NTSTATUS status = build_table(sim, addr, size, 1, &table);
+	return map_table(sim, type, size, status, &table, id);
+}
+
+int32_t sim_map_parallel(SIM_DEVICE * sim, uint32_t type, void * addr, uint64_t size, uint32_t threads, int32_t * id)
+{
+	SEGMENT_TABLE table;
+	NTSTATUS status = build_table(sim, addr, size, threads, &table);
+	return map_table(sim, type, size, status, &table, id);
+}
+
+int32_t sim_stream(SIM_DEVICE * sim, uint32_t type, void * addr, uint64_t size, int32_t * id)
+{
+	/* as ioctl_send_msg, without extend the buffer is sent whole */
+	if (!(sim->context.caps & PH_REG_CAPS_EXTEND))
+		return sim_map(sim, type, addr, size, id);
+
+	PMDL     mdl;
+	ULONG    segments;
+	NTSTATUS status = stream_map(&sim->context, addr, size, type, id, &mdl, &segments);
+	if (NT_SUCCESS(status))
+	{
+		free_mdl(mdl);
+		stats_add(&sim->context, PORTHOLE_STAT_MAPS_CREATED, 1);
+		stats_add(&sim->context, PORTHOLE_STAT_BYTES_MAPPED, size);
+		stats_add(&sim->context, PORTHOLE_STAT_SEGMENTS    , segments);
+	}
+	return status;
+}
+
+int32_t sim_extend(SIM_DEVICE * sim, int32_t id, void * addr, uint64_t size)
+{
+	SEGMENT_TABLE table;
+	NTSTATUS status = build_table(sim, addr, size, 1, &table);
+	if (NT_SUCCESS(status))
+	{
+		cmd_begin(&sim->context);
+		status = cmd_extend(&sim->context, &table, id);
+		quarantine(sim, status, &table);
+		cmd_end(&sim->context);
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		stats_add(&sim->context, PORTHOLE_STAT_BYTES_MAPPED, size);
+		stats_add(&sim->context, PORTHOLE_STAT_SEGMENTS    , table.count);
+	}
+
+	segtable_free(&table);
+	return status;
+}
+
+int32_t sim_unmap(SIM_DEVICE * sim, int32_t id, uint64_t size)
+{
+	cmd_begin(&sim->context);
+	const NTSTATUS status = cmd_unmap(&sim->context, id);
+	cmd_end(&sim->context);
+
+	if (NT_SUCCESS(status))
+	{
+		notify_remove(&sim->context, FileGetContext(sim->file), id);
+		stats_add(&sim->context, PORTHOLE_STAT_MAPS_FREED    , 1);
+		stats_add(&sim->context, PORTHOLE_STAT_BYTES_UNMAPPED, size);
+	}
+	return status;
+}
+
+int32_t sim_dirty(SIM_DEVICE * sim, int32_t id, uint64_t size, void * ranges, uint32_t count)
+{
+	const CO_SIZE used = coalesce_ranges((PCO_RANGE)ranges, count, size);
+	if (!used)
+		return STATUS_SUCCESS;
+
+	SEGMENT_TABLE table;
+	NTSTATUS      status = STATUS_SUCCESS;
+	segtable_init(&table);
+	for (CO_SIZE i = 0; i < used && NT_SUCCESS(status); ++i)
+		status = segtable_add(&table, ((PCO_RANGE)ranges)[i].offset, ((PCO_RANGE)ranges)[i].size);
+
+	if (NT_SUCCESS(status))
+	{
+		cmd_begin(&sim->context);
+		status = cmd_dirty(&sim->context, id, &table);
+		quarantine(sim, status, &table);
+		cmd_end(&sim->context);
+	}
+
+	segtable_free(&table);
+	return status;
+}
+
+int32_t sim_notify(SIM_DEVICE * sim, int32_t id, uint32_t value)
+{
+	if (!(sim->context.caps & PH_REG_CAPS_NOTIFY))
+		return STATUS_NOT_SUPPORTED;
+
+	model_notify(sim->model, (uint32_t)id, value);
+	return STATUS_SUCCESS;
+}
+
+int32_t sim_subscribe(SIM_DEVICE * sim, int32_t id)
+{
+	if (!(sim->context.caps & PH_REG_CAPS_NOTIFY))
+		return STATUS_NOT_SUPPORTED;
+
+	if (sim->regs.cr & PH_REG_CR_NOCONN)
+		return STATUS_DEVICE_NOT_CONNECTED;
+
+	/* map_claim's check, the device only knows live mappings */
+	uint64_t bytes;
+	if (!model_segments(sim->model, (uint32_t)id, &bytes))
+		return STATUS_INVALID_ADDRESS;
+
+	return notify_register(&sim->context, FileGetContext(sim->file), id, NULL);
+}
+
+int32_t sim_notify_wait(SIM_DEVICE * sim, int32_t id, uint64_t timeoutNs, uint32_t * value, uint32_t * count)
+{
+	WDFREQUEST request = kernel_request_create(sim->file);
+	if (!request)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	PortholeNotifyResult result = { 0 };
+	NTSTATUS status = notify_wait(&sim->context, FileGetContext(sim->file), id, request, &result);
+	if (status == STATUS_PENDING)
+	{
+		LARGE_INTEGER timeout;
+		timeout.QuadPart = -(LONG64)(timeoutNs / 100);
+		status = kernel_request_wait(request, timeoutNs ? &timeout : NULL);
+		if (status == STATUS_TIMEOUT)
+		{
+			/* completed either way, by notify_cancel or a racing notify_signal */
+			kernel_request_cancel(request);
+			status = kernel_request_wait(request, NULL);
+		}
+	}
+	kernel_request_free(request);
+
+	if (NT_SUCCESS(status))
+	{
+		*value = result.value;
+		*count = result.count;
+	}
+	return status;
+}
+
+void sim_connect(SIM_DEVICE * sim, int connected)
+{
+	model_connect(sim->model, connected);
+}
+
+void sim_resume(SIM_DEVICE * sim)
+{
+	model_resume(sim->model);
+}
+
+void sim_watch(SIM_DEVICE * sim, sim_connection handler, void * opaque)
+{
+	pthread_mutex_lock(&sim->watchLock);
+	sim->handler = handler;
+	sim->opaque  = opaque;
+	pthread_mutex_unlock(&sim->watchLock);
+}
+
+uint32_t sim_mapped(SIM_DEVICE * sim)
+{
+	return model_mapped(sim->model);
+}
+
+uint32_t sim_segments(SIM_DEVICE * sim, int32_t id, uint64_t * bytes)
+{
+	return model_segments(sim->model, (uint32_t)id, bytes);
+}
+
+uint64_t sim_dirty_bytes(SIM_DEVICE * sim)
+{
+	return model_dirty(sim->model);
+}
+
+uint64_t sim_table_bytes(SIM_DEVICE * sim)
+{
+	return model_table_bytes(sim->model);
+}
+
+void sim_locked(uint64_t * locked, uint64_t * attached)
+{
+	kernel_locked(locked, attached);
+}
+
+void sim_stats(SIM_DEVICE * sim, uint64_t * counters)
+{
+	stats_query(&sim->context, counters);
+}
+
+void sim_histogram(SIM_DEVICE * sim, void * histogram)
+{
+	memcpy(histogram, &sim->context.waitHistogram, sizeof(PortholeWaitHistogram));
+}
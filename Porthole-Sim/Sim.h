@@ -0,0 +1,164 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * User mode simulator of the porthole device. The driver's own command
+ * layer (Command.c, Segment.c, Stats.c, Coalesce.c) is built against a
+ * software model of PortholeDeviceRegisters, so changes to the register
+ * protocol can be measured and broken without QEMU. The handle table
+ * (Handle.c) comes along for it's tests and benchmark, and page locking
+ * (Lock.c), streamed sends (Stream.c) and client notifications (Notify.c)
+ * run on Kernel.c's stand ins. Linux only, eg:
+ *
+ *   cc  -O2 -c -Wno-multichar -Wno-unknown-pragmas -IPorthole-Sim \
+ *       Porthole/Command.c Porthole/Segment.c Porthole/Stats.c \
+ *       Porthole/Coalesce.c Porthole/Handle.c Porthole/Lock.c \
+ *       Porthole/Stream.c Porthole/Notify.c \
+ *       Porthole-Sim/Kernel.c Porthole-Sim/Sim.c
+ *   c++ -O2 -c -std=c++17 -Wno-unknown-pragmas Porthole-Sim/Model.cpp
+ *   ar rcs libporthole-sim.a *.o
+ *
+ * This header has no other dependencies, SimBackend.hpp wraps it in a
+ * porthole::Backend for the client library, SimTest.c checks the shared
+ * units against it, WaitBench.c compares command completion with and
+ * without PH_REG_CAPS_CMD_IRQ, HandleBench.c times the handle table,
+ * CoalesceBench.c the PFN walk and StreamBench.c streamed sends against
+ * whole ones. Porthole-Test/NotifyBench.cpp measures notification wakeups
+ * through SimBackend.
+ * The model polls the registers from it's own thread, without a spare core
+ * the latencies measured are mostly scheduling.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the same order as PORTHOLE_CMD_* */
+#define SIM_CMD_START       0
+#define SIM_CMD_ADD_SEGMENT 1
+#define SIM_CMD_ADD_TABLE   2
+#define SIM_CMD_FINISH      3
+#define SIM_CMD_UNMAP       4
+#define SIM_CMD_MAX         5
+
+typedef struct _SIM_CONFIG
+{
+	uint32_t caps;                   // PH_REG_CAPS_* the device reports
+	uint64_t latencyNs[SIM_CMD_MAX]; // time taken to complete each command
+	uint64_t segmentNs;              // added per segment read from a table
+	uint32_t maxMappings;            // PH_REG_CR_NORES once reached, 0 for no limit
+	uint32_t maxSegments;            // PH_REG_CR_NORES for larger mappings, 0 for no limit
+	uint32_t timeoutEvery;           // report PH_REG_CR_TIMEOUT on every nth command
+	uint32_t hangEvery;              // never complete every nth command
+	uint32_t contigPages;            // pages per physically contiguous run, 0 for all
+	uint64_t pinNs;                  // time taken to lock each page of a buffer
+	void   * faultAddr;              // locking the page holding this fails, NULL for none
+}
+SIM_CONFIG;
+
+/* contigPages, pinNs and faultAddr are process wide, the last sim_create's
+ * apply to every device */
+
+typedef struct _SIM_DEVICE SIM_DEVICE;
+
+/* called with 1 on connect and 0 on disconnect */
+typedef void (*sim_connection)(void * opaque, int connected);
+
+/* the device starts out connected */
+SIM_DEVICE * sim_create (const SIM_CONFIG * config);
+void         sim_destroy(SIM_DEVICE * sim);
+
+/* build the segment table of the buffer and run the map or unmap command
+ * sequence as the driver does, returning it's NTSTATUS. the buffer is never
+ * locked or read so it only has to be reserved address space, size is only
+ * passed to unmap for the statistics */
+int32_t      sim_map    (SIM_DEVICE * sim, uint32_t type, void * addr, uint64_t size, int32_t * id);
+int32_t      sim_unmap  (SIM_DEVICE * sim, int32_t id, uint64_t size);
+
+/* as sim_map, but lock the buffer from up to threads threads as the driver
+ * does under PORTHOLE_CONFIG_PARALLEL_LOCK, with the device's lock workers.
+ * SIM_CONFIG.pinNs is paid by each thread for it's own pages, real page
+ * faults contend on the process's address space and scale less well */
+int32_t      sim_map_parallel(SIM_DEVICE * sim, uint32_t type, void * addr, uint64_t size, uint32_t threads, int32_t * id);
+
+/* as sim_map, but lock and send the buffer in PORTHOLE_STREAM_CHUNK pieces
+ * as IOCTL_PORTHOLE_SEND_MSG does under PORTHOLE_CONFIG_STREAM. the device
+ * is only held to send a piece, without PH_REG_CAPS_EXTEND this is sim_map */
+int32_t      sim_stream (SIM_DEVICE * sim, uint32_t type, void * addr, uint64_t size, int32_t * id);
+
+/* append the buffer to an existing mapping as IOCTL_PORTHOLE_EXTEND does,
+ * needs PH_REG_CAPS_EXTEND in SIM_CONFIG.caps */
+int32_t      sim_extend (SIM_DEVICE * sim, int32_t id, void * addr, uint64_t size);
+
+/* simulate the client connecting or disconnecting */
+void         sim_connect(SIM_DEVICE * sim, int connected);
+void         sim_watch  (SIM_DEVICE * sim, sim_connection handler, void * opaque);
+
+/* complete the commands SIM_CONFIG.hangEvery hung, late, as a device that
+ * was only very slow would. what they were given is read now */
+void         sim_resume (SIM_DEVICE * sim);
+
+/* the client notifies a mapping, needs PH_REG_CAPS_NOTIFY. the device
+ * raises PH_REG_ISR_NOTIFY from it's thread and the interrupt path hands
+ * each notification to Notify.c as the driver's DPC does */
+int32_t      sim_notify (SIM_DEVICE * sim, int32_t id, uint32_t value);
+
+/* IOCTL_PORTHOLE_NOTIFY_REGISTER without an event, the subscription ends
+ * when the mapping is unmapped or the device destroyed */
+int32_t      sim_subscribe(SIM_DEVICE * sim, int32_t id);
+
+/* IOCTL_PORTHOLE_NOTIFY_WAIT, pended until the mapping is notified. a wait
+ * still pending after timeoutNs, 0 for never, is cancelled as CancelIoEx
+ * would and returns STATUS_CANCELLED. value and count are the result */
+int32_t      sim_notify_wait(SIM_DEVICE * sim, int32_t id, uint64_t timeoutNs, uint32_t * value, uint32_t * count);
+
+/* coalesce the written ranges of a mapping and report them to the device
+ * as IOCTL_PORTHOLE_DIRTY does, needs PH_REG_CAPS_DIRTY. ranges is
+ * rewritten in place and size is the size of the mapping */
+int32_t      sim_dirty  (SIM_DEVICE * sim, int32_t id, uint64_t size, void * ranges, uint32_t count);
+
+/* the number of mappings the device is holding */
+uint32_t     sim_mapped (SIM_DEVICE * sim);
+
+/* the number of segments the device holds for a mapping and their total
+ * size in bytes, 0 if it doesn't know the mapping */
+uint32_t     sim_segments(SIM_DEVICE * sim, int32_t id, uint64_t * bytes);
+
+/* the bytes of dirty ranges the device has accepted, what the host copies */
+uint64_t     sim_dirty_bytes(SIM_DEVICE * sim);
+
+/* the total size of the segments the device has read out of tables */
+uint64_t     sim_table_bytes(SIM_DEVICE * sim);
+
+/* the pages of the process locked now, and the pages ever locked by a
+ * device's lock workers, on behalf of any device */
+void         sim_locked   (uint64_t * locked, uint64_t * attached);
+
+/* counters is PORTHOLE_STAT_MAX long, histogram is a PortholeWaitHistogram */
+void         sim_stats    (SIM_DEVICE * sim, uint64_t * counters);
+void         sim_histogram(SIM_DEVICE * sim, void * histogram);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,408 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/*
+ * A porthole::Backend over the simulator, so the client library, tests and
+ * benchmarks run through the driver's real command layer and a register
+ * level model of the device rather than the FakeBackend. Link with the
+ * library described in Sim.h.
+ *
+ * This stands in for the handle table as well, the IDs handed out are the
+ * device's own and neither the registration cache nor deferred unmapping
+ * is modelled, PORTHOLE_CONFIG_REG_CACHE and PORTHOLE_CONFIG_DEFERRED_UNMAP
+ * are accepted and ignored. PORTHOLE_CONFIG_STREAM sends large buffers
+ * through sim_stream and PORTHOLE_CONFIG_PARALLEL_LOCK the rest through
+ * sim_map_parallel. Notifications the host raises through notify reach
+ * IOCTL_PORTHOLE_NOTIFY_WAIT by way of the device's interrupt.
+ */
+
+#include "../Porthole-Client/Porthole.hpp"
+#include "../Porthole/Registers.h"
+#include "Sim.h"
+
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+
+#ifndef ERROR_SEM_TIMEOUT
+#define ERROR_SEM_TIMEOUT     121
+#endif
+#ifndef ERROR_NOT_SUPPORTED
+#define ERROR_NOT_SUPPORTED   50
+#endif
+#ifndef ERROR_INVALID_ADDRESS
+#define ERROR_INVALID_ADDRESS 487
+#endif
+
+namespace porthole
+{
+
+class SimBackend : public Backend
+{
+public:
+	/* SEGTABLE, CMD_IRQ, EXTEND, DIRTY and NOTIFY capable with no added
+	 * latency */
+	static SIM_CONFIG defaultConfig()
+	{
+		SIM_CONFIG config = {};
+		config.caps = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ | PH_REG_CAPS_EXTEND | PH_REG_CAPS_DIRTY |
+			PH_REG_CAPS_NOTIFY;
+		return config;
+	}
+
+	explicit SimBackend(const SIM_CONFIG & config = defaultConfig()) :
+		m_sim(sim_create(&config))
+	{
+		if (!m_sim)
+			throw Error("sim_create", ERROR_NOT_ENOUGH_MEMORY);
+		sim_watch(m_sim, &SimBackend::on_connection, this);
+	}
+
+	~SimBackend() override
+	{
+		/* as the driver does when the handle is closed */
+		for (const auto & mapping : m_sizes)
+			sim_unmap(m_sim, mapping.first, mapping.second);
+		sim_watch(m_sim, nullptr, nullptr);
+		sim_destroy(m_sim);
+	}
+
+	SimBackend(const SimBackend &) = delete;
+	SimBackend & operator=(const SimBackend &) = delete;
+
+	/* simulate the host connecting or disconnecting, applied asynchronously
+	 * by the device as QEMU would */
+	void connect(bool connected) { sim_connect(m_sim, connected ? 1 : 0); }
+
+	/* simulate the client notifying a mapping, false without
+	 * PH_REG_CAPS_NOTIFY. delivered asynchronously by the device */
+	bool notify(PortholeMapID id, uint32_t value) { return sim_notify(m_sim, id, value) == kStatusSuccess; }
+
+	/* the number of mappings the device holds */
+	uint32_t mapped() const { return sim_mapped(m_sim); }
+
+	/* the bytes of dirty ranges the device has accepted */
+	uint64_t dirtyBytes() const { return sim_dirty_bytes(m_sim); }
+
+	uint32_t ioctl(uint32_t code, const void * in, size_t inSize,
+		void * out, size_t outSize, size_t * returned, AsyncOp * op = nullptr) override
+	{
+		size_t   bytes = 0;
+		uint32_t error = dispatch(code, in, inSize, out, outSize, &bytes);
+		if (op)
+		{
+			op->error    = error;
+			op->returned = bytes;
+		}
+		if (returned)
+			*returned = bytes;
+		return error;
+	}
+
+	/* every request completes before ioctl returns, a notify wait blocks */
+	uint32_t wait(AsyncOp & op, size_t * returned) override
+	{
+		if (returned)
+			*returned = op.returned;
+		return op.error;
+	}
+
+	uint32_t watch(std::function<void(bool)> handler) override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_handler = std::move(handler);
+		return 0;
+	}
+
+private:
+	static uint32_t to_error(int32_t status)
+	{
+		switch ((uint32_t)status)
+		{
+			case 0x00000000: return 0;
+			case 0xC0000010: return ERROR_INVALID_FUNCTION;       // STATUS_INVALID_DEVICE_REQUEST
+			case 0xC000009A: return ERROR_NOT_ENOUGH_MEMORY;      // STATUS_INSUFFICIENT_RESOURCES
+			case 0xC0000468: return ERROR_NOT_ENOUGH_MEMORY;      // STATUS_DEVICE_INSUFFICIENT_RESOURCES
+			case 0xC000009D: return ERROR_DEVICE_NOT_CONNECTED;
+			case 0xC00000B5: return ERROR_SEM_TIMEOUT;            // STATUS_IO_TIMEOUT
+			case 0xC00000BB: return ERROR_NOT_SUPPORTED;
+			case 0xC0000141: return ERROR_INVALID_ADDRESS;
+			case 0xC0000120: return ERROR_OPERATION_ABORTED;      // STATUS_CANCELLED
+			default        : return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	static void on_connection(void * opaque, int connected)
+	{
+		SimBackend * self = (SimBackend *)opaque;
+		std::function<void(bool)> handler;
+		{
+			std::lock_guard<std::mutex> lock(self->m_lock);
+
+			/* the device dropped every mapping */
+			if (!connected)
+				self->m_sizes.clear();
+			handler = self->m_handler;
+		}
+
+		if (handler)
+			handler(connected != 0);
+	}
+
+	LONG map(const PortholeMsg64 & msg, PortholeMapID * id)
+	{
+		LONG status;
+		if (m_stream && msg.size > PORTHOLE_STREAM_CHUNK)
+			status = sim_stream(m_sim, msg.type, msg.addr, msg.size, id);
+		else if (m_lockThreads > 1)
+			status = sim_map_parallel(m_sim, msg.type, msg.addr, msg.size, m_lockThreads, id);
+		else
+			status = sim_map(m_sim, msg.type, msg.addr, msg.size, id);
+		if (status == kStatusSuccess)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_sizes[*id] = msg.size;
+		}
+		return status;
+	}
+
+	LONG extend(const PortholeExtendMsg & msg)
+	{
+		uint64_t size;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			auto it = m_sizes.find(msg.id);
+			if (it == m_sizes.end())
+				return kStatusInvalidAddress;
+			size = it->second;
+		}
+
+		if (!msg.addr || !msg.size || msg.size > UINT64_MAX - size)
+			return kStatusInvalidParameter;
+
+		const LONG status = sim_extend(m_sim, msg.id, msg.addr, msg.size);
+		if (status == kStatusSuccess)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_sizes[msg.id] += msg.size;
+		}
+		return status;
+	}
+
+	LONG dirty(const PortholeDirtyMsg & msg, const PortholeDirtyRange * ranges)
+	{
+		uint64_t size;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			auto it = m_sizes.find(msg.id);
+			if (it == m_sizes.end())
+				return kStatusInvalidAddress;
+			size = it->second;
+		}
+
+		/* the driver coalesces in it's copy of the request */
+		std::vector<PortholeDirtyRange> copy(ranges, ranges + msg.count);
+		return sim_dirty(m_sim, msg.id, size, copy.data(), msg.count);
+	}
+
+	LONG unmap(PortholeMapID id)
+	{
+		uint64_t size;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			auto it = m_sizes.find(id);
+			if (it == m_sizes.end())
+				return kStatusInvalidAddress;
+			size = it->second;
+		}
+
+		const LONG status = sim_unmap(m_sim, id, size);
+		if (status == kStatusSuccess)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_sizes.erase(id);
+		}
+		return status;
+	}
+
+	uint32_t dispatch(uint32_t code, const void * in, size_t inSize,
+		void * out, size_t outSize, size_t * returned)
+	{
+		switch (code)
+		{
+			case IOCTL_PORTHOLE_SEND_MSG:
+			{
+				if (inSize != sizeof(PortholeMsg) || outSize != sizeof(PortholeMapID))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const LONG status = map(widen(*(const PortholeMsg *)in), (PortholeMapID *)out);
+				if (status == kStatusSuccess)
+					*returned = sizeof(PortholeMapID);
+				return to_error(status);
+			}
+
+			case IOCTL_PORTHOLE_SEND_MSG64:
+			{
+				if (inSize != sizeof(PortholeMsg64) || outSize != sizeof(PortholeMapID))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const LONG status = map(*(const PortholeMsg64 *)in, (PortholeMapID *)out);
+				if (status == kStatusSuccess)
+					*returned = sizeof(PortholeMapID);
+				return to_error(status);
+			}
+
+			case IOCTL_PORTHOLE_UNLOCK_BUFFER:
+				if (inSize != sizeof(PortholeMapID))
+					return ERROR_INSUFFICIENT_BUFFER;
+				return to_error(unmap(*(const PortholeMapID *)in));
+
+			case IOCTL_PORTHOLE_EXTEND:
+				if (inSize != sizeof(PortholeExtendMsg))
+					return ERROR_INSUFFICIENT_BUFFER;
+				return to_error(extend(*(const PortholeExtendMsg *)in));
+
+			case IOCTL_PORTHOLE_DIRTY:
+			{
+				const PortholeDirtyMsg * msg = (const PortholeDirtyMsg *)in;
+				if (inSize < sizeof(PortholeDirtyMsg) || !msg->count || msg->count > PORTHOLE_MAX_DIRTY ||
+					inSize != sizeof(PortholeDirtyMsg) + msg->count * sizeof(PortholeDirtyRange))
+					return ERROR_INSUFFICIENT_BUFFER;
+				return to_error(dirty(*msg, (const PortholeDirtyRange *)(msg + 1)));
+			}
+
+			case IOCTL_PORTHOLE_SEND_MSG_BATCH:
+			{
+				const size_t count = inSize / sizeof(PortholeMsg);
+				if (count == 0 || count > PORTHOLE_MAX_BATCH || inSize != count * sizeof(PortholeMsg) ||
+					outSize != count * sizeof(PortholeBatchResult))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const PortholeMsg   * msgs    = (const PortholeMsg *)in;
+				PortholeBatchResult * results = (PortholeBatchResult *)out;
+				for (size_t i = 0; i < count; ++i)
+				{
+					results[i].status = map(widen(msgs[i]), &results[i].id);
+					if (results[i].status != kStatusSuccess)
+						results[i].id = -1;
+				}
+				*returned = outSize;
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_UNLOCK_BATCH:
+			{
+				const size_t count = inSize / sizeof(PortholeMapID);
+				if (count == 0 || count > PORTHOLE_MAX_BATCH || inSize != count * sizeof(PortholeMapID) ||
+					outSize != count * sizeof(LONG))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const PortholeMapID * ids     = (const PortholeMapID *)in;
+				LONG                * results = (LONG *)out;
+				for (size_t i = 0; i < count; ++i)
+					results[i] = unmap(ids[i]);
+				*returned = outSize;
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_NOTIFY_REGISTER:
+				if (inSize != sizeof(PortholeNotifyRegister))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				/* there is nothing to signal the event with here, waits go
+				 * through IOCTL_PORTHOLE_NOTIFY_WAIT */
+				return to_error(sim_subscribe(m_sim, ((const PortholeNotifyRegister *)in)->id));
+
+			case IOCTL_PORTHOLE_NOTIFY_WAIT:
+			{
+				if (inSize != sizeof(PortholeMapID) || outSize != sizeof(PortholeNotifyResult))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				PortholeNotifyResult * result = (PortholeNotifyResult *)out;
+				const LONG status = sim_notify_wait(m_sim, *(const PortholeMapID *)in, 0, &result->value, &result->count);
+				if (status == kStatusSuccess)
+					*returned = sizeof(PortholeNotifyResult);
+				return to_error(status);
+			}
+
+			case IOCTL_PORTHOLE_CONFIGURE:
+			{
+				if (inSize != sizeof(PortholeConfig))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				const PortholeConfig * config = (const PortholeConfig *)in;
+				if (config->flags & ~(PORTHOLE_CONFIG_REG_CACHE | PORTHOLE_CONFIG_DEFERRED_UNMAP |
+					PORTHOLE_CONFIG_STREAM | PORTHOLE_CONFIG_PARALLEL_LOCK))
+					return ERROR_INVALID_PARAMETER;
+				if (config->lockThreads > PORTHOLE_MAX_LOCK_THREADS)
+					return ERROR_INVALID_PARAMETER;
+
+				m_stream      = (config->flags & PORTHOLE_CONFIG_STREAM) != 0;
+				m_lockThreads = 0;
+				if (config->flags & PORTHOLE_CONFIG_PARALLEL_LOCK)
+					m_lockThreads = config->lockThreads ? config->lockThreads :
+						std::min<uint32_t>(std::thread::hardware_concurrency(), PORTHOLE_MAX_LOCK_THREADS);
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_FLUSH:
+				return 0;
+
+			case IOCTL_PORTHOLE_QUERY_STATS:
+			{
+				if (outSize != sizeof(PortholeStats))
+					return ERROR_INSUFFICIENT_BUFFER;
+
+				/* a single handle, it's counters are the device's */
+				PortholeStats * stats = (PortholeStats *)out;
+				stats->version = PORTHOLE_STATS_VERSION;
+				stats->count   = PORTHOLE_STAT_MAX;
+				sim_stats(m_sim, stats->device);
+				std::memset(stats->handle, 0, sizeof(stats->handle));
+				std::memcpy(stats->handle, stats->device, (PORTHOLE_STAT_SEGMENTS + 1) * sizeof(UINT64));
+				*returned = outSize;
+				return 0;
+			}
+
+			case IOCTL_PORTHOLE_GET_WAIT_HISTOGRAM:
+				if (outSize != sizeof(PortholeWaitHistogram))
+					return ERROR_INSUFFICIENT_BUFFER;
+				sim_histogram(m_sim, out);
+				*returned = outSize;
+				return 0;
+
+			default:
+				return ERROR_INVALID_FUNCTION;
+		}
+	}
+
+	SIM_DEVICE *                                m_sim;
+	std::mutex                                  m_lock;
+	std::unordered_map<PortholeMapID, uint64_t> m_sizes;
+	std::function<void(bool)>                   m_handler;
+	bool                                        m_stream = false;
+	uint32_t                                    m_lockThreads = 0;
+};
+
+}
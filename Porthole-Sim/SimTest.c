@@ -0,0 +1,1348 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Assertion based checks of the driver's shared units, run against the
+ * register model where they need a device. Build the library as described
+ * in Sim.h, then:
+ *
+ *   cc -O2 -Wno-multichar -Wno-unknown-pragmas -IPorthole-Sim \
+ *       Porthole-Sim/SimTest.c libporthole-sim.a -lstdc++ -lpthread -o simtest
+ *
+ * `simtest` runs every test, `simtest name...` only those named. Each
+ * failed check is printed and the exit code is the number that failed.
+ */
+
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "driver.h"
+#include "Sim.h"
+
+static int failed;
+
+#define CHECK(cond) \
+	do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); ++failed; } } while (0)
+
+/* address space the simulator can describe but nothing can touch */
+static void * reserve(uint64_t size)
+{
+	void * addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+static uint64_t waits(const PortholeWaitHistogram * histogram, int cmd)
+{
+	uint64_t count = histogram->timeouts[cmd];
+	for (int i = 0; i < PORTHOLE_WAIT_BUCKETS; ++i)
+		count += histogram->buckets[cmd][i];
+	return count;
+}
+
+/* a fragmented buffer goes to a PH_REG_CAPS_SEGTABLE device as one table
+ * spanning several linked pages, and a segment at a time to one without */
+static void test_segtable_submit(void)
+{
+	const uint64_t pages = 1000;
+	const uint64_t size  = pages * PAGE_SIZE;
+	PUCHAR base = reserve(size + PAGE_SIZE);
+	CHECK(base);
+	if (!base)
+		return;
+
+	for (int v2 = 0; v2 < 2; ++v2)
+	{
+		SIM_CONFIG config = { 0 };
+		config.caps        = PH_REG_CAPS_CMD_IRQ | (v2 ? PH_REG_CAPS_SEGTABLE : 0);
+		config.contigPages = 1;
+
+		SIM_DEVICE * sim = sim_create(&config);
+		CHECK(sim);
+		if (!sim)
+			continue;
+
+		/* starting part way into a page, every page is it's own segment */
+		int32_t id = 0;
+		CHECK(sim_map(sim, 1, base + 100, size, &id) == STATUS_SUCCESS);
+
+		uint64_t bytes = 0;
+		CHECK(sim_segments(sim, id, &bytes) == pages + 1);
+		CHECK(bytes == size);
+
+		PortholeWaitHistogram histogram;
+		sim_histogram(sim, &histogram);
+		if (v2)
+		{
+			CHECK(waits(&histogram, PORTHOLE_CMD_ADD_TABLE  ) == 1);
+			CHECK(waits(&histogram, PORTHOLE_CMD_ADD_SEGMENT) == 0);
+		}
+		else
+		{
+			CHECK(waits(&histogram, PORTHOLE_CMD_ADD_TABLE  ) == 0);
+			CHECK(waits(&histogram, PORTHOLE_CMD_ADD_SEGMENT) >= pages + 1);
+		}
+
+		CHECK(sim_unmap(sim, id, size) == STATUS_SUCCESS);
+		CHECK(sim_mapped(sim) == 0);
+		sim_destroy(sim);
+	}
+
+	munmap(base, size + PAGE_SIZE);
+}
+
+/* a command the device reports PH_REG_CR_TIMEOUT for fails the map rather
+ * than handing back whatever is left in `addr` as the mapping ID */
+static void test_device_timeout(void)
+{
+	static char buffer[4 * PAGE_SIZE];
+
+	/* START, ADD_SEGMENT, FINISH, the finish times out */
+	SIM_CONFIG config = { 0 };
+	config.caps         = PH_REG_CAPS_CMD_IRQ;
+	config.timeoutEvery = 3;
+
+	SIM_DEVICE * sim = sim_create(&config);
+	CHECK(sim);
+	if (!sim)
+		return;
+
+	int32_t id = -1;
+	CHECK(sim_map(sim, 1, buffer, sizeof(buffer), &id) == STATUS_IO_TIMEOUT);
+	CHECK(id == -1);
+	CHECK(sim_mapped(sim) == 0);
+
+	sim_destroy(sim);
+}
+
+/* a command the device never completes fails the map, and the device is
+ * refused until it catches up. a late ADD_TABLE reads the table the map
+ * had long since given up on, a late FINISH makes a mapping nobody has the
+ * ID of which the next command drops */
+static void test_hung_command(void)
+{
+	const uint64_t pages = 300;
+	const uint64_t size  = pages * PAGE_SIZE;
+	PUCHAR base = reserve(size);
+	CHECK(base);
+	if (!base)
+		return;
+
+	/* START then ADD_TABLE, or START, ADD_TABLE then FINISH */
+	static const uint32_t hangs[] = { 2, 3 };
+	for (size_t i = 0; i < sizeof(hangs) / sizeof(hangs[0]); ++i)
+	{
+		const int finish = hangs[i] == 3;
+
+		SIM_CONFIG config = { 0 };
+		config.caps        = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ;
+		config.contigPages = 1;
+		config.hangEvery   = hangs[i];
+
+		SIM_DEVICE * sim = sim_create(&config);
+		CHECK(sim);
+		if (!sim)
+			continue;
+
+		int32_t id = 0;
+		CHECK(sim_map(sim, 1, base, size, &id) == STATUS_IO_TIMEOUT);
+		CHECK(sim_unmap(sim, 1, 0) == STATUS_DEVICE_BUSY);
+		CHECK(sim_table_bytes(sim) == (finish ? size : 0));
+		CHECK(sim_mapped(sim) == 0);
+
+		sim_resume(sim);
+		for (int w = 0; w < 1000 && (sim_table_bytes(sim) != size || sim_mapped(sim) != (uint32_t)finish); ++w)
+		{
+			const struct timespec ts = { 0, 1000000 };
+			nanosleep(&ts, NULL);
+		}
+		CHECK(sim_table_bytes(sim) == size);
+		CHECK(sim_mapped(sim) == (uint32_t)finish);
+
+		/* the device takes commands again, whatever was made is gone */
+		CHECK(sim_unmap(sim, 1, 0) == STATUS_INVALID_ADDRESS);
+		CHECK(sim_mapped(sim) == 0);
+
+		sim_destroy(sim);
+	}
+
+	munmap(base, size);
+}
+
+/* an extend of 4GB and over is appended whole, not cut down to 32 bits */
+static void test_extend_4gb(void)
+{
+	const uint64_t size = 5ull << 30;
+	PUCHAR base = reserve(size + PAGE_SIZE);
+	CHECK(base);
+	if (!base)
+		return;
+
+	SIM_CONFIG config = { 0 };
+	config.caps = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ | PH_REG_CAPS_EXTEND;
+
+	SIM_DEVICE * sim = sim_create(&config);
+	CHECK(sim);
+	if (!sim)
+	{
+		munmap(base, size + PAGE_SIZE);
+		return;
+	}
+
+	int32_t id = 0;
+	CHECK(sim_map(sim, 1, base, PAGE_SIZE, &id) == STATUS_SUCCESS);
+	CHECK(sim_extend(sim, id, base + PAGE_SIZE, size) == STATUS_SUCCESS);
+
+	uint64_t bytes = 0;
+	CHECK(sim_segments(sim, id, &bytes) >= 2);
+	CHECK(bytes == PAGE_SIZE + size);
+
+	CHECK(sim_unmap(sim, id, PAGE_SIZE + size) == STATUS_SUCCESS);
+	sim_destroy(sim);
+	munmap(base, size + PAGE_SIZE);
+}
+
+static uint32_t next_random(uint32_t * state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/* the per page loop coalesce_run_length replaced */
+static CO_SIZE scalar_run_length(const CO_PFN * pfns, CO_SIZE count)
+{
+	CO_SIZE n = 0;
+	while (n + 1 < count && pfns[n + 1] == pfns[n] + 1)
+		++n;
+	return n;
+}
+
+/* pfns[0..count) from base, contiguous but for a jump before every set bit
+ * of breaks, a jump by 2^32 pages so only the upper half of the PFN differs */
+static void fill_pfns(CO_PFN * pfns, CO_SIZE count, CO_PFN base, uint64_t breaks, int high)
+{
+	CO_PFN pfn = base;
+	for (CO_SIZE i = 0; i < count; ++i)
+	{
+		if (i && (breaks >> (i % 64) & 1))
+			pfn += high ? ((CO_PFN)1 << 32) : 2;
+		pfns[i] = pfn++;
+	}
+}
+
+/* every break position either side of the scalar probe, the vector groups
+ * and the scalar tail, with PFNs in both halves of the 32bit lanes */
+static void test_coalesce_run_length(void)
+{
+	static const CO_PFN bases[] = { 0x1000, 0xFFFFFFF0, 0x7FFFFFFFFFFFFFF0 };
+
+	CO_PFN pfns[48];
+	for (size_t b = 0; b < sizeof(bases) / sizeof(bases[0]); ++b)
+		for (int high = 0; high < 2; ++high)
+			for (CO_SIZE count = 0; count <= 40; ++count)
+				for (CO_SIZE at = 1; at <= count; ++at)
+				{
+					/* at == count leaves the whole array one run */
+					fill_pfns(pfns, count, bases[b], at < count ? 1ull << at : 0, high);
+					CHECK(coalesce_run_length(pfns, count) == scalar_run_length(pfns, count));
+				}
+
+	uint32_t seed = 0x2545F491;
+	for (int i = 0; i < 100000; ++i)
+	{
+		const CO_SIZE  count  = next_random(&seed) % 48;
+		const uint64_t breaks = (uint64_t)next_random(&seed) << 32 | next_random(&seed);
+
+		/* mostly long runs, one break in 16 pairs on average */
+		const uint64_t sparse = breaks & ((uint64_t)next_random(&seed) << 32 | next_random(&seed)) &
+			((uint64_t)next_random(&seed) << 32 | next_random(&seed)) &
+			((uint64_t)next_random(&seed) << 32 | next_random(&seed));
+
+		fill_pfns(pfns, count, bases[i % 3], i & 1 ? breaks : sparse, i & 2);
+		CHECK(coalesce_run_length(pfns, count) == scalar_run_length(pfns, count));
+	}
+}
+
+#define COALESCE_TEST_RUNS 1024
+
+typedef struct _RUNS
+{
+	CO_SIZE  count;
+	CO_RANGE runs[COALESCE_TEST_RUNS];
+}
+RUNS;
+
+static int add_run(void * opaque, CO_U64 addr, CO_U64 size)
+{
+	RUNS * runs = (RUNS *)opaque;
+	if (runs->count == COALESCE_TEST_RUNS)
+		return -1;
+
+	runs->runs[runs->count].offset = addr;
+	runs->runs[runs->count].size   = size;
+	++runs->count;
+	return 0;
+}
+
+/* a page at a time, the bytes of each page merged into the last run */
+static void scalar_coalesce(RUNS * runs, const CO_PFN * pfns, CO_SIZE count, CO_U32 offset, CO_U64 length)
+{
+	for (CO_SIZE i = 0; i < count && length; ++i)
+	{
+		const CO_U64 addr  = ((CO_U64)pfns[i] << COALESCE_PAGE_SHIFT) + offset;
+		const CO_U64 bytes = min(COALESCE_PAGE_SIZE - offset, length);
+		length -= bytes;
+		offset  = 0;
+
+		PCO_RANGE last = runs->count ? &runs->runs[runs->count - 1] : NULL;
+		if (last && last->offset + last->size == addr)
+			last->size += bytes;
+		else
+			add_run(runs, addr, bytes);
+	}
+}
+
+static int same_runs(const RUNS * a, const RUNS * b)
+{
+	if (a->count != b->count)
+		return 0;
+	for (CO_SIZE i = 0; i < a->count; ++i)
+		if (a->runs[i].offset != b->runs[i].offset || a->runs[i].size != b->runs[i].size)
+			return 0;
+	return 1;
+}
+
+/* random layouts fed in random sized pieces as segtable_build feeds an MDL
+ * chain, the first starting part way into a page and the last ending short
+ * of it's final page, give the same runs as the scalar loop */
+static void test_coalesce_pfns(void)
+{
+	static CO_PFN pfns[1024];
+	static RUNS   expected, actual;
+
+	uint32_t seed = 0x6A09E667;
+	for (int i = 0; i < 20000; ++i)
+	{
+		const CO_SIZE  count  = 1 + next_random(&seed) % 1024;
+		const uint64_t breaks = (uint64_t)next_random(&seed) << 32 | next_random(&seed);
+		fill_pfns(pfns, count, 0xFFFFF000 + next_random(&seed) % 0x2000, i & 1 ? breaks : breaks & (breaks >> 7), i & 2);
+
+		const CO_U32 offset = i & 4 ? next_random(&seed) % COALESCE_PAGE_SIZE : 0;
+		const CO_U64 span   = (CO_U64)count * COALESCE_PAGE_SIZE - offset;
+		const CO_U64 length = span - next_random(&seed) % min(span, COALESCE_PAGE_SIZE);
+
+		expected.count = 0;
+		scalar_coalesce(&expected, pfns, count, offset, length);
+
+		COALESCE co;
+		actual.count = 0;
+		coalesce_init(&co, add_run, &actual);
+
+		CO_SIZE done = 0;
+		CO_U64  left = length;
+		while (done < count)
+		{
+			/* min() evaluates its arguments twice, draw the size first */
+			const CO_SIZE drawn = 1 + next_random(&seed) % 300;
+			const CO_SIZE pages = min(drawn, count - done);
+			const CO_U32  first = done ? 0 : offset;
+			const CO_U64  bytes = min((CO_U64)pages * COALESCE_PAGE_SIZE - first, left);
+			CHECK(coalesce_pfns(&co, pfns + done, pages, first, bytes) == 0);
+			done += pages;
+			left -= bytes;
+		}
+		CHECK(coalesce_flush(&co) == 0);
+		CHECK(left == 0);
+		CHECK(same_runs(&actual, &expected));
+	}
+}
+
+/* runs crossing the 4GB line stay whole, and one larger than 4GB carried
+ * across several 1GB calls comes out as a single 64bit sized run */
+static void test_coalesce_4gb(void)
+{
+	const CO_SIZE chunk = MDL_CHUNK_SIZE >> COALESCE_PAGE_SHIFT;
+	CO_PFN * pfns = malloc(chunk * sizeof(CO_PFN));
+	CHECK(pfns);
+	if (!pfns)
+		return;
+
+	static RUNS runs;
+	COALESCE co;
+
+	/* 1MB either side of 4GB */
+	const CO_PFN below = (4ull << 30 >> COALESCE_PAGE_SHIFT) - 256;
+	fill_pfns(pfns, 512, below, 0, 0);
+	runs.count = 0;
+	coalesce_init(&co, add_run, &runs);
+	CHECK(coalesce_pfns(&co, pfns, 512, 0, 512 * COALESCE_PAGE_SIZE) == 0);
+	CHECK(coalesce_flush(&co) == 0);
+	CHECK(runs.count == 1);
+	CHECK(runs.runs[0].offset == (CO_U64)below << COALESCE_PAGE_SHIFT);
+	CHECK(runs.runs[0].size   == 2ull << 20);
+
+	/* 6GB from 3GB up, then a fragment that doesn't follow on */
+	const CO_PFN start = 3ull << 30 >> COALESCE_PAGE_SHIFT;
+	runs.count = 0;
+	coalesce_init(&co, add_run, &runs);
+	for (int i = 0; i < 6; ++i)
+	{
+		fill_pfns(pfns, chunk, start + i * chunk, 0, 0);
+		CHECK(coalesce_pfns(&co, pfns, chunk, 0, MDL_CHUNK_SIZE) == 0);
+		CHECK(runs.count == 0);
+	}
+	pfns[0] = 1;
+	CHECK(coalesce_pfns(&co, pfns, 1, 0, COALESCE_PAGE_SIZE) == 0);
+	CHECK(coalesce_flush(&co) == 0);
+	CHECK(runs.count == 2);
+	CHECK(runs.runs[0].offset == 3ull << 30);
+	CHECK(runs.runs[0].size   == 6ull << 30);
+	CHECK(runs.runs[1].offset == COALESCE_PAGE_SIZE);
+	CHECK(runs.runs[1].size   == COALESCE_PAGE_SIZE);
+
+	free(pfns);
+}
+
+#define SEGTABLE_TEST_RUN   (5ull << 30)
+#define SEGTABLE_TEST_FRAGS 1000
+
+/* the physical page behind page i of the buffer, a 5GB run from 3GB up
+ * followed by pages that don't join anything */
+static PFN_NUMBER segtable_pfn(uint64_t i)
+{
+	const uint64_t run = SEGTABLE_TEST_RUN >> PAGE_SHIFT;
+	if (i < run)
+		return (PFN_NUMBER)((3ull << 30 >> PAGE_SHIFT) + i);
+	return (PFN_NUMBER)((64ull << 30 >> PAGE_SHIFT) + (i - run) * 2);
+}
+
+static void free_mdls(PMDL mdl)
+{
+	for (PMDL next; mdl; mdl = next)
+	{
+		next = mdl->Next;
+		free(mdl->Pfns);
+		free(mdl);
+	}
+}
+
+/* the buffer at va as lock_buffer_chain would lock it, MDL_CHUNK_SIZE at a
+ * time with every piece after the first starting on a page */
+static PMDL segtable_chain(PUCHAR va, uint64_t size)
+{
+	PMDL     head   = NULL;
+	PMDL   * tail   = &head;
+	PUCHAR   pos    = va;
+	uint64_t page   = 0;
+	uint64_t length = MDL_CHUNK_SIZE - BYTE_OFFSET(va);
+	while (size)
+	{
+		length = min(length, size);
+
+		PMDL mdl = calloc(1, sizeof(MDL));
+		if (!mdl)
+			break;
+		*tail = mdl;
+		tail  = &mdl->Next;
+
+		mdl->StartVa    = PAGE_ALIGN(pos);
+		mdl->ByteOffset = BYTE_OFFSET(pos);
+		mdl->ByteCount  = (ULONG)length;
+
+		const ULONG pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(pos, length);
+		if (!(mdl->Pfns = malloc(pages * sizeof(PFN_NUMBER))))
+			break;
+		for (ULONG i = 0; i < pages; ++i)
+			mdl->Pfns[i] = segtable_pfn(page++);
+
+		pos  += length;
+		size -= length;
+		length = MDL_CHUNK_SIZE;
+	}
+
+	if (size)
+	{
+		free_mdls(head);
+		return NULL;
+	}
+	return head;
+}
+
+/* a buffer over 4GB, starting and ending part way into a page, whose first
+ * run crosses both the 4GB line and every 1GB MDL boundary. the table holds
+ * that run whole with it's 64bit size, then a segment per fragment, spread
+ * over linked pages that each end in a zero sized link to the next */
+static void test_segtable_4gb(void)
+{
+	const uint64_t pages = (SEGTABLE_TEST_RUN >> PAGE_SHIFT) + SEGTABLE_TEST_FRAGS;
+	const uint64_t size  = pages * PAGE_SIZE - 100 - 50;
+	PUCHAR va = (PUCHAR)(ULONG_PTR)(0x7F0000000000ull + 100);
+
+	PMDL mdl = segtable_chain(va, size);
+	CHECK(mdl);
+	if (!mdl)
+		return;
+
+	ULONG mdls = 0;
+	for (PMDL cur = mdl; cur; cur = cur->Next)
+		++mdls;
+	CHECK(mdls == 6);
+
+	SEGMENT_TABLE table;
+	segtable_init(&table);
+	CHECK(segtable_build(&table, mdl, size) == STATUS_SUCCESS);
+	CHECK(table.count == 1 + SEGTABLE_TEST_FRAGS);
+
+	ULONG    seen  = 0;
+	ULONG    links = 0;
+	uint64_t total = 0;
+	for (PSEGMENT_PAGE page = table.head; page; page = page->next)
+	{
+		const ULONG count = SEGTABLE_PAGE_COUNT(&table, page);
+		CHECK(count <= PH_SEGTABLE_ENTRIES - 1);
+
+		for (ULONG i = 0; i < count; ++i, ++seen)
+		{
+			const PortholeSegment * seg = &page->entries[i];
+			CHECK(seg->size != 0);
+			total += seg->size;
+
+			if (seen == 0)
+			{
+				CHECK(seg->addr == (3ull << 30) + 100);
+				CHECK(seg->size == SEGTABLE_TEST_RUN - 100);
+				continue;
+			}
+
+			const uint64_t frag = seen - 1;
+			CHECK(seg->addr == (uint64_t)segtable_pfn((SEGTABLE_TEST_RUN >> PAGE_SHIFT) + frag) << PAGE_SHIFT);
+			CHECK(seg->size == (frag == SEGTABLE_TEST_FRAGS - 1 ? PAGE_SIZE - 50 : PAGE_SIZE));
+		}
+
+		if (page->next)
+		{
+			const PortholeSegment * link = &page->entries[PH_SEGTABLE_ENTRIES - 1];
+			CHECK(link->size == 0);
+			CHECK(link->addr == (uint64_t)page->next->pa.QuadPart);
+			++links;
+		}
+		else
+			CHECK(page == table.tail);
+	}
+
+	const ULONG perPage = PH_SEGTABLE_ENTRIES - 1;
+	CHECK(seen  == table.count);
+	CHECK(links == (table.count + perPage - 1) / perPage - 1);
+	CHECK(total == size);
+
+	segtable_free(&table);
+	free_mdls(mdl);
+}
+
+/* the same through the device, a contiguous 6GB buffer goes as one table
+ * entry to a PH_REG_CAPS_SEGTABLE device and as segments under 4GB to one
+ * without */
+static void test_send_4gb(void)
+{
+	const uint64_t size = 6ull << 30;
+	PUCHAR base = reserve(size);
+	CHECK(base);
+	if (!base)
+		return;
+
+	for (int v2 = 0; v2 < 2; ++v2)
+	{
+		SIM_CONFIG config = { 0 };
+		config.caps = PH_REG_CAPS_CMD_IRQ | (v2 ? PH_REG_CAPS_SEGTABLE : 0);
+
+		SIM_DEVICE * sim = sim_create(&config);
+		CHECK(sim);
+		if (!sim)
+			continue;
+
+		int32_t id = 0;
+		CHECK(sim_map(sim, 1, base, size, &id) == STATUS_SUCCESS);
+
+		uint64_t bytes = 0;
+		CHECK(sim_segments(sim, id, &bytes) == (v2 ? 1 : 2));
+		CHECK(bytes == size);
+
+		PortholeWaitHistogram histogram;
+		sim_histogram(sim, &histogram);
+		CHECK(waits(&histogram, PORTHOLE_CMD_ADD_TABLE  ) == (v2 ? 1 : 0));
+		CHECK(v2 ? waits(&histogram, PORTHOLE_CMD_ADD_SEGMENT) == 0 : waits(&histogram, PORTHOLE_CMD_ADD_SEGMENT) >= 2);
+
+		CHECK(sim_unmap(sim, id, size) == STATUS_SUCCESS);
+		sim_destroy(sim);
+	}
+
+	munmap(base, size);
+}
+
+/* the pieces the lock workers lock are joined in order, so a contiguous
+ * buffer is still one segment however many threads it is locked from */
+static void test_lock_parallel(void)
+{
+	const uint64_t size = 300ull << 20;
+	PUCHAR base = reserve(size + PAGE_SIZE);
+	CHECK(base);
+	if (!base)
+		return;
+
+	SIM_CONFIG config = { 0 };
+	config.caps = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ;
+
+	SIM_DEVICE * sim = sim_create(&config);
+	CHECK(sim);
+	if (!sim)
+	{
+		munmap(base, size + PAGE_SIZE);
+		return;
+	}
+
+	static const uint32_t threads[] = { 2, 3, 8, PORTHOLE_MAX_LOCK_THREADS };
+	for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i)
+	{
+		uint64_t locked, before, after;
+		sim_locked(&locked, &before);
+
+		int32_t id = 0;
+		CHECK(sim_map_parallel(sim, 1, base + 100, size, threads[i], &id) == STATUS_SUCCESS);
+
+		uint64_t bytes = 0;
+		CHECK(sim_segments(sim, id, &bytes) == 1);
+		CHECK(bytes == size);
+		CHECK(sim_unmap(sim, id, size) == STATUS_SUCCESS);
+
+		/* the workers locked their share, and everything was unlocked */
+		sim_locked(&locked, &after);
+		CHECK(after > before);
+		CHECK(locked == 0);
+	}
+
+	sim_destroy(sim);
+	munmap(base, size + PAGE_SIZE);
+}
+
+/* a page that can't be locked fails the send whichever thread has it, and
+ * the pieces the others locked are unlocked again */
+static void test_lock_parallel_fault(void)
+{
+	const uint64_t size = 256ull << 20;
+	PUCHAR base = reserve(size);
+	CHECK(base);
+	if (!base)
+		return;
+
+	/* in the caller's first piece and a worker's last */
+	const uint64_t faults[] = { 5ull << 20, 200ull << 20 };
+	for (size_t i = 0; i < sizeof(faults) / sizeof(faults[0]); ++i)
+	{
+		SIM_CONFIG config = { 0 };
+		config.caps      = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ;
+		config.faultAddr = base + faults[i];
+
+		SIM_DEVICE * sim = sim_create(&config);
+		CHECK(sim);
+		if (!sim)
+			continue;
+
+		int32_t id = 0;
+		CHECK(sim_map_parallel(sim, 1, base, size, 4, &id) == STATUS_INVALID_DEVICE_REQUEST);
+		CHECK(sim_mapped(sim) == 0);
+
+		uint64_t locked, attached;
+		sim_locked(&locked, &attached);
+		CHECK(locked == 0);
+		sim_destroy(sim);
+	}
+
+	munmap(base, size);
+}
+
+typedef struct _PROBE_WORK
+{
+	PVOID     addr;
+	PEPROCESS process;
+	NTSTATUS  status;
+}
+PROBE_WORK;
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(PROBE_WORK, ProbeWorkGetContext)
+
+static VOID probe_worker(WDFWORKITEM WorkItem)
+{
+	PROBE_WORK * work = ProbeWorkGetContext(WorkItem);
+
+	KAPC_STATE apc;
+	if (work->process)
+		KeStackAttachProcess(work->process, &apc);
+
+	PMDL mdl;
+	if (NT_SUCCESS(work->status = lock_buffer(work->addr, PAGE_SIZE, &mdl)))
+		free_mdl(mdl);
+
+	if (work->process)
+		KeUnstackDetachProcess(&apc);
+}
+
+/* a work item runs in no process, it can only lock a user buffer once it
+ * attaches to the one that owns it as lock_worker does */
+static void test_lock_attach(void)
+{
+	static char buffer[PAGE_SIZE];
+
+	WDF_WORKITEM_CONFIG   workConfig;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_WORKITEM_CONFIG_INIT(&workConfig, probe_worker);
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, PROBE_WORK);
+
+	WDFWORKITEM    item;
+	const NTSTATUS status = WdfWorkItemCreate(&workConfig, &attributes, &item);
+	CHECK(NT_SUCCESS(status));
+	if (!NT_SUCCESS(status))
+		return;
+
+	PROBE_WORK * work = ProbeWorkGetContext(item);
+	for (int attach = 0; attach < 2; ++attach)
+	{
+		work->addr    = buffer;
+		work->process = attach ? PsGetCurrentProcess() : NULL;
+		work->status  = STATUS_SUCCESS;
+		WdfWorkItemEnqueue(item);
+		WdfWorkItemFlush(item);
+		CHECK(work->status == (attach ? STATUS_SUCCESS : STATUS_INVALID_DEVICE_REQUEST));
+	}
+
+	uint64_t locked, attached;
+	sim_locked(&locked, &attached);
+	CHECK(locked == 0);
+
+	WdfObjectDelete(item);
+}
+
+typedef struct _LOCK_RACE
+{
+	SIM_DEVICE * sim;
+	PUCHAR       base;
+	uint64_t     size;
+	int          failed;
+}
+LOCK_RACE;
+
+static void * lock_race(void * opaque)
+{
+	LOCK_RACE * race = (LOCK_RACE *)opaque;
+	for (int i = 0; i < 20; ++i)
+	{
+		int32_t  id    = 0;
+		uint64_t bytes = 0;
+		if (sim_map_parallel(race->sim, 1, race->base, race->size, PORTHOLE_MAX_LOCK_THREADS, &id) != STATUS_SUCCESS ||
+			sim_segments(race->sim, id, &bytes) != 1 || bytes != race->size ||
+			sim_unmap(race->sim, id, race->size) != STATUS_SUCCESS)
+			++race->failed;
+	}
+	return NULL;
+}
+
+/* callers that want every worker at once share them out, whoever finds
+ * none free locks the whole buffer itself */
+static void test_lock_workers_busy(void)
+{
+	const uint64_t size = 1ull << 30;
+	PUCHAR base = reserve(2 * size);
+	CHECK(base);
+	if (!base)
+		return;
+
+	SIM_CONFIG config = { 0 };
+	config.caps = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ;
+
+	SIM_DEVICE * sim = sim_create(&config);
+	CHECK(sim);
+	if (!sim)
+	{
+		munmap(base, 2 * size);
+		return;
+	}
+
+	LOCK_RACE race[3];
+	pthread_t threads[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		race[i].sim    = sim;
+		race[i].base   = base + (i & 1) * size + i * PAGE_SIZE;
+		race[i].size   = size - PAGE_SIZE * 3;
+		race[i].failed = 0;
+		CHECK(pthread_create(&threads[i], NULL, lock_race, &race[i]) == 0);
+	}
+
+	for (int i = 0; i < 3; ++i)
+	{
+		pthread_join(threads[i], NULL);
+		CHECK(race[i].failed == 0);
+	}
+
+	uint64_t locked, before, after;
+	sim_locked(&locked, &before);
+	CHECK(locked == 0);
+
+	/* every worker was given back, each locks a 64th of the buffer */
+	int32_t id = 0;
+	CHECK(sim_map_parallel(sim, 1, base, size, PORTHOLE_MAX_LOCK_THREADS, &id) == STATUS_SUCCESS);
+	CHECK(sim_unmap(sim, id, size) == STATUS_SUCCESS);
+	sim_locked(&locked, &after);
+	CHECK(after - before == size / PAGE_SIZE / PORTHOLE_MAX_LOCK_THREADS * PH_LOCK_WORKERS);
+
+	sim_destroy(sim);
+	munmap(base, 2 * size);
+}
+
+/* a streamed send is mapped by it's first chunk and extended by the rest,
+ * the chunks after the first are locked by a lock worker. without
+ * PH_REG_CAPS_EXTEND the buffer is sent whole */
+static void test_stream(void)
+{
+	const uint64_t size = 300ull << 20;
+	PUCHAR base = reserve(size + PAGE_SIZE);
+	CHECK(base);
+	if (!base)
+		return;
+
+	for (int extend = 0; extend < 2; ++extend)
+	{
+		SIM_CONFIG config = { 0 };
+		config.caps = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ | (extend ? PH_REG_CAPS_EXTEND : 0);
+
+		SIM_DEVICE * sim = sim_create(&config);
+		CHECK(sim);
+		if (!sim)
+			continue;
+
+		uint64_t locked, before, after;
+		sim_locked(&locked, &before);
+
+		int32_t id = 0;
+		CHECK(sim_stream(sim, 1, base + 100, size, &id) == STATUS_SUCCESS);
+
+		/* a START or EXTEND a chunk, the first ends on a chunk boundary */
+		const uint64_t chunks = extend ? (size + 100 + PORTHOLE_STREAM_CHUNK - 1) / PORTHOLE_STREAM_CHUNK : 1;
+		PortholeWaitHistogram histogram;
+		sim_histogram(sim, &histogram);
+		CHECK(waits(&histogram, PORTHOLE_CMD_START) == chunks);
+
+		uint64_t bytes = 0;
+		CHECK(sim_segments(sim, id, &bytes) == chunks);
+		CHECK(bytes == size);
+		CHECK(sim_unmap(sim, id, size) == STATUS_SUCCESS);
+
+		sim_locked(&locked, &after);
+		CHECK(after - before == (extend ? (size + 100 - PORTHOLE_STREAM_CHUNK + PAGE_SIZE - 1) / PAGE_SIZE : 0));
+		CHECK(locked == 0);
+		sim_destroy(sim);
+	}
+
+	munmap(base, size + PAGE_SIZE);
+}
+
+/* a chunk that can't be locked fails the send, whether it is the first or
+ * one a worker locks after the mapping was opened, and takes the chunks
+ * before it down with it */
+static void test_stream_fault(void)
+{
+	const uint64_t size = 256ull << 20;
+	PUCHAR base = reserve(size);
+	CHECK(base);
+	if (!base)
+		return;
+
+	const uint64_t faults[] = { 5ull << 20, 200ull << 20 };
+	for (size_t i = 0; i < sizeof(faults) / sizeof(faults[0]); ++i)
+	{
+		SIM_CONFIG config = { 0 };
+		config.caps      = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ | PH_REG_CAPS_EXTEND;
+		config.faultAddr = base + faults[i];
+
+		SIM_DEVICE * sim = sim_create(&config);
+		CHECK(sim);
+		if (!sim)
+			continue;
+
+		int32_t id = 0;
+		CHECK(sim_stream(sim, 1, base, size, &id) == STATUS_INVALID_DEVICE_REQUEST);
+		CHECK(sim_mapped(sim) == 0);
+
+		uint64_t locked, attached;
+		sim_locked(&locked, &attached);
+		CHECK(locked == 0);
+		sim_destroy(sim);
+	}
+
+	munmap(base, size);
+}
+
+/* an EXTEND that hangs leaves the chunks mapped so far on the device, they
+ * are unmapped by the first command once it catches up and only then
+ * unlocked. the chunk being locked meanwhile is dropped */
+static void test_stream_hung(void)
+{
+	const uint64_t size = 256ull << 20;
+	PUCHAR base = reserve(size);
+	CHECK(base);
+	if (!base)
+		return;
+
+	/* START, ADD_TABLE and FINISH, then the second chunk's ADD_TABLE */
+	SIM_CONFIG config = { 0 };
+	config.caps      = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ | PH_REG_CAPS_EXTEND;
+	config.hangEvery = 5;
+
+	SIM_DEVICE * sim = sim_create(&config);
+	CHECK(sim);
+	if (!sim)
+	{
+		munmap(base, size);
+		return;
+	}
+
+	int32_t  id = 0;
+	uint64_t locked, attached;
+	CHECK(sim_stream(sim, 1, base, size, &id) == STATUS_IO_TIMEOUT);
+	CHECK(sim_mapped(sim) == 1);
+	sim_locked(&locked, &attached);
+	CHECK(locked == 2 * PORTHOLE_STREAM_CHUNK / PAGE_SIZE);
+
+	sim_resume(sim);
+	for (int i = 0; i < 1000 && sim_table_bytes(sim) != 2 * PORTHOLE_STREAM_CHUNK; ++i)
+	{
+		const struct timespec ts = { 0, 1000000 };
+		nanosleep(&ts, NULL);
+	}
+	CHECK(sim_table_bytes(sim) == 2 * PORTHOLE_STREAM_CHUNK);
+
+	/* any command will do, this one is for an ID the device never gives */
+	CHECK(sim_unmap(sim, 0, 0) == STATUS_INVALID_ADDRESS);
+	CHECK(sim_mapped(sim) == 0);
+	sim_locked(&locked, &attached);
+	CHECK(locked == 0);
+
+	sim_destroy(sim);
+	munmap(base, size);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct _STREAM_RACE
+{
+	SIM_DEVICE * sim;
+	PUCHAR       base;
+	uint64_t     size;
+	int32_t      status;
+	uint64_t     end;
+}
+STREAM_RACE;
+
+static void * stream_race(void * opaque)
+{
+	STREAM_RACE * race = (STREAM_RACE *)opaque;
+
+	int32_t id = 0;
+	race->status = sim_stream(race->sim, 1, race->base, race->size, &id);
+	__atomic_store_n(&race->end, now_ns(), __ATOMIC_RELEASE);
+
+	if (race->status == STATUS_SUCCESS)
+		race->status = sim_unmap(race->sim, id, race->size);
+	return NULL;
+}
+
+/* the device is only held to post a chunk, so another sender's maps run
+ * between the chunks of a stream rather than after the last of them */
+static void test_stream_interleave(void)
+{
+	const uint64_t size = 8ull * PORTHOLE_STREAM_CHUNK;
+	PUCHAR base = reserve(size + PAGE_SIZE);
+	CHECK(base);
+	if (!base)
+		return;
+
+	/* 16ms to lock each chunk */
+	SIM_CONFIG config = { 0 };
+	config.caps  = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ | PH_REG_CAPS_EXTEND;
+	config.pinNs = 1000;
+
+	SIM_DEVICE * sim = sim_create(&config);
+	CHECK(sim);
+	if (!sim)
+	{
+		munmap(base, size + PAGE_SIZE);
+		return;
+	}
+
+	STREAM_RACE race = { sim, base, size, STATUS_SUCCESS, 0 };
+	pthread_t   thread;
+	CHECK(pthread_create(&thread, NULL, stream_race, &race) == 0);
+
+	/* wait for the first chunk to be mapped */
+	while (!sim_table_bytes(sim) && !__atomic_load_n(&race.end, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	uint64_t first = 0;
+	while (!__atomic_load_n(&race.end, __ATOMIC_ACQUIRE))
+	{
+		int32_t id = 0;
+		CHECK(sim_map(sim, 1, base + size, PAGE_SIZE, &id) == STATUS_SUCCESS);
+		if (!first)
+			first = now_ns();
+		CHECK(sim_unmap(sim, id, PAGE_SIZE) == STATUS_SUCCESS);
+	}
+
+	/* with the device held throughout it would have waited for the last */
+	pthread_join(thread, NULL);
+	CHECK(race.status == STATUS_SUCCESS);
+	CHECK(first && race.end > first + config.pinNs * PORTHOLE_STREAM_CHUNK / PAGE_SIZE);
+
+	sim_destroy(sim);
+	munmap(base, size + PAGE_SIZE);
+}
+
+typedef struct _NOTIFY_WAITER
+{
+	SIM_DEVICE * sim;
+	int32_t      id;
+	int32_t      status;
+	uint32_t     value;
+	uint32_t     count;
+}
+NOTIFY_WAITER;
+
+/* a wait that takes the mapping's waiter slot once it is free, given up
+ * after 5s */
+static void * notify_waiter(void * opaque)
+{
+	NOTIFY_WAITER * waiter = (NOTIFY_WAITER *)opaque;
+	do
+		waiter->status = sim_notify_wait(waiter->sim, waiter->id, 5000000000ull, &waiter->value, &waiter->count);
+	while (waiter->status == STATUS_DEVICE_BUSY);
+	return NULL;
+}
+
+/* until the interrupt path has taken count notifications from the device */
+static int notified(SIM_DEVICE * sim, uint64_t count)
+{
+	uint64_t counters[PORTHOLE_STAT_MAX];
+	for (int i = 0; i < 1000; ++i)
+	{
+		sim_stats(sim, counters);
+		if (counters[PORTHOLE_STAT_NOTIFICATIONS] >= count)
+			return counters[PORTHOLE_STAT_NOTIFICATIONS] == count;
+
+		const struct timespec ts = { 0, 1000000 };
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
+
+/* a notification the device raises wakes a pended waiter through the
+ * interrupt path and Notify.c, those raised with nobody waiting are merged
+ * into the next wait and more than one interrupt drains are all delivered */
+static void test_notify(void)
+{
+	PUCHAR base = reserve(PAGE_SIZE);
+	CHECK(base);
+	if (!base)
+		return;
+
+	SIM_CONFIG config = { 0 };
+	config.caps = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ;
+
+	SIM_DEVICE * sim = sim_create(&config);
+	CHECK(sim);
+	if (sim)
+	{
+		CHECK(sim_notify(sim, 1, 1) == STATUS_NOT_SUPPORTED);
+		sim_destroy(sim);
+	}
+
+	config.caps |= PH_REG_CAPS_NOTIFY;
+	sim = sim_create(&config);
+	CHECK(sim);
+	if (!sim)
+	{
+		munmap(base, PAGE_SIZE);
+		return;
+	}
+
+	int32_t  id = 0;
+	uint32_t value, count;
+	CHECK(sim_map(sim, 1, base, PAGE_SIZE, &id) == STATUS_SUCCESS);
+	CHECK(sim_subscribe(sim, id + 1) == STATUS_INVALID_ADDRESS);
+	CHECK(sim_notify_wait(sim, id, 0, &value, &count) == STATUS_NOT_FOUND);
+	CHECK(sim_subscribe(sim, id) == STATUS_SUCCESS);
+
+	/* nothing raised, the pended wait is cancelled */
+	CHECK(sim_notify_wait(sim, id, 1000000, &value, &count) == STATUS_CANCELLED);
+
+	/* raised while the wait is pended, once a wait that is cancelled as
+	 * soon as it pends finds the slot taken */
+	NOTIFY_WAITER waiter = { sim, id, STATUS_SUCCESS, 0, 0 };
+	pthread_t     thread;
+	CHECK(pthread_create(&thread, NULL, notify_waiter, &waiter) == 0);
+	while (sim_notify_wait(sim, id, 1, &value, &count) != STATUS_DEVICE_BUSY)
+		sched_yield();
+	CHECK(sim_notify(sim, id, 0x5) == STATUS_SUCCESS);
+	pthread_join(thread, NULL);
+	CHECK(waiter.status == STATUS_SUCCESS);
+	CHECK(waiter.value == 0x5 && waiter.count == 1);
+
+	/* raised with nobody waiting, only those for the subscribed mapping */
+	CHECK(sim_notify(sim, id, 0x1) == STATUS_SUCCESS);
+	CHECK(sim_notify(sim, id + 1, 0x8) == STATUS_SUCCESS);
+	CHECK(sim_notify(sim, id, 0x2) == STATUS_SUCCESS);
+	CHECK(notified(sim, 4));
+	CHECK(sim_notify_wait(sim, id, 1000000, &value, &count) == STATUS_SUCCESS);
+	CHECK(value == 0x3 && count == 2);
+
+	/* more than an interrupt drains */
+	for (uint32_t i = 0; i < PH_NOTIFY_DRAIN_MAX + 10; ++i)
+		CHECK(sim_notify(sim, id, 1u << (i % 8)) == STATUS_SUCCESS);
+	CHECK(notified(sim, 4 + PH_NOTIFY_DRAIN_MAX + 10));
+	CHECK(sim_notify_wait(sim, id, 1000000, &value, &count) == STATUS_SUCCESS);
+	CHECK(value == 0xFF && count == PH_NOTIFY_DRAIN_MAX + 10);
+
+	/* unmapping ends the subscription and cancels the pended wait */
+	CHECK(pthread_create(&thread, NULL, notify_waiter, &waiter) == 0);
+	while (sim_notify_wait(sim, id, 1, &value, &count) != STATUS_DEVICE_BUSY)
+		sched_yield();
+	CHECK(sim_unmap(sim, id, PAGE_SIZE) == STATUS_SUCCESS);
+	pthread_join(thread, NULL);
+	CHECK(waiter.status == STATUS_CANCELLED);
+	CHECK(sim_notify_wait(sim, id, 0, &value, &count) == STATUS_NOT_FOUND);
+
+	sim_destroy(sim);
+	munmap(base, PAGE_SIZE);
+}
+
+/* allocate a mapping's entry as reserve_slot does, sized so it can be claimed */
+static PMDLInfo handle_add(PHANDLE_TABLE table, PortholeMapID * handle)
+{
+	PMDLInfo info = NULL;
+	if (!NT_SUCCESS(handle_alloc(table, &info, handle)))
+		return NULL;
+
+	info->size = PAGE_SIZE;
+	return info;
+}
+
+/* a freed entry's handle is never accepted again, however it is looked up,
+ * and the entry goes to the next allocation with a new generation */
+static void test_handle_stale(void)
+{
+	HANDLE_TABLE table;
+	handle_table_init(&table);
+
+	PortholeMapID handle, reused;
+	PMDLInfo info = handle_add(&table, &handle);
+	CHECK(info);
+	if (!info)
+		return;
+	CHECK(handle > 0);
+
+	/* idle entries can be claimed once at a time */
+	handle_release(&table, info, FALSE);
+	CHECK(handle_claim(&table, handle) == info);
+	CHECK(handle_claim(&table, handle) == NULL);
+	handle_release(&table, info, TRUE);
+
+	int id;
+	CHECK(handle_claim(&table, handle) == NULL);
+	CHECK(!handle_get_id(&table, handle, &id));
+	CHECK(handle_claim_at(&table, HANDLE_INDEX(handle)) == NULL);
+
+	CHECK(handle_add(&table, &reused) == info);
+	handle_release(&table, info, FALSE);
+	CHECK(HANDLE_INDEX(reused) == HANDLE_INDEX(handle));
+	CHECK(reused != handle);
+	CHECK(handle_claim(&table, handle) == NULL);
+	CHECK(handle_claim(&table, reused) == info);
+
+	/* nor are handles out of range or negative */
+	CHECK(handle_claim(&table, HANDLE_MAKE(HANDLE_TABLE_SIZE(&table), 1)) == NULL);
+	CHECK(handle_claim(&table, -1) == NULL);
+
+	handle_table_free(&table);
+}
+
+/* generations count 1 to HANDLE_GEN_MASK and wrap back to 1, never 0, so
+ * a handle is always positive and only repeats after that many frees */
+static void test_handle_generation_wrap(void)
+{
+	HANDLE_TABLE table;
+	handle_table_init(&table);
+
+	PortholeMapID first;
+	PMDLInfo info = handle_add(&table, &first);
+	CHECK(info);
+	if (!info)
+		return;
+	CHECK(HANDLE_GEN(first) == 1);
+
+	ULONG generation = HANDLE_GEN(first);
+	for (ULONG i = 1; i <= HANDLE_GEN_MASK; ++i)
+	{
+		handle_release(&table, info, TRUE);
+
+		PortholeMapID handle;
+		CHECK(handle_add(&table, &handle) == info);
+		CHECK(handle > 0);
+		CHECK(HANDLE_GEN(handle) == (generation % HANDLE_GEN_MASK) + 1);
+		CHECK(HANDLE_GEN(handle) != 0);
+		CHECK((handle == first) == (i == HANDLE_GEN_MASK));
+		generation = HANDLE_GEN(handle);
+	}
+
+	handle_table_free(&table);
+}
+
+/* the chunk directory starts at 4 and doubles, entries never move */
+static void test_handle_growth(void)
+{
+	HANDLE_TABLE table;
+	handle_table_init(&table);
+
+	const ULONG count = 8 * HANDLE_CHUNK_SIZE + 1;
+	PMDLInfo * infos = calloc(count, sizeof(PMDLInfo));
+	CHECK(infos);
+	if (!infos)
+		return;
+
+	for (ULONG i = 0; i < count; ++i)
+	{
+		PortholeMapID handle;
+		CHECK((infos[i] = handle_add(&table, &handle)) != NULL);
+		CHECK(HANDLE_INDEX(handle) == i);
+		handle_release(&table, infos[i], FALSE);
+
+		const ULONG chunks = i / HANDLE_CHUNK_SIZE + 1;
+		CHECK(table.chunkCount == chunks);
+		CHECK(table.chunkSlots == (chunks <= 4 ? 4 : chunks <= 8 ? 8 : 16));
+	}
+	CHECK(table.live == count);
+
+	/* the first chunk's entries are where they were before it grew */
+	for (ULONG i = 0; i < count; i += HANDLE_CHUNK_SIZE / 2)
+		CHECK(handle_claim_at(&table, i) == infos[i]);
+
+	free(infos);
+	handle_table_free(&table);
+}
+
+/* freed entries are reused most recent first before the table grows */
+static void test_handle_reuse(void)
+{
+	HANDLE_TABLE table;
+	handle_table_init(&table);
+
+	PMDLInfo      infos  [HANDLE_CHUNK_SIZE];
+	PortholeMapID handles[HANDLE_CHUNK_SIZE];
+	for (ULONG i = 0; i < HANDLE_CHUNK_SIZE; ++i)
+		CHECK((infos[i] = handle_add(&table, &handles[i])) != NULL);
+	CHECK(table.live == HANDLE_CHUNK_SIZE);
+	CHECK(table.freeHead == 0);
+
+	handle_release(&table, infos[10], TRUE);
+	handle_release(&table, infos[20], TRUE);
+	handle_release(&table, infos[30], TRUE);
+	CHECK(table.live == HANDLE_CHUNK_SIZE - 3);
+
+	PortholeMapID handle;
+	CHECK(handle_add(&table, &handle) == infos[30]);
+	CHECK(handle_add(&table, &handle) == infos[20]);
+	CHECK(handle_add(&table, &handle) == infos[10]);
+	CHECK(table.chunkCount == 1);
+
+	/* with the free list empty again the next takes a new chunk */
+	CHECK(handle_add(&table, &handle) != NULL);
+	CHECK(HANDLE_INDEX(handle) == HANDLE_CHUNK_SIZE);
+	CHECK(table.chunkCount == 2);
+	CHECK(table.live == HANDLE_CHUNK_SIZE + 1);
+
+	handle_table_free(&table);
+}
+
+typedef struct _SIM_TEST
+{
+	const char * name;
+	void (*run)(void);
+}
+SIM_TEST;
+
+static const SIM_TEST tests[] =
+{
+	{ "segtable_submit"       , test_segtable_submit        },
+	{ "device_timeout"        , test_device_timeout         },
+	{ "hung_command"          , test_hung_command           },
+	{ "extend_4gb"            , test_extend_4gb             },
+	{ "coalesce_run_length"   , test_coalesce_run_length    },
+	{ "coalesce_pfns"         , test_coalesce_pfns          },
+	{ "coalesce_4gb"          , test_coalesce_4gb           },
+	{ "segtable_4gb"          , test_segtable_4gb           },
+	{ "send_4gb"              , test_send_4gb               },
+	{ "lock_parallel"         , test_lock_parallel          },
+	{ "lock_parallel_fault"   , test_lock_parallel_fault    },
+	{ "lock_attach"           , test_lock_attach            },
+	{ "lock_workers_busy"     , test_lock_workers_busy      },
+	{ "stream"                , test_stream                 },
+	{ "stream_fault"          , test_stream_fault           },
+	{ "stream_hung"           , test_stream_hung            },
+	{ "stream_interleave"     , test_stream_interleave      },
+	{ "notify"                , test_notify                 },
+	{ "handle_stale"          , test_handle_stale           },
+	{ "handle_generation_wrap", test_handle_generation_wrap },
+	{ "handle_growth"         , test_handle_growth          },
+	{ "handle_reuse"          , test_handle_reuse           },
+};
+
+int main(int argc, char * argv[])
+{
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+	{
+		int selected = argc < 2;
+		for (int a = 1; a < argc; ++a)
+			selected |= strcmp(argv[a], tests[i].name) == 0;
+		if (!selected)
+			continue;
+
+		const int before = failed;
+		tests[i].run();
+		printf("%-24s %s\n", tests[i].name, failed == before ? "ok" : "FAILED");
+	}
+
+	return failed;
+}
@@ -0,0 +1,181 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Streamed sends against sending the buffer whole. Each run maps and unmaps
+ * a large buffer with sim_map, which locks it all before taking the device,
+ * and with sim_stream, which posts it a chunk at a time while a lock worker
+ * faults in the next. A second thread maps and unmaps a page throughout to
+ * show how long other senders are held up. The buffer is broken into runs
+ * of 16 pages so the device's time reading the segments counts. Build the
+ * library as described in Sim.h, then:
+ *
+ *   cc -O2 -Wno-multichar -Wno-unknown-pragmas -IPorthole-Sim \
+ *       Porthole-Sim/StreamBench.c libporthole-sim.a -lstdc++ -lpthread -o streambench
+ *
+ * `streambench [size_mb]` prints one line of csv per send:
+ *   mode,pin_ns,segment_ns,latency_us,size_mb,send_ms,pages,page_p50_us,page_max_us
+ * pages is the single page maps the other thread completed during the send
+ * and the percentiles are their map and unmap time.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "driver.h"
+#include "Sim.h"
+
+#define STREAM_BENCH_SIZE_MB 1024
+#define STREAM_BENCH_SAMPLES (1024 * 1024)
+#define STREAM_BENCH_CONTIG  16
+
+static const uint64_t pins[]      = { 0, 250, 1000 };
+static const uint64_t segments[]  = { 0, 1000, 4000 };
+static const uint64_t latencies[] = { 0, 20000 };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct _PAGE_SENDER
+{
+	SIM_DEVICE * sim;
+	void       * page;
+	volatile int stop;
+	uint64_t   * samples;
+	uint32_t     count;
+	int          failed;
+}
+PAGE_SENDER;
+
+static void * send_pages(void * opaque)
+{
+	PAGE_SENDER * sender = (PAGE_SENDER *)opaque;
+	while (!__atomic_load_n(&sender->stop, __ATOMIC_ACQUIRE))
+	{
+		const uint64_t start = now_ns();
+		int32_t id;
+		if (sim_map(sender->sim, 1, sender->page, PAGE_SIZE, &id) != STATUS_SUCCESS ||
+			sim_unmap(sender->sim, id, PAGE_SIZE) != STATUS_SUCCESS)
+		{
+			sender->failed = 1;
+			break;
+		}
+
+		if (sender->count < STREAM_BENCH_SAMPLES)
+			sender->samples[sender->count++] = now_ns() - start;
+	}
+	return NULL;
+}
+
+static int compare(const void * a, const void * b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int run(int stream, uint64_t pinNs, uint64_t segmentNs, uint64_t latencyNs, void * buffer, uint64_t size, uint64_t * samples)
+{
+	SIM_CONFIG config = { 0 };
+	config.caps        = PH_REG_CAPS_SEGTABLE | PH_REG_CAPS_CMD_IRQ | PH_REG_CAPS_EXTEND;
+	config.pinNs       = pinNs;
+	config.segmentNs   = segmentNs;
+	config.contigPages = STREAM_BENCH_CONTIG;
+	for (int i = 0; i < SIM_CMD_MAX; ++i)
+		config.latencyNs[i] = latencyNs;
+
+	SIM_DEVICE * sim = sim_create(&config);
+	if (!sim)
+		return -1;
+
+	PAGE_SENDER sender = { sim, (PUCHAR)buffer + size, 0, samples, 0, 0 };
+	pthread_t   thread;
+	if (pthread_create(&thread, NULL, send_pages, &sender) != 0)
+	{
+		sim_destroy(sim);
+		return -1;
+	}
+
+	const uint64_t start = now_ns();
+	int32_t id;
+	int32_t status = stream ?
+		sim_stream(sim, 1, buffer, size, &id) :
+		sim_map   (sim, 1, buffer, size, &id);
+	const uint64_t elapsed = now_ns() - start;
+
+	__atomic_store_n(&sender.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	if (status == STATUS_SUCCESS)
+		status = sim_unmap(sim, id, size);
+	sim_destroy(sim);
+
+	if (status != STATUS_SUCCESS || sender.failed)
+	{
+		fprintf(stderr, "send failed\n");
+		return -1;
+	}
+
+	qsort(samples, sender.count, sizeof(uint64_t), compare);
+	printf("%s,%llu,%llu,%llu,%llu,%.1f,%lu,%.1f,%.1f\n",
+		stream ? "stream" : "whole",
+		(unsigned long long)pinNs,
+		(unsigned long long)segmentNs,
+		(unsigned long long)(latencyNs / 1000),
+		(unsigned long long)(size >> 20),
+		(double)elapsed / 1000000,
+		(unsigned long)sender.count,
+		sender.count ? (double)samples[sender.count / 2] / 1000 : 0,
+		sender.count ? (double)samples[sender.count - 1] / 1000 : 0);
+	return 0;
+}
+
+int main(int argc, char * argv[])
+{
+	const uint64_t size = (uint64_t)(argc > 1 ? atoi(argv[1]) : STREAM_BENCH_SIZE_MB) << 20;
+
+	/* the simulator never touches the pages, reserved address space will do */
+	void     * buffer  = mmap(NULL, size + PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	uint64_t * samples = malloc(STREAM_BENCH_SAMPLES * sizeof(uint64_t));
+	if (buffer == MAP_FAILED || !samples || !size)
+	{
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	printf("mode,pin_ns,segment_ns,latency_us,size_mb,send_ms,pages,page_p50_us,page_max_us\n");
+	for (size_t p = 0; p < sizeof(pins) / sizeof(pins[0]); ++p)
+		for (size_t s = 0; s < sizeof(segments) / sizeof(segments[0]); ++s)
+			for (size_t l = 0; l < sizeof(latencies) / sizeof(latencies[0]); ++l)
+				for (int stream = 0; stream < 2; ++stream)
+					if (run(stream, pins[p], segments[s], latencies[l], buffer, size, samples) != 0)
+						return -1;
+
+	free(samples);
+	munmap(buffer, size + PAGE_SIZE);
+	return 0;
+}
@@ -0,0 +1,155 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Command completion latency with and without PH_REG_CAPS_CMD_IRQ. Each run
+ * maps and unmaps a small buffer against a model that takes a fixed time
+ * per command, first with the driver polling `cr` and backing off, then
+ * woken by the completion interrupt, and reports wait_device's histogram
+ * for each command. Build the library as described in Sim.h, then:
+ *
+ *   cc -O2 -Wno-multichar -Wno-unknown-pragmas -IPorthole-Sim \
+ *       Porthole-Sim/WaitBench.c libporthole-sim.a -lstdc++ -lpthread -o waitbench
+ *
+ * `waitbench [ops]` prints one line of csv per command:
+ *   irq,latency_us,command,waits,mean_us,p50_us,p99_us,polls,histogram
+ * the percentiles are the upper bound of their bucket, polls is the reads
+ * of `cr` per wait over the whole run and histogram the bucket counts from
+ * <1us up, see PORTHOLE_WAIT_BUCKETS.
+ */
+
+#include <stdio.h>
+
+#include "driver.h"
+#include "Sim.h"
+
+#define WAIT_BENCH_OPS   1000
+#define WAIT_BENCH_PAGES 16
+
+static const uint64_t latencies[] = { 0, 2000, 20000, 200000, 2000000 };
+
+static const char * command_name(int cmd)
+{
+	switch (cmd)
+	{
+		case PORTHOLE_CMD_START      : return "start";
+		case PORTHOLE_CMD_ADD_SEGMENT: return "add_segment";
+		case PORTHOLE_CMD_ADD_TABLE  : return "add_table";
+		case PORTHOLE_CMD_FINISH     : return "finish";
+		case PORTHOLE_CMD_UNMAP      : return "unmap";
+	}
+	return "?";
+}
+
+/* the upper bound of the bucket the pct'th wait falls in */
+static uint64_t percentile(const UINT64 * buckets, uint64_t count, double pct)
+{
+	const uint64_t target = (uint64_t)(count * pct);
+	uint64_t seen = 0;
+	for (int i = 0; i < PORTHOLE_WAIT_BUCKETS; ++i)
+	{
+		seen += buckets[i];
+		if (seen > target)
+			return 1ull << i;
+	}
+	return 1ull << (PORTHOLE_WAIT_BUCKETS - 1);
+}
+
+static int run(int irq, uint64_t latencyNs, int ops)
+{
+	SIM_CONFIG config = { 0 };
+	config.caps = PH_REG_CAPS_SEGTABLE | (irq ? PH_REG_CAPS_CMD_IRQ : 0);
+	for (int i = 0; i < SIM_CMD_MAX; ++i)
+		config.latencyNs[i] = latencyNs;
+
+	SIM_DEVICE * sim = sim_create(&config);
+	if (!sim)
+		return -1;
+
+	static char buffer[WAIT_BENCH_PAGES * PAGE_SIZE];
+	for (int i = 0; i < ops; ++i)
+	{
+		int32_t id;
+		if (sim_map(sim, 1, buffer, sizeof(buffer), &id) != STATUS_SUCCESS ||
+			sim_unmap(sim, id, sizeof(buffer)) != STATUS_SUCCESS)
+		{
+			fprintf(stderr, "map/unmap failed\n");
+			sim_destroy(sim);
+			return -1;
+		}
+	}
+
+	PortholeWaitHistogram histogram;
+	uint64_t counters[PORTHOLE_STAT_MAX];
+	sim_histogram(sim, &histogram);
+	sim_stats(sim, counters);
+	sim_destroy(sim);
+
+	const double polls = counters[PORTHOLE_STAT_COMMANDS] ?
+		(double)counters[PORTHOLE_STAT_REG_POLLS] / counters[PORTHOLE_STAT_COMMANDS] : 0;
+
+	for (int cmd = 0; cmd < PORTHOLE_CMD_MAX; ++cmd)
+	{
+		uint64_t count = 0;
+		int      last  = 0;
+		for (int i = 0; i < PORTHOLE_WAIT_BUCKETS; ++i)
+			if (histogram.buckets[cmd][i])
+			{
+				count += histogram.buckets[cmd][i];
+				last   = i;
+			}
+		if (!count)
+			continue;
+
+		printf("%s,%llu,%s,%llu,%.1f,%llu,%llu,%.1f,",
+			irq ? "on" : "off",
+			(unsigned long long)(latencyNs / 1000),
+			command_name(cmd),
+			(unsigned long long)count,
+			(double)counters[PORTHOLE_STAT_WAIT_US + cmd] / count,
+			(unsigned long long)percentile(histogram.buckets[cmd], count, 0.50),
+			(unsigned long long)percentile(histogram.buckets[cmd], count, 0.99),
+			polls);
+
+		for (int i = 0; i <= last; ++i)
+			printf(i ? " %llu" : "%llu", (unsigned long long)histogram.buckets[cmd][i]);
+		printf("\n");
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[])
+{
+	const int ops = argc > 1 ? atoi(argv[1]) : WAIT_BENCH_OPS;
+
+	printf("irq,latency_us,command,waits,mean_us,p50_us,p99_us,polls,histogram\n");
+	for (size_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); ++i)
+		for (int irq = 0; irq < 2; ++irq)
+		{
+			/* the slow device only needs enough samples for the shape */
+			const int count = latencies[i] >= 200000 ? (ops + 9) / 10 : ops;
+			if (run(irq, latencies[i], count) != 0)
+				return -1;
+		}
+
+	return 0;
+}
@@ -0,0 +1 @@
+#include "../Porthole/Coalesce.h"
@@ -0,0 +1,428 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Just enough of the kernel for the command layer (Command.c, Segment.c,
+ * Stats.c and Coalesce.c), the handle table (Handle.c), page locking
+ * (Lock.c), streamed sends (Stream.c) and client notifications (Notify.c)
+ * to build unmodified as a Linux user mode library against the register
+ * model. Those files include "driver.h" by it's lower
+ * case name so on a case sensitive file system this header is found ahead
+ * of the driver's own through the include path.
+ *
+ * DEVICE_CONTEXT comes from the driver's Device.h, the kernel and WDF types
+ * it holds that the shared units never touch are declared opaque here.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../Porthole/Registers.h"
+
+#ifdef __cplusplus
+#define EXTERN_C_START extern "C" {
+#define EXTERN_C_END   }
+#else
+#define EXTERN_C_START
+#define EXTERN_C_END
+#endif
+
+EXTERN_C_START
+
+typedef void      VOID;
+typedef void *    PVOID;
+typedef void *    HANDLE;
+typedef uint8_t   UCHAR, *PUCHAR;
+typedef int16_t   CSHORT;
+typedef char      CCHAR;
+typedef int32_t   LONG;
+typedef int64_t   LONG64;
+typedef uint32_t  UINT32;
+typedef ULONG *   PULONG;
+typedef uint64_t  ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef size_t    SIZE_T;
+typedef uint8_t   BOOLEAN;
+typedef int32_t   NTSTATUS;
+typedef uintptr_t PFN_NUMBER, *PPFN_NUMBER;
+typedef PHYSICAL_ADDRESS LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define TRUE  1
+#define FALSE 0
+
+/* Public.h needs these when built outside of the DDK */
+#define DEFINE_GUID(name, ...)
+#define FILE_DEVICE_UNKNOWN 0x00000022
+#define METHOD_BUFFERED     0
+#define FILE_ANY_ACCESS     0
+#define CTL_CODE(type, func, method, access) \
+	(((type) << 16) | ((access) << 14) | ((func) << 2) | (method))
+
+#define STATUS_SUCCESS                        ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                        ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                        ((NTSTATUS)0x00000103L)
+#define STATUS_DEVICE_BUSY                    ((NTSTATUS)0x80000011L)
+#define STATUS_ACCESS_VIOLATION               ((NTSTATUS)0xC0000005L)
+#define STATUS_INVALID_PARAMETER              ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST         ((NTSTATUS)0xC0000010L)
+#define STATUS_INSUFFICIENT_RESOURCES         ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_NOT_CONNECTED           ((NTSTATUS)0xC000009DL)
+#define STATUS_IO_TIMEOUT                     ((NTSTATUS)0xC00000B5L)
+#define STATUS_NOT_SUPPORTED                  ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED                      ((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_ADDRESS                ((NTSTATUS)0xC0000141L)
+#define STATUS_NOT_FOUND                      ((NTSTATUS)0xC0000225L)
+#define STATUS_DEVICE_INSUFFICIENT_RESOURCES  ((NTSTATUS)0xC0000468L)
+#define NT_SUCCESS(status)                    (((NTSTATUS)(status)) >= 0)
+
+#define PAGE_SHIFT 12
+
+#define C_ASSERT(e)        _Static_assert(e, #e)
+#define FORCEINLINE        static inline __attribute__((always_inline))
+#define __forceinline      inline __attribute__((always_inline))
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#define ANYSIZE_ARRAY      1
+#define CONTAINING_RECORD(addr, type, field) ((type *)((PUCHAR)(addr) - offsetof(type, field)))
+#define _In_
+#define _Inout_
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+#define MAXUINT32 ((UINT32)~0U)
+#define MAXULONG_PTR UINTPTR_MAX
+
+#define RtlZeroMemory(dst, len)  memset((dst), 0, (len))
+#define RtlCopyMemory(dst, src, len) memcpy((dst), (src), (len))
+#if defined(__x86_64__) || defined(__i386__)
+#define YieldProcessor()         __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define YieldProcessor()         __asm__ __volatile__("yield")
+#else
+#define YieldProcessor()         ((void)0)
+#endif
+#define _ReadWriteBarrier()      __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+#define InterlockedIncrement64(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(p, v)    __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedOr64(p, v)     __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange64(p, v, cmp) __sync_val_compare_and_swap((p), (cmp), (v))
+#define ReadNoFence64(p)          __atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* pool memory, page sized or larger allocations are page aligned */
+typedef enum _POOL_TYPE
+{
+	NonPagedPool,
+	NonPagedPoolCacheAligned
+}
+POOL_TYPE;
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE type, SIZE_T size, ULONG tag);
+void  ExFreePoolWithTag    (PVOID addr, ULONG tag);
+
+/* there is no quota to charge */
+#define ExAllocatePoolWithQuotaTag(type, size, tag) ExAllocatePoolWithTag((type), (size), (tag))
+
+/* the model reads guest memory through it's virtual address */
+PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID addr);
+
+/* a single buffer's page list, filled in by MmProbeAndLockPages */
+typedef struct _MDL
+{
+	struct _MDL * Next;
+	CSHORT        MdlFlags;
+	PVOID         StartVa;
+	ULONG         ByteOffset;
+	ULONG         ByteCount;
+	PPFN_NUMBER   Pfns;
+}
+MDL, *PMDL;
+
+#define MDL_PAGES_LOCKED 0x0002
+
+#define MmGetMdlVirtualAddress(mdl) ((PVOID)((PUCHAR)(mdl)->StartVa + (mdl)->ByteOffset))
+#define MmGetMdlByteCount(mdl)      ((mdl)->ByteCount)
+#define MmGetMdlByteOffset(mdl)     ((mdl)->ByteOffset)
+#define MmGetMdlPfnArray(mdl)       ((mdl)->Pfns)
+#define ADDRESS_AND_SIZE_TO_SPAN_PAGES(va, size) \
+	((ULONG)((((ULONG_PTR)(va) & (PAGE_SIZE - 1)) + (size) + PAGE_SIZE - 1) >> PAGE_SHIFT))
+#define BYTE_OFFSET(va) ((ULONG)((ULONG_PTR)(va) & (PAGE_SIZE - 1)))
+#define PAGE_ALIGN(va)  ((PVOID)((ULONG_PTR)(va) & ~(ULONG_PTR)(PAGE_SIZE - 1)))
+#define ROUND_TO_PAGES(size) (((ULONG_PTR)(size) + PAGE_SIZE - 1) & ~(ULONG_PTR)(PAGE_SIZE - 1))
+
+typedef struct _FAST_MUTEX
+{
+	pthread_mutex_t lock;
+}
+FAST_MUTEX, *PFAST_MUTEX;
+
+void ExInitializeFastMutex(PFAST_MUTEX mutex);
+void ExAcquireFastMutex   (PFAST_MUTEX mutex);
+void ExReleaseFastMutex   (PFAST_MUTEX mutex);
+
+/* notification events only */
+typedef struct _KEVENT
+{
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	int             signaled;
+}
+KEVENT, *PKEVENT;
+
+typedef enum { NotificationEvent } EVENT_TYPE;
+typedef enum { Executive } KWAIT_REASON;
+typedef enum { KernelMode, UserMode } KPROCESSOR_MODE;
+typedef LONG KPRIORITY;
+
+#define IO_NO_INCREMENT 0
+
+void     KeInitializeEvent(PKEVENT event, EVENT_TYPE type, BOOLEAN state);
+void     KeSetEvent       (PKEVENT event, KPRIORITY increment, BOOLEAN wait);
+void     KeClearEvent     (PKEVENT event);
+
+/* timeouts are relative only, negative in 100ns units */
+NTSTATUS KeWaitForSingleObject (PKEVENT event, KWAIT_REASON reason, KPROCESSOR_MODE mode, BOOLEAN alertable, PLARGE_INTEGER timeout);
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE mode, BOOLEAN alertable, PLARGE_INTEGER interval);
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER frequency);
+
+#define ALL_PROCESSOR_GROUPS 0xFFFF
+ULONG KeGetCurrentProcessorIndex(void);
+ULONG KeQueryMaximumProcessorCountEx(unsigned short group);
+
+CCHAR RtlFindMostSignificantBit(ULONGLONG set);
+
+/* spins, there are no IRQLs to raise to */
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+typedef UCHAR     KIRQL, *PKIRQL;
+
+void KeInitializeSpinLock(PKSPIN_LOCK lock);
+void KeAcquireSpinLock   (PKSPIN_LOCK lock, PKIRQL oldIrql);
+void KeReleaseSpinLock   (PKSPIN_LOCK lock, KIRQL oldIrql);
+void KeAcquireSpinLockAtDpcLevel   (PKSPIN_LOCK lock);
+void KeReleaseSpinLockFromDpcLevel (PKSPIN_LOCK lock);
+
+/* nothing here is referenced by handle, the events given to Notify.c
+ * belong to whoever registered them */
+void ObDereferenceObject(PVOID object);
+
+/* a single process that every thread is in, except for the threads that
+ * run work items which have to attach to it to reach it's memory */
+typedef struct _KPROCESS * PEPROCESS;
+
+typedef struct _KAPC_STATE
+{
+	PEPROCESS process;
+}
+KAPC_STATE, *PKAPC_STATE;
+
+PEPROCESS PsGetCurrentProcess   (void);
+void      KeStackAttachProcess  (PEPROCESS process, PKAPC_STATE state);
+void      KeUnstackDetachProcess(PKAPC_STATE state);
+
+/* exception handling for ExRaiseStatus only, the filter is ignored and a
+ * try block must not be left by return, break or goto */
+void ExRaiseStatus(NTSTATUS status) __attribute__((noreturn));
+
+#ifndef __cplusplus
+#include <setjmp.h>
+
+#define EXCEPTION_EXECUTE_HANDLER 1
+
+jmp_buf * sim_try_enter(void);
+jmp_buf * sim_try_leave(jmp_buf * frame);
+
+#define try \
+	for (jmp_buf * _try = sim_try_enter(); _try; _try = sim_try_leave(_try)) \
+		if (!setjmp(*_try))
+#define except(filter) \
+		else if (!(_try = sim_try_leave(_try)))
+#endif
+
+typedef struct _IRP * PIRP;
+typedef enum { IoReadAccess, IoWriteAccess, IoModifyAccess } LOCK_OPERATION;
+
+PMDL IoAllocateMdl(PVOID addr, ULONG length, BOOLEAN secondary, BOOLEAN chargeQuota, PIRP irp);
+void IoFreeMdl    (PMDL mdl);
+
+/* the PFNs are made up from the virtual address, see kernel_configure. a
+ * UserMode probe from a thread in no process raises STATUS_ACCESS_VIOLATION */
+void MmProbeAndLockPages(PMDL mdl, KPROCESSOR_MODE mode, LOCK_OPERATION operation);
+void MmUnlockPages      (PMDL mdl);
+
+/* page n of the address space is given PFN n + n / contigPages so runs are
+ * broken at multiples of contigPages, 0 for never, and locking a page takes
+ * pinNs. a probe of the page holding faultAddr fails as an unmapped one
+ * would. these are process wide, sim_create sets them from it's SIM_CONFIG */
+void kernel_configure(ULONG contigPages, uint64_t pinNs, PVOID faultAddr);
+
+/* the pages locked now, and the pages ever locked from work items */
+void kernel_locked(uint64_t * locked, uint64_t * attached);
+
+/* work items run on a thread each, in no process. the device context isn't a
+ * WDF object here so work items have no parent and are deleted by hand */
+typedef PVOID                    WDFOBJECT;
+typedef struct WDFWORKITEM__   * WDFWORKITEM;
+typedef VOID (*PFN_WDF_WORKITEM)(WDFWORKITEM WorkItem);
+
+typedef struct _WDF_WORKITEM_CONFIG
+{
+	PFN_WDF_WORKITEM EvtWorkItemFunc;
+	BOOLEAN          AutomaticSerialization;
+}
+WDF_WORKITEM_CONFIG, *PWDF_WORKITEM_CONFIG;
+
+typedef struct _WDF_OBJECT_ATTRIBUTES
+{
+	WDFOBJECT ParentObject;
+	SIZE_T    ContextSize;
+}
+WDF_OBJECT_ATTRIBUTES, *PWDF_OBJECT_ATTRIBUTES;
+
+#define WDF_WORKITEM_CONFIG_INIT(config, fn) \
+	((config)->EvtWorkItemFunc = (fn), (config)->AutomaticSerialization = TRUE)
+#define WDF_OBJECT_ATTRIBUTES_INIT(attributes) \
+	RtlZeroMemory((attributes), sizeof(WDF_OBJECT_ATTRIBUTES))
+#define WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(attributes, type) \
+	(WDF_OBJECT_ATTRIBUTES_INIT(attributes), (attributes)->ContextSize = sizeof(type))
+#define WdfObjectContextGetObject(context) ((WDFOBJECT)NULL)
+
+NTSTATUS WdfWorkItemCreate (PWDF_WORKITEM_CONFIG config, PWDF_OBJECT_ATTRIBUTES attributes, WDFWORKITEM * workItem);
+void     WdfWorkItemEnqueue(WDFWORKITEM workItem);
+void     WdfWorkItemFlush  (WDFWORKITEM workItem);
+void     WdfObjectDelete   (WDFOBJECT object);
+PVOID    WdfObjectGetTypedContextWorker(WDFOBJECT object);
+
+#define WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(type, name) \
+	static inline type * name(WDFOBJECT object) { return (type *)WdfObjectGetTypedContextWorker(object); }
+
+/* requests and file objects carry a REQUEST_CONTEXT and FILE_OBJECT_CONTEXT
+ * and are made by the kernel_* calls below in place of the I/O manager */
+typedef struct WDFDEVICE__     * WDFDEVICE;
+typedef struct WDFQUEUE__      * WDFQUEUE;
+typedef struct WDFREQUEST__    * WDFREQUEST;
+typedef struct WDFFILEOBJECT__ * WDFFILEOBJECT;
+
+typedef VOID EVT_WDF_REQUEST_CANCEL(WDFREQUEST Request);
+typedef EVT_WDF_REQUEST_CANCEL * PFN_WDF_REQUEST_CANCEL;
+
+NTSTATUS      WdfRequestMarkCancelableEx(WDFREQUEST request, PFN_WDF_REQUEST_CANCEL cancel);
+NTSTATUS      WdfRequestUnmarkCancelable(WDFREQUEST request);
+void          WdfRequestComplete        (WDFREQUEST request, NTSTATUS status);
+void          WdfRequestCompleteWithInformation(WDFREQUEST request, NTSTATUS status, ULONG_PTR information);
+WDFFILEOBJECT WdfRequestGetFileObject   (WDFREQUEST request);
+
+/* Queue.h declares the driver's queue callbacks, none of them are built */
+typedef VOID EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL(WDFQUEUE Queue, WDFREQUEST Request, SIZE_T OutputBufferLength, SIZE_T InputBufferLength, ULONG IoControlCode);
+typedef VOID EVT_WDF_IO_QUEUE_IO_STOP(WDFQUEUE Queue, WDFREQUEST Request, ULONG ActionFlags);
+typedef VOID EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE(WDFQUEUE Queue, WDFREQUEST Request);
+typedef VOID EVT_WDF_WORKITEM(WDFWORKITEM WorkItem);
+
+WDFFILEOBJECT kernel_file_create(void);
+void          kernel_file_free  (WDFFILEOBJECT file);
+
+/* a request as it is handed to an IOCTL, completed once. wait returns it's
+ * status, or STATUS_TIMEOUT if it is still pending, and cancel runs the
+ * request's cancel routine if it is cancelable, as closing the handle or
+ * CancelIoEx would. a request must be complete before it is freed */
+WDFREQUEST    kernel_request_create(WDFFILEOBJECT file);
+NTSTATUS      kernel_request_wait  (WDFREQUEST request, PLARGE_INTEGER timeout);
+void          kernel_request_cancel(WDFREQUEST request);
+void          kernel_request_free  (WDFREQUEST request);
+
+typedef struct _LIST_ENTRY
+{
+	struct _LIST_ENTRY * Flink;
+	struct _LIST_ENTRY * Blink;
+}
+LIST_ENTRY, *PLIST_ENTRY;
+
+FORCEINLINE void InitializeListHead(PLIST_ENTRY head)
+{
+	head->Flink = head->Blink = head;
+}
+
+FORCEINLINE BOOLEAN IsListEmpty(const LIST_ENTRY * head)
+{
+	return head->Flink == head;
+}
+
+FORCEINLINE BOOLEAN RemoveEntryList(PLIST_ENTRY entry)
+{
+	PLIST_ENTRY next = entry->Flink;
+	PLIST_ENTRY prev = entry->Blink;
+	prev->Flink = next;
+	next->Blink = prev;
+	return next == prev;
+}
+
+FORCEINLINE PLIST_ENTRY RemoveHeadList(PLIST_ENTRY head)
+{
+	PLIST_ENTRY entry = head->Flink;
+	RemoveEntryList(entry);
+	return entry;
+}
+
+FORCEINLINE void InsertTailList(PLIST_ENTRY head, PLIST_ENTRY entry)
+{
+	entry->Flink       = head;
+	entry->Blink       = head->Blink;
+	head->Blink->Flink = entry;
+	head->Blink        = entry;
+}
+
+/* held by DEVICE_CONTEXT but only used by the rest of the driver */
+
+typedef struct _KDPC
+{
+	PVOID DeferredContext;
+}
+KDPC, *PKDPC;
+
+typedef struct WDFINTERRUPT__    * WDFINTERRUPT;
+typedef struct WDFDEVICE_INIT__  * PWDFDEVICE_INIT;
+
+
+/* MDLInfo points at these, the simulator has none */
+typedef struct _SHARED_BUFFER * PSHARED_BUFFER;
+
+EXTERN_C_END
+
+#include "../Porthole/Device.h"
+
+#include "../Porthole/Stats.h"
+#include "../Porthole/Coalesce.h"
+#include "../Porthole/Segment.h"
+#include "../Porthole/Command.h"
+#include "../Porthole/Notify.h"
+#include "../Porthole/RegCache.h"
+#include "../Porthole/Handle.h"
+#include "../Porthole/Lock.h"
+#include "../Porthole/Stream.h"
+#include "../Porthole/Queue.h"
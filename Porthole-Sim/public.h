@@ -0,0 +1 @@
+#include "../Porthole/Public.h"
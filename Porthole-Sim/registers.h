@@ -0,0 +1 @@
+#include "../Porthole/Registers.h"
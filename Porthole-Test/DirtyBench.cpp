@@ -0,0 +1,262 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Dirty range coalescer benchmark, this times coalesce_ranges which the driver
+ * runs over every IOCTL_PORTHOLE_DIRTY before the ranges reach the device. It
+ * only needs the standard library and Coalesce.c so it can also be built on
+ * its own, eg:
+ *   cc  -O2 -c -I../Porthole-Sim ../Porthole/Coalesce.c
+ *   c++ -O2 -std=c++17 -DDIRTY_BENCH_MAIN DirtyBench.cpp Coalesce.o -o dirtybench
+ *
+ * each line reports the pattern, mapping size, ranges per call, the time per
+ * input range, the ranges that reach the device per call and the bytes the
+ * host has to copy against the bytes the guest actually wrote
+ */
+
+#include "../Porthole/Coalesce.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+#define DIRTY_BENCH_PAGE    (4096)
+#define DIRTY_BENCH_SECONDS (0.5)
+#define DIRTY_BENCH_SETS    (64)
+#define DIRTY_BENCH_MAX     (4096) // PORTHOLE_MAX_DIRTY
+
+/* the framebuffer the tiles pattern writes to, 1080p at 32bpp */
+#define DIRTY_BENCH_FB_W    (1920)
+#define DIRTY_BENCH_FB_H    (1080)
+#define DIRTY_BENCH_FB_BPP  (4)
+#define DIRTY_BENCH_TILE    (64)
+
+enum class Pattern
+{
+	Random, // small writes anywhere in the mapping
+	Stream, // a writer appending to a ring in the mapping
+	Tiles   // damaged rectangles of a framebuffer, one range per row
+};
+
+static const char * pattern_name(Pattern pattern)
+{
+	switch (pattern)
+	{
+		case Pattern::Random: return "random";
+		case Pattern::Stream: return "stream";
+		case Pattern::Tiles : return "tiles";
+	}
+	return "?";
+}
+
+struct DirtyOptions
+{
+	bool     json    = false;
+	double   seconds = DIRTY_BENCH_SECONDS;
+	uint64_t mapping = 256ull * 1024 * 1024;
+};
+
+struct DirtyResult
+{
+	double   nsRange;   // per input range
+	double   rangesOut; // per call
+	uint64_t written;   // per call, bytes named by the input ranges
+	uint64_t copied;    // per call, bytes named by the output ranges
+};
+
+/* fill one call's worth of ranges in the order a client would record them */
+static void generate(Pattern pattern, uint64_t mapping, size_t count,
+	std::mt19937_64 & rng, uint64_t * cursor, CO_RANGE * out)
+{
+	switch (pattern)
+	{
+		case Pattern::Random:
+		{
+			std::uniform_int_distribution<uint64_t> size(1, 4 * DIRTY_BENCH_PAGE);
+			for (size_t i = 0; i < count; ++i)
+			{
+				out[i].size   = size(rng);
+				out[i].offset = std::uniform_int_distribution<uint64_t>(0, mapping - out[i].size)(rng);
+			}
+			break;
+		}
+
+		case Pattern::Stream:
+		{
+			std::uniform_int_distribution<uint64_t> size(64, 1024);
+			for (size_t i = 0; i < count; ++i)
+			{
+				out[i].size = size(rng);
+				if (*cursor + out[i].size > mapping)
+					*cursor = 0;
+				out[i].offset = *cursor;
+				*cursor += out[i].size;
+			}
+			break;
+		}
+
+		case Pattern::Tiles:
+		{
+			const uint64_t stride = DIRTY_BENCH_FB_W * DIRTY_BENCH_FB_BPP;
+			std::uniform_int_distribution<unsigned> tx(0, DIRTY_BENCH_FB_W / DIRTY_BENCH_TILE - 1);
+			std::uniform_int_distribution<unsigned> ty(0, DIRTY_BENCH_FB_H / DIRTY_BENCH_TILE - 1);
+			for (size_t i = 0; i < count;)
+			{
+				const uint64_t x = (uint64_t)tx(rng) * DIRTY_BENCH_TILE * DIRTY_BENCH_FB_BPP;
+				const uint64_t y = (uint64_t)ty(rng) * DIRTY_BENCH_TILE;
+				for (unsigned row = 0; row < DIRTY_BENCH_TILE && i < count; ++row, ++i)
+				{
+					out[i].offset = (y + row) * stride + x;
+					out[i].size   = DIRTY_BENCH_TILE * DIRTY_BENCH_FB_BPP;
+				}
+			}
+			break;
+		}
+	}
+}
+
+static void bench_run(const DirtyOptions & options, Pattern pattern, uint64_t mapping,
+	size_t count, DirtyResult * result)
+{
+	/* pre-generate a few sets so the generator isn't timed, each call works on
+	 * a fresh copy as the driver coalesces the request's buffer in place, the
+	 * copy is timed too but is small next to the I/O manager's own */
+	std::mt19937_64       rng(0x706f7274686f6c65ull);
+	uint64_t              cursor = 0;
+	std::vector<CO_RANGE> sets(DIRTY_BENCH_SETS * count);
+	std::vector<CO_RANGE> work(count);
+
+	for (size_t s = 0; s < DIRTY_BENCH_SETS; ++s)
+		generate(pattern, mapping, count, rng, &cursor, &sets[s * count]);
+
+	uint64_t written = 0;
+	for (const CO_RANGE & r : sets)
+		written += r.size;
+
+	uint64_t calls  = 0;
+	uint64_t ranges = 0;
+	uint64_t copied = 0;
+	const Clock::time_point start = Clock::now();
+	Clock::time_point       now;
+	do
+	{
+		for (size_t s = 0; s < DIRTY_BENCH_SETS; ++s, ++calls)
+		{
+			memcpy(work.data(), &sets[s * count], count * sizeof(CO_RANGE));
+			const CO_SIZE n = coalesce_ranges(work.data(), count, mapping);
+			ranges += n;
+			for (CO_SIZE i = 0; i < n; ++i)
+				copied += work[i].size;
+		}
+		now = Clock::now();
+	}
+	while (std::chrono::duration<double>(now - start).count() < options.seconds);
+
+	const double ns = std::chrono::duration<double, std::nano>(now - start).count();
+	result->nsRange   = ns / (calls * count);
+	result->rangesOut = (double)ranges / calls;
+	result->written   = written / DIRTY_BENCH_SETS;
+	result->copied    = copied / calls;
+}
+
+static void bench_print(const DirtyOptions & options, Pattern pattern, uint64_t mapping,
+	size_t count, const DirtyResult & result)
+{
+	if (options.json)
+		printf("{\"pattern\":\"%s\",\"mapping\":%llu,\"ranges\":%zu,\"ns_range\":%.2f,"
+			"\"ranges_out\":%.1f,\"written\":%llu,\"copied\":%llu}\n",
+			pattern_name(pattern), (unsigned long long)mapping, count, result.nsRange,
+			result.rangesOut, (unsigned long long)result.written, (unsigned long long)result.copied);
+	else
+		printf("%s,%llu,%zu,%.2f,%.1f,%llu,%llu\n",
+			pattern_name(pattern), (unsigned long long)mapping, count, result.nsRange,
+			result.rangesOut, (unsigned long long)result.written, (unsigned long long)result.copied);
+	fflush(stdout);
+}
+
+static bool parse_options(int argc, char * argv[], DirtyOptions * options)
+{
+	for (int i = 0; i < argc; ++i)
+	{
+		const char * arg  = argv[i];
+		const char * next = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (strcmp(arg, "--json") == 0)
+			options->json = true;
+		else if (strcmp(arg, "--mapping") == 0 && next)
+			options->mapping = strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+		else if (strcmp(arg, "--seconds") == 0 && next)
+			options->seconds = atof(argv[++i]);
+		else
+		{
+			fprintf(stderr, "usage: dirty [--json] [--mapping MB] [--seconds S]\n");
+			return false;
+		}
+	}
+
+	if (options->mapping < DIRTY_BENCH_FB_W * DIRTY_BENCH_FB_H * DIRTY_BENCH_FB_BPP)
+	{
+		fprintf(stderr, "the mapping must be large enough to hold the framebuffer\n");
+		return false;
+	}
+	return true;
+}
+
+int dirty_bench(int argc, char * argv[])
+{
+	DirtyOptions options;
+	if (!parse_options(argc, argv, &options))
+		return -1;
+
+	static const Pattern patterns[] = { Pattern::Random, Pattern::Stream, Pattern::Tiles };
+
+	if (!options.json)
+		printf("pattern,mapping,ranges,ns_range,ranges_out,written,copied\n");
+
+	for (Pattern pattern : patterns)
+	{
+		/* the tiles land in a framebuffer sized mapping */
+		const uint64_t mapping = pattern == Pattern::Tiles ?
+			DIRTY_BENCH_FB_W * DIRTY_BENCH_FB_H * DIRTY_BENCH_FB_BPP : options.mapping;
+
+		for (size_t count = 16; count <= DIRTY_BENCH_MAX; count *= 4)
+		{
+			DirtyResult result;
+			bench_run(options, pattern, mapping, count, &result);
+			bench_print(options, pattern, mapping, count, result);
+		}
+	}
+
+	return 0;
+}
+
+#ifdef DIRTY_BENCH_MAIN
+int main(int argc, char * argv[])
+{
+	return dirty_bench(argc - 1, argv + 1);
+}
+#endif
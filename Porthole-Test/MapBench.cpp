@@ -0,0 +1,518 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Map/unmap throughput and latency sweep. Against the FakeBackend this runs
+ * anywhere and tracks the client library, with `--device` on Windows it
+ * drives the real driver. It only uses the standard library outside of the
+ * buffer allocation so it can also be built on its own, eg:
+ *   g++ -O2 -std=c++17 -pthread -DMAP_BENCH_MAIN MapBench.cpp -o mapbench
+ *
+ * With -DMAP_BENCH_SIM and the simulator library from Porthole-Sim/Sim.h
+ * linked in, `--sim` runs the driver's command layer against the register
+ * model instead. The simulator never touches the pages so it also runs a
+ * sparse layout of reserved address space, `--sim --max-size 16384` takes a
+ * made up 16GB PFN layout through the chained MDLs and the coalescer.
+ * `--pin-ns` and `--segment-ns` give the simulated page locking and device
+ * a cost and `--contig-pages` breaks buffers into that many segments, so
+ * the overlap of the streamed pattern shows against pair and the parallel
+ * pattern scales with it's lock workers.
+ *
+ * Every run is one line of csv (the default) or json so results can be
+ * diffed between builds:
+ *   backend,pattern,layout,size,threads,ops,ops_sec,mb_sec,p50_ns,p99_ns,p999_ns,max_ns,segs_map
+ */
+
+#include "../Porthole-Client/Porthole.hpp"
+#ifdef MAP_BENCH_SIM
+#include "../Porthole-Sim/SimBackend.hpp"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+using namespace porthole;
+using Clock = std::chrono::steady_clock;
+
+#define MAP_BENCH_MIN_SIZE   (4096ULL)
+#define MAP_BENCH_MAX_SIZE   (256ULL * 1024 * 1024)
+#define MAP_BENCH_MAX_MEMORY (1024ULL * 1024 * 1024)
+#define MAP_BENCH_SECONDS    (0.5)
+#define MAP_BENCH_MIN_OPS    (16)
+#define MAP_BENCH_LIVE       (64) // mappings each thread holds in the long pattern
+#define MAP_BENCH_PAGE       (4096)
+#define MAP_BENCH_HUGE_PAGE  (2 * 1024 * 1024)
+
+enum class Pattern
+{
+	Pair,   // map then unmap, timed together
+	Cached,   // as Pair with PORTHOLE_CONFIG_REG_CACHE so repeats skip locking
+	Deferred, // as Pair with PORTHOLE_CONFIG_DEFERRED_UNMAP, flushed at the end
+	Long,     // only the map is timed, up to MAP_BENCH_LIVE stay mapped
+	Extend,   // only the extend is timed, a mapping grows up to MAP_BENCH_LIVE times
+	Streamed, // as Pair with PORTHOLE_CONFIG_STREAM, only sizes that are streamed
+	Parallel  // as Pair from one thread with PORTHOLE_CONFIG_PARALLEL_LOCK and threads workers
+};
+
+enum class Layout
+{
+	Pages, // ordinary pages first touched out of order so they scatter
+	Huge,  // large pages, as physically contiguous as the OS will give us
+	Sparse // reserved but never committed, only for the simulator
+};
+
+static const char * pattern_name(Pattern pattern)
+{
+	switch (pattern)
+	{
+		case Pattern::Pair    : return "pair";
+		case Pattern::Cached  : return "cached";
+		case Pattern::Deferred: return "deferred";
+		case Pattern::Long    : return "long";
+		case Pattern::Extend  : return "extend";
+		case Pattern::Streamed: return "streamed";
+		case Pattern::Parallel: return "parallel";
+	}
+	return "?";
+}
+
+static const char * layout_name(Layout layout)
+{
+	switch (layout)
+	{
+		case Layout::Pages : return "pages";
+		case Layout::Huge  : return "huge";
+		case Layout::Sparse: return "sparse";
+	}
+	return "?";
+}
+
+struct BenchOptions
+{
+	bool     device    = false;
+	bool     sim       = false;
+	bool     json      = false;
+	uint64_t maxSize   = MAP_BENCH_MAX_SIZE;
+	uint64_t maxMemory = MAP_BENCH_MAX_MEMORY;
+	unsigned threads   = 0; // 0 for the number of cores
+	double   seconds   = MAP_BENCH_SECONDS;
+	uint64_t pinNs     = 0; // simulated cost of locking a page
+	uint64_t segmentNs = 0; // simulated cost of the device reading a segment
+	uint32_t contig    = 0; // simulated pages per contiguous run
+};
+
+/* a page aligned buffer, null if the layout could not be provided */
+class BenchBuffer
+{
+public:
+	BenchBuffer(uint64_t size, Layout layout) : m_size(size)
+	{
+#ifdef _WIN32
+		if (layout == Layout::Sparse)
+		{
+			m_addr = VirtualAlloc(NULL, (SIZE_T)m_size, MEM_RESERVE, PAGE_NOACCESS);
+			return;
+		}
+		if (layout == Layout::Huge)
+		{
+			/* needs SeLockMemoryPrivilege, without it the layout is skipped */
+			const SIZE_T large = GetLargePageMinimum();
+			if (!large)
+				return;
+			m_size = (size + large - 1) & ~(uint64_t)(large - 1);
+			m_addr = VirtualAlloc(NULL, (SIZE_T)m_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			return;
+		}
+		m_addr = VirtualAlloc(NULL, (SIZE_T)m_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+		if (layout == Layout::Sparse)
+		{
+			m_addr = mmap(NULL, m_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (m_addr == MAP_FAILED)
+				m_addr = nullptr;
+			return;
+		}
+		if (layout == Layout::Huge)
+		{
+			m_size = (size + MAP_BENCH_HUGE_PAGE - 1) & ~(uint64_t)(MAP_BENCH_HUGE_PAGE - 1);
+			m_addr = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (m_addr == MAP_FAILED)
+				m_addr = nullptr;
+			return;
+		}
+		m_addr = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (m_addr == MAP_FAILED)
+		{
+			m_addr = nullptr;
+			return;
+		}
+		madvise(m_addr, m_size, MADV_NOHUGEPAGE);
+#endif
+		if (!m_addr)
+			return;
+
+		/* fault the pages in out of order so neighbours rarely share a
+		 * physically contiguous run */
+		std::vector<uint64_t> pages(m_size / MAP_BENCH_PAGE);
+		for (uint64_t i = 0; i < pages.size(); ++i)
+			pages[i] = i;
+		std::shuffle(pages.begin(), pages.end(), std::mt19937_64(m_size));
+		for (uint64_t page : pages)
+			((volatile uint8_t *)m_addr)[page * MAP_BENCH_PAGE] = 1;
+	}
+
+	~BenchBuffer()
+	{
+		if (!m_addr)
+			return;
+#ifdef _WIN32
+		VirtualFree(m_addr, 0, MEM_RELEASE);
+#else
+		munmap(m_addr, m_size);
+#endif
+	}
+
+	BenchBuffer(const BenchBuffer &) = delete;
+	BenchBuffer & operator=(const BenchBuffer &) = delete;
+
+	void * addr() const { return m_addr; }
+
+private:
+	void *   m_addr = nullptr;
+	uint64_t m_size;
+};
+
+struct BenchResult
+{
+	std::vector<double> samples;
+	uint64_t            ops      = 0;
+	double              seconds  = 0;
+	double              segments = 0;
+};
+
+static double percentile(const std::vector<double> & sorted, unsigned perMille)
+{
+	return sorted.empty() ? 0.0 : sorted[sorted.size() * perMille / 1000];
+}
+
+/* one thread mapping its own buffer until the deadline */
+static void bench_thread(Device & device, Pattern pattern, void * addr, uint64_t size,
+	Clock::time_point deadline, std::vector<double> & samples)
+{
+	std::vector<Mapping> live;
+	live.reserve(MAP_BENCH_LIVE);
+
+	Mapping  base;
+	unsigned grown = 0;
+
+	while (Clock::now() < deadline || samples.size() < MAP_BENCH_MIN_OPS)
+	{
+		if (pattern == Pattern::Extend)
+		{
+			if (!base || grown == MAP_BENCH_LIVE)
+			{
+				base  = device.send(0x1, addr, size);
+				grown = 0;
+			}
+
+			const auto start = Clock::now();
+			device.extend(base, addr, size);
+			samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+			++grown;
+			continue;
+		}
+
+		const auto start = Clock::now();
+		Mapping mapping = device.send(0x1, addr, size);
+		if (pattern == Pattern::Long)
+		{
+			samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+			live.push_back(std::move(mapping));
+			if (live.size() == MAP_BENCH_LIVE)
+				live.clear();
+			continue;
+		}
+
+		const uint32_t error = mapping.reset();
+		if (error)
+			throw Error("IOCTL_PORTHOLE_UNLOCK_BUFFER", error);
+		samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+	}
+}
+
+static bool bench_run(Device & device, const BenchOptions & options, Pattern pattern, Layout layout,
+	uint64_t size, unsigned threads, BenchResult * result)
+{
+	/* the parallel pattern has one caller and threads workers locking it's pages */
+	const unsigned lockThreads = pattern == Pattern::Parallel ? threads : 0;
+	if (pattern == Pattern::Parallel)
+		threads = 1;
+
+	std::vector<std::unique_ptr<BenchBuffer>> buffers;
+	for (unsigned t = 0; t < threads; ++t)
+	{
+		buffers.emplace_back(new BenchBuffer(size, layout));
+		if (!buffers.back()->addr())
+			return false;
+	}
+
+	device.configure(
+		pattern == Pattern::Cached   ? PORTHOLE_CONFIG_REG_CACHE      :
+		pattern == Pattern::Deferred ? PORTHOLE_CONFIG_DEFERRED_UNMAP :
+		pattern == Pattern::Streamed ? PORTHOLE_CONFIG_STREAM         :
+		pattern == Pattern::Parallel ? PORTHOLE_CONFIG_PARALLEL_LOCK  : 0,
+		0, lockThreads);
+
+	std::vector<std::vector<double>> samples(threads);
+	std::vector<std::thread>         workers;
+	std::atomic<bool>                failed(false);
+
+	const PortholeStats before   = device.stats();
+	const auto          start    = Clock::now();
+	const auto          deadline = start + std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>(options.seconds));
+
+	for (unsigned t = 0; t < threads; ++t)
+		workers.emplace_back([&, t]()
+		{
+			try
+			{
+				bench_thread(device, pattern, buffers[t]->addr(), size, deadline, samples[t]);
+			}
+			catch (const Error & e)
+			{
+				fprintf(stderr, "%s\n", e.what());
+				failed = true;
+			}
+		});
+
+	for (std::thread & worker : workers)
+		worker.join();
+
+	/* the background unmaps count against the throughput, not the latency */
+	if (!failed && pattern == Pattern::Deferred)
+	{
+		try
+		{
+			device.flush();
+		}
+		catch (const Error & e)
+		{
+			fprintf(stderr, "%s\n", e.what());
+			failed = true;
+		}
+	}
+
+	result->seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	if (failed)
+		return false;
+
+	const PortholeStats after = device.stats();
+	uint64_t            maps  = after.handle[PORTHOLE_STAT_MAPS_CREATED] - before.handle[PORTHOLE_STAT_MAPS_CREATED];
+
+	result->samples.clear();
+	for (const std::vector<double> & s : samples)
+		result->samples.insert(result->samples.end(), s.begin(), s.end());
+	std::sort(result->samples.begin(), result->samples.end());
+	result->ops = result->samples.size();
+
+	/* every send and extend covers the same buffer */
+	if (pattern == Pattern::Extend)
+		maps += result->ops;
+	result->segments = maps ? (double)(after.handle[PORTHOLE_STAT_SEGMENTS] - before.handle[PORTHOLE_STAT_SEGMENTS]) / maps : 0.0;
+	return true;
+}
+
+static void bench_print(const BenchOptions & options, Pattern pattern, Layout layout,
+	uint64_t size, unsigned threads, const BenchResult & result)
+{
+	const char * backend = options.device ? "device" : options.sim ? "sim" : "fake";
+	const char * layoutName = layout_name(layout);
+	const double opsSec = result.ops / result.seconds;
+
+	if (options.json)
+		printf("{\"backend\":\"%s\",\"pattern\":\"%s\",\"layout\":\"%s\",\"size\":%llu,\"threads\":%u,"
+			"\"ops\":%llu,\"ops_sec\":%.1f,\"mb_sec\":%.1f,\"p50_ns\":%.0f,\"p99_ns\":%.0f,"
+			"\"p999_ns\":%.0f,\"max_ns\":%.0f,\"segs_map\":%.2f}\n",
+			backend, pattern_name(pattern), layoutName, (unsigned long long)size, threads,
+			(unsigned long long)result.ops, opsSec, opsSec * size / (1024.0 * 1024.0),
+			percentile(result.samples, 500), percentile(result.samples, 990),
+			percentile(result.samples, 999), result.samples.back(), result.segments);
+	else
+		printf("%s,%s,%s,%llu,%u,%llu,%.1f,%.1f,%.0f,%.0f,%.0f,%.0f,%.2f\n",
+			backend, pattern_name(pattern), layoutName, (unsigned long long)size, threads,
+			(unsigned long long)result.ops, opsSec, opsSec * size / (1024.0 * 1024.0),
+			percentile(result.samples, 500), percentile(result.samples, 990),
+			percentile(result.samples, 999), result.samples.back(), result.segments);
+	fflush(stdout);
+}
+
+static bool parse_options(int argc, char * argv[], BenchOptions * options)
+{
+	for (int i = 0; i < argc; ++i)
+	{
+		const char * arg  = argv[i];
+		const char * next = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (strcmp(arg, "--device") == 0)
+			options->device = true;
+#ifdef MAP_BENCH_SIM
+		else if (strcmp(arg, "--sim") == 0)
+			options->sim = true;
+		else if (strcmp(arg, "--pin-ns") == 0 && next)
+			options->pinNs = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(arg, "--segment-ns") == 0 && next)
+			options->segmentNs = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(arg, "--contig-pages") == 0 && next)
+			options->contig = (uint32_t)strtoul(argv[++i], nullptr, 10);
+#endif
+		else if (strcmp(arg, "--json") == 0)
+			options->json = true;
+		else if (strcmp(arg, "--max-size") == 0 && next)
+			options->maxSize = strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+		else if (strcmp(arg, "--memory") == 0 && next)
+			options->maxMemory = strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+		else if (strcmp(arg, "--threads") == 0 && next)
+			options->threads = (unsigned)atoi(argv[++i]);
+		else if (strcmp(arg, "--seconds") == 0 && next)
+			options->seconds = atof(argv[++i]);
+		else
+		{
+			fprintf(stderr,
+				"usage: map [--device] [--json] [--max-size MB] [--memory MB] [--threads N] [--seconds S]\n"
+#ifdef MAP_BENCH_SIM
+				"           [--sim] [--pin-ns NS] [--segment-ns NS] [--contig-pages N]\n"
+#endif
+				);
+			return false;
+		}
+	}
+
+	options->maxSize = std::max<uint64_t>(options->maxSize, MAP_BENCH_MIN_SIZE);
+	return true;
+}
+
+int map_bench(int argc, char * argv[])
+{
+	BenchOptions options;
+	if (!parse_options(argc, argv, &options))
+		return -1;
+
+	std::unique_ptr<Backend> backend;
+#ifdef _WIN32
+	if (options.device)
+		backend = WindowsBackend::open();
+#else
+	if (options.device)
+	{
+		fprintf(stderr, "--device is only available on Windows\n");
+		return -1;
+	}
+#endif
+#ifdef MAP_BENCH_SIM
+	if (options.sim)
+	{
+		SIM_CONFIG config = SimBackend::defaultConfig();
+		config.pinNs       = options.pinNs;
+		config.segmentNs   = options.segmentNs;
+		config.contigPages = options.contig;
+		backend.reset(new SimBackend(config));
+	}
+#endif
+	if (!backend)
+		backend.reset(new FakeBackend());
+	Device device(std::move(backend));
+
+	const unsigned maxThreads = options.threads ? options.threads :
+		std::max(1u, std::thread::hardware_concurrency());
+
+	std::vector<uint64_t> sizes;
+	for (uint64_t size = MAP_BENCH_MIN_SIZE; size <= options.maxSize; size *= 16)
+		sizes.push_back(size);
+	if (sizes.back() != options.maxSize && options.maxSize > MAP_BENCH_MIN_SIZE)
+		sizes.push_back(options.maxSize & ~(uint64_t)(MAP_BENCH_PAGE - 1));
+
+	if (!options.json)
+		printf("backend,pattern,layout,size,threads,ops,ops_sec,mb_sec,p50_ns,p99_ns,p999_ns,max_ns,segs_map\n");
+
+	const Pattern patterns[] = { Pattern::Pair, Pattern::Cached, Pattern::Deferred, Pattern::Long, Pattern::Extend,
+		Pattern::Streamed, Pattern::Parallel };
+	const Layout  layouts [] = { Layout::Pages, Layout::Huge, Layout::Sparse };
+
+	try
+	{
+		for (Pattern pattern : patterns)
+			for (Layout layout : layouts)
+				for (uint64_t size : sizes)
+					for (unsigned threads = 1; threads <= maxThreads; threads *= 2)
+					{
+						/* sparse buffers cost no memory but can't be locked */
+						const unsigned buffers = pattern == Pattern::Parallel ? 1 : threads;
+						if (layout == Layout::Sparse ? !options.sim : size * buffers > options.maxMemory)
+							break;
+
+						/* too small to be split between workers */
+						if (pattern == Pattern::Parallel && size < 2 * PORTHOLE_PARALLEL_LOCK_MIN)
+							break;
+
+						/* anything smaller is sent exactly as pair */
+						if (pattern == Pattern::Streamed && size <= PORTHOLE_STREAM_CHUNK)
+							break;
+
+						BenchResult result;
+						if (!bench_run(device, options, pattern, layout, size, threads, &result))
+						{
+							fprintf(stderr, "skipped %s/%s size %llu threads %u\n", pattern_name(pattern),
+								layout_name(layout), (unsigned long long)size, threads);
+							break;
+						}
+						bench_print(options, pattern, layout, size, threads, result);
+					}
+
+		device.configure(0);
+	}
+	catch (const Error & e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef MAP_BENCH_MAIN
+int main(int argc, char * argv[])
+{
+	return map_bench(argc - 1, argv + 1);
+}
+#endif
@@ -0,0 +1,171 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Notification wakeup latency, measured against the in-process fake device
+ * so only the client library is exercised. This only uses the standard
+ * library so it can also be built on its own, eg:
+ *   g++ -O2 -std=c++17 -pthread -DNOTIFY_BENCH_MAIN NotifyBench.cpp -o notifybench
+ *
+ * With -DNOTIFY_BENCH_SIM and the simulator library from Porthole-Sim/Sim.h
+ * linked in, `--sim` raises each notification on the register model
+ * instead, so the time also covers PH_REG_ISR_NOTIFY, the driver's drain of
+ * `notify` and Notify.c completing the pended wait. The model polls from
+ * it's own thread, see Sim.h.
+ */
+
+#include "../Porthole-Client/Porthole.hpp"
+#ifdef NOTIFY_BENCH_SIM
+#include "../Porthole-Sim/SimBackend.hpp"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+using namespace porthole;
+using Clock = std::chrono::steady_clock;
+
+#define NOTIFY_BENCH_PINGS (50000)
+#define NOTIFY_BENCH_BURST (64)
+
+static bool parse_options(int argc, char * argv[], bool * sim)
+{
+	*sim = false;
+	for (int i = 0; i < argc; ++i)
+	{
+#ifdef NOTIFY_BENCH_SIM
+		if (strcmp(argv[i], "--sim") == 0)
+		{
+			*sim = true;
+			continue;
+		}
+#endif
+		fprintf(stderr,
+			"unknown option %s\n"
+			"usage: notify"
+#ifdef NOTIFY_BENCH_SIM
+			" [--sim]"
+#endif
+			"\n", argv[i]);
+		return false;
+	}
+	return true;
+}
+
+int notify_bench(int argc, char * argv[])
+{
+	bool sim;
+	if (!parse_options(argc, argv, &sim))
+		return -1;
+
+	/* how the host side raises a notification */
+	std::unique_ptr<Backend>                      backend;
+	std::function<void(PortholeMapID, uint32_t)> notify;
+#ifdef NOTIFY_BENCH_SIM
+	if (sim)
+	{
+		SimBackend * simBackend = new SimBackend();
+		notify = [simBackend](PortholeMapID id, uint32_t value) { simBackend->notify(id, value); };
+		backend.reset(simBackend);
+	}
+#endif
+	if (!backend)
+	{
+		FakeBackend * fake = new FakeBackend();
+		notify = [fake](PortholeMapID id, uint32_t value) { fake->notify(id, value); };
+		backend.reset(fake);
+	}
+	Device device(std::move(backend));
+
+	static uint8_t buffer[4096];
+	Mapping mapping = device.send(0x1, buffer, sizeof(buffer));
+	device.subscribe(mapping);
+
+	const PortholeMapID   id = mapping.id();
+	std::atomic<int64_t>  stamp(0);
+	std::atomic<int>      acked(0);
+	std::vector<double>   samples(NOTIFY_BENCH_PINGS);
+
+	/* the host side raises one notification at a time and waits for the
+	 * guest to pick it up */
+	std::thread host([&]()
+	{
+		for (int i = 0; i < NOTIFY_BENCH_PINGS; ++i)
+		{
+			stamp = Clock::now().time_since_epoch().count();
+			notify(id, 1);
+			while (acked.load() <= i)
+				std::this_thread::yield();
+		}
+	});
+
+	for (int i = 0; i < NOTIFY_BENCH_PINGS; ++i)
+	{
+		device.waitNotify(mapping);
+		const int64_t now = Clock::now().time_since_epoch().count();
+		samples[i] = std::chrono::duration<double, std::nano>(Clock::duration(now - stamp.load())).count();
+		acked = i + 1;
+	}
+	host.join();
+
+	std::sort(samples.begin(), samples.end());
+	printf("wakeup latency (ns)\n");
+	printf("       p50        p99       p999        max\n");
+	printf("%10.0f %10.0f %10.0f %10.0f\n",
+		samples[samples.size() / 2],
+		samples[samples.size() * 99  / 100],
+		samples[samples.size() * 999 / 1000],
+		samples.back());
+
+	/* a burst raised while nobody is waiting is merged into the next wakeup,
+	 * a device delivering it asynchronously may take a few */
+	for (int i = 0; i < NOTIFY_BENCH_BURST; ++i)
+		notify(id, 1u << (i % 8));
+
+	PortholeNotifyResult burst  = {};
+	int                  wakeups = 0;
+	while (burst.count < NOTIFY_BENCH_BURST)
+	{
+		const PortholeNotifyResult result = device.waitNotify(mapping);
+		burst.count += result.count;
+		burst.value |= result.value;
+		++wakeups;
+	}
+	printf("\nburst of %d delivered as count %u value 0x%02x in %d wakeups\n",
+		NOTIFY_BENCH_BURST, burst.count, burst.value, wakeups);
+	fflush(stdout);
+
+	return burst.count == NOTIFY_BENCH_BURST ? 0 : -1;
+}
+
+#ifdef NOTIFY_BENCH_MAIN
+int main(int argc, char * argv[])
+{
+	return notify_bench(argc - 1, argv + 1);
+}
+#endif
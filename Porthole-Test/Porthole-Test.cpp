@@ -22,6 +22,7 @@ SOFTWARE.
 
 #include "pch.h"
 #include <stdio.h>
+#include <string.h>
 
 #pragma pack(push,1)
 typedef struct _MsgSetup
@@ -33,18 +34,13 @@ typedef struct _MsgSetup
 MsgSetup, *PMsgSetup;
 #pragma pack(pop)
 
-int main()
+static HANDLE open_device(DWORD flags)
 {
-	SYSTEM_INFO sysInfo;
-	GetSystemInfo(&sysInfo);
-
 	HDEVINFO                         deviceInfoSet;
 	PSP_DEVICE_INTERFACE_DETAIL_DATA infData    = NULL;
 	HANDLE                           devHandle  = INVALID_HANDLE_VALUE;
 	SP_DEVICE_INTERFACE_DATA		 devInfData = { 0 };
 	DWORD                            reqSize    = 0;
-	ULONG                            returned;
-	HANDLE                           connectEvent, disconnectEvent;
 
 	devInfData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
 	deviceInfoSet     = SetupDiGetClassDevs(NULL, NULL, NULL, DIGCF_PRESENT | DIGCF_ALLCLASSES | DIGCF_DEVICEINTERFACE);
@@ -54,15 +50,250 @@ int main()
 	if (reqSize == 0)
 	{
 		printf("Failed to get reqSize, is the driver loaded?\n");
-		return -1;
+		return INVALID_HANDLE_VALUE;
 	}
 
 	// open the device
 	infData = (PSP_DEVICE_INTERFACE_DETAIL_DATA)malloc(reqSize);
 	infData->cbSize = sizeof(PSP_DEVICE_INTERFACE_DETAIL_DATA);
 	SetupDiGetDeviceInterfaceDetail(deviceInfoSet, &devInfData, infData, reqSize, NULL, NULL);
-	devHandle = CreateFile(infData->DevicePath, 0, 0, NULL, OPEN_EXISTING, 0, 0);
+	devHandle = CreateFile(infData->DevicePath, 0, 0, NULL, OPEN_EXISTING, flags, 0);
 	free(infData);
+	return devHandle;
+}
+
+#define BENCH_BUFFER_SIZE (65536)
+#define BENCH_DURATION_MS (2000)
+#define BENCH_MAX_DEPTH   (32)
+
+typedef struct _BenchSlot
+{
+	OVERLAPPED    ov;
+	PortholeMsg   msg;
+	PortholeMapID id;
+	BOOL          mapped;
+}
+BenchSlot, *PBenchSlot;
+
+static BOOL bench_issue(HANDLE devHandle, PBenchSlot slot)
+{
+	BOOL ok;
+	ZeroMemory(&slot->ov, sizeof(OVERLAPPED));
+	if (slot->mapped)
+		ok = DeviceIoControl(devHandle, IOCTL_PORTHOLE_UNLOCK_BUFFER, &slot->id,
+			sizeof(PortholeMapID), NULL, 0, NULL, &slot->ov);
+	else
+		ok = DeviceIoControl(devHandle, IOCTL_PORTHOLE_SEND_MSG, &slot->msg,
+			sizeof(PortholeMsg), &slot->id, sizeof(PortholeMapID), NULL, &slot->ov);
+
+	return ok || GetLastError() == ERROR_IO_PENDING;
+}
+
+/* keep `depth` map/unmap requests in flight from a single thread */
+static int bench_depth(HANDLE devHandle, HANDLE iocp, PBenchSlot slots, int depth)
+{
+	for (int i = 0; i < depth; ++i)
+	{
+		slots[i].mapped = FALSE;
+		if (!bench_issue(devHandle, &slots[i]))
+		{
+			printf("failed to issue request: %lu\n", GetLastError());
+			return -1;
+		}
+	}
+
+	LARGE_INTEGER freq, start, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+
+	UINT64 mappings = 0;
+	int    inflight = depth;
+	BOOL   stop     = FALSE;
+	while (inflight)
+	{
+		DWORD        bytes;
+		ULONG_PTR    key;
+		LPOVERLAPPED ov;
+		const BOOL ok = GetQueuedCompletionStatus(iocp, &bytes, &key, &ov, INFINITE);
+		if (!ov)
+		{
+			printf("GetQueuedCompletionStatus failed: %lu\n", GetLastError());
+			return -1;
+		}
+
+		if (!ok)
+		{
+			printf("request failed: %lu\n", GetLastError());
+			return -1;
+		}
+
+		PBenchSlot slot = CONTAINING_RECORD(ov, BenchSlot, ov);
+		if (!slot->mapped)
+			++mappings;
+		slot->mapped = !slot->mapped;
+
+		QueryPerformanceCounter(&now);
+		if (!stop && (now.QuadPart - start.QuadPart) * 1000 / freq.QuadPart >= BENCH_DURATION_MS)
+			stop = TRUE;
+
+		/* always unmap what we mapped, even when stopping */
+		if (stop && !slot->mapped)
+		{
+			--inflight;
+			continue;
+		}
+
+		if (!bench_issue(devHandle, slot))
+		{
+			printf("failed to issue request: %lu\n", GetLastError());
+			return -1;
+		}
+	}
+
+	QueryPerformanceCounter(&now);
+	const double secs = (double)(now.QuadPart - start.QuadPart) / freq.QuadPart;
+	printf("%5d %12.0f\n", depth, mappings / secs);
+	return 0;
+}
+
+static BOOL query_stats(HANDLE devHandle, PPortholeStats stats)
+{
+	DWORD returned;
+	if (!DeviceIoControl(devHandle, IOCTL_PORTHOLE_QUERY_STATS, NULL, 0,
+		stats, sizeof(PortholeStats), &returned, NULL) || stats->version != PORTHOLE_STATS_VERSION)
+	{
+		printf("IOCTL_PORTHOLE_QUERY_STATS failed: %lu\n", GetLastError());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+#define STAT_INTERVAL_MS (1000)
+#define STAT_HEADER_ROWS (20)
+
+/* print the device counters every interval like vmstat, forever if count is 0 */
+static int stats_monitor(DWORD interval, int count)
+{
+	HANDLE devHandle = open_device(0);
+	if (devHandle == INVALID_HANDLE_VALUE)
+		return -1;
+
+	PortholeStats prev, cur;
+	if (!query_stats(devHandle, &prev))
+	{
+		CloseHandle(devHandle);
+		return -1;
+	}
+
+	const double secs = interval / 1000.0;
+	for (int row = 0; count == 0 || row < count; ++row)
+	{
+		Sleep(interval);
+		if (!query_stats(devHandle, &cur))
+			break;
+
+		if (row % STAT_HEADER_ROWS == 0)
+			printf("  maps/s unmaps/s  pinnedMB segs/map  cmds/s polls/cmd us/cmd   irq/s   dpc/s events/s notify/s  bells/s merged/s\n");
+
+#define DELTA(x) (cur.device[PORTHOLE_STAT_##x] - prev.device[PORTHOLE_STAT_##x])
+		UINT64 waitUs = 0;
+		for (int i = 0; i < PORTHOLE_CMD_MAX; ++i)
+			waitUs += cur.device[PORTHOLE_STAT_WAIT_US + i] - prev.device[PORTHOLE_STAT_WAIT_US + i];
+
+		const UINT64 maps = DELTA(MAPS_CREATED);
+		const UINT64 cmds = DELTA(COMMANDS);
+		printf("%8.0f %8.0f %9.1f %8.1f %7.0f %9.1f %6.1f %7.0f %7.0f %8.0f %8.0f %8.0f %8.0f\n",
+			maps / secs,
+			DELTA(MAPS_FREED) / secs,
+			(cur.device[PORTHOLE_STAT_BYTES_MAPPED] - cur.device[PORTHOLE_STAT_BYTES_UNMAPPED]) / (1024.0 * 1024.0),
+			maps ? (double)DELTA(SEGMENTS) / maps : 0.0,
+			cmds / secs,
+			cmds ? (double)DELTA(REG_POLLS) / cmds : 0.0,
+			cmds ? (double)waitUs / cmds : 0.0,
+			DELTA(INTERRUPTS) / secs,
+			DELTA(DPCS) / secs,
+			DELTA(EVENT_SIGNALS) / secs,
+			DELTA(NOTIFICATIONS) / secs,
+			DELTA(DOORBELLS) / secs,
+			DELTA(DOORBELLS_MERGED) / secs);
+#undef DELTA
+		fflush(stdout);
+
+		prev = cur;
+	}
+
+	CloseHandle(devHandle);
+	return 0;
+}
+
+int ring_bench();
+int notify_bench(int argc, char * argv[]);
+int map_bench(int argc, char * argv[]);
+int dirty_bench(int argc, char * argv[]);
+
+static int bench()
+{
+	HANDLE devHandle = open_device(FILE_FLAG_OVERLAPPED);
+	if (devHandle == INVALID_HANDLE_VALUE)
+		return -1;
+
+	HANDLE iocp = CreateIoCompletionPort(devHandle, NULL, 0, 1);
+
+	static BenchSlot slots[BENCH_MAX_DEPTH];
+	for (int i = 0; i < BENCH_MAX_DEPTH; ++i)
+	{
+		slots[i].msg.type = 0x1;
+		slots[i].msg.addr = VirtualAlloc(NULL, BENCH_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		slots[i].msg.size = BENCH_BUFFER_SIZE;
+	}
+
+	printf("depth  mappings/sec\n");
+	int ret = 0;
+	for (int depth = 1; depth <= BENCH_MAX_DEPTH && ret == 0; depth *= 2)
+		ret = bench_depth(devHandle, iocp, slots, depth);
+
+	for (int i = 0; i < BENCH_MAX_DEPTH; ++i)
+		VirtualFree(slots[i].msg.addr, 0, MEM_RELEASE);
+
+	CloseHandle(iocp);
+	CloseHandle(devHandle);
+	return ret;
+}
+
+int main(int argc, char * argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+		return bench();
+
+	if (argc > 1 && strcmp(argv[1], "ring") == 0)
+		return ring_bench();
+
+	// notify [options], see NotifyBench.cpp
+	if (argc > 1 && strcmp(argv[1], "notify") == 0)
+		return notify_bench(argc - 2, argv + 2);
+
+	// map [options], see MapBench.cpp
+	if (argc > 1 && strcmp(argv[1], "map") == 0)
+		return map_bench(argc - 2, argv + 2);
+
+	// dirty [options], see DirtyBench.cpp
+	if (argc > 1 && strcmp(argv[1], "dirty") == 0)
+		return dirty_bench(argc - 2, argv + 2);
+
+	// stat [interval ms] [count]
+	if (argc > 1 && strcmp(argv[1], "stat") == 0)
+		return stats_monitor(
+			argc > 2 ? (DWORD)atoi(argv[2]) : STAT_INTERVAL_MS,
+			argc > 3 ? atoi(argv[3]) : 0);
+
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo(&sysInfo);
+
+	HANDLE devHandle = open_device(0);
+	ULONG  returned;
+
+	if (devHandle == INVALID_HANDLE_VALUE)
+		return -1;
 	
 	// register events
 	PortholeEvents events;
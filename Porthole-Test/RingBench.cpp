@@ -0,0 +1,196 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Ring transport benchmark, this only uses the standard library so it can
+ * also be built on its own, eg:
+ *   g++ -O2 -std=c++17 -pthread -DRING_BENCH_MAIN RingBench.cpp -o ringbench
+ */
+
+#include "../Porthole-Client/Ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace porthole;
+using Clock = std::chrono::steady_clock;
+
+#define RING_BENCH_SIZE      (4 * 1024 * 1024)
+#define RING_BENCH_SECONDS   (2)
+#define RING_BENCH_PINGS     (200000)
+#define RING_BENCH_MAX_MSG   (4096)
+
+/* spin briefly then start giving up the CPU so the bench still completes
+ * when there are fewer cores than threads */
+template<typename F>
+static void spin_until(F && done)
+{
+	for (unsigned spins = 0; !done(); ++spins)
+		if (spins >= 1024)
+			std::this_thread::yield();
+}
+
+struct RingBuffer
+{
+	explicit RingBuffer(size_t size) : mem(new uint64_t[size / sizeof(uint64_t)]), size(size) {}
+	std::unique_ptr<uint64_t[]> mem;
+	size_t size;
+};
+
+/* one consumer against `producers` threads for RING_BENCH_SECONDS */
+static void bench_throughput(bool mpsc, int producers, uint32_t msgSize)
+{
+	RingBuffer   buffer(RING_BENCH_SIZE);
+	RingHeader * ring = ring_init(buffer.mem.get(), buffer.size, mpsc ? kRingFlagMPSC : 0);
+
+	std::atomic<bool>  stop(false);
+	std::atomic<int>   running(producers);
+	MpscProducer       shared(ring);
+	std::vector<std::thread> threads;
+
+	for (int p = 0; p < producers; ++p)
+		threads.emplace_back([&, p]()
+		{
+			uint8_t msg[RING_BENCH_MAX_MSG];
+			std::memset(msg, p, sizeof(msg));
+
+			SpscProducer single(ring);
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				const bool written = mpsc ?
+					shared.write(msg, msgSize) :
+					single.write(msg, msgSize);
+
+				if (!written)
+					std::this_thread::yield();
+			}
+
+			single.publish();
+			running.fetch_sub(1);
+		});
+
+	RingConsumer consumer(ring);
+	uint64_t     count = 0;
+	uint64_t     bytes = 0;
+	const auto   start = Clock::now();
+	const auto   end   = start + std::chrono::seconds(RING_BENCH_SECONDS);
+
+	while (Clock::now() < end)
+	{
+		const size_t n = consumer.poll([&](const void *, uint32_t size) { bytes += size; }, 256);
+		if (!n)
+			std::this_thread::yield();
+		count += n;
+	}
+
+	stop = true;
+	while (running.load())
+		consumer.poll([](const void *, uint32_t) {});
+
+	for (std::thread & t : threads)
+		t.join();
+
+	const double secs = std::chrono::duration<double>(Clock::now() - start).count();
+	printf("%-5s %9d %9u %14.0f %10.1f\n", mpsc ? "mpsc" : "spsc", producers, msgSize,
+		count / secs, bytes / secs / (1024.0 * 1024.0));
+	fflush(stdout);
+}
+
+/* round trip between two spsc rings publishing every message */
+static void bench_latency(uint32_t msgSize)
+{
+	RingBuffer   toBuf(RING_BENCH_SIZE), fromBuf(RING_BENCH_SIZE);
+	RingHeader * to   = ring_init(toBuf  .mem.get(), toBuf  .size);
+	RingHeader * from = ring_init(fromBuf.mem.get(), fromBuf.size);
+
+	std::thread echo([&]()
+	{
+		RingConsumer consumer(to);
+		SpscProducer producer(from, 1);
+		for (int n = 0; n < RING_BENCH_PINGS; )
+			spin_until([&]()
+			{
+				const size_t got = consumer.poll([&](const void * data, uint32_t size)
+				{
+					spin_until([&]() { return producer.write(data, size); });
+				});
+				n += (int)got;
+				return got != 0 || n >= RING_BENCH_PINGS;
+			});
+	});
+
+	uint8_t msg[RING_BENCH_MAX_MSG] = {};
+	std::vector<double> samples(RING_BENCH_PINGS);
+	SpscProducer producer(to, 1);
+	RingConsumer consumer(from);
+
+	for (int i = 0; i < RING_BENCH_PINGS; ++i)
+	{
+		const auto start = Clock::now();
+		spin_until([&]() { return producer.write(msg, msgSize); });
+		spin_until([&]() { return consumer.poll([](const void *, uint32_t) {}, 1) != 0; });
+		samples[i] = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / 2.0;
+	}
+	echo.join();
+
+	std::sort(samples.begin(), samples.end());
+	printf("%9u %10.0f %10.0f %10.0f %10.0f\n", msgSize,
+		samples[samples.size() / 2],
+		samples[samples.size() * 99  / 100],
+		samples[samples.size() * 999 / 1000],
+		samples.back());
+	fflush(stdout);
+}
+
+int ring_bench()
+{
+	const uint32_t sizes[] = { 16, 64, 256, 1024, 4096 };
+
+	printf("mode  producers  msg size       msgs/sec       MB/s\n");
+	for (uint32_t size : sizes)
+		bench_throughput(false, 1, size);
+
+	const unsigned cores = std::max(2u, std::thread::hardware_concurrency());
+	for (unsigned producers = 1; producers < cores; producers *= 2)
+		bench_throughput(true, (int)producers, 64);
+
+	printf("\none way latency (ns)\n");
+	printf(" msg size        p50        p99       p999        max\n");
+	for (uint32_t size : sizes)
+		bench_latency(size);
+
+	return 0;
+}
+
+#ifdef RING_BENCH_MAIN
+int main()
+{
+	return ring_bench();
+}
+#endif
@@ -0,0 +1,125 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "buffer.tmh"
+
+static PSHARED_BUFFER alloc_pages(const SIZE_T size)
+{
+	PSHARED_BUFFER buffer = (PSHARED_BUFFER)ExAllocatePoolWithTag(NonPagedPool, sizeof(SHARED_BUFFER), TAG);
+	if (!buffer)
+		return NULL;
+	RtlZeroMemory(buffer, sizeof(SHARED_BUFFER));
+	buffer->size = size;
+
+	PHYSICAL_ADDRESS low, high, boundary;
+	low.QuadPart      = 0;
+	high.QuadPart     = MAXULONG64;
+	boundary.QuadPart = 0;
+
+	/* a physically contiguous buffer is a single segment to the device */
+	buffer->kernelAddr = MmAllocateContiguousMemorySpecifyCache(size, low, high, boundary, MmCached);
+	if (buffer->kernelAddr)
+	{
+		RtlZeroMemory(buffer->kernelAddr, size);
+		if ((buffer->mdl = IoAllocateMdl(buffer->kernelAddr, (ULONG)size, FALSE, FALSE, NULL)))
+		{
+			MmBuildMdlForNonPagedPool(buffer->mdl);
+			return buffer;
+		}
+
+		MmFreeContiguousMemorySpecifyCache(buffer->kernelAddr, size, MmCached);
+		ExFreePoolWithTag(buffer, TAG);
+		return NULL;
+	}
+
+	/* otherwise take pages that are as contiguous as the allocator can
+	 * manage, these are zeroed for us */
+	buffer->mdl = MmAllocatePagesForMdlEx(low, high, boundary, size, MmCached,
+		MM_ALLOCATE_FULLY_REQUIRED | MM_ALLOCATE_PREFER_CONTIGUOUS);
+	if (!buffer->mdl)
+	{
+		ExFreePoolWithTag(buffer, TAG);
+		return NULL;
+	}
+
+	return buffer;
+}
+
+NTSTATUS buffer_alloc(const UINT32 size, PSHARED_BUFFER * result)
+{
+	PSHARED_BUFFER buffer = alloc_pages(ROUND_TO_PAGES(size));
+	if (!buffer)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	try
+	{
+		buffer->userAddr = MmMapLockedPagesSpecifyCache(buffer->mdl, UserMode, MmCached, NULL, FALSE,
+			NormalPagePriority | MdlMappingNoExecute);
+	}
+	except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		buffer->userAddr = NULL;
+	}
+
+	if (!buffer->userAddr)
+	{
+		buffer_free(buffer);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	buffer->process = PsGetCurrentProcess();
+	ObReferenceObject(buffer->process);
+
+	*result = buffer;
+	return STATUS_SUCCESS;
+}
+
+void buffer_free(PSHARED_BUFFER buffer)
+{
+	/* the user mapping must be removed from the process it was made in */
+	if (buffer->userAddr)
+	{
+		KAPC_STATE    apcState;
+		const BOOLEAN attach = PsGetCurrentProcess() != buffer->process;
+		if (attach)
+			KeStackAttachProcess(buffer->process, &apcState);
+		MmUnmapLockedPages(buffer->userAddr, buffer->mdl);
+		if (attach)
+			KeUnstackDetachProcess(&apcState);
+	}
+
+	if (buffer->kernelAddr)
+	{
+		IoFreeMdl(buffer->mdl);
+		MmFreeContiguousMemorySpecifyCache(buffer->kernelAddr, buffer->size, MmCached);
+	}
+	else
+	{
+		MmFreePagesFromMdl(buffer->mdl);
+		ExFreePool(buffer->mdl);
+	}
+
+	if (buffer->process)
+		ObDereferenceObject(buffer->process);
+	ExFreePoolWithTag(buffer, TAG);
+}
@@ -0,0 +1,41 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+/* a driver allocated buffer mapped into the address space of the process
+ * that requested it */
+typedef struct _SHARED_BUFFER
+{
+	PEPROCESS process;
+	PVOID     kernelAddr; // set if the buffer is physically contiguous
+	PVOID     userAddr;
+	SIZE_T    size;
+	PMDL      mdl;
+}
+SHARED_BUFFER, *PSHARED_BUFFER;
+
+/* allocate a zeroed buffer and map it into the current process */
+NTSTATUS buffer_alloc(const UINT32 size, PSHARED_BUFFER * buffer);
+void     buffer_free (PSHARED_BUFFER buffer);
+
+EXTERN_C_END
@@ -0,0 +1,265 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "coalesce.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <emmintrin.h>
+#define COALESCE_SSE2
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#ifdef _MSC_VER
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#define COALESCE_NEON
+#endif
+
+void coalesce_init(PCOALESCE co, coalesce_emit emit, void * opaque)
+{
+	co->emit   = emit;
+	co->opaque = opaque;
+	co->addr   = 0;
+	co->size   = 0;
+}
+
+/*
+ * short runs are checked a pair at a time so fragmented buffers don't pay
+ * for the vector setup, longer runs are then tested eight neighbouring
+ * pairs per iteration stopping at the first group containing a break, and
+ * the scalar tail finds the exact position. 32bit x86 is left scalar as the
+ * kernel would need to save the extended state to use SSE there.
+ */
+#define COALESCE_SCALAR_PROBE 4
+
+static __inline CO_SIZE run_length(const CO_PFN * pfns, CO_SIZE count)
+{
+	if (count < 2)
+		return 0;
+
+	const CO_SIZE pairs = count - 1;
+	CO_SIZE n = 0;
+
+	for (; n < pairs && n < COALESCE_SCALAR_PROBE; ++n)
+		if (pfns[n + 1] != pfns[n] + 1)
+			return n;
+
+#if defined(COALESCE_SSE2)
+	const __m128i one = _mm_set_epi64x(1, 1);
+	for (; n + 8 <= pairs; n += 8)
+	{
+		const __m128i * p = (const __m128i *)(pfns + n);
+		const __m128i * q = (const __m128i *)(pfns + n + 1);
+
+		__m128i eq =               _mm_cmpeq_epi32(_mm_sub_epi64(_mm_loadu_si128(q + 0), _mm_loadu_si128(p + 0)), one);
+		eq = _mm_and_si128(eq, _mm_cmpeq_epi32(_mm_sub_epi64(_mm_loadu_si128(q + 1), _mm_loadu_si128(p + 1)), one));
+		eq = _mm_and_si128(eq, _mm_cmpeq_epi32(_mm_sub_epi64(_mm_loadu_si128(q + 2), _mm_loadu_si128(p + 2)), one));
+		eq = _mm_and_si128(eq, _mm_cmpeq_epi32(_mm_sub_epi64(_mm_loadu_si128(q + 3), _mm_loadu_si128(p + 3)), one));
+
+		if (_mm_movemask_epi8(eq) != 0xFFFF)
+			break;
+	}
+#elif defined(COALESCE_NEON)
+	const uint64x2_t one = vdupq_n_u64(1);
+	for (; n + 8 <= pairs; n += 8)
+	{
+		const uint64_t * p = (const uint64_t *)(pfns + n);
+		const uint64_t * q = (const uint64_t *)(pfns + n + 1);
+
+		uint64x2_t eq =      vceqq_u64(vsubq_u64(vld1q_u64(q + 0), vld1q_u64(p + 0)), one);
+		eq = vandq_u64(eq, vceqq_u64(vsubq_u64(vld1q_u64(q + 2), vld1q_u64(p + 2)), one));
+		eq = vandq_u64(eq, vceqq_u64(vsubq_u64(vld1q_u64(q + 4), vld1q_u64(p + 4)), one));
+		eq = vandq_u64(eq, vceqq_u64(vsubq_u64(vld1q_u64(q + 6), vld1q_u64(p + 6)), one));
+
+		if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) != ~(uint64_t)0)
+			break;
+	}
+#endif
+
+	while (n < pairs && pfns[n + 1] == pfns[n] + 1)
+		++n;
+
+	return n;
+}
+
+CO_SIZE coalesce_run_length(const CO_PFN * pfns, CO_SIZE count)
+{
+	return run_length(pfns, count);
+}
+
+int coalesce_pfns(PCOALESCE co, const CO_PFN * pfns, CO_SIZE count, CO_U32 offset, CO_U64 length)
+{
+	int    result = 0;
+	CO_U64 addr   = co->addr;
+	CO_U64 size   = co->size;
+
+	for (CO_SIZE i = 0; i < count && length; )
+	{
+		const CO_SIZE run   = run_length(pfns + i, count - i) + 1;
+		const CO_U64  curPA = ((CO_U64)pfns[i] << COALESCE_PAGE_SHIFT) + offset;
+		CO_U64 bytes = ((CO_U64)run << COALESCE_PAGE_SHIFT) - offset;
+		if (bytes > length)
+			bytes = length;
+
+		length -= bytes;
+		offset  = 0;
+		i      += run;
+
+		/* extend the current run if this one follows on from it */
+		if (addr + size == curPA)
+		{
+			size += bytes;
+			continue;
+		}
+
+		if (size && (result = co->emit(co->opaque, addr, size)) != 0)
+			break;
+
+		addr = curPA;
+		size = bytes;
+	}
+
+	co->addr = addr;
+	co->size = size;
+	return result;
+}
+
+int coalesce_flush(PCOALESCE co)
+{
+	int result = 0;
+	if (co->size)
+		result = co->emit(co->opaque, co->addr, co->size);
+
+	co->size = 0;
+	return result;
+}
+
+/*
+ * Ranges that arrive in order, as they do from anything writing a buffer
+ * front to back, are merged as they are aligned and never reach the sort.
+ * A few out of place are moved with an insertion sort, anything more random
+ * is heap sorted so there is no recursion or allocation.
+ */
+#define COALESCE_INSERTION_LIMIT 8
+
+static __inline void insertion_sort(PCO_RANGE ranges, CO_SIZE count)
+{
+	for (CO_SIZE i = 1; i < count; ++i)
+	{
+		const CO_RANGE range = ranges[i];
+		CO_SIZE j = i;
+		for (; j > 0 && ranges[j - 1].offset > range.offset; --j)
+			ranges[j] = ranges[j - 1];
+		ranges[j] = range;
+	}
+}
+
+static __inline void sift_down(PCO_RANGE ranges, CO_SIZE root, CO_SIZE count)
+{
+	const CO_RANGE range = ranges[root];
+	for (CO_SIZE child; (child = root * 2 + 1) < count; root = child)
+	{
+		if (child + 1 < count && ranges[child + 1].offset > ranges[child].offset)
+			++child;
+		if (ranges[child].offset <= range.offset)
+			break;
+		ranges[root] = ranges[child];
+	}
+	ranges[root] = range;
+}
+
+static void heap_sort(PCO_RANGE ranges, CO_SIZE count)
+{
+	for (CO_SIZE i = count / 2; i > 0; --i)
+		sift_down(ranges, i - 1, count);
+
+	for (CO_SIZE end = count - 1; end > 0; --end)
+	{
+		const CO_RANGE top = ranges[0];
+		ranges[0]   = ranges[end];
+		ranges[end] = top;
+		sift_down(ranges, 0, end);
+	}
+}
+
+CO_SIZE coalesce_ranges(PCO_RANGE ranges, CO_SIZE count, CO_U64 limit)
+{
+	const CO_U64 mask = COALESCE_PAGE_SIZE - 1;
+	CO_SIZE used  = 0;
+	CO_SIZE moved = 0; // ranges that start before the one ahead of them
+
+	/* a partial final page is still a whole page to the host */
+	limit = (limit + mask) & ~mask;
+
+	for (CO_SIZE i = 0; i < count; ++i)
+	{
+		const CO_U64 offset = ranges[i].offset;
+		const CO_U64 size   = ranges[i].size;
+		if (!size || offset >= limit)
+			continue;
+
+		const CO_U64 start = offset & ~mask;
+		const CO_U64 end   = size > limit - offset ? limit : (offset + size + mask) & ~mask;
+
+		if (used)
+		{
+			PCO_RANGE last = &ranges[used - 1];
+			if (start >= last->offset && start <= last->offset + last->size)
+			{
+				if (end > last->offset + last->size)
+					last->size = end - last->offset;
+				continue;
+			}
+
+			if (start < last->offset)
+				++moved;
+		}
+
+		ranges[used].offset = start;
+		ranges[used].size   = end - start;
+		++used;
+	}
+
+	if (!moved)
+		return used;
+
+	if (moved <= COALESCE_INSERTION_LIMIT)
+		insertion_sort(ranges, used);
+	else
+		heap_sort(ranges, used);
+
+	CO_SIZE merged = 0;
+	for (CO_SIZE i = 1; i < used; ++i)
+	{
+		PCO_RANGE last = &ranges[merged];
+		const CO_U64 lastEnd = last->offset + last->size;
+		if (ranges[i].offset <= lastEnd)
+		{
+			if (ranges[i].offset + ranges[i].size > lastEnd)
+				last->size = ranges[i].offset + ranges[i].size - last->offset;
+			continue;
+		}
+		ranges[++merged] = ranges[i];
+	}
+
+	return merged + 1;
+}
@@ -0,0 +1,96 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * PFN run and byte range coalescing, this module has no kernel dependencies
+ * so the same code can be built into user mode tools.
+ *
+ * Pages are walked in runs of consecutive PFNs, the run detection compares
+ * several neighbouring PFNs at a time with SIMD where the platform allows
+ * it to be used without saving the extended processor state.
+ */
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+typedef UINT32    CO_U32;
+typedef UINT64    CO_U64;
+typedef SIZE_T    CO_SIZE;
+typedef ULONG_PTR CO_PFN;
+#else
+#include <stddef.h>
+#include <stdint.h>
+typedef uint32_t  CO_U32;
+typedef uint64_t  CO_U64;
+typedef size_t    CO_SIZE;
+typedef uintptr_t CO_PFN;
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COALESCE_PAGE_SHIFT 12
+#define COALESCE_PAGE_SIZE  (1UL << COALESCE_PAGE_SHIFT)
+
+/* called for each completed run, a non-zero return aborts the walk and is
+ * returned to the caller */
+typedef int (*coalesce_emit)(void * opaque, CO_U64 addr, CO_U64 size);
+
+/* the run being built, runs are carried across calls so a chain of PFN
+ * arrays coalesces as if it were one */
+typedef struct _COALESCE
+{
+	coalesce_emit emit;
+	void        * opaque;
+	CO_U64        addr;
+	CO_U64        size;
+}
+COALESCE, *PCOALESCE;
+
+void   coalesce_init (PCOALESCE co, coalesce_emit emit, void * opaque);
+
+/* add length bytes described by count PFNs starting offset bytes into the
+ * first page */
+int    coalesce_pfns (PCOALESCE co, const CO_PFN * pfns, CO_SIZE count, CO_U32 offset, CO_U64 length);
+
+/* emit the final run */
+int    coalesce_flush(PCOALESCE co);
+
+/* the number of PFNs following pfns[0] that continue it's run */
+CO_SIZE coalesce_run_length(const CO_PFN * pfns, CO_SIZE count);
+
+/* a byte range of a mapping, the same layout as PortholeDirtyRange */
+typedef struct _CO_RANGE
+{
+	CO_U64 offset;
+	CO_U64 size;
+}
+CO_RANGE, *PCO_RANGE;
+
+/* page align the ranges and clip them to limit bytes, then sort and merge
+ * the overlapping and touching ones in place. empty ranges are dropped,
+ * returns the number of ranges left */
+CO_SIZE coalesce_ranges(PCO_RANGE ranges, CO_SIZE count, CO_U64 limit);
+
+#ifdef __cplusplus
+}
+#endif
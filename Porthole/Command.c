@@ -0,0 +1,446 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "command.tmh"
+
+/*
+ * The device only has a single set of command registers, everything in here
+ * must run between cmd_begin and cmd_end. Callers are expected to do all of
+ * the expensive preparation (page locking, building segment tables) before
+ * they get here so the lock is only held for the register transactions.
+ */
+
+void cmd_begin(const PDEVICE_CONTEXT DeviceContext)
+{
+	ExAcquireFastMutex(&DeviceContext->cmdLock);
+}
+
+static void release_held(PCMD_HELD held)
+{
+	for (PCMD_HELD next; held; held = next)
+	{
+		next = held->next;
+		held->release(held);
+	}
+}
+
+void cmd_end(const PDEVICE_CONTEXT DeviceContext)
+{
+	/* what a hung command was given, the device has since finished it */
+	PCMD_HELD released = DeviceContext->cmdReleased;
+	DeviceContext->cmdReleased = NULL;
+	ExReleaseFastMutex(&DeviceContext->cmdLock);
+
+	release_held(released);
+}
+
+BOOLEAN cmd_hung(const PDEVICE_CONTEXT DeviceContext, const NTSTATUS result)
+{
+	return result == STATUS_IO_TIMEOUT && DeviceContext->cmdHung;
+}
+
+void cmd_quarantine(const PDEVICE_CONTEXT DeviceContext, const PCMD_HELD held, const PCMD_RELEASE release)
+{
+	held->release = release;
+	held->unmap   = FALSE;
+	held->next    = DeviceContext->cmdHeld;
+	DeviceContext->cmdHeld = held;
+}
+
+void cmd_quarantine_unmap(const PDEVICE_CONTEXT DeviceContext, const PCMD_HELD held, const PCMD_RELEASE release, const PortholeMapID id)
+{
+	cmd_quarantine(DeviceContext, held, release);
+	held->unmap = TRUE;
+	held->id    = id;
+}
+
+void cmd_cleanup(const PDEVICE_CONTEXT DeviceContext)
+{
+	release_held(DeviceContext->cmdReleased);
+	release_held(DeviceContext->cmdHeld);
+	DeviceContext->cmdReleased = NULL;
+	DeviceContext->cmdHeld     = NULL;
+	DeviceContext->cmdHung     = 0;
+}
+
+/* number of register polls before the waiter starts to sleep */
+#define WAIT_SPIN_COUNT   1000
+
+/* initial and maximum sleep between polls, in 100ns units */
+#define WAIT_DELAY_MIN    10
+#define WAIT_DELAY_MAX    (10 * 1000 * 10)
+
+/* give up on the device after this many microseconds */
+#define WAIT_TIMEOUT_US   (5 * 1000 * 1000)
+
+static UINT32 wait_command(const UINT32 mask)
+{
+	switch (mask)
+	{
+		case PH_REG_CR_START      :
+		case PH_REG_CR_EXTEND     : return PORTHOLE_CMD_START;
+		case PH_REG_CR_ADD_SEGMENT: return PORTHOLE_CMD_ADD_SEGMENT;
+		case PH_REG_CR_ADD_TABLE  :
+		case PH_REG_CR_DIRTY      : return PORTHOLE_CMD_ADD_TABLE;
+		case PH_REG_CR_FINISH     : return PORTHOLE_CMD_FINISH;
+		default                   : return PORTHOLE_CMD_UNMAP;
+	}
+}
+
+static void wait_stats(const PDEVICE_CONTEXT DeviceContext, const UINT32 mask, const UINT64 us, const ULONG polls)
+{
+	stats_add(DeviceContext, PORTHOLE_STAT_COMMANDS , 1);
+	stats_add(DeviceContext, PORTHOLE_STAT_REG_POLLS, polls);
+	stats_add(DeviceContext, PORTHOLE_STAT_WAIT_US + wait_command(mask), (LONG64)us);
+}
+
+static void wait_record(const PDEVICE_CONTEXT DeviceContext, const UINT32 mask, const UINT64 us, const ULONG polls)
+{
+	const UINT32 bucket = us == 0 ? 0 :
+		min((UINT32)RtlFindMostSignificantBit(us) + 1, PORTHOLE_WAIT_BUCKETS - 1);
+
+	InterlockedIncrement64((LONG64 *)&DeviceContext->waitHistogram.buckets[wait_command(mask)][bucket]);
+	wait_stats(DeviceContext, mask, us, polls);
+}
+
+static NTSTATUS wait_device(const PDEVICE_CONTEXT DeviceContext, const UINT32 mask, const UINT32 value)
+{
+	PortholeDeviceRegisters *regs = DeviceContext->regs;
+
+	LARGE_INTEGER freq;
+	const LARGE_INTEGER start = KeQueryPerformanceCounter(&freq);
+	UINT64 elapsed = 0;
+	ULONG  polls   = 0;
+
+	/* most commands complete in well under a microsecond */
+	for (int i = 0; i < WAIT_SPIN_COUNT; ++i)
+	{
+		++polls;
+		if ((regs->cr & mask) == value)
+			goto done;
+		YieldProcessor();
+	}
+
+	/* any completion from here on will signal the event, anything prior is
+	 * already visible in the control register */
+	if (DeviceContext->caps & PH_REG_CAPS_CMD_IRQ)
+	{
+		KeClearEvent(&DeviceContext->cmdEvent);
+
+		/* have the completion vector wake us where we are running */
+		DeviceContext->cmdProcessor = KeGetCurrentProcessorIndex();
+	}
+
+	LARGE_INTEGER delay;
+	delay.QuadPart = WAIT_DELAY_MIN;
+	for (;;)
+	{
+		++polls;
+		if ((regs->cr & mask) == value)
+			break;
+
+		elapsed = ((UINT64)(KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart) * 1000000) / freq.QuadPart;
+		if (elapsed >= WAIT_TIMEOUT_US)
+		{
+			InterlockedIncrement64((LONG64 *)&DeviceContext->waitHistogram.timeouts[wait_command(mask)]);
+			wait_stats(DeviceContext, mask, elapsed, polls);
+
+			/* the device may still be working on it, see check_idle */
+			DeviceContext->cmdHung = mask;
+			return STATUS_IO_TIMEOUT;
+		}
+
+		/* back off exponentially, the timeout on the completion event only
+		 * guards against a lost interrupt */
+		LARGE_INTEGER timeout;
+		timeout.QuadPart = -delay.QuadPart;
+		if (DeviceContext->caps & PH_REG_CAPS_CMD_IRQ)
+			KeWaitForSingleObject(&DeviceContext->cmdEvent, Executive, KernelMode, FALSE, &timeout);
+		else
+			KeDelayExecutionThread(KernelMode, FALSE, &timeout);
+
+		delay.QuadPart = min(delay.QuadPart * 2, WAIT_DELAY_MAX);
+	}
+
+done:
+	elapsed = ((UINT64)(KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart) * 1000000) / freq.QuadPart;
+	wait_record(DeviceContext, mask, elapsed, polls);
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS check_success(const PortholeDeviceRegisters *regs)
+{
+	/* this must be checked first, a disconnect invalidates all mappings */
+	if (regs->cr & PH_REG_CR_NOCONN)
+		return STATUS_DEVICE_NOT_CONNECTED;
+
+	/* not STATUS_TIMEOUT, that is a success code */
+	if (regs->cr & PH_REG_CR_TIMEOUT)
+		return STATUS_IO_TIMEOUT;
+
+	if (regs->cr & PH_REG_CR_BADADDR)
+		return STATUS_INVALID_ADDRESS;
+
+	if (regs->cr & PH_REG_CR_NORES)
+		return STATUS_DEVICE_INSUFFICIENT_RESOURCES;
+
+	if (regs->cr & PH_REG_CR_DEVERR)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS send_unmap(const PDEVICE_CONTEXT DeviceContext, const PortholeMapID id)
+{
+	PortholeDeviceRegisters *regs = DeviceContext->regs;
+	NTSTATUS result;
+
+	regs->addr.QuadPart = id;
+	_ReadWriteBarrier();
+	regs->cr |= PH_REG_CR_UNMAP;
+	if (NT_SUCCESS(result = wait_device(DeviceContext, PH_REG_CR_UNMAP, 0x0)))
+		result = check_success(regs);
+
+	return result;
+}
+
+/* a command the device never completed leaves it's bit set in `cr`, setting
+ * another would run it alongside or not at all. refuse everything until the
+ * device clears the bit, drop the mappings it made or kept for callers that
+ * gave up on them and then have cmd_end release what it was given */
+static NTSTATUS check_idle(const PDEVICE_CONTEXT DeviceContext)
+{
+	PortholeDeviceRegisters *regs = DeviceContext->regs;
+	if (!DeviceContext->cmdHung)
+		return STATUS_SUCCESS;
+
+	if (regs->cr & DeviceContext->cmdHung)
+		return STATUS_DEVICE_BUSY;
+
+	/* a late FINISH of a new mapping left it's ID in the registers */
+	const BOOLEAN late =
+		DeviceContext->cmdHung == PH_REG_CR_FINISH &&
+		DeviceContext->cmdOpen == PH_REG_CR_START  &&
+		NT_SUCCESS(check_success(regs));
+
+	DeviceContext->cmdHung = 0;
+	if (late && cmd_hung(DeviceContext, send_unmap(DeviceContext, regs->addr.LowPart)))
+		return STATUS_DEVICE_BUSY;
+
+	/* an unmap that hangs keeps the rest held until it completes */
+	for (PCMD_HELD held = DeviceContext->cmdHeld; held; held = held->next)
+		if (held->unmap)
+		{
+			held->unmap = FALSE;
+			if (cmd_hung(DeviceContext, send_unmap(DeviceContext, held->id)))
+				return STATUS_DEVICE_BUSY;
+		}
+
+	PCMD_HELD * tail = &DeviceContext->cmdReleased;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = DeviceContext->cmdHeld;
+
+	DeviceContext->cmdHeld = NULL;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS send_segment(const PDEVICE_CONTEXT DeviceContext, UINT64 addr, UINT32 size)
+{
+	PortholeDeviceRegisters *regs = DeviceContext->regs;
+
+	NTSTATUS result = wait_device(DeviceContext, PH_REG_CR_ADD_SEGMENT, 0x0);
+	if (!NT_SUCCESS(result) || !NT_SUCCESS(result = check_success(regs)))
+		return result;
+
+	/* send the segment */
+	regs->addr.QuadPart = addr;
+	regs->size          = size;
+	_ReadWriteBarrier();
+	regs->cr    |= PH_REG_CR_ADD_SEGMENT;
+
+	return STATUS_SUCCESS;
+}
+
+/* the largest piece of a segment the 32 bit size register can carry */
+#define SEGMENT_MAX_V1 (MAXUINT32 & ~(UINT32)(PAGE_SIZE - 1))
+
+/* protocol v1, hand the device each segment with it's own handshake. the
+ * final segment is left in flight, see wait_sent */
+static NTSTATUS send_segments(const PDEVICE_CONTEXT DeviceContext, const PSEGMENT_TABLE table)
+{
+	NTSTATUS result;
+	for (PSEGMENT_PAGE page = table->head; page; page = page->next)
+	{
+		const ULONG count = SEGTABLE_PAGE_COUNT(table, page);
+		for (ULONG i = 0; i < count; ++i)
+		{
+			/* runs of 4GB and over are sent in pieces */
+			UINT64 addr = page->entries[i].addr;
+			UINT64 size = page->entries[i].size;
+			do
+			{
+				const UINT32 piece = (UINT32)min(size, SEGMENT_MAX_V1);
+				if (!NT_SUCCESS(result = send_segment(DeviceContext, addr, piece)))
+					return result;
+
+				addr += piece;
+				size -= piece;
+			}
+			while (size);
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+/* protocol v2, hand the device the whole segment table in one handshake.
+ * the device reads the table after this returns, see wait_sent */
+static void send_table(const PDEVICE_CONTEXT DeviceContext, const PSEGMENT_TABLE table)
+{
+	PortholeDeviceRegisters *regs = DeviceContext->regs;
+
+	regs->addr.QuadPart = table->head->pa.QuadPart;
+	regs->size          = table->count;
+	_ReadWriteBarrier();
+	regs->cr           |= PH_REG_CR_ADD_TABLE;
+}
+
+static NTSTATUS send_segtable(const PDEVICE_CONTEXT DeviceContext, const PSEGMENT_TABLE table)
+{
+	if (!(DeviceContext->caps & PH_REG_CAPS_SEGTABLE))
+		return send_segments(DeviceContext, table);
+
+	send_table(DeviceContext, table);
+	return STATUS_SUCCESS;
+}
+
+/* wait for the device to take what send_segtable gave it and check the
+ * result, until then the table must not be touched */
+static NTSTATUS wait_sent(const PDEVICE_CONTEXT DeviceContext)
+{
+	const UINT32 mask = (DeviceContext->caps & PH_REG_CAPS_SEGTABLE) ?
+		PH_REG_CR_ADD_TABLE : PH_REG_CR_ADD_SEGMENT;
+
+	NTSTATUS result = wait_device(DeviceContext, mask, 0x0);
+	if (!NT_SUCCESS(result))
+		return result;
+	return check_success(DeviceContext->regs);
+}
+
+/* tell the device we are about to send a list of segments */
+static NTSTATUS open_mapping(const PDEVICE_CONTEXT DeviceContext, const UINT32 open)
+{
+	PortholeDeviceRegisters *regs = DeviceContext->regs;
+	NTSTATUS result;
+
+	DeviceContext->cmdOpen = open;
+	_ReadWriteBarrier();
+	regs->cr |= open;
+	if (!NT_SUCCESS(result = wait_device(DeviceContext, open, 0x0)))
+		return result;
+	return check_success(regs);
+}
+
+/* send the final message */
+static NTSTATUS finish_mapping(const PDEVICE_CONTEXT DeviceContext, const UINT32 type, PPortholeMapID id)
+{
+	PortholeDeviceRegisters *regs = DeviceContext->regs;
+	NTSTATUS result;
+
+	regs->type = type;
+	_ReadWriteBarrier();
+	regs->cr  |= PH_REG_CR_FINISH;
+	if (!NT_SUCCESS(result = wait_device(DeviceContext, PH_REG_CR_FINISH, 0x0)) ||
+		!NT_SUCCESS(result = check_success(regs)))
+		return result;
+
+	/* the mapping ID will be in the lower address register */
+	*id = regs->addr.LowPart;
+	return STATUS_SUCCESS;
+}
+
+/* open a mapping with START or EXTEND, send the table and finish it */
+static NTSTATUS send_mapping(const PDEVICE_CONTEXT DeviceContext, const UINT32 open, const PSEGMENT_TABLE table, const UINT32 type, PPortholeMapID id)
+{
+	NTSTATUS result;
+	if (!NT_SUCCESS(result = open_mapping(DeviceContext, open)) ||
+		!NT_SUCCESS(result = send_segtable(DeviceContext, table)) ||
+		!NT_SUCCESS(result = wait_sent(DeviceContext)))
+		return result;
+
+	return finish_mapping(DeviceContext, type, id);
+}
+
+NTSTATUS cmd_map(const PDEVICE_CONTEXT DeviceContext, const PSEGMENT_TABLE table, const UINT32 type, PPortholeMapID id)
+{
+	NTSTATUS result = check_idle(DeviceContext);
+	if (!NT_SUCCESS(result))
+		return result;
+	return send_mapping(DeviceContext, PH_REG_CR_START, table, type, id);
+}
+
+NTSTATUS cmd_extend(const PDEVICE_CONTEXT DeviceContext, const PSEGMENT_TABLE table, const PortholeMapID id)
+{
+	if (!(DeviceContext->caps & PH_REG_CAPS_EXTEND))
+		return STATUS_NOT_SUPPORTED;
+
+	NTSTATUS check = check_idle(DeviceContext);
+	if (!NT_SUCCESS(check))
+		return check;
+
+	DeviceContext->regs->addr.QuadPart = id;
+
+	PortholeMapID result;
+	return send_mapping(DeviceContext, PH_REG_CR_EXTEND, table, 0, &result);
+}
+
+NTSTATUS cmd_dirty(const PDEVICE_CONTEXT DeviceContext, const PortholeMapID id, const PSEGMENT_TABLE table)
+{
+	PortholeDeviceRegisters *regs = DeviceContext->regs;
+	NTSTATUS result;
+
+	if (!(DeviceContext->caps & PH_REG_CAPS_DIRTY))
+		return STATUS_NOT_SUPPORTED;
+
+	if (!NT_SUCCESS(result = check_idle(DeviceContext)))
+		return result;
+
+	regs->type          = id;
+	regs->addr.QuadPart = table->head->pa.QuadPart;
+	regs->size          = table->count;
+	_ReadWriteBarrier();
+	regs->cr           |= PH_REG_CR_DIRTY;
+	if (NT_SUCCESS(result = wait_device(DeviceContext, PH_REG_CR_DIRTY, 0x0)))
+		result = check_success(regs);
+
+	return result;
+}
+
+NTSTATUS cmd_unmap(const PDEVICE_CONTEXT DeviceContext, const PortholeMapID id)
+{
+	NTSTATUS result = check_idle(DeviceContext);
+	if (!NT_SUCCESS(result))
+		return result;
+	return send_unmap(DeviceContext, id);
+}
@@ -0,0 +1,75 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+/* take and release exclusive use of the device's command registers */
+void cmd_begin(const PDEVICE_CONTEXT DeviceContext);
+void cmd_end  (const PDEVICE_CONTEXT DeviceContext);
+
+/* something a command handed to the device, kept in the owner's own record
+ * of it while the device may still be reading it */
+typedef struct _CMD_HELD CMD_HELD, *PCMD_HELD;
+typedef void (*PCMD_RELEASE)(PCMD_HELD held);
+
+struct _CMD_HELD
+{
+	PCMD_HELD     next;
+	PCMD_RELEASE  release;
+	BOOLEAN       unmap; // id is still mapped by the device
+	PortholeMapID id;
+};
+
+/* TRUE if the command that failed with result was never completed by the
+ * device. until it is, every command fails with STATUS_DEVICE_BUSY without
+ * touching the registers, and the tables and pages the hung command was
+ * given must be passed to cmd_quarantine rather than freed */
+BOOLEAN cmd_hung(const PDEVICE_CONTEXT DeviceContext, const NTSTATUS result);
+
+/* keep held until the device completes the hung command, release is then
+ * called from the cmd_end of whichever command notices, or from cmd_cleanup.
+ * must be called between cmd_begin and cmd_end */
+void    cmd_quarantine(const PDEVICE_CONTEXT DeviceContext, const PCMD_HELD held, const PCMD_RELEASE release);
+
+/* as cmd_quarantine for what backs a mapping the device still has, id is
+ * unmapped before held is released. a mapping made by a FINISH that hung is
+ * unmapped by the command layer itself, it's ID never reached the caller */
+void    cmd_quarantine_unmap(const PDEVICE_CONTEXT DeviceContext, const PCMD_HELD held, const PCMD_RELEASE release, const PortholeMapID id);
+
+/* release everything quarantined, the device must no longer be running */
+void    cmd_cleanup(const PDEVICE_CONTEXT DeviceContext);
+
+/* map the segments in the table, returns the device's ID for the mapping */
+NTSTATUS cmd_map(const PDEVICE_CONTEXT DeviceContext, const PSEGMENT_TABLE table, const UINT32 type, PPortholeMapID id);
+
+/* append the segments in the table to an existing mapping, the mapping is
+ * left as it was on failure. needs PH_REG_CAPS_EXTEND */
+NTSTATUS cmd_extend(const PDEVICE_CONTEXT DeviceContext, const PSEGMENT_TABLE table, const PortholeMapID id);
+
+/* hand the device a table of the ranges of a mapping that were written,
+ * see PH_REG_CAPS_DIRTY */
+NTSTATUS cmd_dirty(const PDEVICE_CONTEXT DeviceContext, const PortholeMapID id, const PSEGMENT_TABLE table);
+
+/* tell the device to release a mapping */
+NTSTATUS cmd_unmap(const PDEVICE_CONTEXT DeviceContext, const PortholeMapID id);
+
+EXTERN_C_END
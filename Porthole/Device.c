@@ -30,9 +30,14 @@ SOFTWARE.
 #endif
 
 EVT_WDF_INTERRUPT_ISR     PortholeInterruptISR;
+EVT_WDF_INTERRUPT_ISR     PortholeMessageISR;
 EVT_WDF_INTERRUPT_DPC     PortholeInterruptDPC;
 EVT_WDF_INTERRUPT_ENABLE  PortholeInterruptEnable;
 EVT_WDF_INTERRUPT_DISABLE PortholeInterruptDisable;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP PortholeEvtDeviceContextCleanup;
+KDEFERRED_ROUTINE         PortholeConfigDpc;
+KDEFERRED_ROUTINE         PortholeCompleteDpc;
+KDEFERRED_ROUTINE         PortholeNotifyDpc;
 
 NTSTATUS PortholeCreateDevice(_Inout_ PWDFDEVICE_INIT DeviceInit)
 {
@@ -50,11 +55,15 @@ NTSTATUS PortholeCreateDevice(_Inout_ PWDFDEVICE_INIT DeviceInit)
 	WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
 
 	WDF_FILEOBJECT_CONFIG fileConfig;
-	WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, PortholeDeviceFileCreate, NULL, PortholeDeviceFileCleanup);
+	WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, PortholeDeviceFileCreate, PortholeDeviceFileClose, PortholeDeviceFileCleanup);
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, FILE_OBJECT_CONTEXT);
 	WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, &attributes);
 
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, REQUEST_CONTEXT);
+	WdfDeviceInitSetRequestAttributes(DeviceInit, &attributes);
+
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, DEVICE_CONTEXT);
+	attributes.EvtCleanupCallback = PortholeEvtDeviceContextCleanup;
     status = WdfDeviceCreate(&DeviceInit, &attributes, &device);
 
 	if (!NT_SUCCESS(status))
@@ -63,9 +72,18 @@ NTSTATUS PortholeCreateDevice(_Inout_ PWDFDEVICE_INIT DeviceInit)
     deviceContext = DeviceGetContext(device);
 	RtlZeroMemory(deviceContext, sizeof(DEVICE_CONTEXT));
 
-	KeInitializeSpinLock(&deviceContext->deviceLock   );
-	KeInitializeSpinLock(&deviceContext->eventListLock);
-	InitializeListHead(&deviceContext->eventList);
+	ExInitializeFastMutex(&deviceContext->cmdLock);
+	KeInitializeEvent(&deviceContext->cmdEvent, SynchronizationEvent, FALSE);
+	ExInitializeFastMutex(&deviceContext->releaseLock);
+	KeInitializeSpinLock(&deviceContext->releaseListLock);
+	InitializeListHead(&deviceContext->releaseList);
+	ExInitializeFastMutex(&deviceContext->eventLock);
+	KeInitializeSpinLock(&deviceContext->doorbell.lock);
+	notify_init(&deviceContext->notify);
+
+	status = stats_init(deviceContext);
+	if (!NT_SUCCESS(status))
+		return status;
 
     status = WdfDeviceCreateDeviceInterface(device, &GUID_DEVINTERFACE_PORTHOLE, NULL);
 	if (!NT_SUCCESS(status))
@@ -78,6 +96,95 @@ NTSTATUS PortholeCreateDevice(_Inout_ PWDFDEVICE_INIT DeviceInit)
     return status;
 }
 
+/* read a processor index for a vector's DPC from the device's registry key */
+static ULONG vector_processor(const WDFKEY Key, PCUNICODE_STRING Name)
+{
+	ULONG value;
+	if (!Key || !NT_SUCCESS(WdfRegistryQueryULong(Key, Name, &value)))
+		return PH_VECTOR_ANY_CPU;
+
+	if (value >= KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS))
+		return PH_VECTOR_ANY_CPU;
+
+	return value;
+}
+
+static void target_dpc(PKDPC Dpc, const ULONG Processor)
+{
+	PROCESSOR_NUMBER number;
+	if (Processor == PH_VECTOR_ANY_CPU || !NT_SUCCESS(KeGetProcessorNumberFromIndex(Processor, &number)))
+		return;
+
+	KeSetTargetProcessorDpcEx(Dpc, &number);
+	KeSetImportanceDpc(Dpc, MediumHighImportance);
+}
+
+/*
+ * each vector gets a DPC of it's own that can be pinned to a processor with
+ * the ConfigProcessor, CompleteProcessor and NotifyProcessor registry
+ * values. Unless pinned, completions are queued to the processor that is
+ * waiting on the command so the waiter is woken where it's cache is warm.
+ */
+static NTSTATUS init_vectors(const WDFDEVICE Device, const PDEVICE_CONTEXT DeviceContext)
+{
+	static PKDEFERRED_ROUTINE routines[PH_VECTOR_COUNT] =
+	{
+		PortholeConfigDpc,
+		PortholeCompleteDpc,
+		PortholeNotifyDpc
+	};
+
+	static const UNICODE_STRING names[PH_VECTOR_COUNT] =
+	{
+		RTL_CONSTANT_STRING(L"ConfigProcessor"  ),
+		RTL_CONSTANT_STRING(L"CompleteProcessor"),
+		RTL_CONSTANT_STRING(L"NotifyProcessor"  )
+	};
+
+	WDFKEY key = NULL;
+	if (!NT_SUCCESS(WdfDeviceOpenRegistryKey(Device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key)))
+		key = NULL;
+
+	for (ULONG i = 0; i < PH_VECTOR_COUNT; ++i)
+	{
+		PPH_VECTOR vector = &DeviceContext->vectors[i];
+		vector->processor = vector_processor(key, &names[i]);
+		KeInitializeDpc(&vector->dpc, routines[i], DeviceContext);
+		target_dpc(&vector->dpc, vector->processor);
+	}
+
+	if (key)
+		WdfRegistryClose(key);
+
+	const ULONG count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	DeviceContext->cmdDpcs = ExAllocatePoolWithTag(NonPagedPool, count * sizeof(KDPC), TAG);
+	if (!DeviceContext->cmdDpcs)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	for (ULONG i = 0; i < count; ++i)
+	{
+		KeInitializeDpc(&DeviceContext->cmdDpcs[i], PortholeCompleteDpc, DeviceContext);
+		target_dpc(&DeviceContext->cmdDpcs[i], i);
+	}
+	DeviceContext->cmdDpcCount = count;
+	return STATUS_SUCCESS;
+}
+
+static void free_vectors(const PDEVICE_CONTEXT DeviceContext)
+{
+	/* nothing can be queued once interrupts are off, let anything that was
+	 * finish before the DPCs go away */
+	KeFlushQueuedDpcs();
+
+	if (DeviceContext->cmdDpcs)
+		ExFreePoolWithTag(DeviceContext->cmdDpcs, TAG);
+
+	DeviceContext->cmdDpcs     = NULL;
+	DeviceContext->cmdDpcCount = 0;
+	DeviceContext->vectorCount = 0;
+	DeviceContext->vectored    = FALSE;
+}
+
 NTSTATUS PortholePrepareHardware(_In_ WDFDEVICE Device, _In_ WDFCMRESLIST ResourceRaw, _In_ WDFCMRESLIST ResourceTranslated)
 {
 	PDEVICE_CONTEXT deviceContext = DeviceGetContext(Device);
@@ -104,7 +211,54 @@ NTSTATUS PortholePrepareHardware(_In_ WDFDEVICE Device, _In_ WDFCMRESLIST Resour
 	if (!deviceContext->regs)
 		return STATUS_DEVICE_HARDWARE_ERROR;
 
-	NTSTATUS status = STATUS_DEVICE_HARDWARE_ERROR;
+	deviceContext->caps = deviceContext->regs->caps;
+
+	NTSTATUS status = init_vectors(Device, deviceContext);
+	if (!NT_SUCCESS(status))
+		goto fail;
+
+	/* prefer message signalled interrupts, they are never shared so the ISR
+	 * doesn't need to read the device to know the interrupt is ours */
+	status = STATUS_DEVICE_HARDWARE_ERROR;
+	for (ULONG i = 0; i < resCount && deviceContext->vectorCount < PH_VECTOR_COUNT; ++i)
+	{
+		PCM_PARTIAL_RESOURCE_DESCRIPTOR descriptor;
+		descriptor = WdfCmResourceListGetDescriptor(ResourceTranslated, i);
+		if (!descriptor)
+		{
+			status = STATUS_DEVICE_CONFIGURATION_ERROR;
+			goto fail;
+		}
+
+		if (descriptor->Type != CmResourceTypeInterrupt || !(descriptor->Flags & CM_RESOURCE_INTERRUPT_MESSAGE))
+			continue;
+
+		WDF_INTERRUPT_CONFIG irqConfig;
+		WDF_INTERRUPT_CONFIG_INIT(&irqConfig, PortholeMessageISR, PortholeInterruptDPC);
+		irqConfig.InterruptTranslated = descriptor;
+		irqConfig.InterruptRaw        = WdfCmResourceListGetDescriptor(ResourceRaw, i);
+		irqConfig.EvtInterruptEnable  = PortholeInterruptEnable;
+		irqConfig.EvtInterruptDisable = PortholeInterruptDisable;
+		status = WdfInterruptCreate(Device, &irqConfig, WDF_NO_OBJECT_ATTRIBUTES,
+			&deviceContext->vectors[deviceContext->vectorCount].interrupt);
+		if (!NT_SUCCESS(status))
+			goto fail;
+
+		++deviceContext->vectorCount;
+	}
+
+	if (deviceContext->vectorCount)
+	{
+		/* with too few vectors everything is decoded from `isr` as before */
+		deviceContext->interrupt = deviceContext->vectors[PH_VECTOR_CONFIG].interrupt;
+		deviceContext->vectored  =
+			deviceContext->vectorCount == PH_VECTOR_COUNT &&
+			(deviceContext->caps & PH_REG_CAPS_VECTORS);
+
+		deviceContext->connected = (deviceContext->regs->cr & PH_REG_CR_NOCONN) == 0x0 ? TRUE : FALSE;
+		return STATUS_SUCCESS;
+	}
+
 	for (ULONG i = 0; i < resCount; ++i)
 	{
 		PCM_PARTIAL_RESOURCE_DESCRIPTOR descriptor;
@@ -132,6 +286,8 @@ NTSTATUS PortholePrepareHardware(_In_ WDFDEVICE Device, _In_ WDFCMRESLIST Resour
 		}
 	}
 
+fail:
+	free_vectors(deviceContext);
 	MmUnmapIoSpace(deviceContext->regs, sizeof(PortholeDeviceRegisters));
 	deviceContext->regs = NULL;
 	return status;
@@ -145,25 +301,14 @@ NTSTATUS PortholeReleaseHardware(_In_ WDFDEVICE Device, _In_ WDFCMRESLIST Resour
 	PDEVICE_CONTEXT deviceContext = DeviceGetContext(Device);
 
 	// disable interrupts
-	deviceContext->regs->cr &= (~PH_REG_CR_IRQ);
+	deviceContext->regs->cr &= ~(PH_REG_CR_IRQ | PH_REG_CR_VECTORS);
+	free_vectors(deviceContext);
 
-	// dereference and free the event list
-	KIRQL oldIRQL;
-	KeAcquireSpinLock(&deviceContext->eventListLock, &oldIRQL);
-	while (!IsListEmpty(&deviceContext->eventList))
-	{
-		PLIST_ENTRY     entry  = RemoveTailList(&deviceContext->eventList);
-		PPORTHOLE_EVENT record = CONTAINING_RECORD(entry, PORTHOLE_EVENT, listEntry);
-
-		if (record->connect)
-			ObDereferenceObject(record->connect);
+	// dereference and free the event subscribers
+	events_free(deviceContext);
 
-		if (record->disconnect)
-			ObDereferenceObject(record->disconnect);
-
-		ExFreePoolWithTag(record, TAG);
-	}
-	KeReleaseSpinLock(&deviceContext->eventListLock, oldIRQL);
+	// the device is going away, free what any hung command was given
+	cmd_cleanup(deviceContext);
 
 	// unmap the io space
 	if (deviceContext->regs)
@@ -176,8 +321,9 @@ NTSTATUS PortholeInterruptEnable(WDFINTERRUPT Interrupt, WDFDEVICE Device)
 {
 	UNREFERENCED_PARAMETER(Interrupt);
 
+	/* called once per vector, the first enables them all */
 	PDEVICE_CONTEXT deviceContext = DeviceGetContext(Device);
-	deviceContext->regs->cr |= PH_REG_CR_IRQ;
+	deviceContext->regs->cr |= PH_REG_CR_IRQ | (deviceContext->vectored ? PH_REG_CR_VECTORS : 0);
 	return STATUS_SUCCESS;
 }
 
@@ -186,7 +332,7 @@ NTSTATUS PortholeInterruptDisable(WDFINTERRUPT Interrupt, WDFDEVICE Device)
 	UNREFERENCED_PARAMETER(Interrupt);
 
 	PDEVICE_CONTEXT deviceContext = DeviceGetContext(Device);
-	deviceContext->regs->cr &= (~PH_REG_CR_IRQ);
+	deviceContext->regs->cr &= ~(PH_REG_CR_IRQ | PH_REG_CR_VECTORS);
 	return STATUS_SUCCESS;
 }
 
@@ -198,35 +344,122 @@ BOOLEAN PortholeInterruptISR(WDFINTERRUPT Interrupt, ULONG MessageID)
 	PDEVICE_CONTEXT deviceContext = DeviceGetContext(device);
 
 	if (deviceContext->regs->isr)
+	{
+		stats_add(deviceContext, PORTHOLE_STAT_INTERRUPTS, 1);
 		WdfInterruptQueueDpcForIsr(Interrupt);
+	}
 
 	return TRUE;
 }
 
-void PortholeInterruptDPC(WDFINTERRUPT Interrupt, WDFOBJECT AssociatedObject)
+BOOLEAN PortholeMessageISR(WDFINTERRUPT Interrupt, ULONG MessageID)
 {
-	UNREFERENCED_PARAMETER(AssociatedObject);
-
 	WDFDEVICE       device        = WdfInterruptGetDevice(Interrupt);
 	PDEVICE_CONTEXT deviceContext = DeviceGetContext(device);
 
+	stats_add(deviceContext, PORTHOLE_STAT_INTERRUPTS, 1);
+	if (!deviceContext->vectored)
+	{
+		WdfInterruptQueueDpcForIsr(Interrupt);
+		return TRUE;
+	}
+
+	if (MessageID >= PH_VECTOR_COUNT)
+		return TRUE;
+
+	const PPH_VECTOR vector = &deviceContext->vectors[MessageID];
+	if (MessageID == PH_VECTOR_COMPLETE && vector->processor == PH_VECTOR_ANY_CPU)
+	{
+		const ULONG processor = deviceContext->cmdProcessor;
+		if (processor < deviceContext->cmdDpcCount)
+		{
+			KeInsertQueueDpc(&deviceContext->cmdDpcs[processor], NULL, NULL);
+			return TRUE;
+		}
+	}
+
+	KeInsertQueueDpc(&vector->dpc, NULL, NULL);
+	return TRUE;
+}
+
+static void handle_notify(const PDEVICE_CONTEXT deviceContext)
+{
+	/* drain the client's notifications, bounded in case the device keeps
+	 * producing them, whatever is left raises another interrupt */
+	for (ULONG i = 0; i < PH_NOTIFY_DRAIN_MAX; ++i)
+	{
+		const ULONG word = deviceContext->regs->notify;
+		if (word == PH_NOTIFY_EMPTY)
+			break;
+		notify_signal(deviceContext, word & PH_DOORBELL_ID_MASK, word >> PH_DOORBELL_ID_BITS);
+	}
+}
+
+static void handle_isr(const PDEVICE_CONTEXT deviceContext)
+{
+	stats_add(deviceContext, PORTHOLE_STAT_DPCS, 1);
+
 	LONG isr = InterlockedExchange(&(LONG)deviceContext->regs->isr, 0xFFFFFFFF);
 	if (!isr)
 		return;
 
+	/* wake the thread waiting on the current command */
+	if (isr & PH_REG_ISR_COMPLETE)
+		KeSetEvent(&deviceContext->cmdEvent, IO_NO_INCREMENT, FALSE);
+
+	if (isr & PH_REG_ISR_NOTIFY)
+		handle_notify(deviceContext);
+
+	if (!(isr & (PH_REG_ISR_CONNECT | PH_REG_ISR_DISCONNECT)))
+		return;
+
 	deviceContext->connected = (deviceContext->regs->cr & PH_REG_CR_NOCONN) == 0x0 ? TRUE : FALSE;
+	events_signal(deviceContext, isr);
+}
 
-	KeAcquireSpinLockAtDpcLevel(&deviceContext->eventListLock);
-	for (PLIST_ENTRY entry = deviceContext->eventList.Flink; entry != &deviceContext->eventList; entry = entry->Flink)
-	{
-		PPORTHOLE_EVENT record = CONTAINING_RECORD(entry, PORTHOLE_EVENT, listEntry);
+void PortholeInterruptDPC(WDFINTERRUPT Interrupt, WDFOBJECT AssociatedObject)
+{
+	UNREFERENCED_PARAMETER(AssociatedObject);
 
-		// always flag disconnections first if both have happend in the same ISR
-		if ((isr & PH_REG_ISR_DISCONNECT) && record->disconnect)
-			KeSetEvent(record->disconnect, 0, FALSE);
+	WDFDEVICE       device        = WdfInterruptGetDevice(Interrupt);
+	PDEVICE_CONTEXT deviceContext = DeviceGetContext(device);
 
-		if ((isr & PH_REG_ISR_CONNECT) && record->connect)
-			KeSetEvent(record->connect, 0, FALSE);
-	}
-	KeReleaseSpinLockFromDpcLevel(&deviceContext->eventListLock);
+	handle_isr(deviceContext);
+}
+
+void PortholeConfigDpc(PKDPC Dpc, PVOID Context, PVOID Arg1, PVOID Arg2)
+{
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(Arg1);
+	UNREFERENCED_PARAMETER(Arg2);
+
+	/* only connection changes are still latched in `isr` */
+	handle_isr((PDEVICE_CONTEXT)Context);
+}
+
+void PortholeCompleteDpc(PKDPC Dpc, PVOID Context, PVOID Arg1, PVOID Arg2)
+{
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(Arg1);
+	UNREFERENCED_PARAMETER(Arg2);
+
+	const PDEVICE_CONTEXT deviceContext = (PDEVICE_CONTEXT)Context;
+	stats_add(deviceContext, PORTHOLE_STAT_DPCS, 1);
+	KeSetEvent(&deviceContext->cmdEvent, IO_NO_INCREMENT, FALSE);
+}
+
+void PortholeNotifyDpc(PKDPC Dpc, PVOID Context, PVOID Arg1, PVOID Arg2)
+{
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(Arg1);
+	UNREFERENCED_PARAMETER(Arg2);
+
+	const PDEVICE_CONTEXT deviceContext = (PDEVICE_CONTEXT)Context;
+	stats_add(deviceContext, PORTHOLE_STAT_DPCS, 1);
+	handle_notify(deviceContext);
+}
+
+void PortholeEvtDeviceContextCleanup(WDFOBJECT Device)
+{
+	stats_free(DeviceGetContext((WDFDEVICE)Device));
 }
\ No newline at end of file
@@ -21,65 +21,124 @@ SOFTWARE.
 */
 
 #include "public.h"
+#include "registers.h"
 
 EXTERN_C_START
 
-#pragma align(push, 4)
-typedef struct PortholeDeviceRegisters
+#define TAG (ULONG)'TROP'
+
+typedef struct _PORTHOLE_EVENT
 {
-	volatile ULONG cr;
-	volatile ULONG isr;
-	volatile ULONG type;
+	PVOID      owner;
+	LIST_ENTRY listEntry; // in the owner's list of events
+	ULONG      slot;      // index in the subscriber array
+	PKEVENT    connect;
+	PKEVENT    disconnect;
+}
+PORTHOLE_EVENT, *PPORTHOLE_EVENT;
+
+/* the subscribers signalled by the DPC, which reads them without a lock.
+ * slots are only ever appended or cleared in place, compacting or growing
+ * the array publishes a new one */
+typedef struct _EVENT_SLOTS
+{
+	ULONG                    capacity;
+	volatile LONG            count;
+	PPORTHOLE_EVENT volatile slots[ANYSIZE_ARRAY];
+}
+EVENT_SLOTS, *PEVENT_SLOTS;
 
-	volatile ULONG size;
-	volatile PHYSICAL_ADDRESS addr;
+#define PH_DOORBELL_QUEUE 64
 
-	volatile ULONG reserved1;
-	volatile ULONG reserved2;
+/* doorbells waiting for the thread that is currently writing the register */
+typedef struct _DOORBELL_QUEUE
+{
+	KSPIN_LOCK      lock;
+	BOOLEAN         ringing;
+	ULONG           count;
+	ULONG           pending[PH_DOORBELL_QUEUE];
+	LONG64          taken;   // batches the writer has taken out of pending
+	volatile LONG64 written; // of those, the batches written to the register
 }
-PortholeDeviceRegisters, *PPortholeDeviceRegisters;
-#pragma align(pop)
+DOORBELL_QUEUE, *PDOORBELL_QUEUE;
 
-#define PH_REG_CR_IRQ         (1 << 0) // SW=S, SW=C, enable interrupts
-#define PH_REG_CR_START       (1 << 1) // SW=S, HW=C, start of a mapping
-#define PH_REG_CR_ADD_SEGMENT (1 << 2) // SW=S, HW=C, add a segment to mapping
-#define PH_REG_CR_FINISH      (1 << 3) // SW=S, HW=C, end of segments
-#define PH_REG_CR_UNMAP       (1 << 4) // SW=S, HW=C, unmap a segment
+/* each processor counts into it's own cache line, see stats_add */
+typedef struct DECLSPEC_CACHEALIGN _STATS_CPU
+{
+	volatile LONG64 counters[PORTHOLE_STAT_MAX];
+}
+STATS_CPU, *PSTATS_CPU;
 
-#define PH_REG_CR_TIMEOUT     (1 << 5) // HW=S, HW=C, timeout occured
-#define PH_REG_CR_BADADDR     (1 << 6) // HW=S, HW=C, bad address specified
-#define PH_REG_CR_NOCONN      (1 << 7) // HW=S, HW=C, no client connection
-#define PH_REG_CR_NORES       (1 << 8) // HW=S, HW=C, no resources left
-#define PH_REG_CR_DEVERR      (1 << 9) // HW=S, HW=C, invalid device usage
+#define PH_VECTOR_CONFIG   0 // connect and disconnect
+#define PH_VECTOR_COMPLETE 1 // command completion
+#define PH_VECTOR_NOTIFY   2 // client notifications
+#define PH_VECTOR_COUNT    3
 
-// All ISRs are set by hardware and cleared by writing to them
+/* the vector's DPC runs on whichever processor it is queued from */
+#define PH_VECTOR_ANY_CPU  ((ULONG)-1)
 
-/* client connection state changed
- * check PH_REG_CR_NOCONN to determine the current state
- */
-#define PH_REG_ISR_CONNECT    (1 << 0)
-#define PH_REG_ISR_DISCONNECT (1 << 1)
+typedef struct _PH_VECTOR
+{
+	WDFINTERRUPT interrupt;
+	ULONG        processor; // PH_VECTOR_ANY_CPU or a processor index
+	KDPC         dpc;
+}
+PH_VECTOR, *PPH_VECTOR;
 
-#define TAG (ULONG)'TROP'
+/* the workers lent out to lock a buffer, one less than the most threads it
+ * is locked from as the caller is one, see Lock.c */
+#define PH_LOCK_WORKERS (PORTHOLE_MAX_LOCK_THREADS - 1)
 
-typedef struct _PORTHOLE_EVENT
+#define PH_NOTIFY_BUCKETS 64
+
+/* subscriptions to client notifications, hashed by device mapping ID */
+typedef struct _NOTIFY_REGISTRY
 {
-	PVOID      owner;
-	LIST_ENTRY listEntry;
-	PKEVENT    connect;
-	PKEVENT    disconnect;
+	KSPIN_LOCK lock;
+	LIST_ENTRY buckets[PH_NOTIFY_BUCKETS];
 }
-PORTHOLE_EVENT, *PPORTHOLE_EVENT;
+NOTIFY_REGISTRY, *PNOTIFY_REGISTRY;
 
 typedef struct _DEVICE_CONTEXT
 {
 	PPortholeDeviceRegisters regs;
+	ULONG        caps;
 	BOOLEAN      connected;
 	WDFINTERRUPT interrupt;
-	KSPIN_LOCK   deviceLock;
-
-	KSPIN_LOCK eventListLock;
-	LIST_ENTRY eventList;
+	FAST_MUTEX   cmdLock;
+	PH_VECTOR    vectors[PH_VECTOR_COUNT];
+	ULONG        vectorCount;
+	BOOLEAN      vectored;     // PH_REG_CR_VECTORS is in use
+	PKDPC        cmdDpcs;      // completion DPC per processor
+	ULONG        cmdDpcCount;
+	ULONG        cmdProcessor; // index of the processor waiting on a command
+	KEVENT       cmdEvent;
+	ULONG        cmdHung;      // command bits the device never cleared, see cmd_hung
+	ULONG        cmdOpen;      // START or EXTEND, how the last mapping sent was opened
+	struct _CMD_HELD * cmdHeld;     // quarantined until cmdHung clears
+	struct _CMD_HELD * cmdReleased; // for cmd_end to release
+	WDFQUEUE     cmdQueue;
+	WDFWORKITEM  cmdWorker;
+
+	/* handles with deferred unmaps waiting on the release worker */
+	FAST_MUTEX   releaseLock;     // held while a handle's unmaps are run
+	KSPIN_LOCK   releaseListLock;
+	LIST_ENTRY   releaseList;
+	WDFQUEUE     flushQueue;
+	WDFWORKITEM  releaseWorker;
+
+	WDFWORKITEM     lockWorkers[PH_LOCK_WORKERS];
+	volatile LONG64 lockIdle; // a bit per worker not lent out
+
+	PortholeWaitHistogram waitHistogram;
+	PSTATS_CPU            stats;
+	ULONG                 statsCount;
+	DOORBELL_QUEUE        doorbell;
+	NOTIFY_REGISTRY       notify;
+
+	FAST_MUTEX            eventLock; // serialises changes to `events`
+	PEVENT_SLOTS volatile events;
+	ULONG                 eventLive;
 }
 DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
@@ -0,0 +1,106 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "doorbell.tmh"
+
+/*
+ * each doorbell is a register write and so a trip out to the hypervisor.
+ * only one thread writes at a time, doorbells raised meanwhile are queued
+ * for it and any for the same mapping are merged, so a burst collapses into
+ * one write per mapping. a doorbell handed to the writer waits for the batch
+ * it went out in, so the caller's claim on the mapping covers the write.
+ */
+NTSTATUS doorbell_ring(const PDEVICE_CONTEXT DeviceContext, const int id, const ULONG value)
+{
+	PDOORBELL_QUEUE queue = &DeviceContext->doorbell;
+
+	if (!(DeviceContext->caps & PH_REG_CAPS_DOORBELL))
+		return STATUS_NOT_SUPPORTED;
+
+	if ((ULONG)id > PH_DOORBELL_ID_MASK || value > PH_DOORBELL_VALUE_MASK)
+		return STATUS_INVALID_PARAMETER;
+
+	const ULONG word = PH_DOORBELL(id, value);
+	BOOLEAN     queued = FALSE;
+
+	KIRQL oldIRQL;
+	KeAcquireSpinLock(&queue->lock, &oldIRQL);
+	for (ULONG i = 0; i < queue->count; ++i)
+		if ((queue->pending[i] & PH_DOORBELL_ID_MASK) == (ULONG)id)
+		{
+			queue->pending[i] |= word;
+			queued = TRUE;
+			break;
+		}
+
+	if (!queued && queue->count < PH_DOORBELL_QUEUE)
+	{
+		queue->pending[queue->count++] = word;
+		queued = TRUE;
+	}
+
+	/* someone else is writing, they will pick this up with their next
+	 * batch. wait for it, at worst the rest of their current batch and
+	 * this one, so the mapping stays claimed until the write is out */
+	if (queue->ringing && queued)
+	{
+		const LONG64 batch = queue->taken + 1;
+		KeReleaseSpinLock(&queue->lock, oldIRQL);
+		stats_add(DeviceContext, PORTHOLE_STAT_DOORBELLS_MERGED, 1);
+
+		while (ReadAcquire64(&queue->written) < batch)
+			YieldProcessor();
+		return STATUS_SUCCESS;
+	}
+
+	/* the queue is full, don't wait for it to drain */
+	if (!queued)
+	{
+		KeReleaseSpinLock(&queue->lock, oldIRQL);
+		DeviceContext->regs->doorbell = word;
+		stats_add(DeviceContext, PORTHOLE_STAT_DOORBELLS, 1);
+		return STATUS_SUCCESS;
+	}
+
+	queue->ringing = TRUE;
+	while (queue->count)
+	{
+		ULONG pending[PH_DOORBELL_QUEUE];
+		const ULONG  count = queue->count;
+		const LONG64 batch = ++queue->taken;
+		RtlCopyMemory(pending, queue->pending, count * sizeof(ULONG));
+		queue->count = 0;
+		KeReleaseSpinLock(&queue->lock, oldIRQL);
+
+		for (ULONG i = 0; i < count; ++i)
+			DeviceContext->regs->doorbell = pending[i];
+		InterlockedExchange64(&queue->written, batch);
+		stats_add(DeviceContext, PORTHOLE_STAT_DOORBELLS, count);
+
+		KeAcquireSpinLock(&queue->lock, &oldIRQL);
+	}
+	queue->ringing = FALSE;
+	KeReleaseSpinLock(&queue->lock, oldIRQL);
+
+	return STATUS_SUCCESS;
+}
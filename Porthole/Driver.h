@@ -25,7 +25,20 @@ SOFTWARE.
 #include <initguid.h>
 
 #include "device.h"
+#include "stats.h"
+#include "coalesce.h"
+#include "segment.h"
+#include "command.h"
+#include "doorbell.h"
+#include "notify.h"
+#include "events.h"
+#include "regcache.h"
+#include "buffer.h"
+#include "handle.h"
+#include "lock.h"
+#include "stream.h"
 #include "queue.h"
+#include "map.h"
 #include "trace.h"
 
 EXTERN_C_START
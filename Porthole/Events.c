@@ -0,0 +1,193 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "events.tmh"
+
+/*
+ * The DPC walks the subscriber array without taking a lock, so it's cost
+ * only depends on the number of subscribers and never on the callers
+ * adding or removing them. Writers are serialised by eventLock and run at
+ * PASSIVE_LEVEL, once an array or record can no longer be reached they wait
+ * for every queued DPC to run before it is freed.
+ */
+
+#define EVENT_SLOTS_MIN 16
+
+static void free_record(const PPORTHOLE_EVENT record)
+{
+	if (record->connect)
+		ObDereferenceObject(record->connect);
+
+	if (record->disconnect)
+		ObDereferenceObject(record->disconnect);
+
+	ExFreePoolWithTag(record, TAG);
+}
+
+/* publish a new array holding the live subscribers with room for at least
+ * one more, must be called with eventLock held */
+static NTSTATUS rebuild(const PDEVICE_CONTEXT DeviceContext)
+{
+	const PEVENT_SLOTS old = DeviceContext->events;
+
+	ULONG capacity = old ? old->capacity : EVENT_SLOTS_MIN;
+	if (DeviceContext->eventLive + 1 > capacity / 2)
+		capacity *= 2;
+
+	PEVENT_SLOTS slots = ExAllocatePoolWithTag(NonPagedPool,
+		FIELD_OFFSET(EVENT_SLOTS, slots) + capacity * sizeof(PPORTHOLE_EVENT), TAG);
+	if (!slots)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	slots->capacity = capacity;
+	slots->count    = 0;
+	if (old)
+		for (LONG i = 0; i < old->count; ++i)
+		{
+			const PPORTHOLE_EVENT record = old->slots[i];
+			if (!record)
+				continue;
+
+			record->slot = slots->count;
+			slots->slots[slots->count++] = record;
+		}
+
+	InterlockedExchangePointer((PVOID volatile *)&DeviceContext->events, slots);
+	if (old)
+	{
+		KeFlushQueuedDpcs();
+		ExFreePoolWithTag(old, TAG);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS events_add(const PDEVICE_CONTEXT DeviceContext, const PLIST_ENTRY OwnerList, const PPORTHOLE_EVENT record)
+{
+	ExAcquireFastMutex(&DeviceContext->eventLock);
+
+	PEVENT_SLOTS slots = DeviceContext->events;
+	if (!slots || (ULONG)slots->count == slots->capacity)
+	{
+		const NTSTATUS status = rebuild(DeviceContext);
+		if (!NT_SUCCESS(status))
+		{
+			ExReleaseFastMutex(&DeviceContext->eventLock);
+			return status;
+		}
+		slots = DeviceContext->events;
+	}
+
+	/* the slot must be filled before the DPC can see it */
+	record->slot = slots->count;
+	slots->slots[record->slot] = record;
+	InterlockedIncrement(&slots->count);
+
+	InsertTailList(OwnerList, &record->listEntry);
+	++DeviceContext->eventLive;
+
+	ExReleaseFastMutex(&DeviceContext->eventLock);
+	return STATUS_SUCCESS;
+}
+
+void events_remove(const PDEVICE_CONTEXT DeviceContext, const PLIST_ENTRY OwnerList)
+{
+	LIST_ENTRY removed;
+	InitializeListHead(&removed);
+
+	/* only the owner's records are visited, their slots are left empty and
+	 * reclaimed the next time the array is rebuilt */
+	ExAcquireFastMutex(&DeviceContext->eventLock);
+	const PEVENT_SLOTS slots = DeviceContext->events;
+	while (!IsListEmpty(OwnerList))
+	{
+		PLIST_ENTRY     entry  = RemoveHeadList(OwnerList);
+		PPORTHOLE_EVENT record = CONTAINING_RECORD(entry, PORTHOLE_EVENT, listEntry);
+
+		InterlockedExchangePointer((PVOID volatile *)&slots->slots[record->slot], NULL);
+		--DeviceContext->eventLive;
+		InsertTailList(&removed, entry);
+	}
+	ExReleaseFastMutex(&DeviceContext->eventLock);
+
+	if (IsListEmpty(&removed))
+		return;
+
+	KeFlushQueuedDpcs();
+	while (!IsListEmpty(&removed))
+		free_record(CONTAINING_RECORD(RemoveHeadList(&removed), PORTHOLE_EVENT, listEntry));
+}
+
+void events_free(const PDEVICE_CONTEXT DeviceContext)
+{
+	ExAcquireFastMutex(&DeviceContext->eventLock);
+	const PEVENT_SLOTS slots = InterlockedExchangePointer((PVOID volatile *)&DeviceContext->events, NULL);
+	DeviceContext->eventLive = 0;
+
+	/* the owners may still be open, don't leave them pointing at us */
+	if (slots)
+		for (LONG i = 0; i < slots->count; ++i)
+			if (slots->slots[i])
+				RemoveEntryList(&slots->slots[i]->listEntry);
+	ExReleaseFastMutex(&DeviceContext->eventLock);
+
+	if (!slots)
+		return;
+
+	KeFlushQueuedDpcs();
+	for (LONG i = 0; i < slots->count; ++i)
+		if (slots->slots[i])
+			free_record(slots->slots[i]);
+	ExFreePoolWithTag(slots, TAG);
+}
+
+void events_signal(const PDEVICE_CONTEXT DeviceContext, const LONG isr)
+{
+	const PEVENT_SLOTS slots = ReadPointerAcquire((PVOID volatile *)&DeviceContext->events);
+	if (!slots)
+		return;
+
+	const LONG count   = ReadAcquire(&slots->count);
+	LONG64     signals = 0;
+	for (LONG i = 0; i < count; ++i)
+	{
+		const PPORTHOLE_EVENT record = ReadPointerAcquire((PVOID volatile *)&slots->slots[i]);
+		if (!record)
+			continue;
+
+		// always flag disconnections first if both have happend in the same ISR
+		if ((isr & PH_REG_ISR_DISCONNECT) && record->disconnect)
+		{
+			KeSetEvent(record->disconnect, 0, FALSE);
+			++signals;
+		}
+
+		if ((isr & PH_REG_ISR_CONNECT) && record->connect)
+		{
+			KeSetEvent(record->connect, 0, FALSE);
+			++signals;
+		}
+	}
+
+	stats_add(DeviceContext, PORTHOLE_STAT_EVENT_SIGNALS, signals);
+}
@@ -0,0 +1,37 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+/* add a subscriber and link it into it's owner's list */
+NTSTATUS events_add   (const PDEVICE_CONTEXT DeviceContext, const PLIST_ENTRY OwnerList, const PPORTHOLE_EVENT record);
+
+/* remove and free every subscriber in an owner's list */
+void     events_remove(const PDEVICE_CONTEXT DeviceContext, const PLIST_ENTRY OwnerList);
+
+/* remove and free every subscriber */
+void     events_free  (const PDEVICE_CONTEXT DeviceContext);
+
+/* signal the subscribers for a connection change, called from the DPC */
+void     events_signal(const PDEVICE_CONTEXT DeviceContext, const LONG isr);
+
+EXTERN_C_END
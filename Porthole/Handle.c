@@ -0,0 +1,200 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "handle.tmh"
+
+void handle_table_init(PHANDLE_TABLE table)
+{
+	RtlZeroMemory(table, sizeof(HANDLE_TABLE));
+	KeInitializeSpinLock(&table->lock);
+}
+
+void handle_table_free(PHANDLE_TABLE table)
+{
+	for (ULONG i = 0; i < table->chunkCount; ++i)
+		ExFreePoolWithTag(table->chunks[i], TAG);
+
+	if (table->chunks)
+		ExFreePoolWithTag(table->chunks, TAG);
+
+	handle_table_init(table);
+}
+
+static __forceinline PMDLInfo get_entry(const PHANDLE_TABLE table, const ULONG index)
+{
+	return &table->chunks[index >> HANDLE_CHUNK_SHIFT][index & (HANDLE_CHUNK_SIZE - 1)];
+}
+
+/* add a chunk of free entries to the table, must be called with the lock held */
+static NTSTATUS grow_table(PHANDLE_TABLE table)
+{
+	if (HANDLE_TABLE_SIZE(table) >= HANDLE_MAX_ENTRIES)
+		return STATUS_DEVICE_INSUFFICIENT_RESOURCES;
+
+	/* double the directory when it's full, the chunks themselves never move */
+	if (table->chunkCount == table->chunkSlots)
+	{
+		const ULONG slots = table->chunkSlots ? table->chunkSlots * 2 : 4;
+		PMDLInfo * chunks = (PMDLInfo *)ExAllocatePoolWithTag(NonPagedPool, slots * sizeof(PMDLInfo), TAG);
+		if (!chunks)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		if (table->chunks)
+		{
+			RtlCopyMemory(chunks, table->chunks, table->chunkCount * sizeof(PMDLInfo));
+			ExFreePoolWithTag(table->chunks, TAG);
+		}
+
+		table->chunks     = chunks;
+		table->chunkSlots = slots;
+	}
+
+	PMDLInfo chunk = (PMDLInfo)ExAllocatePoolWithTag(NonPagedPool, HANDLE_CHUNK_SIZE * sizeof(MDLInfo), TAG);
+	if (!chunk)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	RtlZeroMemory(chunk, HANDLE_CHUNK_SIZE * sizeof(MDLInfo));
+
+	/* chain the new entries onto the free list in index order */
+	const ULONG base = HANDLE_TABLE_SIZE(table);
+	for (ULONG i = 0; i < HANDLE_CHUNK_SIZE; ++i)
+	{
+		chunk[i].index      = base + i;
+		chunk[i].generation = 1;
+		chunk[i].nextFree   = i + 1 < HANDLE_CHUNK_SIZE ? base + i + 2 : table->freeHead;
+	}
+
+	table->chunks[table->chunkCount++] = chunk;
+	table->freeHead = base + 1;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS handle_alloc(PHANDLE_TABLE table, PMDLInfo * info, PortholeMapID * handle)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	KIRQL oldIRQL;
+	KeAcquireSpinLock(&table->lock, &oldIRQL);
+	if (!table->freeHead)
+		status = grow_table(table);
+
+	if (NT_SUCCESS(status))
+	{
+		const ULONG index = table->freeHead - 1;
+		PMDLInfo entry = get_entry(table, index);
+		table->freeHead = entry->nextFree;
+		++table->live;
+
+		entry->nextFree = 0;
+		entry->busy     = TRUE;
+		*info   = entry;
+		*handle = HANDLE_MAKE(index, entry->generation);
+	}
+	KeReleaseSpinLock(&table->lock, oldIRQL);
+
+	return status;
+}
+
+PMDLInfo handle_claim(PHANDLE_TABLE table, const PortholeMapID handle)
+{
+	if (handle < 0)
+		return NULL;
+
+	const ULONG index = HANDLE_INDEX(handle);
+	PMDLInfo info = NULL;
+
+	KIRQL oldIRQL;
+	KeAcquireSpinLock(&table->lock, &oldIRQL);
+	if (index < HANDLE_TABLE_SIZE(table))
+	{
+		PMDLInfo entry = get_entry(table, index);
+		if (entry->generation == HANDLE_GEN(handle) && entry->size && !entry->busy)
+		{
+			entry->busy = TRUE;
+			info = entry;
+		}
+	}
+	KeReleaseSpinLock(&table->lock, oldIRQL);
+
+	return info;
+}
+
+BOOLEAN handle_get_id(PHANDLE_TABLE table, const PortholeMapID handle, int * id)
+{
+	if (handle < 0)
+		return FALSE;
+
+	const ULONG index = HANDLE_INDEX(handle);
+	BOOLEAN found = FALSE;
+
+	KIRQL oldIRQL;
+	KeAcquireSpinLock(&table->lock, &oldIRQL);
+	if (index < HANDLE_TABLE_SIZE(table))
+	{
+		PMDLInfo entry = get_entry(table, index);
+		if (entry->generation == HANDLE_GEN(handle) && entry->size && !entry->busy)
+		{
+			*id   = entry->id;
+			found = TRUE;
+		}
+	}
+	KeReleaseSpinLock(&table->lock, oldIRQL);
+
+	return found;
+}
+
+PMDLInfo handle_claim_at(PHANDLE_TABLE table, const ULONG index)
+{
+	PMDLInfo info = NULL;
+
+	KIRQL oldIRQL;
+	KeAcquireSpinLock(&table->lock, &oldIRQL);
+	if (index < HANDLE_TABLE_SIZE(table))
+	{
+		PMDLInfo entry = get_entry(table, index);
+		if (entry->size && !entry->busy)
+		{
+			entry->busy = TRUE;
+			info = entry;
+		}
+	}
+	KeReleaseSpinLock(&table->lock, oldIRQL);
+
+	return info;
+}
+
+void handle_release(PHANDLE_TABLE table, const PMDLInfo info, const BOOLEAN free)
+{
+	KIRQL oldIRQL;
+	KeAcquireSpinLock(&table->lock, &oldIRQL);
+	info->busy = FALSE;
+	if (free)
+	{
+		info->size       = 0;
+		info->mdl        = NULL;
+		info->generation = (info->generation % HANDLE_GEN_MASK) + 1;
+		info->nextFree   = table->freeHead;
+		table->freeHead  = info->index + 1;
+		--table->live;
+	}
+	KeReleaseSpinLock(&table->lock, oldIRQL);
+}
@@ -0,0 +1,96 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+typedef struct _MDLInfo
+{
+	int            id;     // the device's ID for the mapping
+	PVOID          addr;
+	UINT64         size;
+	PMDL           mdl;
+	PMDL           extensions; // ranges appended by IOCTL_PORTHOLE_EXTEND, chained by Next
+	PREG_ENTRY     reg;    // the cache entry the mdl belongs to, if any
+	PSHARED_BUFFER buffer; // the driver allocation the mdl belongs to, if any
+	BOOLEAN        busy;   // being mapped or unmapped
+	struct _MDLInfo * nextDeferred; // in the handle's DEFERRED_UNMAP queue
+
+	/* handle table bookkeeping */
+	ULONG          index;
+	ULONG          generation;
+	ULONG          nextFree;
+}
+MDLInfo, *PMDLInfo;
+
+/*
+ * handles given to user mode are the entry index tagged with the entry's
+ * generation, the generation is bumped each time an entry is freed so a
+ * stale handle never matches a reused entry. the top bit is left clear so
+ * handles are always positive.
+ */
+#define HANDLE_INDEX_BITS   20
+#define HANDLE_INDEX_MASK   ((1UL << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GEN_BITS     11
+#define HANDLE_GEN_MASK     ((1UL << HANDLE_GEN_BITS) - 1)
+#define HANDLE_CHUNK_SHIFT  8
+#define HANDLE_CHUNK_SIZE   (1UL << HANDLE_CHUNK_SHIFT)
+#define HANDLE_MAX_ENTRIES  (1UL << HANDLE_INDEX_BITS)
+
+#define HANDLE_MAKE(index, gen) ((PortholeMapID)(((gen) << HANDLE_INDEX_BITS) | (index)))
+#define HANDLE_INDEX(handle)    ((ULONG)(handle) & HANDLE_INDEX_MASK)
+#define HANDLE_GEN(handle)      (((ULONG)(handle) >> HANDLE_INDEX_BITS) & HANDLE_GEN_MASK)
+
+/* entries live in fixed size chunks so they never move once allocated,
+ * only the chunk directory is reallocated as the table grows */
+typedef struct _HANDLE_TABLE
+{
+	KSPIN_LOCK lock;
+	PMDLInfo * chunks;
+	ULONG      chunkCount; // chunks allocated
+	ULONG      chunkSlots; // capacity of the chunk directory
+	ULONG      freeHead;   // index + 1 of the first free entry, 0 if none
+	ULONG      live;
+}
+HANDLE_TABLE, *PHANDLE_TABLE;
+
+void     handle_table_init(PHANDLE_TABLE table);
+void     handle_table_free(PHANDLE_TABLE table);
+
+/* allocate a busy entry, growing the table if needed */
+NTSTATUS handle_alloc     (PHANDLE_TABLE table, PMDLInfo * info, PortholeMapID * handle);
+
+/* claim an idle entry by handle, NULL if the handle is stale or busy */
+PMDLInfo handle_claim     (PHANDLE_TABLE table, const PortholeMapID handle);
+
+/* get the device ID of an idle mapping without claiming it */
+BOOLEAN  handle_get_id    (PHANDLE_TABLE table, const PortholeMapID handle, int * id);
+
+/* claim the idle entry at index, used to walk the table on cleanup */
+PMDLInfo handle_claim_at  (PHANDLE_TABLE table, const ULONG index);
+
+/* return a claimed entry idle, or free it and retire it's handle */
+void     handle_release   (PHANDLE_TABLE table, const PMDLInfo info, const BOOLEAN free);
+
+/* number of entries the table can currently index */
+#define HANDLE_TABLE_SIZE(table) ((table)->chunkCount << HANDLE_CHUNK_SHIFT)
+
+EXTERN_C_END
@@ -0,0 +1,302 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "lock.tmh"
+
+/*
+ * Page locking, everything here runs in the context of the process that
+ * owns the buffer. A large buffer can be shared out between the caller and
+ * the device's lock workers, which attach to the caller's process to fault
+ * their pieces in. The workers are created once with the device and each
+ * is lent to one caller at a time, a caller that finds them all lent out
+ * locks the pieces it would have handed them itself. lock_begin lends one
+ * the whole of a range so the caller can get on with something else, see
+ * Stream.c.
+ */
+
+void free_mdl(PMDL mdl)
+{
+	for (PMDL nextMdl; mdl; mdl = nextMdl)
+	{
+		nextMdl = mdl->Next;
+		if (mdl->MdlFlags & MDL_PAGES_LOCKED)
+			MmUnlockPages(mdl);
+		IoFreeMdl(mdl);
+	}
+}
+
+NTSTATUS lock_buffer(PVOID addr, UINT32 size, PMDL * result)
+{
+	/* allocate a MDL for the address provided */
+	PMDL mdl = IoAllocateMdl(addr, size, FALSE, FALSE, NULL);
+	if (!mdl)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	/* lock the page into ram */
+	try
+	{
+		MmProbeAndLockPages(mdl, UserMode, IoModifyAccess);
+	}
+	except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		IoFreeMdl(mdl);
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	*result = mdl;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS lock_buffer_chain(PVOID addr, UINT64 size, PMDL * result)
+{
+	if (size > (UINT64)MAXULONG_PTR - (ULONG_PTR)addr)
+		return STATUS_INVALID_PARAMETER;
+
+	PMDL   head = NULL;
+	PMDL * tail = &head;
+	PUCHAR pos  = (PUCHAR)addr;
+
+	/* end the first piece on a chunk boundary so no two share a page */
+	UINT64 length = MDL_CHUNK_SIZE - BYTE_OFFSET(addr);
+	while (size)
+	{
+		length = min(length, size);
+
+		NTSTATUS status = lock_buffer(pos, (UINT32)length, tail);
+		if (!NT_SUCCESS(status))
+		{
+			free_mdl(head);
+			return status;
+		}
+
+		tail    = &(*tail)->Next;
+		pos    += (SIZE_T)length;
+		size   -= length;
+		length  = MDL_CHUNK_SIZE;
+	}
+
+	*result = head;
+	return STATUS_SUCCESS;
+}
+
+typedef struct _LOCK_WORK
+{
+	PLOCK_SHARE share;
+	ULONG       first;
+	NTSTATUS    status;
+}
+LOCK_WORK, *PLOCK_WORK;
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(LOCK_WORK, LockWorkGetContext)
+
+static NTSTATUS lock_pieces(const PLOCK_SHARE share, ULONG first)
+{
+	const PUCHAR base = (PUCHAR)PAGE_ALIGN(share->addr);
+	const PUCHAR end  = share->addr + share->size;
+
+	for (ULONG i = first; i < share->count; i += share->stride)
+	{
+		PUCHAR start = max(share->addr, base + share->step * i);
+		PUCHAR stop  = min(end        , base + share->step * (i + 1));
+
+		NTSTATUS status = lock_buffer(start, (UINT32)(stop - start), &share->pieces[i]);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+	return STATUS_SUCCESS;
+}
+
+static VOID lock_worker(_In_ WDFWORKITEM WorkItem)
+{
+	PLOCK_WORK work = LockWorkGetContext(WorkItem);
+
+	/* the buffer is only addressable from the process it belongs to */
+	KAPC_STATE apc;
+	KeStackAttachProcess(work->share->process, &apc);
+	work->status = lock_pieces(work->share, work->first);
+	KeUnstackDetachProcess(&apc);
+}
+
+NTSTATUS lock_init(const PDEVICE_CONTEXT DeviceContext)
+{
+	WDF_WORKITEM_CONFIG   workConfig;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_WORKITEM_CONFIG_INIT(&workConfig, lock_worker);
+	workConfig.AutomaticSerialization = FALSE;
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, LOCK_WORK);
+	attributes.ParentObject = WdfObjectContextGetObject(DeviceContext);
+
+	DeviceContext->lockIdle = 0;
+	for (ULONG i = 0; i < PH_LOCK_WORKERS; ++i)
+	{
+		NTSTATUS status = WdfWorkItemCreate(&workConfig, &attributes, &DeviceContext->lockWorkers[i]);
+		if (!NT_SUCCESS(status))
+			return status;
+		DeviceContext->lockIdle |= 1LL << i;
+	}
+	return STATUS_SUCCESS;
+}
+
+/* take up to want idle workers, their indices are stored in workers */
+static ULONG claim_workers(const PDEVICE_CONTEXT DeviceContext, const ULONG want, PULONG workers)
+{
+	LONG64 idle, claimed;
+	ULONG  count;
+	do
+	{
+		idle    = ReadNoFence64(&DeviceContext->lockIdle);
+		claimed = 0;
+		count   = 0;
+		for (ULONG i = 0; i < PH_LOCK_WORKERS && count < want; ++i)
+			if (idle & (1LL << i))
+			{
+				claimed |= 1LL << i;
+				workers[count++] = i;
+			}
+	}
+	while (claimed && InterlockedCompareExchange64(&DeviceContext->lockIdle, idle & ~claimed, idle) != idle);
+	return count;
+}
+
+/* lend a claimed worker the pieces of share from first */
+static void lend_worker(const PDEVICE_CONTEXT DeviceContext, const ULONG worker, const PLOCK_SHARE share, const ULONG first)
+{
+	const WDFWORKITEM item = DeviceContext->lockWorkers[worker];
+	PLOCK_WORK        work = LockWorkGetContext(item);
+	work->share  = share;
+	work->first  = first;
+	work->status = STATUS_SUCCESS;
+	WdfWorkItemEnqueue(item);
+}
+
+/* wait for a lent worker to finish, give it back and return it's status */
+static NTSTATUS return_worker(const PDEVICE_CONTEXT DeviceContext, const ULONG worker)
+{
+	const WDFWORKITEM item = DeviceContext->lockWorkers[worker];
+	WdfWorkItemFlush(item);
+
+	const NTSTATUS status = LockWorkGetContext(item)->status;
+	InterlockedOr64(&DeviceContext->lockIdle, 1LL << worker);
+	return status;
+}
+
+NTSTATUS lock_buffer_parallel(const PDEVICE_CONTEXT DeviceContext, PVOID addr, UINT64 size, ULONG threads, PMDL * result)
+{
+	if (size > (UINT64)MAXULONG_PTR - (ULONG_PTR)addr)
+		return STATUS_INVALID_PARAMETER;
+
+	threads = min(threads, PORTHOLE_MAX_LOCK_THREADS);
+	if (threads < 2)
+		return lock_buffer_chain(addr, size, result);
+
+	/* split the pages evenly, but not so finely the workers cost more than
+	 * they save, nor so coarsely a piece is too large for a MDL */
+	const UINT64 span = ROUND_TO_PAGES(BYTE_OFFSET(addr) + size);
+	UINT64 step = ROUND_TO_PAGES((span + threads - 1) / threads);
+	step = max(step, PORTHOLE_PARALLEL_LOCK_MIN);
+	step = min(step, MDL_CHUNK_SIZE);
+
+	LOCK_SHARE share;
+	share.count = (ULONG)((span + step - 1) / step);
+	if (share.count < 2)
+		return lock_buffer_chain(addr, size, result);
+
+	share.pieces = ExAllocatePoolWithTag(NonPagedPool, share.count * sizeof(PMDL), TAG);
+	if (!share.pieces)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	RtlZeroMemory(share.pieces, share.count * sizeof(PMDL));
+
+	/* the pieces are shared between us and however many workers are free */
+	ULONG workers[PH_LOCK_WORKERS];
+	const ULONG lent = claim_workers(DeviceContext, min(threads, share.count) - 1, workers);
+	if (!lent)
+	{
+		ExFreePoolWithTag(share.pieces, TAG);
+		return lock_buffer_chain(addr, size, result);
+	}
+
+	share.process = PsGetCurrentProcess();
+	share.addr    = (PUCHAR)addr;
+	share.size    = size;
+	share.step    = step;
+	share.stride  = lent + 1;
+
+	/* the first share is ours */
+	for (ULONG i = 0; i < lent; ++i)
+		lend_worker(DeviceContext, workers[i], &share, i + 1);
+
+	NTSTATUS status = lock_pieces(&share, 0);
+	for (ULONG i = 0; i < lent; ++i)
+	{
+		const NTSTATUS workStatus = return_worker(DeviceContext, workers[i]);
+		if (NT_SUCCESS(status))
+			status = workStatus;
+	}
+
+	/* join the pieces in order, on failure whatever was locked is undone */
+	PMDL head = NULL;
+	for (ULONG i = share.count; i-- > 0;)
+		if (share.pieces[i])
+		{
+			share.pieces[i]->Next = head;
+			head = share.pieces[i];
+		}
+	ExFreePoolWithTag(share.pieces, TAG);
+
+	if (!NT_SUCCESS(status))
+	{
+		free_mdl(head);
+		return status;
+	}
+
+	*result = head;
+	return STATUS_SUCCESS;
+}
+
+void lock_begin(const PDEVICE_CONTEXT DeviceContext, const PLOCK_ASYNC async, PVOID addr, UINT32 size)
+{
+	async->mdl           = NULL;
+	async->share.process = PsGetCurrentProcess();
+	async->share.addr    = (PUCHAR)addr;
+	async->share.size    = size;
+	async->share.step    = ROUND_TO_PAGES(BYTE_OFFSET(addr) + (UINT64)size);
+	async->share.count   = 1;
+	async->share.stride  = 1;
+	async->share.pieces  = &async->mdl;
+
+	async->lent = claim_workers(DeviceContext, 1, &async->worker) != 0;
+	if (async->lent)
+		lend_worker(DeviceContext, async->worker, &async->share, 0);
+}
+
+NTSTATUS lock_end(const PDEVICE_CONTEXT DeviceContext, const PLOCK_ASYNC async, PMDL * result)
+{
+	/* with every worker lent out the range is locked now instead */
+	const NTSTATUS status = async->lent ?
+		return_worker(DeviceContext, async->worker) :
+		lock_pieces(&async->share, 0);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	*result = async->mdl;
+	return STATUS_SUCCESS;
+}
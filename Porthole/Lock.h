@@ -0,0 +1,70 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+/* create the device's lock workers, they are deleted along with the device */
+NTSTATUS lock_init(const PDEVICE_CONTEXT DeviceContext);
+
+void     free_mdl   (PMDL mdl);
+NTSTATUS lock_buffer(PVOID addr, UINT32 size, PMDL * result);
+NTSTATUS lock_buffer_chain(PVOID addr, UINT64 size, PMDL * result);
+
+/* a buffer shared out between the caller and the workers locking it, piece
+ * i starts step * i bytes into the buffer's first page and each locks every
+ * stride'th piece from it's first. it lives on the caller's stack, the
+ * caller waits for every worker it lent it to before returning */
+typedef struct _LOCK_SHARE
+{
+	PEPROCESS process;
+	PUCHAR    addr;
+	UINT64    size;
+	UINT64    step;
+	ULONG     count;
+	ULONG     stride;
+	PMDL    * pieces;
+}
+LOCK_SHARE, *PLOCK_SHARE;
+
+/* a range being locked by a worker while the caller does something else */
+typedef struct _LOCK_ASYNC
+{
+	LOCK_SHARE share;
+	PMDL       mdl;
+	ULONG      worker;
+	BOOLEAN    lent;
+}
+LOCK_ASYNC, *PLOCK_ASYNC;
+
+/* as lock_buffer_chain with the pieces locked by up to threads workers,
+ * fewer if other callers have the rest. must be called in the context of
+ * the process that owns the buffer */
+NTSTATUS lock_buffer_parallel(const PDEVICE_CONTEXT DeviceContext, PVOID addr, UINT64 size, ULONG threads, PMDL * result);
+
+/* start locking a range on a worker and collect it with lock_end, which
+ * locks it there and then if no worker was free. async must stay put until
+ * lock_end returns and lock_end must always be called. both must be called
+ * in the context of the process that owns the buffer */
+void     lock_begin(const PDEVICE_CONTEXT DeviceContext, const PLOCK_ASYNC async, PVOID addr, UINT32 size);
+NTSTATUS lock_end  (const PDEVICE_CONTEXT DeviceContext, const PLOCK_ASYNC async, PMDL * result);
+
+EXTERN_C_END
@@ -0,0 +1,564 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "map.tmh"
+
+/*
+ * Everything here except the device transaction in cmd_map/cmd_unmap runs
+ * without the command lock held, so any number of threads can be locking
+ * pages and building segment tables while another talks to the device.
+ *
+ * A mapping is built in two halves, map_prepare runs in the context of the
+ * requesting process to lock the pages, map_submit can then run from any
+ * thread to hand the result to the device.
+ */
+
+/* allocate a handle and reserve it's entry for the buffer */
+static NTSTATUS reserve_slot(const PFILE_OBJECT_CONTEXT FileContext, PVOID addr, const UINT64 size, PMDLInfo * info)
+{
+	PortholeMapID handle;
+	NTSTATUS status = handle_alloc(&FileContext->mappings, info, &handle);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	(*info)->addr       = addr;
+	(*info)->size       = size;
+	(*info)->mdl        = NULL;
+	(*info)->extensions = NULL;
+	(*info)->reg        = NULL;
+	(*info)->buffer     = NULL;
+	return STATUS_SUCCESS;
+}
+
+/* find an idle mapping by handle and claim it */
+PMDLInfo map_claim(const PFILE_OBJECT_CONTEXT FileContext, const PortholeMapID id)
+{
+	return handle_claim(&FileContext->mappings, id);
+}
+
+static void release_slot(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, const BOOLEAN free)
+{
+	handle_release(&FileContext->mappings, info, free);
+}
+
+/* count against the device and the handle, see PORTHOLE_STAT_* */
+static void count_stat(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const ULONG counter, const LONG64 value)
+{
+	stats_add(DeviceContext, counter, value);
+	InterlockedAdd64(&FileContext->stats[counter], value);
+}
+
+static void count_unmap(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info)
+{
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_MAPS_FREED    , 1);
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_BYTES_UNMAPPED, info->size);
+}
+
+/* drop the buffer behind a mapping, cached buffers stay locked in the cache */
+static void release_buffer(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table)
+{
+	/* appended ranges are always locked by us, whatever the mapping began as */
+	free_mdl(info->extensions);
+	info->extensions = NULL;
+
+	if (info->buffer)
+	{
+		if (table)
+			segtable_free(table);
+		buffer_free(info->buffer);
+		info->buffer = NULL;
+		return;
+	}
+
+	if (info->reg)
+	{
+		regcache_release(&FileContext->cache, info->reg);
+		info->reg = NULL;
+		return;
+	}
+
+	if (table)
+		segtable_free(table);
+	free_mdl(info->mdl);
+}
+
+/* what a command the device never completed was given, see cmd_hung */
+typedef struct _MAP_HELD
+{
+	CMD_HELD       held;
+	SEGMENT_TABLE  table;
+	PMDL           mdl;
+	PSHARED_BUFFER buffer;
+	PREG_ENTRY     reg;
+}
+MAP_HELD, *PMAP_HELD;
+
+static void release_held(PCMD_HELD held)
+{
+	PMAP_HELD map = CONTAINING_RECORD(held, MAP_HELD, held);
+	segtable_free(&map->table);
+	free_mdl(map->mdl);
+	if (map->buffer)
+		buffer_free(map->buffer);
+	if (map->reg)
+		regcache_put(map->reg);
+	ExFreePoolWithTag(map, TAG);
+}
+
+/* hand the table, the MDL chain and if info is given the buffer behind the
+ * mapping to the command layer, rather than free what the device may still
+ * be reading. with unmap the device still has info's mapping and it is
+ * dropped first. the caller's table is left empty. if the record can't be
+ * allocated they are leaked, which is the lesser evil */
+static void quarantine(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table, PMDL mdl, const BOOLEAN unmap)
+{
+	PMAP_HELD held = ExAllocatePoolWithTag(NonPagedPool, sizeof(MAP_HELD), TAG);
+	if (held)
+		RtlZeroMemory(held, sizeof(MAP_HELD));
+
+	if (table)
+	{
+		if (held)
+			held->table = *table;
+		segtable_init(table);
+	}
+
+	if (info)
+	{
+		/* as release_buffer, the table of a cached buffer is the cache's */
+		if (info->reg)
+			regcache_detach(&FileContext->cache, info->reg);
+		else if (!info->buffer)
+			mdl = info->mdl;
+
+		if (held)
+		{
+			held->buffer = info->buffer;
+			held->reg    = info->reg;
+		}
+
+		if (info->extensions)
+		{
+			PMDL last = info->extensions;
+			while (last->Next)
+				last = last->Next;
+			last->Next = mdl;
+			mdl = info->extensions;
+		}
+
+		info->extensions = NULL;
+		info->buffer     = NULL;
+		info->reg        = NULL;
+		info->mdl        = NULL;
+	}
+
+	if (!held)
+		return;
+
+	held->mdl = mdl;
+	if (unmap)
+		cmd_quarantine_unmap(DeviceContext, &held->held, release_held, info->id);
+	else
+		cmd_quarantine(DeviceContext, &held->held, release_held);
+}
+
+static NTSTATUS prepare(const PFILE_OBJECT_CONTEXT FileContext, PVOID addr, const UINT64 size, PMDLInfo * info, PSEGMENT_TABLE table)
+{
+	/* an empty buffer has no pages to build a segment table from */
+	if (!size)
+		return STATUS_INVALID_PARAMETER;
+
+	PMDLInfo slot;
+	NTSTATUS result = reserve_slot(FileContext, addr, size, &slot);
+	if (!NT_SUCCESS(result))
+		return result;
+
+	/* a cached buffer is already locked with it's table built, the cache
+	 * only holds buffers a PortholeMsg can describe */
+	PREG_ENTRY reg;
+	result = size <= MAXUINT32 ?
+		regcache_acquire(&FileContext->cache, addr, (UINT32)size, &reg) : STATUS_NOT_FOUND;
+	if (NT_SUCCESS(result))
+	{
+		slot->reg = reg;
+		slot->mdl = reg->mdl;
+		*table    = reg->table;
+		*info     = slot;
+		return STATUS_SUCCESS;
+	}
+
+	if (result != STATUS_NOT_FOUND)
+	{
+		release_slot(FileContext, slot, TRUE);
+		return result;
+	}
+
+	result = FileContext->lockThreads > 1 ?
+		lock_buffer_parallel(FileContext->deviceContext, addr, size, FileContext->lockThreads, &slot->mdl) :
+		lock_buffer_chain(addr, size, &slot->mdl);
+	if (!NT_SUCCESS(result))
+	{
+		release_slot(FileContext, slot, TRUE);
+		return result;
+	}
+
+	/* build the table of physically contiguous segments */
+	segtable_init(table);
+	if (!NT_SUCCESS(result = segtable_build(table, slot->mdl, size)))
+	{
+		map_abort(FileContext, slot, table);
+		return result;
+	}
+
+	*info = slot;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS map_prepare(const PFILE_OBJECT_CONTEXT FileContext, const PPortholeMsg msg, PMDLInfo * info, PSEGMENT_TABLE table)
+{
+	return prepare(FileContext, msg->addr, msg->size, info, table);
+}
+
+NTSTATUS map_prepare64(const PFILE_OBJECT_CONTEXT FileContext, const PPortholeMsg64 msg, PMDLInfo * info, PSEGMENT_TABLE table)
+{
+	return prepare(FileContext, msg->addr, msg->size, info, table);
+}
+
+NTSTATUS map_stream(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, PVOID addr, const UINT64 size, const UINT32 type, PPortholeMapID id)
+{
+	PMDLInfo slot;
+	NTSTATUS result = reserve_slot(FileContext, addr, size, &slot);
+	if (!NT_SUCCESS(result))
+		return result;
+
+	/* nothing is left locked on failure */
+	ULONG segments;
+	if (!NT_SUCCESS(result = stream_map(DeviceContext, addr, size, type, &slot->id, &slot->mdl, &segments)))
+	{
+		release_slot(FileContext, slot, TRUE);
+		return result;
+	}
+
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_MAPS_CREATED, 1);
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_BYTES_MAPPED, size);
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_SEGMENTS    , segments);
+
+	*id = HANDLE_MAKE(slot->index, slot->generation);
+	release_slot(FileContext, slot, FALSE);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS map_prepare_alloc(const PFILE_OBJECT_CONTEXT FileContext, const UINT32 size, PMDLInfo * info, PSEGMENT_TABLE table)
+{
+	if (!size)
+		return STATUS_INVALID_PARAMETER;
+
+	PMDLInfo slot;
+	NTSTATUS result = reserve_slot(FileContext, NULL, size, &slot);
+	if (!NT_SUCCESS(result))
+		return result;
+
+	if (!NT_SUCCESS(result = buffer_alloc(size, &slot->buffer)))
+	{
+		release_slot(FileContext, slot, TRUE);
+		return result;
+	}
+
+	slot->addr = slot->buffer->userAddr;
+	slot->mdl  = slot->buffer->mdl;
+
+	segtable_init(table);
+	if (!NT_SUCCESS(result = segtable_build(table, slot->mdl, size)))
+	{
+		map_abort(FileContext, slot, table);
+		return result;
+	}
+
+	*info = slot;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS map_submit(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table, const UINT32 type, PPortholeMapID id)
+{
+	NTSTATUS result = cmd_map(DeviceContext, table, type, &info->id);
+	if (!NT_SUCCESS(result))
+	{
+		if (cmd_hung(DeviceContext, result))
+		{
+			/* a cached buffer's table goes with the entry */
+			quarantine(DeviceContext, FileContext, info, info->reg ? NULL : table, NULL, FALSE);
+			release_slot(FileContext, info, TRUE);
+		}
+		else
+			map_abort(FileContext, info, table);
+		return result;
+	}
+
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_MAPS_CREATED, 1);
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_BYTES_MAPPED, info->size);
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_SEGMENTS    , table->count);
+
+	/* the table of a cached buffer belongs to the cache */
+	if (!info->reg)
+		segtable_free(table);
+	*id = HANDLE_MAKE(info->index, info->generation);
+	release_slot(FileContext, info, FALSE);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS map_prepare_extend(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, const PPortholeExtendMsg msg, PMDL * mdl, PSEGMENT_TABLE table)
+{
+	NTSTATUS result = STATUS_INVALID_PARAMETER;
+	if (!msg->size)
+		goto fail;
+
+	if (!NT_SUCCESS(result = lock_buffer_chain(msg->addr, msg->size, mdl)))
+		goto fail;
+
+	segtable_init(table);
+	if (!NT_SUCCESS(result = segtable_build(table, *mdl, msg->size)))
+	{
+		segtable_free(table);
+		free_mdl(*mdl);
+		goto fail;
+	}
+
+	return STATUS_SUCCESS;
+
+fail:
+	release_slot(FileContext, info, FALSE);
+	return result;
+}
+
+NTSTATUS map_extend(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, const PMDL mdl, PSEGMENT_TABLE table, const UINT64 size)
+{
+	NTSTATUS result = cmd_extend(DeviceContext, table, info->id);
+	if (!NT_SUCCESS(result))
+	{
+		if (cmd_hung(DeviceContext, result))
+		{
+			quarantine(DeviceContext, FileContext, NULL, table, mdl, FALSE);
+			release_slot(FileContext, info, FALSE);
+		}
+		else
+			map_abort_extend(FileContext, info, mdl, table);
+		return result;
+	}
+
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_BYTES_MAPPED, size);
+	count_stat(DeviceContext, FileContext, PORTHOLE_STAT_SEGMENTS    , table->count);
+
+	/* chain the range so it is unlocked along with the rest of the mapping */
+	segtable_free(table);
+	PMDL tail = mdl;
+	while (tail->Next)
+		tail = tail->Next;
+	tail->Next       = info->extensions;
+	info->extensions = mdl;
+	info->size      += size;
+	release_slot(FileContext, info, FALSE);
+	return STATUS_SUCCESS;
+}
+
+void map_abort_extend(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, const PMDL mdl, PSEGMENT_TABLE table)
+{
+	segtable_free(table);
+	free_mdl(mdl);
+	release_slot(FileContext, info, FALSE);
+}
+
+/* the device reads the ranges in the segment table format */
+C_ASSERT(sizeof(PortholeDirtyRange) == sizeof(CO_RANGE));
+C_ASSERT(FIELD_OFFSET(PortholeDirtyRange, size) == FIELD_OFFSET(CO_RANGE, size));
+
+NTSTATUS map_prepare_dirty(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PPortholeDirtyRange ranges, const ULONG count, PSEGMENT_TABLE table)
+{
+	const CO_SIZE used = coalesce_ranges((PCO_RANGE)ranges, count, info->size);
+
+	NTSTATUS result = STATUS_SUCCESS;
+	segtable_init(table);
+	for (CO_SIZE i = 0; i < used && NT_SUCCESS(result); ++i)
+		result = segtable_add(table, ranges[i].offset, ranges[i].size);
+
+	if (!NT_SUCCESS(result))
+		map_abort_dirty(FileContext, info, table);
+	return result;
+}
+
+NTSTATUS map_dirty(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table)
+{
+	const NTSTATUS result = cmd_dirty(DeviceContext, info->id, table);
+	if (cmd_hung(DeviceContext, result))
+		quarantine(DeviceContext, FileContext, NULL, table, NULL, FALSE);
+	map_abort_dirty(FileContext, info, table);
+	return result;
+}
+
+void map_abort_dirty(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table)
+{
+	segtable_free(table);
+	release_slot(FileContext, info, FALSE);
+}
+
+void map_abort(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table)
+{
+	release_buffer(FileContext, info, table);
+	release_slot(FileContext, info, TRUE);
+}
+
+void map_unclaim(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info)
+{
+	release_slot(FileContext, info, FALSE);
+}
+
+/* free a mapping the device no longer knows about */
+static void retire(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info)
+{
+	notify_remove(DeviceContext, FileContext, info->id);
+	count_unmap(DeviceContext, FileContext, info);
+	release_buffer(FileContext, info, NULL);
+	release_slot(FileContext, info, TRUE);
+}
+
+NTSTATUS map_release(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info)
+{
+	NTSTATUS result = cmd_unmap(DeviceContext, info->id);
+	if (!NT_SUCCESS(result))
+	{
+		release_slot(FileContext, info, FALSE);
+		return result;
+	}
+
+	retire(DeviceContext, FileContext, info);
+	return STATUS_SUCCESS;
+}
+
+void map_defer(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info)
+{
+	PDEFERRED_UNMAP deferred = &FileContext->deferred;
+	KIRQL           oldIRQL;
+
+	info->nextDeferred = NULL;
+	KeAcquireSpinLock(&deferred->lock, &oldIRQL);
+	if (deferred->tail)
+		deferred->tail->nextDeferred = info;
+	else
+		deferred->head = info;
+	deferred->tail = info;
+	++deferred->pending;
+	KeReleaseSpinLock(&deferred->lock, oldIRQL);
+}
+
+void map_run_deferred(const PFILE_OBJECT_CONTEXT FileContext)
+{
+	const PDEVICE_CONTEXT deviceContext = FileContext->deviceContext;
+	PDEFERRED_UNMAP       deferred      = &FileContext->deferred;
+	KIRQL                 oldIRQL;
+
+	KeAcquireSpinLock(&deferred->lock, &oldIRQL);
+	PMDLInfo list = deferred->head;
+	deferred->head = NULL;
+	deferred->tail = NULL;
+	KeReleaseSpinLock(&deferred->lock, oldIRQL);
+
+	if (!list)
+		return;
+
+	/* the device has no batched unmap, so send them back to back under one
+	 * hold of the command lock and only unlock the pages once it's dropped.
+	 * the entries are sorted onto the done and failed lists as we go */
+	PMDLInfo done   = NULL;
+	PMDLInfo failed = NULL;
+	ULONG    count  = 0;
+	NTSTATUS error  = STATUS_SUCCESS;
+
+	cmd_begin(deviceContext);
+	for (PMDLInfo info = list, next; info; info = next)
+	{
+		next = info->nextDeferred;
+		++count;
+
+		/* a disconnect has already dropped every mapping on the device */
+		NTSTATUS status = cmd_unmap(deviceContext, info->id);
+		if (NT_SUCCESS(status) || status == STATUS_DEVICE_NOT_CONNECTED)
+		{
+			info->nextDeferred = done;
+			done = info;
+			continue;
+		}
+
+		if (NT_SUCCESS(error))
+			error = status;
+		info->nextDeferred = failed;
+		failed = info;
+	}
+	cmd_end(deviceContext);
+
+	for (PMDLInfo info = done, next; info; info = next)
+	{
+		next = info->nextDeferred;
+		retire(deviceContext, FileContext, info);
+	}
+
+	/* the device may still be using these, hand them back mapped */
+	for (PMDLInfo info = failed, next; info; info = next)
+	{
+		next = info->nextDeferred;
+		release_slot(FileContext, info, FALSE);
+	}
+
+	KeAcquireSpinLock(&deferred->lock, &oldIRQL);
+	deferred->pending -= count;
+	if (NT_SUCCESS(deferred->error))
+		deferred->error = error;
+	KeReleaseSpinLock(&deferred->lock, oldIRQL);
+}
+
+void map_cleanup(const PFILE_OBJECT_CONTEXT FileContext)
+{
+	const PDEVICE_CONTEXT deviceContext = FileContext->deviceContext;
+
+	cmd_begin(deviceContext);
+	for (ULONG i = 0; i < HANDLE_TABLE_SIZE(&FileContext->mappings); ++i)
+	{
+		PMDLInfo info = handle_claim_at(&FileContext->mappings, i);
+		if (!info)
+			continue;
+
+		/* we don't check for errors here intentionally, except that a hung
+		 * device may still be using the buffer, and still has the mapping if
+		 * it was busy with another command */
+		const NTSTATUS status = cmd_unmap(deviceContext, info->id);
+		if (status == STATUS_DEVICE_BUSY || cmd_hung(deviceContext, status))
+			quarantine(deviceContext, FileContext, info, NULL, NULL, status == STATUS_DEVICE_BUSY);
+
+		count_unmap(deviceContext, FileContext, info);
+		release_buffer(FileContext, info, NULL);
+		release_slot(FileContext, info, TRUE);
+	}
+	cmd_end(deviceContext);
+	notify_remove(deviceContext, FileContext, NOTIFY_ALL);
+
+	/* with nothing mapped every cached buffer is idle */
+	regcache_flush(&FileContext->cache);
+}
@@ -0,0 +1,89 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+/* reserve a slot, lock the buffer and build it's segment table */
+NTSTATUS map_prepare(const PFILE_OBJECT_CONTEXT FileContext, const PPortholeMsg msg, PMDLInfo * info, PSEGMENT_TABLE table);
+
+/* as map_prepare for buffers of any size, see PortholeMsg64 */
+NTSTATUS map_prepare64(const PFILE_OBJECT_CONTEXT FileContext, const PPortholeMsg64 msg, PMDLInfo * info, PSEGMENT_TABLE table);
+
+/* map the buffer with stream_map and give it a handle. needs
+ * PH_REG_CAPS_EXTEND, runs in the context of the requesting process and
+ * takes the command lock itself */
+NTSTATUS map_stream (const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, PVOID addr, const UINT64 size, const UINT32 type, PPortholeMapID id);
+
+/* allocate a buffer in the driver, map it into the caller and build it's
+ * segment table, the buffer lives until the mapping is released */
+NTSTATUS map_prepare_alloc(const PFILE_OBJECT_CONTEXT FileContext, const UINT32 size, PMDLInfo * info, PSEGMENT_TABLE table);
+
+/* send a prepared mapping to the device, on failure the mapping is aborted.
+ * must be called between cmd_begin and cmd_end */
+NTSTATUS map_submit (const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table, const UINT32 type, PPortholeMapID id);
+
+/* lock a range to append to a mapping claimed with map_claim and build it's
+ * segment table, on failure the mapping is given back */
+NTSTATUS map_prepare_extend(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, const PPortholeExtendMsg msg, PMDL * mdl, PSEGMENT_TABLE table);
+
+/* send a prepared range to the device and give the mapping back, on failure
+ * the range is dropped and the mapping is left as it was.
+ * must be called between cmd_begin and cmd_end */
+NTSTATUS map_extend (const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, const PMDL mdl, PSEGMENT_TABLE table, const UINT64 size);
+
+/* drop a prepared range that was never sent and give the mapping back */
+void     map_abort_extend(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, const PMDL mdl, PSEGMENT_TABLE table);
+
+/* coalesce the written ranges of a mapping claimed with map_claim into a
+ * table for the device, ranges is rewritten in place. on failure the
+ * mapping is given back */
+NTSTATUS map_prepare_dirty(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PPortholeDirtyRange ranges, const ULONG count, PSEGMENT_TABLE table);
+
+/* send a prepared table to the device, free it and give the mapping back.
+ * must be called between cmd_begin and cmd_end */
+NTSTATUS map_dirty  (const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table);
+
+/* drop a prepared table that was never sent and give the mapping back */
+void     map_abort_dirty(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table);
+
+/* release a prepared mapping that was never submitted */
+void     map_abort  (const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info, PSEGMENT_TABLE table);
+
+/* claim an idle mapping for release, or give it back */
+PMDLInfo map_claim  (const PFILE_OBJECT_CONTEXT FileContext, const PortholeMapID id);
+void     map_unclaim(const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info);
+
+/* unmap a claimed mapping, on failure the mapping is returned idle.
+ * must be called between cmd_begin and cmd_end */
+NTSTATUS map_release(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info);
+
+/* queue a claimed mapping to be unmapped later by map_run_deferred */
+void     map_defer  (const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info);
+
+/* unmap and release everything queued by map_defer, failures are recorded
+ * in the handle's DEFERRED_UNMAP. must be called with releaseLock held */
+void     map_run_deferred(const PFILE_OBJECT_CONTEXT FileContext);
+
+/* unmap and release all idle mappings */
+void     map_cleanup(const PFILE_OBJECT_CONTEXT FileContext);
+
+EXTERN_C_END
@@ -0,0 +1,289 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "notify.tmh"
+
+typedef struct _NOTIFY_SUB
+{
+	LIST_ENTRY            entry;
+	PVOID                 owner;
+	int                   id;     // device mapping ID
+	PKEVENT               event;
+	WDFREQUEST            waiter; // a pended IOCTL_PORTHOLE_NOTIFY_WAIT
+	PPortholeNotifyResult result; // the waiter's output buffer
+	ULONG                 value;
+	ULONG                 count;
+}
+NOTIFY_SUB, *PNOTIFY_SUB;
+
+/* a waiter detached under the lock, to be completed once it is released */
+typedef struct _NOTIFY_WAKE
+{
+	WDFREQUEST            request;
+	PPortholeNotifyResult result;
+	ULONG                 value;
+	ULONG                 count;
+}
+NOTIFY_WAKE, *PNOTIFY_WAKE;
+
+#define NOTIFY_WAKE_BATCH 16
+
+static EVT_WDF_REQUEST_CANCEL notify_cancel;
+
+static inline PLIST_ENTRY bucket_for(const PNOTIFY_REGISTRY Registry, const int id)
+{
+	return &Registry->buckets[(ULONG)id % PH_NOTIFY_BUCKETS];
+}
+
+/* must be called with the registry lock held */
+static PNOTIFY_SUB find_sub(const PNOTIFY_REGISTRY Registry, const PVOID Owner, const int id)
+{
+	const PLIST_ENTRY head = bucket_for(Registry, id);
+	for (PLIST_ENTRY entry = head->Flink; entry != head; entry = entry->Flink)
+	{
+		PNOTIFY_SUB sub = CONTAINING_RECORD(entry, NOTIFY_SUB, entry);
+		if (sub->owner == Owner && sub->id == id)
+			return sub;
+	}
+	return NULL;
+}
+
+/* must be called with the registry lock held */
+static void detach_waiter(const PNOTIFY_SUB sub, PNOTIFY_WAKE wake)
+{
+	wake->request = sub->waiter;
+	wake->result  = sub->result;
+	wake->value   = sub->value;
+	wake->count   = sub->count;
+
+	sub->waiter = NULL;
+	sub->result = NULL;
+	sub->value  = 0;
+	sub->count  = 0;
+}
+
+static void complete_waiter(const PNOTIFY_WAKE wake, const NTSTATUS status)
+{
+	/* if the request is being cancelled notify_cancel will complete it */
+	if (!NT_SUCCESS(WdfRequestUnmarkCancelable(wake->request)))
+		return;
+
+	if (!NT_SUCCESS(status))
+	{
+		WdfRequestComplete(wake->request, status);
+		return;
+	}
+
+	wake->result->value = wake->value;
+	wake->result->count = wake->count;
+	WdfRequestCompleteWithInformation(wake->request, STATUS_SUCCESS, sizeof(PortholeNotifyResult));
+}
+
+void notify_init(const PNOTIFY_REGISTRY Registry)
+{
+	KeInitializeSpinLock(&Registry->lock);
+	for (ULONG i = 0; i < PH_NOTIFY_BUCKETS; ++i)
+		InitializeListHead(&Registry->buckets[i]);
+}
+
+NTSTATUS notify_register(const PDEVICE_CONTEXT DeviceContext, const PVOID Owner, const int id, const PKEVENT event)
+{
+	const PNOTIFY_REGISTRY registry = &DeviceContext->notify;
+
+	PNOTIFY_SUB sub = ExAllocatePoolWithQuotaTag(NonPagedPool, sizeof(NOTIFY_SUB), TAG);
+	if (!sub)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	RtlZeroMemory(sub, sizeof(NOTIFY_SUB));
+	sub->owner = Owner;
+	sub->id    = id;
+	sub->event = event;
+
+	PKEVENT old = NULL;
+	KIRQL   oldIRQL;
+	KeAcquireSpinLock(&registry->lock, &oldIRQL);
+	PNOTIFY_SUB existing = find_sub(registry, Owner, id);
+	if (existing)
+	{
+		old             = existing->event;
+		existing->event = event;
+	}
+	else
+		InsertTailList(bucket_for(registry, id), &sub->entry);
+	KeReleaseSpinLock(&registry->lock, oldIRQL);
+
+	if (existing)
+	{
+		if (old)
+			ObDereferenceObject(old);
+		ExFreePoolWithTag(sub, TAG);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS notify_wait(const PDEVICE_CONTEXT DeviceContext, const PVOID Owner, const int id, const WDFREQUEST Request, PPortholeNotifyResult result)
+{
+	const PNOTIFY_REGISTRY registry = &DeviceContext->notify;
+	NTSTATUS status;
+
+	KIRQL oldIRQL;
+	KeAcquireSpinLock(&registry->lock, &oldIRQL);
+	PNOTIFY_SUB sub = find_sub(registry, Owner, id);
+	if (!sub)
+		status = STATUS_NOT_FOUND;
+	else if (sub->waiter)
+		status = STATUS_DEVICE_BUSY;
+	else if (sub->count)
+	{
+		/* notifications arrived since the last wait, don't pend */
+		result->value = sub->value;
+		result->count = sub->count;
+		sub->value    = 0;
+		sub->count    = 0;
+		status        = STATUS_SUCCESS;
+	}
+	else
+	{
+		RequestGetContext(Request)->notifyId = id;
+		status = WdfRequestMarkCancelableEx(Request, notify_cancel);
+		if (NT_SUCCESS(status))
+		{
+			sub->waiter = Request;
+			sub->result = result;
+			status      = STATUS_PENDING;
+		}
+	}
+	KeReleaseSpinLock(&registry->lock, oldIRQL);
+
+	return status;
+}
+
+static VOID notify_cancel(WDFREQUEST Request)
+{
+	const PFILE_OBJECT_CONTEXT fileContext = FileGetContext(WdfRequestGetFileObject(Request));
+	const PNOTIFY_REGISTRY     registry    = &fileContext->deviceContext->notify;
+
+	/* the subscription may already be gone, only clear it if it still
+	 * points at this request */
+	KIRQL oldIRQL;
+	KeAcquireSpinLock(&registry->lock, &oldIRQL);
+	PNOTIFY_SUB sub = find_sub(registry, fileContext, RequestGetContext(Request)->notifyId);
+	if (sub && sub->waiter == Request)
+	{
+		sub->waiter = NULL;
+		sub->result = NULL;
+	}
+	KeReleaseSpinLock(&registry->lock, oldIRQL);
+
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+}
+
+/*
+ * any number of owners may subscribe to the same mapping. events are set
+ * under the lock, but the waiters are detached in batches and completed
+ * once it has been released so a burst of waiters never holds off other
+ * interrupts.
+ */
+void notify_signal(const PDEVICE_CONTEXT DeviceContext, const int id, const ULONG value)
+{
+	const PNOTIFY_REGISTRY registry = &DeviceContext->notify;
+	const PLIST_ENTRY      head     = bucket_for(registry, id);
+	BOOLEAN                merged   = FALSE;
+	NOTIFY_WAKE            wake[NOTIFY_WAKE_BATCH];
+	ULONG                  count;
+
+	stats_add(DeviceContext, PORTHOLE_STAT_NOTIFICATIONS, 1);
+	do
+	{
+		count = 0;
+		KeAcquireSpinLockAtDpcLevel(&registry->lock);
+		for (PLIST_ENTRY entry = head->Flink; entry != head; entry = entry->Flink)
+		{
+			PNOTIFY_SUB sub = CONTAINING_RECORD(entry, NOTIFY_SUB, entry);
+			if (sub->id != id)
+				continue;
+
+			if (!merged)
+			{
+				sub->value |= value;
+				++sub->count;
+				if (sub->event)
+					KeSetEvent(sub->event, IO_NO_INCREMENT, FALSE);
+			}
+
+			if (sub->waiter && sub->count && count < NOTIFY_WAKE_BATCH)
+				detach_waiter(sub, &wake[count++]);
+		}
+		merged = TRUE;
+		KeReleaseSpinLockFromDpcLevel(&registry->lock);
+
+		for (ULONG i = 0; i < count; ++i)
+			complete_waiter(&wake[i], STATUS_SUCCESS);
+	}
+	while (count == NOTIFY_WAKE_BATCH);
+}
+
+void notify_remove(const PDEVICE_CONTEXT DeviceContext, const PVOID Owner, const int id)
+{
+	const PNOTIFY_REGISTRY registry = &DeviceContext->notify;
+	LIST_ENTRY             removed;
+	InitializeListHead(&removed);
+
+	KIRQL oldIRQL;
+	KeAcquireSpinLock(&registry->lock, &oldIRQL);
+	for (ULONG i = 0; i < PH_NOTIFY_BUCKETS; ++i)
+	{
+		const PLIST_ENTRY head = &registry->buckets[i];
+		if (id != NOTIFY_ALL && head != bucket_for(registry, id))
+			continue;
+
+		PLIST_ENTRY next;
+		for (PLIST_ENTRY entry = head->Flink; entry != head; entry = next)
+		{
+			next = entry->Flink;
+			PNOTIFY_SUB sub = CONTAINING_RECORD(entry, NOTIFY_SUB, entry);
+			if (sub->owner != Owner || (id != NOTIFY_ALL && sub->id != id))
+				continue;
+
+			RemoveEntryList(entry);
+			InsertTailList(&removed, entry);
+		}
+	}
+	KeReleaseSpinLock(&registry->lock, oldIRQL);
+
+	while (!IsListEmpty(&removed))
+	{
+		PNOTIFY_SUB sub = CONTAINING_RECORD(RemoveHeadList(&removed), NOTIFY_SUB, entry);
+		if (sub->waiter)
+		{
+			NOTIFY_WAKE wake;
+			detach_waiter(sub, &wake);
+			complete_waiter(&wake, STATUS_CANCELLED);
+		}
+
+		if (sub->event)
+			ObDereferenceObject(sub->event);
+		ExFreePoolWithTag(sub, TAG);
+	}
+}
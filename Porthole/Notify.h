@@ -0,0 +1,45 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+/* passed as the id to notify_remove to drop every subscription of an owner */
+#define NOTIFY_ALL (-1)
+
+void     notify_init    (const PNOTIFY_REGISTRY Registry);
+
+/* subscribe Owner to notifications on a device mapping ID, event may be NULL
+ * and a reference to it is owned by the subscription on success. registering
+ * the same mapping again replaces the event */
+NTSTATUS notify_register(const PDEVICE_CONTEXT DeviceContext, const PVOID Owner, const int id, const PKEVENT event);
+
+/* complete with the notifications already received, or pend Request until
+ * the next one arrives, returns STATUS_PENDING if the request was pended */
+NTSTATUS notify_wait    (const PDEVICE_CONTEXT DeviceContext, const PVOID Owner, const int id, const WDFREQUEST Request, PPortholeNotifyResult result);
+
+/* deliver a notification from the device, called from the interrupt DPC */
+void     notify_signal  (const PDEVICE_CONTEXT DeviceContext, const int id, const ULONG value);
+
+/* drop subscriptions, cancelling any waiting requests */
+void     notify_remove  (const PDEVICE_CONTEXT DeviceContext, const PVOID Owner, const int id);
+
+EXTERN_C_END
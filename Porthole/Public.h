@@ -20,7 +20,9 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#ifdef _WIN32
 #include <initguid.h>
+#endif
 
 DEFINE_GUID (GUID_DEVINTERFACE_PORTHOLE,
     0x10ccc0ac,0xf4b0,0x4d78,0xba,0x41,0x1e,0xbb,0x38,0x5a,0x52,0x85);
@@ -34,8 +36,119 @@ typedef struct _PortholeMsg
 }
 PortholeMsg, *PPortholeMsg;
 
+/* input to IOCTL_PORTHOLE_SEND_MSG64, as PortholeMsg for buffers of 4GB and
+ * over. the buffer is locked as a chain of MDLs and sent as one mapping,
+ * the output is a single PortholeMapID as for IOCTL_PORTHOLE_SEND_MSG */
+typedef struct _PortholeMsg64
+{
+	UINT32 type;
+	PVOID  addr;
+	UINT64 size;
+}
+PortholeMsg64, *PPortholeMsg64;
+
+/* an opaque, generation tagged handle to a mapping, always positive */
 typedef int PortholeMapID, *PPortholeMapID;
 
+// maximum number of entries in a single batch request
+#define PORTHOLE_MAX_BATCH 1024
+
+/* per entry result of IOCTL_PORTHOLE_SEND_MSG_BATCH, status is an NTSTATUS
+ * and id is only valid if it indicates success.
+ * IOCTL_PORTHOLE_UNLOCK_BATCH returns an array of LONG NTSTATUS values. */
+typedef struct _PortholeBatchResult
+{
+	PortholeMapID id;
+	LONG          status;
+}
+PortholeBatchResult, *PPortholeBatchResult;
+
+/* input to IOCTL_PORTHOLE_ALLOC_BUFFER, the driver allocates size bytes of
+ * physically contiguous memory where it can and maps it for the device */
+typedef struct _PortholeAllocMsg
+{
+	UINT32 type;
+	UINT32 size;
+}
+PortholeAllocMsg, *PPortholeAllocMsg;
+
+/* the buffer is mapped into the caller at addr until id is unlocked or the
+ * handle is closed */
+typedef struct _PortholeAllocResult
+{
+	PortholeMapID id;
+	PVOID         addr;
+}
+PortholeAllocResult, *PPortholeAllocResult;
+
+/* input to IOCTL_PORTHOLE_EXTEND, appends size bytes at addr to the end of
+ * an existing mapping. only the new pages are locked and sent to the device,
+ * as a chain of MDLs like PortholeMsg64 so size may be 4GB and over, the
+ * mapping keeps it's ID and everything is unlocked with it. needs a device
+ * with PH_REG_CAPS_EXTEND, STATUS_NOT_SUPPORTED otherwise */
+typedef struct _PortholeExtendMsg
+{
+	PortholeMapID id;
+	PVOID         addr;
+	UINT64        size;
+}
+PortholeExtendMsg, *PPortholeExtendMsg;
+
+// maximum number of ranges in a single IOCTL_PORTHOLE_DIRTY
+#define PORTHOLE_MAX_DIRTY 4096
+
+/* input to IOCTL_PORTHOLE_DIRTY is a PortholeDirtyMsg followed by count
+ * PortholeDirtyRanges of the mapping that have been written. the driver
+ * page aligns, sorts and merges them before handing them to the device so
+ * the host only copies what changed. ranges past the end of the mapping
+ * are clipped. needs a device with PH_REG_CAPS_DIRTY */
+typedef struct _PortholeDirtyMsg
+{
+	PortholeMapID id;
+	UINT32        count;
+}
+PortholeDirtyMsg, *PPortholeDirtyMsg;
+
+typedef struct _PortholeDirtyRange
+{
+	UINT64 offset;
+	UINT64 size;
+}
+PortholeDirtyRange, *PPortholeDirtyRange;
+
+/* input to IOCTL_PORTHOLE_DOORBELL, notifies the client of activity on an
+ * existing mapping. value is 0-255, values raised for the same mapping
+ * before the device is notified are OR'd together. a device with doorbells
+ * or notifications keeps fewer than 2^24 mappings live, see
+ * PH_DOORBELL_ID_BITS */
+typedef struct _PortholeDoorbell
+{
+	PortholeMapID id;
+	UINT32        value;
+}
+PortholeDoorbell, *PPortholeDoorbell;
+
+/* input to IOCTL_PORTHOLE_NOTIFY_REGISTER, subscribes to notifications the
+ * client raises on a mapping. event is signalled on each notification, pass
+ * (HANDLE)-1 to only use IOCTL_PORTHOLE_NOTIFY_WAIT. the subscription ends
+ * when the mapping is unlocked */
+typedef struct _PortholeNotifyRegister
+{
+	PortholeMapID id;
+	HANDLE        event;
+}
+PortholeNotifyRegister, *PPortholeNotifyRegister;
+
+/* IOCTL_PORTHOLE_NOTIFY_WAIT takes a PortholeMapID and completes once the
+ * mapping has been notified. value is the OR of, and count the number of,
+ * the notifications received since the last wait completed */
+typedef struct _PortholeNotifyResult
+{
+	UINT32 value;
+	UINT32 count;
+}
+PortholeNotifyResult, *PPortholeNotifyResult;
+
 typedef struct _PortholeEvents
 {
 	HANDLE connect;
@@ -43,6 +156,123 @@ typedef struct _PortholeEvents
 }
 PortholeEvents, *PPortholeEvents;
 
-#define IOCTL_PORTHOLE_SEND_MSG        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define IOCTL_PORTHOLE_UNLOCK_BUFFER   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define IOCTL_PORTHOLE_REGISTER_EVENTS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
\ No newline at end of file
+// device commands as reported by IOCTL_PORTHOLE_GET_WAIT_HISTOGRAM
+#define PORTHOLE_CMD_START       0
+#define PORTHOLE_CMD_ADD_SEGMENT 1
+#define PORTHOLE_CMD_ADD_TABLE   2
+#define PORTHOLE_CMD_FINISH      3
+#define PORTHOLE_CMD_UNMAP       4
+#define PORTHOLE_CMD_MAX         5
+
+/* bucket 0 counts waits under 1us, bucket n counts waits of 2^(n-1) to 2^n
+ * microseconds, the final bucket counts everything longer */
+#define PORTHOLE_WAIT_BUCKETS    24
+
+typedef struct _PortholeWaitHistogram
+{
+	UINT64 buckets [PORTHOLE_CMD_MAX][PORTHOLE_WAIT_BUCKETS];
+	UINT64 timeouts[PORTHOLE_CMD_MAX];
+}
+PortholeWaitHistogram, *PPortholeWaitHistogram;
+
+// flags for IOCTL_PORTHOLE_CONFIGURE
+#define PORTHOLE_CONFIG_REG_CACHE      (1 << 0) // cache locked buffers between sends
+#define PORTHOLE_CONFIG_DEFERRED_UNMAP (1 << 1) // unlock in the background, see below
+#define PORTHOLE_CONFIG_STREAM         (1 << 2) // pin and send large buffers in pieces, see below
+#define PORTHOLE_CONFIG_PARALLEL_LOCK  (1 << 3) // lock large buffers from several threads, see below
+
+/* with PORTHOLE_CONFIG_DEFERRED_UNMAP the unlock IOCTLs complete as soon as
+ * the mappings are queued, the driver unmaps them and unlocks their pages
+ * later from a worker. IOCTL_PORTHOLE_FLUSH takes no buffers and completes
+ * once every unlock queued on the handle before it is done, returning the
+ * first error since the previous flush. a mapping that failed to unmap
+ * stays mapped and may be unlocked again */
+
+/* with PORTHOLE_CONFIG_STREAM a send of more than PORTHOLE_STREAM_CHUNK bytes
+ * is locked a piece at a time and each piece is handed to the device as
+ * soon as it is pinned, so the device takes one piece while the next is
+ * faulted in. the first piece is mapped and the rest extend the mapping,
+ * each as it's own command, so other commands run in between. these sends
+ * skip the registration cache and complete before the IOCTL returns. on a
+ * device without PH_REG_CAPS_EXTEND the flag has no effect */
+#define PORTHOLE_STREAM_CHUNK (64 * 1024 * 1024)
+
+/* with PORTHOLE_CONFIG_PARALLEL_LOCK the pages of a send are faulted in and
+ * locked by up to lockThreads system workers attached to the caller, 0 for
+ * one per processor, in pieces of at least PORTHOLE_PARALLEL_LOCK_MIN bytes.
+ * the device has PORTHOLE_MAX_LOCK_THREADS - 1 workers shared by every
+ * handle, a send that finds them busy uses fewer.
+ * the pieces are joined in order into one segment table so the mapping is
+ * the same as if a single thread had locked it */
+#define PORTHOLE_PARALLEL_LOCK_MIN   (16 * 1024 * 1024)
+#define PORTHOLE_MAX_LOCK_THREADS    64
+
+/* per handle configuration, cacheBudget is the number of bytes the
+ * registration cache may keep pinned before evicting idle buffers */
+typedef struct _PortholeConfig
+{
+	UINT32 flags;
+	UINT64 cacheBudget;
+	UINT32 lockThreads;
+}
+PortholeConfig, *PPortholeConfig;
+
+typedef struct _PortholeCacheStats
+{
+	UINT64 hits;
+	UINT64 misses;
+	UINT64 evictions;
+	UINT64 pinnedBytes;
+	UINT32 entries;
+}
+PortholeCacheStats, *PPortholeCacheStats;
+
+/* counters returned by IOCTL_PORTHOLE_QUERY_STATS, all are cumulative since
+ * the device was started. Bytes pinned is BYTES_MAPPED - BYTES_UNMAPPED */
+#define PORTHOLE_STATS_VERSION         1
+
+#define PORTHOLE_STAT_MAPS_CREATED     0
+#define PORTHOLE_STAT_MAPS_FREED       1
+#define PORTHOLE_STAT_BYTES_MAPPED     2
+#define PORTHOLE_STAT_BYTES_UNMAPPED   3
+#define PORTHOLE_STAT_SEGMENTS         4  // segments sent for new and extended mappings
+#define PORTHOLE_STAT_COMMANDS         5  // register command round trips
+#define PORTHOLE_STAT_REG_POLLS        6  // reads of `cr` while waiting on them
+#define PORTHOLE_STAT_INTERRUPTS       7
+#define PORTHOLE_STAT_DPCS             8
+#define PORTHOLE_STAT_EVENT_SIGNALS    9  // connect and disconnect events set
+#define PORTHOLE_STAT_NOTIFICATIONS    10 // client notifications received
+#define PORTHOLE_STAT_DOORBELLS        11 // doorbell register writes
+#define PORTHOLE_STAT_DOORBELLS_MERGED 12 // doorbells merged into another write
+#define PORTHOLE_STAT_WAIT_US          13 // + PORTHOLE_CMD_*, microseconds waiting on the device
+#define PORTHOLE_STAT_MAX              (PORTHOLE_STAT_WAIT_US + PORTHOLE_CMD_MAX)
+
+/* output of IOCTL_PORTHOLE_QUERY_STATS, the handle counters only cover the
+ * mapping counters of the handle the query was made on. later versions
+ * only ever append counters */
+typedef struct _PortholeStats
+{
+	UINT32 version;
+	UINT32 count;
+	UINT64 device[PORTHOLE_STAT_MAX];
+	UINT64 handle[PORTHOLE_STAT_MAX];
+}
+PortholeStats, *PPortholeStats;
+
+#define IOCTL_PORTHOLE_SEND_MSG           CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_UNLOCK_BUFFER      CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_REGISTER_EVENTS    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_GET_WAIT_HISTOGRAM CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_SEND_MSG_BATCH     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_UNLOCK_BATCH       CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_CONFIGURE          CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_GET_CACHE_STATS    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_ALLOC_BUFFER       CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_DOORBELL           CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_NOTIFY_REGISTER    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_NOTIFY_WAIT        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_QUERY_STATS        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_FLUSH              CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_EXTEND             CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_DIRTY              CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_PORTHOLE_SEND_MSG64         CTL_CODE(FILE_DEVICE_UNKNOWN, 0x810, METHOD_BUFFERED, FILE_ANY_ACCESS)
\ No newline at end of file
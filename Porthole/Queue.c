@@ -37,23 +37,23 @@ SOFTWARE.
 		size_t *					BytesReturned)
 
 // forwards
-static void wait_device(PortholeDeviceRegisters *regs, const UINT32 mask, const UINT32 value);
-static NTSTATUS check_success(const PortholeDeviceRegisters *regs);
-
 IOCTL_FN(ioctl_send_msg);
 IOCTL_FN(ioctl_unlock_buffer);
+IOCTL_FN(ioctl_send_msg_batch);
+IOCTL_FN(ioctl_unlock_batch);
 IOCTL_FN(ioctl_register_events);
-
-void free_mdl(PMDL mdl)
-{
-	for (PMDL nextMdl; mdl; mdl = nextMdl)
-	{
-		nextMdl = mdl->Next;
-		if (mdl->MdlFlags & MDL_PAGES_LOCKED)
-			MmUnlockPages(mdl);
-		IoFreeMdl(mdl);
-	}
-}
+IOCTL_FN(ioctl_get_wait_histogram);
+IOCTL_FN(ioctl_configure);
+IOCTL_FN(ioctl_get_cache_stats);
+IOCTL_FN(ioctl_alloc_buffer);
+IOCTL_FN(ioctl_doorbell);
+IOCTL_FN(ioctl_notify_register);
+IOCTL_FN(ioctl_notify_wait);
+IOCTL_FN(ioctl_query_stats);
+IOCTL_FN(ioctl_flush);
+IOCTL_FN(ioctl_extend);
+IOCTL_FN(ioctl_dirty);
+IOCTL_FN(ioctl_send_msg64);
 
 NTSTATUS
 PortholeQueueInitialize(_In_ WDFDEVICE Device)
@@ -71,7 +71,38 @@ PortholeQueueInitialize(_In_ WDFDEVICE Device)
 	if (!NT_SUCCESS(status))
 		return status;
 
-	return status;
+	/* requests that need the device are pended here for the command worker */
+	PDEVICE_CONTEXT deviceContext = DeviceGetContext(Device);
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.EvtIoCanceledOnQueue = PortholeEvtIoCanceledOnQueue;
+	status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &deviceContext->cmdQueue);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	WDF_WORKITEM_CONFIG   workConfig;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_WORKITEM_CONFIG_INIT(&workConfig, PortholeCommandWorker);
+	workConfig.AutomaticSerialization = FALSE;
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+	status = WdfWorkItemCreate(&workConfig, &attributes, &deviceContext->cmdWorker);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	/* flushes wait here for the release worker to catch up */
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &deviceContext->flushQueue);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	WDF_WORKITEM_CONFIG_INIT(&workConfig, PortholeReleaseWorker);
+	workConfig.AutomaticSerialization = FALSE;
+	status = WdfWorkItemCreate(&workConfig, &attributes, &deviceContext->releaseWorker);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	/* lent to callers locking large buffers, see lock_buffer_parallel */
+	return lock_init(deviceContext);
 }
 
 VOID
@@ -89,23 +120,51 @@ PortholeEvtIoDeviceControl(
 	PFILE_OBJECT_CONTEXT fileContext   = FileGetContext(fileObject);
 	NTSTATUS             status        = STATUS_INVALID_DEVICE_REQUEST;
 	size_t               bytesReturned = 0;
+	BOOLEAN              mapping       = FALSE;
 
 #define HANDLER(msg, fn)	\
 	case msg: \
 		status = fn(deviceContext, fileContext, OutputBufferLength, InputBufferLength, Request, &bytesReturned); \
 		break;
 
+/* a request that maps or unmaps, see below */
+#define MAP_HANDLER(msg, fn)	\
+	case msg: \
+		status  = fn(deviceContext, fileContext, OutputBufferLength, InputBufferLength, Request, &bytesReturned); \
+		mapping = TRUE; \
+		break;
+
 	switch (IoControlCode)
 	{
-		HANDLER(IOCTL_PORTHOLE_SEND_MSG       , ioctl_send_msg       );
-		HANDLER(IOCTL_PORTHOLE_UNLOCK_BUFFER  , ioctl_unlock_buffer  );
-		HANDLER(IOCTL_PORTHOLE_REGISTER_EVENTS, ioctl_register_events);
+		MAP_HANDLER(IOCTL_PORTHOLE_SEND_MSG          , ioctl_send_msg          );
+		MAP_HANDLER(IOCTL_PORTHOLE_UNLOCK_BUFFER     , ioctl_unlock_buffer     );
+		HANDLER    (IOCTL_PORTHOLE_REGISTER_EVENTS   , ioctl_register_events   );
+		HANDLER    (IOCTL_PORTHOLE_GET_WAIT_HISTOGRAM, ioctl_get_wait_histogram);
+		MAP_HANDLER(IOCTL_PORTHOLE_SEND_MSG_BATCH    , ioctl_send_msg_batch    );
+		MAP_HANDLER(IOCTL_PORTHOLE_UNLOCK_BATCH      , ioctl_unlock_batch      );
+		HANDLER    (IOCTL_PORTHOLE_CONFIGURE         , ioctl_configure         );
+		HANDLER    (IOCTL_PORTHOLE_GET_CACHE_STATS   , ioctl_get_cache_stats   );
+		MAP_HANDLER(IOCTL_PORTHOLE_ALLOC_BUFFER      , ioctl_alloc_buffer      );
+		HANDLER    (IOCTL_PORTHOLE_DOORBELL          , ioctl_doorbell          );
+		HANDLER    (IOCTL_PORTHOLE_NOTIFY_REGISTER   , ioctl_notify_register   );
+		HANDLER    (IOCTL_PORTHOLE_NOTIFY_WAIT       , ioctl_notify_wait       );
+		HANDLER    (IOCTL_PORTHOLE_QUERY_STATS       , ioctl_query_stats       );
+		HANDLER    (IOCTL_PORTHOLE_FLUSH             , ioctl_flush             );
+		MAP_HANDLER(IOCTL_PORTHOLE_EXTEND            , ioctl_extend            );
+		MAP_HANDLER(IOCTL_PORTHOLE_DIRTY             , ioctl_dirty             );
+		MAP_HANDLER(IOCTL_PORTHOLE_SEND_MSG64        , ioctl_send_msg64        );
 	}
 
+#undef MAP_HANDLER
 #undef HANDLER
 
-	// a disconnect invalidates all mappings
-	if (status == STATUS_DEVICE_NOT_CONNECTED)
+	// the command worker, a notification or the release worker will complete the request
+	if (status == STATUS_PENDING)
+		return;
+
+	// a disconnect seen by a map or unmap invalidates all mappings, the others
+	// just report it
+	if (status == STATUS_DEVICE_NOT_CONNECTED && mapping)
 		PortholeDeviceFileCleanup(fileObject);
 
     WdfRequestCompleteWithInformation(Request, status, bytesReturned);
@@ -123,106 +182,348 @@ VOID PortholeEvtIoStop(
 	WdfRequestStopAcknowledge(Request, TRUE);
 }
 
-VOID PortholeDeviceFileCreate(WDFDEVICE Device, WDFREQUEST Request, WDFFILEOBJECT FileObject)
+static PREQUEST_CONTEXT init_command(const WDFREQUEST Request, const ULONG count, const BOOLEAN batch, const BOOLEAN unmap)
 {
-	UNREFERENCED_PARAMETER(Request);
+	PREQUEST_CONTEXT context = RequestGetContext(Request);
+	RtlZeroMemory(context, sizeof(REQUEST_CONTEXT));
+	context->batch = batch;
+	context->unmap = unmap;
+	context->jobs  = &context->job;
 
-	PFILE_OBJECT_CONTEXT fileContext = FileGetContext(FileObject);
-	RtlZeroMemory(fileContext, sizeof(FILE_OBJECT_CONTEXT));
-	fileContext->deviceContext = DeviceGetContext(Device);
+	if (batch)
+	{
+		context->jobs = ExAllocatePoolWithTag(NonPagedPool, count * sizeof(MAP_JOB), TAG);
+		if (!context->jobs)
+			return NULL;
+	}
 
-	WdfRequestComplete(Request, STATUS_SUCCESS);
+	/* entries are only live once they have been prepared */
+	RtlZeroMemory(context->jobs, count * sizeof(MAP_JOB));
+	for (ULONG i = 0; i < count; ++i)
+		context->jobs[i].status = STATUS_CANCELLED;
+
+	context->count = count;
+	return context;
 }
 
-VOID PortholeDeviceFileCleanup(WDFFILEOBJECT FileObject)
+static void free_command(const PREQUEST_CONTEXT Context)
 {
-	PFILE_OBJECT_CONTEXT fileContext = FileGetContext(FileObject);
-	const PDEVICE_CONTEXT deviceContext = fileContext->deviceContext;
+	if (Context->jobs != &Context->job)
+		ExFreePoolWithTag(Context->jobs, TAG);
 
-	KIRQL oldIRQL;
-	KeAcquireSpinLock(&deviceContext->deviceLock, &oldIRQL);
-	for (int i = 0; i < PORTHOLE_MAX_LOCKS; ++i)
-		if (fileContext->mdlList[i].size)
+	Context->jobs  = &Context->job;
+	Context->count = 0;
+}
+
+/* release whatever a pended request was holding */
+static void abort_command(WDFREQUEST Request)
+{
+	PFILE_OBJECT_CONTEXT fileContext = FileGetContext(WdfRequestGetFileObject(Request));
+	PREQUEST_CONTEXT     context     = RequestGetContext(Request);
+
+	for (ULONG i = 0; i < context->count; ++i)
+	{
+		PMAP_JOB job = &context->jobs[i];
+		if (!NT_SUCCESS(job->status))
+			continue;
+
+		if (context->unmap)
+			map_unclaim(fileContext, job->info);
+		else if (context->extend)
+			map_abort_extend(fileContext, job->info, job->mdl, &job->table);
+		else if (context->dirty)
+			map_abort_dirty(fileContext, job->info, &job->table);
+		else
+			map_abort(fileContext, job->info, &job->table);
+	}
+
+	free_command(context);
+}
+
+/* copy the per job results back to the caller */
+static NTSTATUS write_results(WDFREQUEST Request, const PREQUEST_CONTEXT Context, size_t * BytesReturned)
+{
+	if (Context->alloc)
+	{
+		if (NT_SUCCESS(Context->job.status))
 		{
-			PMDLInfo info = &fileContext->mdlList[i];
+			PPortholeAllocResult output;
+			if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(PortholeAllocResult), (PVOID *)&output, NULL)))
+				return STATUS_INVALID_USER_BUFFER;
 
-			/* tell the device about the unmapping */
-			deviceContext->regs->addr.QuadPart = info->id;
-			_ReadWriteBarrier();
-			deviceContext->regs->cr |= PH_REG_CR_UNMAP;
-			wait_device(deviceContext->regs, PH_REG_CR_UNMAP, 0);
+			output->id     = Context->job.id;
+			output->addr   = Context->job.addr;
+			*BytesReturned = sizeof(PortholeAllocResult);
+		}
+		return Context->job.status;
+	}
 
-			/* we don't check for errors here intentionally */
+	if (!Context->batch)
+	{
+		if (NT_SUCCESS(Context->job.status) && !Context->unmap && !Context->extend && !Context->dirty)
+		{
+			PPortholeMapID output;
+			if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(PortholeMapID), (PVOID *)&output, NULL)))
+				return STATUS_INVALID_USER_BUFFER;
 
-			free_mdl(info->mdl);
-			info->size = 0;
+			*output        = Context->job.id;
+			*BytesReturned = sizeof(PortholeMapID);
 		}
-	KeReleaseSpinLock(&deviceContext->deviceLock, oldIRQL);
+		return Context->job.status;
+	}
 
-	KeAcquireSpinLock(&deviceContext->eventListLock, &oldIRQL);
-	PLIST_ENTRY nextEntry;
-	for (PLIST_ENTRY entry = deviceContext->eventList.Flink; entry != &deviceContext->eventList; entry = nextEntry)
+	if (Context->unmap)
 	{
-		nextEntry = entry->Flink;
+		PLONG output;
+		if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, Context->count * sizeof(LONG), (PVOID *)&output, NULL)))
+			return STATUS_INVALID_USER_BUFFER;
 
-		PPORTHOLE_EVENT record = CONTAINING_RECORD(entry, PORTHOLE_EVENT, listEntry);
-		if (record->owner != fileContext)
-			continue;
+		for (ULONG i = 0; i < Context->count; ++i)
+			output[i] = Context->jobs[i].status;
+
+		*BytesReturned = Context->count * sizeof(LONG);
+		return STATUS_SUCCESS;
+	}
+
+	PPortholeBatchResult output;
+	if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, Context->count * sizeof(PortholeBatchResult), (PVOID *)&output, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	for (ULONG i = 0; i < Context->count; ++i)
+	{
+		output[i].id     = NT_SUCCESS(Context->jobs[i].status) ? Context->jobs[i].id : -1;
+		output[i].status = Context->jobs[i].status;
+	}
+
+	*BytesReturned = Context->count * sizeof(PortholeBatchResult);
+	return STATUS_SUCCESS;
+}
 
-		RemoveEntryList(entry);
+static NTSTATUS queue_command(const PDEVICE_CONTEXT DeviceContext, const WDFREQUEST Request)
+{
+	NTSTATUS status = WdfRequestForwardToIoQueue(Request, DeviceContext->cmdQueue);
+	if (!NT_SUCCESS(status))
+		return status;
 
-		if (record->connect)
-			ObDereferenceObject(record->connect);
+	WdfWorkItemEnqueue(DeviceContext->cmdWorker);
+	return STATUS_PENDING;
+}
 
-		if (record->disconnect)
-			ObDereferenceObject(record->disconnect);
+VOID PortholeEvtIoCanceledOnQueue(
+	_In_ WDFQUEUE   Queue,
+	_In_ WDFREQUEST Request
+)
+{
+	UNREFERENCED_PARAMETER(Queue);
+
+	abort_command(Request);
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+}
 
-		ExFreePoolWithTag(record, TAG);
+VOID PortholeCommandWorker(_In_ WDFWORKITEM WorkItem)
+{
+	WDFDEVICE       device        = WdfWorkItemGetParentObject(WorkItem);
+	PDEVICE_CONTEXT deviceContext = DeviceGetContext(device);
+	WDFREQUEST      request;
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(deviceContext->cmdQueue, &request)))
+	{
+		WDFFILEOBJECT        fileObject    = WdfRequestGetFileObject(request);
+		PFILE_OBJECT_CONTEXT fileContext   = FileGetContext(fileObject);
+		PREQUEST_CONTEXT     context       = RequestGetContext(request);
+		BOOLEAN              disconnected  = FALSE;
+		size_t               bytesReturned = 0;
+
+		/* a batch is run under a single hold of the command lock */
+		cmd_begin(deviceContext);
+		for (ULONG i = 0; i < context->count; ++i)
+		{
+			PMAP_JOB job = &context->jobs[i];
+			if (!NT_SUCCESS(job->status))
+				continue;
+
+			if (context->unmap)
+				job->status = map_release(deviceContext, fileContext, job->info);
+			else if (context->extend)
+				job->status = map_extend(deviceContext, fileContext, job->info, job->mdl, &job->table, job->size);
+			else if (context->dirty)
+				job->status = map_dirty(deviceContext, fileContext, job->info, &job->table);
+			else
+				job->status = map_submit(deviceContext, fileContext, job->info, &job->table, job->type, &job->id);
+
+			if (job->status == STATUS_DEVICE_NOT_CONNECTED)
+				disconnected = TRUE;
+		}
+		cmd_end(deviceContext);
+
+		NTSTATUS status = write_results(request, context, &bytesReturned);
+		free_command(context);
+
+		// a disconnect invalidates all mappings
+		if (disconnected)
+			PortholeDeviceFileCleanup(fileObject);
+
+		WdfRequestCompleteWithInformation(request, status, bytesReturned);
 	}
-	KeReleaseSpinLock(&deviceContext->eventListLock, oldIRQL);
 }
 
-static void wait_device(PortholeDeviceRegisters *regs, const UINT32 mask, const UINT32 value)
+/* hand a claimed mapping to the release worker */
+static void defer_unmap(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const PMDLInfo info)
 {
-	LARGE_INTEGER delay = { 1 };
-	while ((regs->cr & mask) != value)
-		KeDelayExecutionThread(KernelMode, FALSE, &delay);
+	KIRQL oldIRQL;
+
+	map_defer(FileContext, info);
+
+	KeAcquireSpinLock(&DeviceContext->releaseListLock, &oldIRQL);
+	if (!FileContext->deferred.queued)
+	{
+		FileContext->deferred.queued = TRUE;
+		InsertTailList(&DeviceContext->releaseList, &FileContext->deferred.listEntry);
+	}
+	KeReleaseSpinLock(&DeviceContext->releaseListLock, oldIRQL);
+
+	WdfWorkItemEnqueue(DeviceContext->releaseWorker);
 }
 
-static NTSTATUS check_success(const PortholeDeviceRegisters *regs)
+/* complete the handle's pended flushes if nothing is left to unmap, the
+ * check and the completion are made under the lock so an unlock that is
+ * queued meanwhile can't be flushed early */
+static void complete_flushes(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext)
 {
-	/* this must be checked first, a disconnect invalidates all mappings */
-	if (regs->cr & PH_REG_CR_NOCONN)
-		return STATUS_DEVICE_NOT_CONNECTED;
+	PDEFERRED_UNMAP deferred   = &FileContext->deferred;
+	WDFFILEOBJECT   fileObject = WdfObjectContextGetObject(FileContext);
+	WDFREQUEST      request;
+	KIRQL           oldIRQL;
 
-	if (regs->cr & PH_REG_CR_TIMEOUT)
-		return STATUS_TIMEOUT;
+	KeAcquireSpinLock(&deferred->lock, &oldIRQL);
+	if (!deferred->pending)
+	{
+		while (NT_SUCCESS(WdfIoQueueRetrieveRequestByFileObject(DeviceContext->flushQueue, fileObject, &request)))
+		{
+			WdfRequestComplete(request, deferred->error);
+			deferred->error = STATUS_SUCCESS;
+		}
+	}
+	KeReleaseSpinLock(&deferred->lock, oldIRQL);
+}
 
-	if (regs->cr & PH_REG_CR_BADADDR)
-		return STATUS_INVALID_ADDRESS;
+VOID PortholeReleaseWorker(_In_ WDFWORKITEM WorkItem)
+{
+	WDFDEVICE       device        = WdfWorkItemGetParentObject(WorkItem);
+	PDEVICE_CONTEXT deviceContext = DeviceGetContext(device);
+	KIRQL           oldIRQL;
 
-	if (regs->cr & PH_REG_CR_NORES)
-		return STATUS_DEVICE_INSUFFICIENT_RESOURCES;
+	for (;;)
+	{
+		/* held across the run so cleanup can wait for us to let go of the handle */
+		ExAcquireFastMutex(&deviceContext->releaseLock);
 
-	if (regs->cr & PH_REG_CR_DEVERR)
-		return STATUS_INVALID_DEVICE_REQUEST;
+		PFILE_OBJECT_CONTEXT fileContext = NULL;
+		KeAcquireSpinLock(&deviceContext->releaseListLock, &oldIRQL);
+		if (!IsListEmpty(&deviceContext->releaseList))
+		{
+			PLIST_ENTRY entry = RemoveHeadList(&deviceContext->releaseList);
+			fileContext = CONTAINING_RECORD(entry, FILE_OBJECT_CONTEXT, deferred.listEntry);
+			fileContext->deferred.queued = FALSE;
+		}
+		KeReleaseSpinLock(&deviceContext->releaseListLock, oldIRQL);
 
-	return STATUS_SUCCESS;
+		if (!fileContext)
+		{
+			ExReleaseFastMutex(&deviceContext->releaseLock);
+			break;
+		}
+
+		map_run_deferred(fileContext);
+		complete_flushes(deviceContext, fileContext);
+		ExReleaseFastMutex(&deviceContext->releaseLock);
+	}
+}
+
+/* take the handle off the release worker and run what it had queued */
+static void drain_deferred(const PFILE_OBJECT_CONTEXT FileContext)
+{
+	const PDEVICE_CONTEXT deviceContext = FileContext->deviceContext;
+	KIRQL                 oldIRQL;
+
+	KeAcquireSpinLock(&deviceContext->releaseListLock, &oldIRQL);
+	if (FileContext->deferred.queued)
+	{
+		FileContext->deferred.queued = FALSE;
+		RemoveEntryList(&FileContext->deferred.listEntry);
+	}
+	KeReleaseSpinLock(&deviceContext->releaseListLock, oldIRQL);
+
+	ExAcquireFastMutex(&deviceContext->releaseLock);
+	map_run_deferred(FileContext);
+	complete_flushes(deviceContext, FileContext);
+	ExReleaseFastMutex(&deviceContext->releaseLock);
+}
+
+VOID PortholeDeviceFileCreate(WDFDEVICE Device, WDFREQUEST Request, WDFFILEOBJECT FileObject)
+{
+	UNREFERENCED_PARAMETER(Request);
+
+	PFILE_OBJECT_CONTEXT fileContext = FileGetContext(FileObject);
+	RtlZeroMemory(fileContext, sizeof(FILE_OBJECT_CONTEXT));
+	fileContext->deviceContext = DeviceGetContext(Device);
+	handle_table_init(&fileContext->mappings);
+	regcache_init(&fileContext->cache);
+	InitializeListHead(&fileContext->events);
+	KeInitializeSpinLock(&fileContext->deferred.lock);
+
+	WdfRequestComplete(Request, STATUS_SUCCESS);
+}
+
+VOID PortholeDeviceFileCleanup(WDFFILEOBJECT FileObject)
+{
+	PFILE_OBJECT_CONTEXT fileContext = FileGetContext(FileObject);
+	const PDEVICE_CONTEXT deviceContext = fileContext->deviceContext;
+
+	/* drop any of our requests still waiting on the device */
+	WDFREQUEST request;
+	while (NT_SUCCESS(WdfIoQueueRetrieveRequestByFileObject(deviceContext->cmdQueue, FileObject, &request)))
+	{
+		abort_command(request);
+		WdfRequestComplete(request, STATUS_CANCELLED);
+	}
+
+	/* deferred unmaps are claimed, map_cleanup would skip them */
+	drain_deferred(fileContext);
+	map_cleanup(fileContext);
+
+	events_remove(deviceContext, &fileContext->events);
+}
+
+VOID PortholeDeviceFileClose(WDFFILEOBJECT FileObject)
+{
+	PFILE_OBJECT_CONTEXT fileContext = FileGetContext(FileObject);
+
+	/* release anything mapped by a request that was in flight at cleanup */
+	drain_deferred(fileContext);
+	map_cleanup(fileContext);
+	handle_table_free(&fileContext->mappings);
 }
 
-static NTSTATUS send_segment(PortholeDeviceRegisters *regs, UINT64 addr, UINT32 size)
+/* a streamed send is driven from the caller's thread as it locks the pages
+ * and so completes here rather than on the command queue. a device that
+ * can't extend a mapping is sent the buffer whole through the queue */
+static BOOLEAN use_stream(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, const UINT64 size)
 {
-	wait_device(regs, PH_REG_CR_ADD_SEGMENT, 0x0);
-	NTSTATUS result = check_success(regs);
+	return FileContext->stream && size > PORTHOLE_STREAM_CHUNK &&
+		(DeviceContext->caps & PH_REG_CAPS_EXTEND);
+}
+
+/* complete a streamed send with the handle of it's mapping */
+static NTSTATUS send_stream(const PDEVICE_CONTEXT DeviceContext, const PFILE_OBJECT_CONTEXT FileContext, PVOID addr, const UINT64 size, const UINT32 type, PPortholeMapID output, size_t * BytesReturned)
+{
+	PortholeMapID id;
+	NTSTATUS result = map_stream(DeviceContext, FileContext, addr, size, type, &id);
 	if (!NT_SUCCESS(result))
 		return result;
 
-	/* send the segment */
-	regs->addr.QuadPart = addr;
-	regs->size          = size;
-	_ReadWriteBarrier();
-	regs->cr    |= PH_REG_CR_ADD_SEGMENT;
-
+	*output        = id;
+	*BytesReturned = sizeof(PortholeMapID);
 	return STATUS_SUCCESS;
 }
 
@@ -246,142 +547,222 @@ IOCTL_FN(ioctl_send_msg)
 	if (input->size == 0 || !input->addr)
 		return STATUS_INVALID_USER_BUFFER;
 
-	/* find a free mdl and reserve it */
-	PMDLInfo mdlInfo = NULL;
-	for (int i = 0; i < PORTHOLE_MAX_LOCKS; ++i)
-		if (!FileContext->mdlList[i].size)
-		{
-			mdlInfo = &FileContext->mdlList[i];
-			mdlInfo->addr = input->addr;
-			mdlInfo->size = input->size;
-			break;
-		}
+	if (use_stream(DeviceContext, FileContext, input->size))
+		return send_stream(DeviceContext, FileContext, input->addr, input->size, input->type, output, BytesReturned);
 
-	if (!mdlInfo)
-		return STATUS_DEVICE_INSUFFICIENT_RESOURCES;
+	PREQUEST_CONTEXT context = init_command(Request, 1, FALSE, FALSE);
+	PMAP_JOB         job     = &context->job;
 
-	/* allocate a MDL for the address provided */
-	PMDL mdl = IoAllocateMdl(input->addr, input->size, FALSE, FALSE, NULL);
-	if (!mdl)
-	{
-		mdlInfo->size = 0;
-		return STATUS_INVALID_DEVICE_REQUEST;
-	}
+	/* lock the pages now while we are in the context of the caller */
+	job->type = input->type;
+	if (!NT_SUCCESS(job->status = map_prepare(FileContext, input, &job->info, &job->table)))
+		return job->status;
 
-	mdlInfo->mdl = mdl;
+	NTSTATUS result = queue_command(DeviceContext, Request);
+	if (!NT_SUCCESS(result))
+		abort_command(Request);
 
-	/* lock the page into ram */
-	try
-	{
-		MmProbeAndLockPages(mdl, UserMode, IoModifyAccess);
-	}
-	except(STATUS_ACCESS_VIOLATION)
-	{
-		mdlInfo->size = 0;
-		return STATUS_INVALID_DEVICE_REQUEST;
-	}
+	return result;
+}
 
-	NTSTATUS result;
+IOCTL_FN(ioctl_send_msg64)
+{
+	if (InputBufferLength != sizeof(PortholeMsg64))
+		return STATUS_INVALID_BUFFER_SIZE;
 
-	KIRQL oldIRQL;
-	KeAcquireSpinLock(&DeviceContext->deviceLock, &oldIRQL);
+	if (OutputBufferLength != sizeof(PortholeMapID))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	PPortholeMsg64 input;
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, sizeof(PortholeMsg64), (PVOID *)&input, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (input->size == 0 || !input->addr)
+		return STATUS_INVALID_USER_BUFFER;
 
-	/* tell the device we are about to send a list of segments */
-	_ReadWriteBarrier();
-	DeviceContext->regs->cr |= PH_REG_CR_START;
-	wait_device(DeviceContext->regs, PH_REG_CR_START, 0x0);
-	if (!NT_SUCCESS(result = check_success(DeviceContext->regs)))
+	if (use_stream(DeviceContext, FileContext, input->size))
 	{
-		free_mdl(mdl);
-		mdlInfo->size = 0;
-		KeReleaseSpinLock(&DeviceContext->deviceLock, oldIRQL);
-		return result;
+		PPortholeMapID output;
+		if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(PortholeMapID), (PVOID *)&output, NULL)))
+			return STATUS_INVALID_USER_BUFFER;
+
+		return send_stream(DeviceContext, FileContext, input->addr, input->size, input->type, output, BytesReturned);
 	}
 
-	ULONG   segSize   = 0;
-	ULONG64 lastPA    = 0;
-	UINT32  remaining = input->size;
+	PREQUEST_CONTEXT context = init_command(Request, 1, FALSE, FALSE);
+	PMAP_JOB         job     = &context->job;
 
-	for (PMDL curMdl = mdl; curMdl != NULL; curMdl = curMdl->Next)
-	{
-		const ULONG pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(curMdl), MmGetMdlByteCount(curMdl));
-		ULONG pageOffset  = MmGetMdlByteOffset(curMdl);
-		PPFN_NUMBER pfn   = MmGetMdlPfnArray(curMdl);
-		for (ULONG i = 0; i < pages; ++i, ++pfn)
-		{
-			const UINT64 curPA    = (*pfn << PAGE_SHIFT) + pageOffset;
-			const ULONG  pageSize = min(PAGE_SIZE - pageOffset, remaining);
+	/* lock the pages now while we are in the context of the caller, the
+	 * result is completed the same way as IOCTL_PORTHOLE_SEND_MSG */
+	job->type = input->type;
+	if (!NT_SUCCESS(job->status = map_prepare64(FileContext, input, &job->info, &job->table)))
+		return job->status;
 
-			remaining -= pageSize;
-			pageOffset = 0;
+	NTSTATUS result = queue_command(DeviceContext, Request);
+	if (!NT_SUCCESS(result))
+		abort_command(Request);
 
-			/* if it's the first entry */
-			if (lastPA == 0)
-			{
-				lastPA   = curPA;
-				segSize += pageSize;
-				continue;
-			}
+	return result;
+}
 
-			/* if the pages are contiguous, merge them */
-			if (lastPA + segSize == curPA)
-			{
-				segSize += pageSize;
-				continue;
-			}
+IOCTL_FN(ioctl_alloc_buffer)
+{
+	UNREFERENCED_PARAMETER(BytesReturned);
 
-			if (!NT_SUCCESS(result = send_segment(DeviceContext->regs, lastPA, segSize)))
-			{
-				free_mdl(mdl);
-				mdlInfo->size = 0;
-				KeReleaseSpinLock(&DeviceContext->deviceLock, oldIRQL);
-				return result;
-			}
+	if (InputBufferLength != sizeof(PortholeAllocMsg))
+		return STATUS_INVALID_BUFFER_SIZE;
 
-			/* move on to the next segment */
-			lastPA  = curPA;
-			segSize = pageSize;
-		}
-	}
+	if (OutputBufferLength != sizeof(PortholeAllocResult))
+		return STATUS_INVALID_BUFFER_SIZE;
 
-	/* send the final segment */
-	if (!NT_SUCCESS(result = send_segment(DeviceContext->regs, lastPA, segSize)))
-	{
-		free_mdl(mdl);
-		mdlInfo->size = 0;
-		KeReleaseSpinLock(&DeviceContext->deviceLock, oldIRQL);
-		return result;
-	}
+	PPortholeAllocMsg input;
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, sizeof(PortholeAllocMsg), (PVOID *)&input, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (input->size == 0)
+		return STATUS_INVALID_USER_BUFFER;
+
+	PREQUEST_CONTEXT context = init_command(Request, 1, FALSE, FALSE);
+	PMAP_JOB         job     = &context->job;
+	context->alloc = TRUE;
+
+	/* the buffer has to be mapped while we are in the context of the caller */
+	job->type = input->type;
+	if (!NT_SUCCESS(job->status = map_prepare_alloc(FileContext, input->size, &job->info, &job->table)))
+		return job->status;
+	job->addr = job->info->addr;
+
+	NTSTATUS result = queue_command(DeviceContext, Request);
+	if (!NT_SUCCESS(result))
+		abort_command(Request);
+
+	return result;
+}
+
+IOCTL_FN(ioctl_send_msg_batch)
+{
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	const size_t count = InputBufferLength / sizeof(PortholeMsg);
+	if (count == 0 || count > PORTHOLE_MAX_BATCH || InputBufferLength != count * sizeof(PortholeMsg))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (OutputBufferLength != count * sizeof(PortholeBatchResult))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	PPortholeMsg input;
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, InputBufferLength, (PVOID *)&input, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
 
-	/* want for the final segment and check it's result */
-	wait_device(DeviceContext->regs, PH_REG_CR_ADD_SEGMENT, 0x0);
-	if (!NT_SUCCESS(result = check_success(DeviceContext->regs)))
+	PREQUEST_CONTEXT context = init_command(Request, (ULONG)count, TRUE, FALSE);
+	if (!context)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	/* entries that fail here are reported back in the results */
+	for (ULONG i = 0; i < context->count; ++i)
 	{
-		free_mdl(mdl);
-		mdlInfo->size = 0;
-		KeReleaseSpinLock(&DeviceContext->deviceLock, oldIRQL);
-		return result;
+		PMAP_JOB job = &context->jobs[i];
+		if (input[i].size == 0 || !input[i].addr)
+		{
+			job->status = STATUS_INVALID_USER_BUFFER;
+			continue;
+		}
+
+		job->type   = input[i].type;
+		job->status = map_prepare(FileContext, &input[i], &job->info, &job->table);
 	}
 
-	/* send the final message */
-	DeviceContext->regs->type = input->type;
-	_ReadWriteBarrier();
-	DeviceContext->regs->cr  |= PH_REG_CR_FINISH;
-	wait_device(DeviceContext->regs, PH_REG_CR_FINISH, 0x0);
-	result = check_success(DeviceContext->regs);
+	NTSTATUS result = queue_command(DeviceContext, Request);
+	if (!NT_SUCCESS(result))
+		abort_command(Request);
+
+	return result;
+}
+
+IOCTL_FN(ioctl_extend)
+{
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	PPortholeExtendMsg input;
+
+	if (InputBufferLength != sizeof(PortholeExtendMsg))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, sizeof(PortholeExtendMsg), (PVOID *)&input, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (input->size == 0 || !input->addr)
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (!(DeviceContext->caps & PH_REG_CAPS_EXTEND))
+		return STATUS_NOT_SUPPORTED;
+
+	PREQUEST_CONTEXT context = init_command(Request, 1, FALSE, FALSE);
+	PMAP_JOB         job     = &context->job;
+	context->extend = TRUE;
+
+	/* hold the mapping so it can't be unmapped while it grows */
+	if (!(job->info = map_claim(FileContext, input->id)))
+		return STATUS_INVALID_ADDRESS;
+
+	/* lock only the new pages, while we are in the context of the caller */
+	job->size = input->size;
+	if (!NT_SUCCESS(job->status = map_prepare_extend(FileContext, job->info, input, &job->mdl, &job->table)))
+		return job->status;
+
+	NTSTATUS result = queue_command(DeviceContext, Request);
 	if (!NT_SUCCESS(result))
+		abort_command(Request);
+
+	return result;
+}
+
+IOCTL_FN(ioctl_dirty)
+{
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	PPortholeDirtyMsg input;
+
+	if (InputBufferLength < sizeof(PortholeDirtyMsg))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, InputBufferLength, (PVOID *)&input, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (input->count == 0 || input->count > PORTHOLE_MAX_DIRTY ||
+		InputBufferLength != sizeof(PortholeDirtyMsg) + input->count * sizeof(PortholeDirtyRange))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!(DeviceContext->caps & PH_REG_CAPS_DIRTY))
+		return STATUS_NOT_SUPPORTED;
+
+	PREQUEST_CONTEXT context = init_command(Request, 1, FALSE, FALSE);
+	PMAP_JOB         job     = &context->job;
+	context->dirty = TRUE;
+
+	/* hold the mapping so the ranges can't outlive it */
+	if (!(job->info = map_claim(FileContext, input->id)))
+		return STATUS_INVALID_ADDRESS;
+
+	/* the ranges follow the header and are coalesced in the system buffer */
+	PPortholeDirtyRange ranges = (PPortholeDirtyRange)(input + 1);
+	if (!NT_SUCCESS(job->status = map_prepare_dirty(FileContext, job->info, ranges, input->count, &job->table)))
+		return job->status;
+
+	/* nothing was left inside the mapping */
+	if (!job->table.count)
 	{
-		KeReleaseSpinLock(&DeviceContext->deviceLock, oldIRQL);
-		return result;
+		map_abort_dirty(FileContext, job->info, &job->table);
+		return STATUS_SUCCESS;
 	}
 
-	/* the mapping ID will be in the lower address register */
-	mdlInfo->id = DeviceContext->regs->addr.LowPart;
-	KeReleaseSpinLock(&DeviceContext->deviceLock, oldIRQL);
+	NTSTATUS result = queue_command(DeviceContext, Request);
+	if (!NT_SUCCESS(result))
+		abort_command(Request);
 
-	*output = mdlInfo->id;
-	*BytesReturned = sizeof(PortholeMapID);
-	return STATUS_SUCCESS;
+	return result;
 }
 
 IOCTL_FN(ioctl_unlock_buffer)
@@ -397,32 +778,83 @@ IOCTL_FN(ioctl_unlock_buffer)
 	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, sizeof(PortholeMapID), (PVOID *)&input, NULL)))
 		return STATUS_INVALID_USER_BUFFER;
 
-	KIRQL oldIRQL;
-	KeAcquireSpinLock(&DeviceContext->deviceLock, &oldIRQL);
-	for (int i = 0; i < PORTHOLE_MAX_LOCKS; ++i)
-		if (FileContext->mdlList[i].size > 0 && FileContext->mdlList[i].id == *input)
+	if (FileContext->deferUnmap)
+	{
+		PMDLInfo info = map_claim(FileContext, *input);
+		if (!info)
+			return STATUS_INVALID_ADDRESS;
+
+		defer_unmap(DeviceContext, FileContext, info);
+		return STATUS_SUCCESS;
+	}
+
+	PREQUEST_CONTEXT context = init_command(Request, 1, FALSE, TRUE);
+	PMAP_JOB         job     = &context->job;
+
+	if (!(job->info = map_claim(FileContext, *input)))
+		return STATUS_INVALID_ADDRESS;
+	job->status = STATUS_SUCCESS;
+
+	NTSTATUS result = queue_command(DeviceContext, Request);
+	if (!NT_SUCCESS(result))
+		abort_command(Request);
+
+	return result;
+}
+
+IOCTL_FN(ioctl_unlock_batch)
+{
+	const size_t count = InputBufferLength / sizeof(PortholeMapID);
+	if (count == 0 || count > PORTHOLE_MAX_BATCH || InputBufferLength != count * sizeof(PortholeMapID))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (OutputBufferLength != count * sizeof(LONG))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	PPortholeMapID input;
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, InputBufferLength, (PVOID *)&input, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (FileContext->deferUnmap)
+	{
+		PLONG output;
+		if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, OutputBufferLength, (PVOID *)&output, NULL)))
+			return STATUS_INVALID_USER_BUFFER;
+
+		/* the results only say if the entry was queued, see IOCTL_PORTHOLE_FLUSH */
+		for (ULONG i = 0; i < count; ++i)
 		{
-			PMDLInfo info = &FileContext->mdlList[i];
-
-			DeviceContext->regs->addr.QuadPart = info->id;
-			_ReadWriteBarrier();
-			DeviceContext->regs->cr |= PH_REG_CR_UNMAP;
-			wait_device(DeviceContext->regs, PH_REG_CR_UNMAP, 0);
-			NTSTATUS result = check_success(DeviceContext->regs);
-			if (!NT_SUCCESS(result))
+			PMDLInfo info = map_claim(FileContext, input[i]);
+			if (!info)
 			{
-				KeReleaseSpinLock(&DeviceContext->deviceLock, oldIRQL);
-				return result;
+				output[i] = STATUS_INVALID_ADDRESS;
+				continue;
 			}
 
-			free_mdl(info->mdl);
-			info->size = 0;
-			KeReleaseSpinLock(&DeviceContext->deviceLock, oldIRQL);
-			return STATUS_SUCCESS;
+			defer_unmap(DeviceContext, FileContext, info);
+			output[i] = STATUS_SUCCESS;
 		}
 
-	KeReleaseSpinLock(&DeviceContext->deviceLock, oldIRQL);
-	return STATUS_INVALID_ADDRESS;
+		*BytesReturned = OutputBufferLength;
+		return STATUS_SUCCESS;
+	}
+
+	PREQUEST_CONTEXT context = init_command(Request, (ULONG)count, TRUE, TRUE);
+	if (!context)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	for (ULONG i = 0; i < context->count; ++i)
+	{
+		PMAP_JOB job = &context->jobs[i];
+		job->status = (job->info = map_claim(FileContext, input[i])) ?
+			STATUS_SUCCESS : STATUS_INVALID_ADDRESS;
+	}
+
+	NTSTATUS result = queue_command(DeviceContext, Request);
+	if (!NT_SUCCESS(result))
+		abort_command(Request);
+
+	return result;
 }
 
 IOCTL_FN(ioctl_register_events)
@@ -431,6 +863,7 @@ IOCTL_FN(ioctl_register_events)
 	UNREFERENCED_PARAMETER(OutputBufferLength);
 
 	PPortholeEvents input;
+	NTSTATUS        status;
 
 	if (InputBufferLength != sizeof(PortholeEvents))
 		return STATUS_INVALID_BUFFER_SIZE;
@@ -465,16 +898,241 @@ IOCTL_FN(ioctl_register_events)
 		KeResetEvent(record->disconnect);
 	}
 
-	ExInterlockedInsertTailList(
-		&DeviceContext->eventList,
-		&record->listEntry,
-		&DeviceContext->eventListLock);
-
-	return STATUS_SUCCESS;
+	status = events_add(DeviceContext, &FileContext->events, record);
+	if (NT_SUCCESS(status))
+		return STATUS_SUCCESS;
+	goto fail;
 
 invalid_handle:
-	if (input->connect)
-		ObDereferenceObject(input->connect);
+	status = STATUS_INVALID_HANDLE;
+
+fail:
+	if (record->connect)
+		ObDereferenceObject(record->connect);
+	if (record->disconnect)
+		ObDereferenceObject(record->disconnect);
 	ExFreePoolWithTag(record, TAG);
-	return STATUS_INVALID_HANDLE;
+	return status;
+}
+
+IOCTL_FN(ioctl_get_wait_histogram)
+{
+	UNREFERENCED_PARAMETER(FileContext);
+	UNREFERENCED_PARAMETER(InputBufferLength);
+
+	PPortholeWaitHistogram output;
+
+	if (OutputBufferLength != sizeof(PortholeWaitHistogram))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(PortholeWaitHistogram), (PVOID *)&output, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	RtlCopyMemory(output, &DeviceContext->waitHistogram, sizeof(PortholeWaitHistogram));
+	*BytesReturned = sizeof(PortholeWaitHistogram);
+	return STATUS_SUCCESS;
+}
+
+IOCTL_FN(ioctl_configure)
+{
+	UNREFERENCED_PARAMETER(DeviceContext);
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	PPortholeConfig config;
+
+	if (InputBufferLength != sizeof(PortholeConfig))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, sizeof(PortholeConfig), (PVOID *)&config, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (config->flags & ~(PORTHOLE_CONFIG_REG_CACHE | PORTHOLE_CONFIG_DEFERRED_UNMAP | PORTHOLE_CONFIG_STREAM |
+		PORTHOLE_CONFIG_PARALLEL_LOCK))
+		return STATUS_INVALID_PARAMETER;
+
+	if (config->lockThreads > PORTHOLE_MAX_LOCK_THREADS)
+		return STATUS_INVALID_PARAMETER;
+
+	regcache_configure(&FileContext->cache, (config->flags & PORTHOLE_CONFIG_REG_CACHE) != 0, config->cacheBudget);
+
+	/* unlocks already queued still run, turning this off doesn't flush them */
+	FileContext->deferUnmap = (config->flags & PORTHOLE_CONFIG_DEFERRED_UNMAP) != 0;
+	FileContext->stream     = (config->flags & PORTHOLE_CONFIG_STREAM        ) != 0;
+
+	ULONG threads = 0;
+	if (config->flags & PORTHOLE_CONFIG_PARALLEL_LOCK)
+		threads = config->lockThreads ? config->lockThreads :
+			min(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS), PORTHOLE_MAX_LOCK_THREADS);
+	FileContext->lockThreads = threads;
+	return STATUS_SUCCESS;
+}
+
+IOCTL_FN(ioctl_get_cache_stats)
+{
+	UNREFERENCED_PARAMETER(DeviceContext);
+	UNREFERENCED_PARAMETER(InputBufferLength);
+
+	PPortholeCacheStats output;
+
+	if (OutputBufferLength != sizeof(PortholeCacheStats))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(PortholeCacheStats), (PVOID *)&output, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	regcache_stats(&FileContext->cache, output);
+	*BytesReturned = sizeof(PortholeCacheStats);
+	return STATUS_SUCCESS;
+}
+
+IOCTL_FN(ioctl_doorbell)
+{
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	PPortholeDoorbell input;
+
+	if (InputBufferLength != sizeof(PortholeDoorbell))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, sizeof(PortholeDoorbell), (PVOID *)&input, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (!DeviceContext->connected)
+		return STATUS_DEVICE_NOT_CONNECTED;
+
+	/* completed inline, the doorbell never waits on the command queue. hold
+	 * the mapping so the device can't reuse it's ID for another before the
+	 * write goes out, doorbell_ring only returns once it has */
+	PMDLInfo info = map_claim(FileContext, input->id);
+	if (!info)
+		return STATUS_INVALID_ADDRESS;
+
+	NTSTATUS status = doorbell_ring(DeviceContext, info->id, input->value);
+	map_unclaim(FileContext, info);
+	return status;
+}
+
+IOCTL_FN(ioctl_notify_register)
+{
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	PPortholeNotifyRegister input;
+
+	if (InputBufferLength != sizeof(PortholeNotifyRegister))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, sizeof(PortholeNotifyRegister), (PVOID *)&input, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (!(DeviceContext->caps & PH_REG_CAPS_NOTIFY))
+		return STATUS_NOT_SUPPORTED;
+
+	if (!DeviceContext->connected)
+		return STATUS_DEVICE_NOT_CONNECTED;
+
+	PKEVENT event = NULL;
+	if (input->event != (HANDLE)-1)
+	{
+		PIRP irp = WdfRequestWdmGetIrp(Request);
+		if (!NT_SUCCESS(ObReferenceObjectByHandle(input->event, SYNCHRONIZE | EVENT_MODIFY_STATE, *ExEventObjectType, irp->RequestorMode, &event, NULL)))
+			return STATUS_INVALID_HANDLE;
+		KeResetEvent(event);
+	}
+
+	/* hold the mapping so it can't be unmapped before we have subscribed */
+	PMDLInfo info = map_claim(FileContext, input->id);
+	if (!info)
+	{
+		if (event)
+			ObDereferenceObject(event);
+		return STATUS_INVALID_ADDRESS;
+	}
+
+	NTSTATUS status = notify_register(DeviceContext, FileContext, info->id, event);
+	map_unclaim(FileContext, info);
+
+	if (!NT_SUCCESS(status) && event)
+		ObDereferenceObject(event);
+	return status;
+}
+
+IOCTL_FN(ioctl_notify_wait)
+{
+	PPortholeMapID        input;
+	PPortholeNotifyResult output;
+
+	if (InputBufferLength != sizeof(PortholeMapID))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (OutputBufferLength != sizeof(PortholeNotifyResult))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, sizeof(PortholeMapID), (PVOID *)&input, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(PortholeNotifyResult), (PVOID *)&output, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	int id;
+	if (!handle_get_id(&FileContext->mappings, *input, &id))
+		return STATUS_INVALID_ADDRESS;
+
+	NTSTATUS status = notify_wait(DeviceContext, FileContext, id, Request, output);
+	if (status == STATUS_SUCCESS)
+		*BytesReturned = sizeof(PortholeNotifyResult);
+	return status;
+}
+
+IOCTL_FN(ioctl_query_stats)
+{
+	UNREFERENCED_PARAMETER(InputBufferLength);
+
+	PPortholeStats output;
+
+	if (OutputBufferLength != sizeof(PortholeStats))
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(PortholeStats), (PVOID *)&output, NULL)))
+		return STATUS_INVALID_USER_BUFFER;
+
+	RtlZeroMemory(output, sizeof(PortholeStats));
+	output->version = PORTHOLE_STATS_VERSION;
+	output->count   = PORTHOLE_STAT_MAX;
+	stats_query(DeviceContext, output->device);
+
+	for (ULONG i = 0; i < ARRAYSIZE(FileContext->stats); ++i)
+		output->handle[i] = (UINT64)ReadNoFence64(&FileContext->stats[i]);
+
+	*BytesReturned = sizeof(PortholeStats);
+	return STATUS_SUCCESS;
+}
+
+IOCTL_FN(ioctl_flush)
+{
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(InputBufferLength);
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	PDEFERRED_UNMAP deferred = &FileContext->deferred;
+	NTSTATUS        status;
+	KIRQL           oldIRQL;
+
+	/* pended under the lock so complete_flushes can't miss the request */
+	KeAcquireSpinLock(&deferred->lock, &oldIRQL);
+	if (deferred->pending)
+	{
+		status = WdfRequestForwardToIoQueue(Request, DeviceContext->flushQueue);
+		if (NT_SUCCESS(status))
+			status = STATUS_PENDING;
+	}
+	else
+	{
+		status          = deferred->error;
+		deferred->error = STATUS_SUCCESS;
+	}
+	KeReleaseSpinLock(&deferred->lock, oldIRQL);
+	return status;
 }
\ No newline at end of file
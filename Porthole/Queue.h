@@ -22,36 +22,79 @@ SOFTWARE.
 
 EXTERN_C_START
 
-typedef struct _MDLInfo
+/* unlocks queued by a PORTHOLE_CONFIG_DEFERRED_UNMAP handle for the release
+ * worker, the entries are claimed so nothing else can touch them */
+typedef struct _DEFERRED_UNMAP
 {
-	int    id;
-	PVOID  addr;
-	UINT32 size;
-	PMDL   mdl;
+	KSPIN_LOCK lock;
+	PMDLInfo   head;
+	PMDLInfo   tail;
+	ULONG      pending;   // queued or being unmapped
+	NTSTATUS   error;     // first failure since the last flush
+	BOOLEAN    queued;    // on the device's releaseList, under releaseListLock
+	LIST_ENTRY listEntry;
 }
-MDLInfo, *PMDLInfo;
-
-#define PORTHOLE_MAX_LOCKS 32
+DEFERRED_UNMAP, *PDEFERRED_UNMAP;
 
 typedef struct _FILE_OBJECT_CONTEXT
 {
 	PDEVICE_CONTEXT deviceContext;
-	MDLInfo         mdlList[PORTHOLE_MAX_LOCKS];
+	HANDLE_TABLE    mappings;
+	REG_CACHE       cache;
+	LIST_ENTRY      events; // PORTHOLE_EVENTs registered through this handle
+	BOOLEAN         deferUnmap;
+	BOOLEAN         stream;
+	ULONG           lockThreads; // PORTHOLE_CONFIG_PARALLEL_LOCK workers, 0 when off
+	DEFERRED_UNMAP  deferred;
+
+	/* this handle's share of the mapping counters */
+	volatile LONG64 stats[PORTHOLE_STAT_SEGMENTS + 1];
 }
 FILE_OBJECT_CONTEXT, *PFILE_OBJECT_CONTEXT;
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_OBJECT_CONTEXT, FileGetContext)
 
+/* a single map or unmap waiting on the device */
+typedef struct _MAP_JOB
+{
+	NTSTATUS      status;
+	PMDLInfo      info;
+	SEGMENT_TABLE table;
+	UINT32        type;
+	PortholeMapID id;
+	PVOID         addr; // where a driver allocated buffer was mapped
+	PMDL          mdl;  // the range an extend appends
+	UINT64        size;
+}
+MAP_JOB, *PMAP_JOB;
+
+/* a request waiting on the command queue for the device */
+typedef struct _REQUEST_CONTEXT
+{
+	BOOLEAN  batch;
+	BOOLEAN  unmap;
+	BOOLEAN  alloc;
+	BOOLEAN  extend;
+	BOOLEAN  dirty;
+	ULONG    count;
+	int      notifyId; // device mapping ID while pended on a notification
+	PMAP_JOB jobs; // points at `job` unless this is a batch
+	MAP_JOB  job;
+}
+REQUEST_CONTEXT, *PREQUEST_CONTEXT;
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT, RequestGetContext)
+
 NTSTATUS PortholeQueueInitialize  (WDFDEVICE Device);
 VOID     PortholeDeviceFileCreate (WDFDEVICE Device, WDFREQUEST Request, WDFFILEOBJECT FileObject);
 VOID     PortholeDeviceFileCleanup(WDFFILEOBJECT FileObject);
+VOID     PortholeDeviceFileClose  (WDFFILEOBJECT FileObject);
 
 //
 // Events from the IoQueue object
 //
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL PortholeEvtIoDeviceControl;
 EVT_WDF_IO_QUEUE_IO_STOP PortholeEvtIoStop;
-
-// Helpers
-void free_mdl(PMDL mdl);
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE PortholeEvtIoCanceledOnQueue;
+EVT_WDF_WORKITEM PortholeCommandWorker;
+EVT_WDF_WORKITEM PortholeReleaseWorker;
 
 EXTERN_C_END
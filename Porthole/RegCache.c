@@ -0,0 +1,250 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "regcache.tmh"
+
+#define HASH_ADDR(addr) (((ULONG_PTR)(addr) >> PAGE_SHIFT) % REGCACHE_BUCKETS)
+
+void regcache_init(PREG_CACHE cache)
+{
+	RtlZeroMemory(cache, sizeof(REG_CACHE));
+	ExInitializeFastMutex(&cache->lock);
+	InitializeListHead(&cache->lru);
+	for (int i = 0; i < REGCACHE_BUCKETS; ++i)
+		InitializeListHead(&cache->buckets[i]);
+}
+
+static void destroy_entry(PREG_ENTRY entry)
+{
+	/* the range must be unsecured from the process that secured it */
+	if (entry->secure)
+	{
+		KAPC_STATE    apcState;
+		const BOOLEAN attach = PsGetCurrentProcess() != entry->process;
+		if (attach)
+			KeStackAttachProcess(entry->process, &apcState);
+		MmUnsecureVirtualMemory(entry->secure);
+		if (attach)
+			KeUnstackDetachProcess(&apcState);
+	}
+
+	segtable_free(&entry->table);
+	free_mdl(entry->mdl);
+	if (entry->process)
+		ObDereferenceObject(entry->process);
+	ExFreePoolWithTag(entry, TAG);
+}
+
+/* unlink idle entries onto the evicted list until the pinned bytes fit the
+ * budget, must be called with the lock held */
+static void trim(PREG_CACHE cache, PLIST_ENTRY evicted)
+{
+	const UINT64 limit = cache->enabled ? cache->budget : 0;
+	while (cache->pinned > limit && !IsListEmpty(&cache->lru))
+	{
+		PREG_ENTRY entry = CONTAINING_RECORD(RemoveHeadList(&cache->lru), REG_ENTRY, lruEntry);
+		RemoveEntryList(&entry->hashEntry);
+		cache->pinned -= entry->size;
+		--cache->entries;
+		++cache->evictions;
+		InsertTailList(evicted, &entry->lruEntry);
+	}
+}
+
+/* destroy evicted entries, must be called without the lock held as
+ * unsecuring a range may need to attach to the owning process */
+static void destroy_evicted(PLIST_ENTRY evicted)
+{
+	while (!IsListEmpty(evicted))
+		destroy_entry(CONTAINING_RECORD(RemoveHeadList(evicted), REG_ENTRY, lruEntry));
+}
+
+void regcache_configure(PREG_CACHE cache, const BOOLEAN enable, const UINT64 budget)
+{
+	LIST_ENTRY evicted;
+	InitializeListHead(&evicted);
+
+	ExAcquireFastMutex(&cache->lock);
+	cache->enabled = enable;
+	cache->budget  = budget;
+	trim(cache, &evicted);
+	ExReleaseFastMutex(&cache->lock);
+
+	destroy_evicted(&evicted);
+}
+
+NTSTATUS regcache_acquire(PREG_CACHE cache, PVOID addr, UINT32 size, PREG_ENTRY * result)
+{
+	const PEPROCESS   process = PsGetCurrentProcess();
+	const PLIST_ENTRY bucket  = &cache->buckets[HASH_ADDR(addr)];
+
+	ExAcquireFastMutex(&cache->lock);
+	if (!cache->enabled || size > cache->budget)
+	{
+		ExReleaseFastMutex(&cache->lock);
+		return STATUS_NOT_FOUND;
+	}
+
+	for (PLIST_ENTRY item = bucket->Flink; item != bucket; item = item->Flink)
+	{
+		PREG_ENTRY entry = CONTAINING_RECORD(item, REG_ENTRY, hashEntry);
+		if (entry->process != process || entry->addr != addr || entry->size != size)
+			continue;
+
+		/* in use entries are not on the lru list */
+		if (entry->refs++ == 0)
+			RemoveEntryList(&entry->lruEntry);
+
+		++cache->hits;
+		ExReleaseFastMutex(&cache->lock);
+		*result = entry;
+		return STATUS_SUCCESS;
+	}
+	++cache->misses;
+	ExReleaseFastMutex(&cache->lock);
+
+	/* lock and build the new entry without holding the cache lock */
+	PREG_ENTRY entry = (PREG_ENTRY)ExAllocatePoolWithTag(NonPagedPool, sizeof(REG_ENTRY), TAG);
+	if (!entry)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	RtlZeroMemory(entry, sizeof(REG_ENTRY));
+
+	entry->addr = addr;
+	entry->size = size;
+	entry->refs = 1;
+	segtable_init(&entry->table);
+
+	NTSTATUS status = lock_buffer(addr, size, &entry->mdl);
+	if (!NT_SUCCESS(status))
+	{
+		ExFreePoolWithTag(entry, TAG);
+		return status;
+	}
+
+	if (!NT_SUCCESS(status = segtable_build(&entry->table, entry->mdl, size)))
+	{
+		destroy_entry(entry);
+		return status;
+	}
+
+	/* stop the process freeing or remapping the range while it's cached,
+	 * if this fails the buffer is simply not cached */
+	if (!(entry->secure = MmSecureVirtualMemory(addr, size, PAGE_READWRITE)))
+	{
+		destroy_entry(entry);
+		return STATUS_NOT_FOUND;
+	}
+
+	ObReferenceObject(process);
+	entry->process = process;
+
+	LIST_ENTRY evicted;
+	InitializeListHead(&evicted);
+
+	ExAcquireFastMutex(&cache->lock);
+	InsertHeadList(bucket, &entry->hashEntry);
+	cache->pinned += size;
+	++cache->entries;
+	trim(cache, &evicted);
+	ExReleaseFastMutex(&cache->lock);
+
+	destroy_evicted(&evicted);
+
+	*result = entry;
+	return STATUS_SUCCESS;
+}
+
+void regcache_release(PREG_CACHE cache, PREG_ENTRY entry)
+{
+	LIST_ENTRY evicted;
+	InitializeListHead(&evicted);
+
+	ExAcquireFastMutex(&cache->lock);
+	if (entry->detached)
+	{
+		ExReleaseFastMutex(&cache->lock);
+		regcache_put(entry);
+		return;
+	}
+
+	if (--entry->refs == 0)
+	{
+		InsertTailList(&cache->lru, &entry->lruEntry);
+		trim(cache, &evicted);
+	}
+	ExReleaseFastMutex(&cache->lock);
+
+	destroy_evicted(&evicted);
+}
+
+void regcache_detach(PREG_CACHE cache, PREG_ENTRY entry)
+{
+	ExAcquireFastMutex(&cache->lock);
+	if (!entry->detached)
+	{
+		/* in use, so not on the lru list */
+		RemoveEntryList(&entry->hashEntry);
+		cache->pinned -= entry->size;
+		--cache->entries;
+		++cache->evictions;
+		entry->detached = TRUE;
+	}
+	ExReleaseFastMutex(&cache->lock);
+}
+
+void regcache_put(PREG_ENTRY entry)
+{
+	/* once detached the count is only changed here */
+	if (InterlockedDecrement(&entry->refs) == 0)
+		destroy_entry(entry);
+}
+
+void regcache_flush(PREG_CACHE cache)
+{
+	LIST_ENTRY evicted;
+	InitializeListHead(&evicted);
+
+	ExAcquireFastMutex(&cache->lock);
+	while (!IsListEmpty(&cache->lru))
+	{
+		PREG_ENTRY entry = CONTAINING_RECORD(RemoveHeadList(&cache->lru), REG_ENTRY, lruEntry);
+		RemoveEntryList(&entry->hashEntry);
+		cache->pinned -= entry->size;
+		--cache->entries;
+		InsertTailList(&evicted, &entry->lruEntry);
+	}
+	ExReleaseFastMutex(&cache->lock);
+
+	destroy_evicted(&evicted);
+}
+
+void regcache_stats(PREG_CACHE cache, PPortholeCacheStats stats)
+{
+	ExAcquireFastMutex(&cache->lock);
+	stats->hits        = cache->hits;
+	stats->misses      = cache->misses;
+	stats->evictions   = cache->evictions;
+	stats->pinnedBytes = cache->pinned;
+	stats->entries     = cache->entries;
+	ExReleaseFastMutex(&cache->lock);
+}
@@ -0,0 +1,83 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+/*
+ * an opt-in cache of locked buffers so a producer that sends the same
+ * buffers over and over only pays for MmProbeAndLockPages and building the
+ * segment table once. cached ranges are secured so the process can't free
+ * or remap them while the cache holds their pages.
+ */
+
+#define REGCACHE_BUCKETS 64
+
+typedef struct _REG_ENTRY
+{
+	LIST_ENTRY    hashEntry;
+	LIST_ENTRY    lruEntry;   // only linked while the entry is idle
+	PEPROCESS     process;
+	PVOID         addr;
+	UINT32        size;
+	PMDL          mdl;
+	HANDLE        secure;
+	SEGMENT_TABLE table;
+	LONG          refs;       // mappings currently using the entry
+	BOOLEAN       detached;   // no longer in the cache, see regcache_detach
+}
+REG_ENTRY, *PREG_ENTRY;
+
+typedef struct _REG_CACHE
+{
+	FAST_MUTEX lock;
+	BOOLEAN    enabled;
+	UINT64     budget;        // pinned bytes to keep before evicting
+	UINT64     pinned;
+	ULONG      entries;
+	LIST_ENTRY lru;           // idle entries, least recently used first
+	LIST_ENTRY buckets[REGCACHE_BUCKETS];
+
+	UINT64     hits;
+	UINT64     misses;
+	UINT64     evictions;
+}
+REG_CACHE, *PREG_CACHE;
+
+void     regcache_init     (PREG_CACHE cache);
+void     regcache_configure(PREG_CACHE cache, const BOOLEAN enable, const UINT64 budget);
+
+/* find or create an entry for the buffer in the current process, returns
+ * STATUS_NOT_FOUND if the buffer should not be cached */
+NTSTATUS regcache_acquire  (PREG_CACHE cache, PVOID addr, UINT32 size, PREG_ENTRY * entry);
+void     regcache_release  (PREG_CACHE cache, PREG_ENTRY entry);
+
+/* take an in use entry out of the cache for good, a hung command may still
+ * be reading it. the caller's reference is dropped with regcache_put,
+ * which unlike regcache_release may outlive the cache */
+void     regcache_detach   (PREG_CACHE cache, PREG_ENTRY entry);
+void     regcache_put      (PREG_ENTRY entry);
+
+/* evict every idle entry */
+void     regcache_flush    (PREG_CACHE cache);
+void     regcache_stats    (PREG_CACHE cache, PPortholeCacheStats stats);
+
+EXTERN_C_END
@@ -0,0 +1,181 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+/*
+ * The device's register file and the structures it reads from guest memory.
+ * This has no kernel dependencies so user mode models of the device can be
+ * built from the same definitions.
+ */
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#elif defined(_WIN32)
+#include <Windows.h>
+typedef LARGE_INTEGER PHYSICAL_ADDRESS;
+#else
+#include <stdint.h>
+typedef uint32_t ULONG;
+typedef uint64_t UINT64;
+typedef union _PHYSICAL_ADDRESS
+{
+	struct
+	{
+		uint32_t LowPart;
+		int32_t  HighPart;
+	};
+	int64_t QuadPart;
+}
+PHYSICAL_ADDRESS;
+#endif
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 0x1000
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma align(push, 4)
+typedef struct PortholeDeviceRegisters
+{
+	volatile ULONG cr;
+	volatile ULONG isr;
+	volatile ULONG type;
+
+	volatile ULONG size;
+	volatile PHYSICAL_ADDRESS addr;
+
+	volatile ULONG caps;
+	volatile ULONG doorbell;
+	volatile ULONG notify;
+}
+PortholeDeviceRegisters, *PPortholeDeviceRegisters;
+#pragma align(pop)
+
+#define PH_REG_CR_IRQ         (1 << 0) // SW=S, SW=C, enable interrupts
+#define PH_REG_CR_START       (1 << 1) // SW=S, HW=C, start of a mapping
+#define PH_REG_CR_ADD_SEGMENT (1 << 2) // SW=S, HW=C, add a segment to mapping
+#define PH_REG_CR_FINISH      (1 << 3) // SW=S, HW=C, end of segments
+#define PH_REG_CR_UNMAP       (1 << 4) // SW=S, HW=C, unmap a segment
+
+#define PH_REG_CR_TIMEOUT     (1 << 5) // HW=S, HW=C, timeout occured
+#define PH_REG_CR_BADADDR     (1 << 6) // HW=S, HW=C, bad address specified
+#define PH_REG_CR_NOCONN      (1 << 7) // HW=S, HW=C, no client connection
+#define PH_REG_CR_NORES       (1 << 8) // HW=S, HW=C, no resources left
+#define PH_REG_CR_DEVERR      (1 << 9) // HW=S, HW=C, invalid device usage
+#define PH_REG_CR_ADD_TABLE   (1 << 10) // SW=S, HW=C, add a segment table to mapping
+#define PH_REG_CR_VECTORS     (1 << 11) // SW=S, SW=C, raise causes on their own vectors
+#define PH_REG_CR_EXTEND      (1 << 12) // SW=S, HW=C, start appending to the mapping in addr
+#define PH_REG_CR_DIRTY       (1 << 13) // SW=S, HW=C, report written ranges of the mapping in type
+
+// Device capabilities, read only
+
+/* protocol v2, the device accepts PH_REG_CR_ADD_TABLE where `addr` is the
+ * physical address of the first page of a segment table and `size` is the
+ * number of segments in it.
+ */
+#define PH_REG_CAPS_SEGTABLE  (1 << 0)
+
+/* the device raises PH_REG_ISR_COMPLETE when it clears a command bit */
+#define PH_REG_CAPS_CMD_IRQ   (1 << 1)
+
+/* the device accepts writes to `doorbell`, see PH_DOORBELL */
+#define PH_REG_CAPS_DOORBELL  (1 << 2)
+
+/* a doorbell notifies the client of activity on an existing mapping with a
+ * single register write, no command sequence is run and nothing is
+ * acknowledged. the low bits carry the mapping ID and the high bits a small
+ * value, values raised for the same mapping may be OR'd together.
+ *
+ * `doorbell` and `notify` are 32 bits wide, so a device reporting
+ * PH_REG_CAPS_DOORBELL or PH_REG_CAPS_NOTIFY only hands out mapping IDs up
+ * to PH_DOORBELL_ID_MASK and reuses them from 1 once it gets there.
+ */
+#define PH_DOORBELL_ID_BITS    24
+#define PH_DOORBELL_ID_MASK    ((1UL << PH_DOORBELL_ID_BITS) - 1)
+#define PH_DOORBELL_VALUE_MASK (0xFFUL)
+#define PH_DOORBELL(id, value) (((ULONG)(value) << PH_DOORBELL_ID_BITS) | ((ULONG)(id) & PH_DOORBELL_ID_MASK))
+
+/* the client can notify the guest of activity on a mapping, the device
+ * raises PH_REG_ISR_NOTIFY and each read of `notify` pops the next
+ * notification in the doorbell format, or PH_NOTIFY_EMPTY if there are none
+ */
+#define PH_REG_CAPS_NOTIFY    (1 << 3)
+#define PH_NOTIFY_EMPTY       (0xFFFFFFFFUL)
+#define PH_NOTIFY_DRAIN_MAX   256
+
+/* given PH_VECTOR_COUNT message signalled interrupts the device can raise
+ * each cause on it's own vector. with PH_REG_CR_VECTORS set completions and
+ * notifications are no longer latched in `isr`, only connection changes
+ * are and they arrive on PH_VECTOR_CONFIG.
+ */
+#define PH_REG_CAPS_VECTORS   (1 << 4)
+
+/* PH_REG_CR_EXTEND takes the ID of an existing mapping in `addr` and opens
+ * it in place of PH_REG_CR_START. the segments that follow are appended to
+ * the end of the mapping, PH_REG_CR_FINISH ignores `type` and hands back the
+ * same ID. if any step fails the mapping is left as it was.
+ */
+#define PH_REG_CAPS_EXTEND    (1 << 5)
+
+/* PH_REG_CR_DIRTY tells the device which parts of a mapping the guest has
+ * written. `type` is the mapping ID, `addr` and `size` point at a table in
+ * the segment table format where each entry's `addr` is a byte offset into
+ * the mapping. the entries are page aligned, sorted and never overlap or
+ * touch.
+ */
+#define PH_REG_CAPS_DIRTY     (1 << 6)
+
+/* segment table entry as read by the device. Each table page holds
+ * PH_SEGTABLE_ENTRIES entries, if the table continues the last entry of the
+ * page is a link with `size` set to zero and `addr` set to the physical
+ * address of the next page.
+ */
+typedef struct PortholeSegment
+{
+	UINT64 addr;
+	UINT64 size;
+}
+PortholeSegment, *PPortholeSegment;
+
+#define PH_SEGTABLE_ENTRIES (PAGE_SIZE / sizeof(PortholeSegment))
+
+// All ISRs are set by hardware and cleared by writing to them
+
+/* client connection state changed
+ * check PH_REG_CR_NOCONN to determine the current state
+ */
+#define PH_REG_ISR_CONNECT    (1 << 0)
+#define PH_REG_ISR_DISCONNECT (1 << 1)
+
+/* a command has completed, see PH_REG_CAPS_CMD_IRQ */
+#define PH_REG_ISR_COMPLETE   (1 << 2)
+
+/* the client has notified one or more mappings, see PH_REG_CAPS_NOTIFY */
+#define PH_REG_ISR_NOTIFY     (1 << 3)
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,120 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "segment.tmh"
+
+void segtable_init(PSEGMENT_TABLE table)
+{
+	RtlZeroMemory(table, sizeof(SEGMENT_TABLE));
+}
+
+void segtable_free(PSEGMENT_TABLE table)
+{
+	for (PSEGMENT_PAGE page = table->head, next; page; page = next)
+	{
+		next = page->next;
+		ExFreePoolWithTag(page->entries, TAG);
+		ExFreePoolWithTag(page, TAG);
+	}
+	segtable_init(table);
+}
+
+static PSEGMENT_PAGE alloc_page(void)
+{
+	PSEGMENT_PAGE page = ExAllocatePoolWithTag(NonPagedPool, sizeof(SEGMENT_PAGE), TAG);
+	if (!page)
+		return NULL;
+
+	/* page sized allocations are always page aligned */
+	page->entries = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, TAG);
+	if (!page->entries)
+	{
+		ExFreePoolWithTag(page, TAG);
+		return NULL;
+	}
+
+	page->next = NULL;
+	page->pa   = MmGetPhysicalAddress(page->entries);
+	return page;
+}
+
+NTSTATUS segtable_add(PSEGMENT_TABLE table, UINT64 addr, UINT64 size)
+{
+	if (!table->tail)
+	{
+		if (!(table->head = table->tail = alloc_page()))
+			return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	else if (table->used == PH_SEGTABLE_ENTRIES - 1)
+	{
+		/* the last entry of a full page links to the next page */
+		PSEGMENT_PAGE page = alloc_page();
+		if (!page)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		table->tail->entries[table->used].addr = page->pa.QuadPart;
+		table->tail->entries[table->used].size = 0;
+		table->tail->next = page;
+		table->tail       = page;
+		table->used       = 0;
+	}
+
+	table->tail->entries[table->used].addr = addr;
+	table->tail->entries[table->used].size = size;
+	++table->used;
+	++table->count;
+	return STATUS_SUCCESS;
+}
+
+/* the coalescer is OS independent so make sure it's view of pages matches ours */
+C_ASSERT(PAGE_SHIFT == COALESCE_PAGE_SHIFT);
+C_ASSERT(sizeof(PFN_NUMBER) == sizeof(CO_PFN));
+
+static int add_run(void * opaque, CO_U64 addr, CO_U64 size)
+{
+	return segtable_add((PSEGMENT_TABLE)opaque, addr, size);
+}
+
+NTSTATUS segtable_build(PSEGMENT_TABLE table, PMDL mdl, UINT64 size)
+{
+	NTSTATUS result;
+	UINT64   remaining = size;
+
+	COALESCE co;
+	coalesce_init(&co, add_run, table);
+
+	for (PMDL curMdl = mdl; curMdl != NULL && remaining; curMdl = curMdl->Next)
+	{
+		const ULONG pages  = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(curMdl), MmGetMdlByteCount(curMdl));
+		const ULONG length = (ULONG)min(MmGetMdlByteCount(curMdl), remaining);
+
+		result = coalesce_pfns(&co, MmGetMdlPfnArray(curMdl), pages, MmGetMdlByteOffset(curMdl), length);
+		if (!NT_SUCCESS(result))
+			return result;
+
+		remaining -= length;
+	}
+
+	/* add the final segment */
+	return coalesce_flush(&co);
+}
@@ -0,0 +1,56 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+/* a driver owned, non-paged chain of segment table pages */
+typedef struct _SEGMENT_PAGE
+{
+	struct _SEGMENT_PAGE * next;
+	PPortholeSegment       entries;
+	PHYSICAL_ADDRESS       pa;
+}
+SEGMENT_PAGE, *PSEGMENT_PAGE;
+
+typedef struct _SEGMENT_TABLE
+{
+	PSEGMENT_PAGE head;
+	PSEGMENT_PAGE tail;
+	ULONG         used;  // entries used in the tail page
+	ULONG         count; // total number of segments
+}
+SEGMENT_TABLE, *PSEGMENT_TABLE;
+
+void     segtable_init (PSEGMENT_TABLE table);
+void     segtable_free (PSEGMENT_TABLE table);
+NTSTATUS segtable_add  (PSEGMENT_TABLE table, UINT64 addr, UINT64 size);
+NTSTATUS segtable_build(PSEGMENT_TABLE table, PMDL mdl, UINT64 size);
+
+/* the most a single MDL is made to describe, larger buffers are locked as a
+ * chain linked by Next where every MDL after the first starts on a page */
+#define MDL_CHUNK_SIZE (1ULL << 30)
+
+/* number of segments stored in the supplied page of the table */
+#define SEGTABLE_PAGE_COUNT(table, page) \
+	((page)->next ? (ULONG)PH_SEGTABLE_ENTRIES - 1 : (table)->used)
+
+EXTERN_C_END
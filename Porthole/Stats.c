@@ -0,0 +1,59 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "stats.tmh"
+
+NTSTATUS stats_init(const PDEVICE_CONTEXT DeviceContext)
+{
+	/* room for processors that are added later */
+	const ULONG count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	DeviceContext->stats = ExAllocatePoolWithTag(NonPagedPoolCacheAligned, count * sizeof(STATS_CPU), TAG);
+	if (!DeviceContext->stats)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	RtlZeroMemory(DeviceContext->stats, count * sizeof(STATS_CPU));
+	DeviceContext->statsCount = count;
+	return STATUS_SUCCESS;
+}
+
+void stats_free(const PDEVICE_CONTEXT DeviceContext)
+{
+	if (DeviceContext->stats)
+		ExFreePoolWithTag(DeviceContext->stats, TAG);
+
+	DeviceContext->stats      = NULL;
+	DeviceContext->statsCount = 0;
+}
+
+void stats_query(const PDEVICE_CONTEXT DeviceContext, UINT64 counters[PORTHOLE_STAT_MAX])
+{
+	RtlZeroMemory(counters, PORTHOLE_STAT_MAX * sizeof(UINT64));
+	if (!DeviceContext->stats)
+		return;
+
+	/* the sum is not a snapshot, each counter is read once */
+	for (ULONG cpu = 0; cpu < DeviceContext->statsCount; ++cpu)
+		for (ULONG i = 0; i < PORTHOLE_STAT_MAX; ++i)
+			counters[i] += (UINT64)ReadNoFence64(&DeviceContext->stats[cpu].counters[i]);
+}
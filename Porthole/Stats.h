@@ -0,0 +1,40 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+NTSTATUS stats_init (const PDEVICE_CONTEXT DeviceContext);
+void     stats_free (const PDEVICE_CONTEXT DeviceContext);
+
+/* sum the counters of every processor */
+void     stats_query(const PDEVICE_CONTEXT DeviceContext, UINT64 counters[PORTHOLE_STAT_MAX]);
+
+/* callable at any IRQL, the add is interlocked only so a preempted thread
+ * can't lose another's count, the line is never shared between processors */
+FORCEINLINE void stats_add(const PDEVICE_CONTEXT DeviceContext, const ULONG counter, const LONG64 value)
+{
+	const PSTATS_CPU stats = DeviceContext->stats;
+	if (stats)
+		InterlockedAdd64(&stats[KeGetCurrentProcessorIndex() % DeviceContext->statsCount].counters[counter], value);
+}
+
+EXTERN_C_END
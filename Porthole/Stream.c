@@ -0,0 +1,180 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "driver.h"
+#include "stream.tmh"
+
+/*
+ * Streamed sends. Each chunk of the buffer is posted to the device as it's
+ * own command, so the command lock is only held while the device takes one
+ * chunk's table and commands from other handles run in between. While the
+ * caller posts a chunk one of the device's lock workers is faulting in the
+ * next. A send that fails after the first chunk is mapped unmaps it again
+ * before the pages are unlocked, once the device is idle if it hung.
+ */
+
+/* what a command the device never completed was given, see cmd_hung */
+typedef struct _STREAM_HELD
+{
+	CMD_HELD      held;
+	SEGMENT_TABLE table;
+	PMDL          mdl;
+}
+STREAM_HELD, *PSTREAM_HELD;
+
+static void release_held(PCMD_HELD held)
+{
+	PSTREAM_HELD stream = CONTAINING_RECORD(held, STREAM_HELD, held);
+	segtable_free(&stream->table);
+	free_mdl(stream->mdl);
+	ExFreePoolWithTag(stream, TAG);
+}
+
+/* hand the table and the chain to the command layer rather than free what
+ * the device may still be reading, the caller's are left empty. with
+ * mapped the device still has id and the chain outlives it. if the record
+ * can't be allocated they are leaked, which is the lesser evil. must be
+ * called between cmd_begin and cmd_end */
+static void quarantine(const PDEVICE_CONTEXT DeviceContext, PSEGMENT_TABLE table, PMDL * mdl, const BOOLEAN mapped, const PortholeMapID id)
+{
+	PSTREAM_HELD held = ExAllocatePoolWithTag(NonPagedPool, sizeof(STREAM_HELD), TAG);
+	if (held)
+	{
+		held->table = *table;
+		held->mdl   = *mdl;
+		if (mapped)
+			cmd_quarantine_unmap(DeviceContext, &held->held, release_held, id);
+		else
+			cmd_quarantine(DeviceContext, &held->held, release_held);
+	}
+
+	segtable_init(table);
+	*mdl = NULL;
+}
+
+/* the first chunk opens the mapping, the rest are appended to it. a hung
+ * START takes the chain with it, the command layer unmaps whatever a late
+ * FINISH makes. a hung EXTEND only takes the table, the mapping is still
+ * the caller's to drop */
+static NTSTATUS post(const PDEVICE_CONTEXT DeviceContext, const BOOLEAN first, PSEGMENT_TABLE table, const UINT32 type, PPortholeMapID id, PMDL * mdl)
+{
+	cmd_begin(DeviceContext);
+	const NTSTATUS result = first ?
+		cmd_map   (DeviceContext, table, type, id) :
+		cmd_extend(DeviceContext, table, *id);
+
+	if (cmd_hung(DeviceContext, result))
+	{
+		PMDL none = NULL;
+		quarantine(DeviceContext, table, first ? mdl : &none, FALSE, 0);
+	}
+	cmd_end(DeviceContext);
+	return result;
+}
+
+/* drop the chunks already mapped when a later one fails, the chain is only
+ * unlocked once the device has let go of them */
+static void unmap(const PDEVICE_CONTEXT DeviceContext, const PortholeMapID id, PMDL * mdl)
+{
+	SEGMENT_TABLE none;
+	segtable_init(&none);
+
+	cmd_begin(DeviceContext);
+	const NTSTATUS result = cmd_unmap(DeviceContext, id);
+	if (result == STATUS_DEVICE_BUSY || cmd_hung(DeviceContext, result))
+		quarantine(DeviceContext, &none, mdl, result == STATUS_DEVICE_BUSY, id);
+	cmd_end(DeviceContext);
+}
+
+NTSTATUS stream_map(const PDEVICE_CONTEXT DeviceContext, PVOID addr, const UINT64 size, const UINT32 type, PPortholeMapID id, PMDL * mdl, PULONG segments)
+{
+	if (!(DeviceContext->caps & PH_REG_CAPS_EXTEND))
+		return STATUS_NOT_SUPPORTED;
+
+	if (!size || size > (UINT64)MAXULONG_PTR - (ULONG_PTR)addr)
+		return STATUS_INVALID_PARAMETER;
+
+	PMDL    head   = NULL;
+	PMDL *  tail   = &head;
+	PUCHAR  pos    = (PUCHAR)addr;
+	UINT64  left   = size;
+	UINT64  length = min(PORTHOLE_STREAM_CHUNK - BYTE_OFFSET(addr), size);
+	ULONG   count  = 0;
+	BOOLEAN mapped = FALSE;
+
+	/* the first chunk has nothing to overlap with */
+	NTSTATUS result = lock_buffer(pos, (UINT32)length, tail);
+	while (NT_SUCCESS(result))
+	{
+		SEGMENT_TABLE table;
+		segtable_init(&table);
+		if (!NT_SUCCESS(result = segtable_build(&table, *tail, length)))
+		{
+			segtable_free(&table);
+			break;
+		}
+
+		tail  = &(*tail)->Next;
+		pos  += (SIZE_T)length;
+		left -= length;
+
+		/* lock the next chunk while the device takes this one */
+		LOCK_ASYNC next;
+		length = min(left, PORTHOLE_STREAM_CHUNK);
+		if (left)
+			lock_begin(DeviceContext, &next, pos, (UINT32)length);
+
+		if (NT_SUCCESS(result = post(DeviceContext, !mapped, &table, type, id, &head)))
+		{
+			mapped = TRUE;
+			count += table.count;
+		}
+		segtable_free(&table);
+
+		if (!left)
+			break;
+
+		/* the worker has to be given back whatever happened */
+		PMDL locked = NULL;
+		const NTSTATUS status = lock_end(DeviceContext, &next, &locked);
+		if (!NT_SUCCESS(result))
+		{
+			free_mdl(locked);
+			break;
+		}
+
+		*tail  = locked;
+		result = status;
+	}
+
+	if (!NT_SUCCESS(result))
+	{
+		if (mapped)
+			unmap(DeviceContext, *id, &head);
+		free_mdl(head);
+		return result;
+	}
+
+	*mdl      = head;
+	*segments = count;
+	return STATUS_SUCCESS;
+}
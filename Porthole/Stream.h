@@ -0,0 +1,34 @@
+/*
+Copyright 2019 Geoffrey McRae
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+EXTERN_C_START
+
+/* lock the buffer a chunk at a time and map it with cmd_map of the first
+ * chunk and cmd_extend of each that follows, see PORTHOLE_CONFIG_STREAM.
+ * the command lock is only held to post a chunk and the next is locked on
+ * a lock worker meanwhile. returns the device's ID, the chain of MDLs to
+ * unlock along with the mapping and the number of segments sent. needs
+ * PH_REG_CAPS_EXTEND and must be called in the context of the process that
+ * owns the buffer, on failure nothing is left mapped or locked */
+NTSTATUS stream_map(const PDEVICE_CONTEXT DeviceContext, PVOID addr, const UINT64 size, const UINT32 type, PPortholeMapID id, PMDL * mdl, PULONG segments);
+
+EXTERN_C_END